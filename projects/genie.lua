@@ -14,6 +14,14 @@ function defaultConfigurations()
 		flags { "Optimize", "WinMain" }
 end
 
+function expressionsConfigurations()
+	defaultConfigurations()
+
+	configuration "linux"
+		buildoptions { "-std=c++14" }
+		links { "pthread" }
+end
+
 
 solution "Playground"
 	configurations { "Debug", "Release" }
@@ -27,8 +35,28 @@ solution "Playground"
 project "expressions"
 	kind "ConsoleApp"
 
-	files { "../src/expressions/main.cpp", "genie.lua" }
-	defaultConfigurations()
+	files { "../src/expressions/main.cpp", "../src/expressions/expressions.cpp", "../src/expressions/expressions.h", "../src/expressions/expressions_constexpr.h", "genie.lua" }
+	expressionsConfigurations()
+
+-- the tests with the hooks of ExpressionProfiler compiled in
+project "expressions_profiler"
+	kind "ConsoleApp"
+
+	defines { "EXPRESSIONS_PROFILER" }
+	files { "../src/expressions/main.cpp", "../src/expressions/expressions.cpp", "../src/expressions/expressions.h", "../src/expressions/expressions_constexpr.h", "genie.lua" }
+	expressionsConfigurations()
+
+project "expressions_benchmark"
+	kind "ConsoleApp"
+
+	files { "../src/expressions/benchmark.cpp", "../src/expressions/expressions.cpp", "../src/expressions/expressions.h", "genie.lua" }
+	expressionsConfigurations()
+
+project "expressions_transpiler"
+	kind "ConsoleApp"
+
+	files { "../src/expressions/transpiler.cpp", "../src/expressions/expressions.cpp", "../src/expressions/expressions.h", "genie.lua" }
+	expressionsConfigurations()
 
 project "minimal_exe"
 	kind "ConsoleApp"
@@ -0,0 +1,788 @@
+// Throughput of the expression compiler and evaluators
+//   expressions_benchmark [--csv] [--quick] [--pairs] [--threads]
+// Every stage of every corpus prints one line: ns per operation, rows per second for evaluation
+// stages and the average size of the bytecode. --csv prints the same as comma separated values,
+// so results of two releases can be compared line by line. --pairs prints the most frequently
+// executed opcode pairs instead, candidates for superinstructions. --threads prints how
+// ExpressionEngine scales with the number of threads.
+#include "expressions.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+static const char* VARIABLES[] = {"x", "y", "z"};
+static const int VARIABLES_COUNT = sizeof(VARIABLES) / sizeof(VARIABLES[0]);
+static const int ROWS = 4096;
+static const int MAX_TOKENS = 1 << 16;
+static const int MAX_BYTECODE_SIZE = 1 << 18;
+static const int SCALING_ROWS = 1 << 17;
+
+
+// results are accumulated here, so the compiler can not remove the benchmarked code
+static volatile float g_sink = 0;
+
+
+struct Corpus
+{
+	const char* name;
+	std::vector<std::string> sources;
+};
+
+
+struct Compiled
+{
+	std::vector<uint8> byte_code;
+};
+
+
+struct Options
+{
+	bool csv;
+	bool pairs;
+	bool threads;
+	double min_seconds;
+};
+
+
+class Random
+{
+public:
+	explicit Random(uint32 seed)
+		: m_seed(seed)
+	{
+	}
+
+	int next(int n)
+	{
+		m_seed = m_seed * 1664525U + 1013904223U;
+		return (m_seed >> 16) % n;
+	}
+
+private:
+	uint32 m_seed;
+};
+
+
+// Few distinct constants, so even huge expressions fit into the register file
+static std::string randomExpression(Random& random, bool boolean, int depth)
+{
+	if (boolean)
+	{
+		static const char* COMPARISONS[] = {" < ", " > "};
+		static const char* LOGIC[] = {" and ", " or "};
+		if (depth <= 0 || random.next(3) == 0)
+		{
+			return randomExpression(random, false, depth - 1) + COMPARISONS[random.next(2)] +
+				   randomExpression(random, false, depth - 1);
+		}
+		return "(" + randomExpression(random, true, depth - 1) + LOGIC[random.next(2)] +
+			   randomExpression(random, true, depth - 1) + ")";
+	}
+
+	static const char* LEAVES[] = {"x", "y", "z", "2", "0.5", "10", "PI"};
+	static const int LEAVES_COUNT = sizeof(LEAVES) / sizeof(LEAVES[0]);
+	static const char* OPERATORS[] = {" + ", " - ", " * ", " / "};
+	if (depth <= 0) return LEAVES[random.next(LEAVES_COUNT)];
+	switch (random.next(8))
+	{
+		case 0: return LEAVES[random.next(LEAVES_COUNT)];
+		case 1: return "-" + randomExpression(random, false, depth - 1);
+		case 2:
+			return (random.next(2) ? "sin(" : "cos(") + randomExpression(random, false, depth - 1) +
+				   ")";
+		default:
+			return "(" + randomExpression(random, false, depth - 1) + OPERATORS[random.next(4)] +
+				   randomExpression(random, false, depth - 1) + ")";
+	}
+}
+
+
+static std::vector<Corpus> generateCorpora()
+{
+	Random random(1);
+	std::vector<Corpus> corpora(3);
+	corpora[0].name = "small";
+	corpora[1].name = "medium";
+	corpora[2].name = "huge";
+	for (int i = 0; i < 64; ++i)
+	{
+		corpora[0].sources.push_back(randomExpression(random, i % 4 == 0, 2));
+		corpora[1].sources.push_back(randomExpression(random, i % 4 == 0, 5));
+	}
+	for (int i = 0; i < 4; ++i)
+	{
+		std::string src = randomExpression(random, false, 3);
+		for (int j = 0; j < 400; ++j) src += " + " + randomExpression(random, false, 3);
+		corpora[2].sources.push_back(src);
+	}
+	return corpora;
+}
+
+
+// Calls `fn` until `min_seconds` pass, `fn` does `ops` operations, returns ns per operation
+template <typename F> static double measure(const Options& options, int ops, F fn)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+	long long total_ops = 0;
+	auto start = Clock::now();
+	double elapsed = 0;
+	do
+	{
+		fn();
+		total_ops += ops;
+		elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	} while (elapsed < options.min_seconds);
+	return elapsed * 1e9 / total_ops;
+}
+
+
+// `rows_per_op` and `bytes` are 0 where they do not apply
+static void report(const Options& options,
+	const Corpus& corpus,
+	const char* stage,
+	double ns_per_op,
+	double rows_per_op,
+	double bytes)
+{
+	char rows_per_second[32] = "";
+	char bytecode_bytes[32] = "";
+	if (rows_per_op > 0)
+	{
+		snprintf(rows_per_second, sizeof(rows_per_second), "%.0f", rows_per_op * 1e9 / ns_per_op);
+	}
+	if (bytes > 0) snprintf(bytecode_bytes, sizeof(bytecode_bytes), "%.1f", bytes);
+
+	if (options.csv)
+	{
+		printf("%s,%s,%.3f,%s,%s\n",
+			corpus.name,
+			stage,
+			ns_per_op,
+			rows_per_second,
+			bytecode_bytes);
+	}
+	else
+	{
+		printf("%-8s %-18s %14.2f %16s %10s\n",
+			corpus.name,
+			stage,
+			ns_per_op,
+			rows_per_second,
+			bytecode_bytes);
+	}
+}
+
+
+static std::vector<Compiled> compileCorpus(const Corpus& corpus,
+	Types number_type = Types::FLOAT,
+	MathTier math_tier = MathTier::STANDARD)
+{
+	ExpressionCompiler compiler;
+	compiler.setVariables(VARIABLES, VARIABLES_COUNT);
+	compiler.setNumberType(number_type);
+	compiler.setMathTier(math_tier);
+	std::vector<ExpressionCompiler::Token> tokens(MAX_TOKENS);
+	std::vector<ExpressionCompiler::Token> postfix(MAX_TOKENS);
+	std::vector<uint8> byte_code(MAX_BYTECODE_SIZE);
+	std::vector<Compiled> compiled;
+	for (auto& src : corpus.sources)
+	{
+		int count = compiler.tokenize(src.c_str(), &tokens[0], MAX_TOKENS);
+		if (count > 0) count = compiler.toPostfix(&tokens[0], &postfix[0], count);
+		if (count <= 0) continue;
+		count = compiler.optimize(src.c_str(), &postfix[0], count);
+		int size =
+			compiler.compile(src.c_str(), &postfix[0], count, &byte_code[0], MAX_BYTECODE_SIZE);
+		if (size <= 0) continue;
+		Compiled program;
+		program.byte_code.assign(byte_code.begin(), byte_code.begin() + size);
+		compiled.push_back(program);
+	}
+	return compiled;
+}
+
+
+static void benchmarkCompiler(const Options& options,
+	const Corpus& corpus,
+	std::vector<Compiled>& compiled)
+{
+	ExpressionCompiler compiler;
+	compiler.setVariables(VARIABLES, VARIABLES_COUNT);
+	std::vector<ExpressionCompiler::Token> tokens(MAX_TOKENS);
+	std::vector<ExpressionCompiler::Token> postfix(MAX_TOKENS);
+	std::vector<ExpressionCompiler::Token> optimized(MAX_TOKENS);
+	std::vector<uint8> byte_code(MAX_BYTECODE_SIZE);
+	int ops = (int)corpus.sources.size();
+
+	double ns = measure(options, ops, [&]() {
+		for (auto& src : corpus.sources)
+		{
+			g_sink = g_sink + compiler.tokenize(src.c_str(), &tokens[0], MAX_TOKENS);
+		}
+	});
+	report(options, corpus, "tokenize", ns, 0, 0);
+
+	// every stage gets the output of the previous one
+	std::vector<std::vector<ExpressionCompiler::Token>> tokenized;
+	for (auto& src : corpus.sources)
+	{
+		int count = compiler.tokenize(src.c_str(), &tokens[0], MAX_TOKENS);
+		tokenized.emplace_back(tokens.begin(), tokens.begin() + (count > 0 ? count : 0));
+	}
+	ns = measure(options, ops, [&]() {
+		for (auto& input : tokenized)
+		{
+			g_sink = g_sink + compiler.toPostfix(&input[0], &postfix[0], (int)input.size());
+		}
+	});
+	report(options, corpus, "toPostfix", ns, 0, 0);
+
+	std::vector<std::vector<ExpressionCompiler::Token>> postfixed;
+	for (auto& input : tokenized)
+	{
+		int count = compiler.toPostfix(&input[0], &postfix[0], (int)input.size());
+		postfixed.emplace_back(postfix.begin(), postfix.begin() + (count > 0 ? count : 0));
+	}
+	ns = measure(options, ops, [&]() {
+		for (int i = 0; i < ops; ++i)
+		{
+			const auto& input = postfixed[i];
+			std::copy(input.begin(), input.end(), optimized.begin());
+			const char* src = corpus.sources[i].c_str();
+			g_sink = g_sink + compiler.optimize(src, &optimized[0], (int)input.size());
+		}
+	});
+	report(options, corpus, "optimize", ns, 0, 0);
+
+	std::vector<std::vector<ExpressionCompiler::Token>> optimized_tokens;
+	for (int i = 0; i < ops; ++i)
+	{
+		std::vector<ExpressionCompiler::Token> input = postfixed[i];
+		int count = compiler.optimize(corpus.sources[i].c_str(), &input[0], (int)input.size());
+		input.resize(count);
+		optimized_tokens.push_back(input);
+	}
+	ns = measure(options, ops, [&]() {
+		for (int i = 0; i < ops; ++i)
+		{
+			const auto& input = optimized_tokens[i];
+			g_sink = g_sink + compiler.compile(corpus.sources[i].c_str(),
+								  &input[0],
+								  (int)input.size(),
+								  &byte_code[0],
+								  MAX_BYTECODE_SIZE);
+		}
+	});
+
+	compiled.clear();
+	double bytes = 0;
+	for (int i = 0; i < ops; ++i)
+	{
+		const auto& input = optimized_tokens[i];
+		const char* src = corpus.sources[i].c_str();
+		int size =
+			compiler.compile(src, &input[0], (int)input.size(), &byte_code[0], MAX_BYTECODE_SIZE);
+		if (size <= 0)
+		{
+			fprintf(stderr,
+				"%s: failed to compile %.60s..., error %d\n",
+				corpus.name,
+				src,
+				(int)compiler.getError());
+			continue;
+		}
+		Compiled program;
+		program.byte_code.assign(byte_code.begin(), byte_code.begin() + size);
+		compiled.push_back(program);
+		bytes += size;
+	}
+	report(options, corpus, "compile", ns, 0, compiled.empty() ? 0 : bytes / compiled.size());
+
+	// on a copy, so every iteration fuses the same pairs
+	ns = measure(options, (int)compiled.size(), [&]() {
+		for (auto& program : compiled)
+		{
+			std::copy(program.byte_code.begin(), program.byte_code.end(), byte_code.begin());
+			g_sink = g_sink + compiler.peephole(&byte_code[0], (int)program.byte_code.size());
+		}
+	});
+	report(options, corpus, "peephole", ns, 0, 0);
+	for (auto& program : compiled)
+	{
+		compiler.peephole(&program.byte_code[0], (int)program.byte_code.size());
+	}
+
+	// all stages back to back from the source, the baseline of the single pass compile
+	ns = measure(options, ops, [&]() {
+		for (auto& src : corpus.sources)
+		{
+			int count = compiler.tokenize(src.c_str(), &tokens[0], MAX_TOKENS);
+			if (count > 0) count = compiler.toPostfix(&tokens[0], &postfix[0], count);
+			if (count <= 0) continue;
+			count = compiler.optimize(src.c_str(), &postfix[0], count);
+			int size =
+				compiler.compile(src.c_str(), &postfix[0], count, &byte_code[0], MAX_BYTECODE_SIZE);
+			if (size > 0) g_sink = g_sink + compiler.peephole(&byte_code[0], size);
+		}
+	});
+	report(options, corpus, "compile_stages", ns, 0, 0);
+
+	// single pass from the source, the arena and the output are reused
+	ExpressionArena arena;
+	std::vector<uint8> program;
+	ns = measure(options, ops, [&]() {
+		for (auto& src : corpus.sources)
+		{
+			g_sink = g_sink + compiler.compile(src.c_str(), arena, program);
+		}
+	});
+	report(options, corpus, "compile_arena", ns, 0, 0);
+
+	// startup from a precompiled program file: validate it and look up every source
+	std::vector<const char*> sources;
+	for (auto& src : corpus.sources) sources.push_back(src.c_str());
+	std::vector<uint8> file_data;
+	if (compiler.serialize(&sources[0], ops, file_data) < 0) return;
+	ns = measure(options, ops, [&]() {
+		ProgramFile file;
+		file.open(&file_data[0], (int)file_data.size());
+		for (const char* src : sources) g_sink = g_sink + file.find(src);
+	});
+	report(options, corpus, "load", ns, 0, 0);
+}
+
+
+static void benchmarkEvaluation(const Options& options,
+	const Corpus& corpus,
+	const std::vector<Compiled>& compiled)
+{
+	if (compiled.empty()) return;
+
+	std::vector<float> columns_data(VARIABLES_COUNT * ROWS);
+	std::vector<float> rows_data(VARIABLES_COUNT * ROWS);
+	const float* columns[VARIABLES_COUNT];
+	Random random(2);
+	for (int v = 0; v < VARIABLES_COUNT; ++v)
+	{
+		columns[v] = &columns_data[v * ROWS];
+		for (int row = 0; row < ROWS; ++row)
+		{
+			float value = random.next(2001) * 0.01f - 10.0f;
+			columns_data[v * ROWS + row] = value;
+			rows_data[row * VARIABLES_COUNT + v] = value;
+		}
+	}
+	std::vector<float> output(ROWS);
+	ExpressionVM vm;
+	int programs = (int)compiled.size();
+
+	// per expression, a single row with every program
+	static const int SCALAR_ROWS = 64;
+	double ns = measure(options, programs * SCALAR_ROWS, [&]() {
+		for (auto& program : compiled)
+		{
+			for (int row = 0; row < SCALAR_ROWS; ++row)
+			{
+				const float* inputs = &rows_data[row * VARIABLES_COUNT];
+				g_sink = g_sink + vm.evaluate(&program.byte_code[0], inputs).f_value;
+			}
+		}
+	});
+	report(options, corpus, "evaluate", ns, 1, 0);
+
+	std::vector<ExpressionVM::DecodedProgram> decoded(programs);
+	for (int i = 0; i < programs; ++i) vm.decode(&compiled[i].byte_code[0], decoded[i]);
+	ns = measure(options, programs * SCALAR_ROWS, [&]() {
+		for (auto& program : decoded)
+		{
+			for (int row = 0; row < SCALAR_ROWS; ++row)
+			{
+				g_sink = g_sink + vm.evaluate(program, &rows_data[row * VARIABLES_COUNT]).f_value;
+			}
+		}
+	});
+	report(options, corpus, "evaluate_decoded", ns, 1, 0);
+
+	// the same programs on doubles
+	std::vector<Compiled> doubles = compileCorpus(corpus, Types::DOUBLE);
+	std::vector<double> double_rows(rows_data.begin(), rows_data.end());
+	DoubleExpressionVM double_vm;
+	ns = measure(options, (int)doubles.size() * SCALAR_ROWS, [&]() {
+		for (auto& program : doubles)
+		{
+			for (int row = 0; row < SCALAR_ROWS; ++row)
+			{
+				const double* inputs = &double_rows[row * VARIABLES_COUNT];
+				g_sink = g_sink + (float)double_vm.evaluate(&program.byte_code[0], inputs).value;
+			}
+		}
+	});
+	report(options, corpus, "evaluate_double", ns, 1, 0);
+
+	std::vector<ExpressionJIT> jits(programs);
+	bool native = true;
+	for (int i = 0; i < programs; ++i)
+	{
+		const std::vector<uint8>& byte_code = compiled[i].byte_code;
+		native = jits[i].compile(&byte_code[0], (int)byte_code.size()) && native;
+	}
+	if (native)
+	{
+		ns = measure(options, programs * SCALAR_ROWS, [&]() {
+			for (auto& jit : jits)
+			{
+				for (int row = 0; row < SCALAR_ROWS; ++row)
+				{
+					g_sink = g_sink + jit.evaluate(&rows_data[row * VARIABLES_COUNT]).f_value;
+				}
+			}
+		});
+		report(options, corpus, "evaluate_jit", ns, 1, 0);
+	}
+
+	// per row, every program over all rows
+	ns = measure(options, programs * ROWS, [&]() {
+		for (auto& program : compiled)
+		{
+			vm.evaluateBatch(&program.byte_code[0], columns, &output[0], ROWS);
+			g_sink = g_sink + output[ROWS - 1];
+		}
+	});
+	report(options, corpus, "batch", ns, 1, 0);
+
+	// the same with sin and cos computed by SIMD polynomials
+	for (MathTier tier : {MathTier::PRECISE, MathTier::FAST})
+	{
+		std::vector<Compiled> tiered = compileCorpus(corpus, Types::FLOAT, tier);
+		ns = measure(options, (int)tiered.size() * ROWS, [&]() {
+			for (auto& program : tiered)
+			{
+				vm.evaluateBatch(&program.byte_code[0], columns, &output[0], ROWS);
+				g_sink = g_sink + output[ROWS - 1];
+			}
+		});
+		const char* stage = tier == MathTier::PRECISE ? "batch_precise" : "batch_fast";
+		report(options, corpus, stage, ns, 1, 0);
+	}
+
+	// predicates only, to masks by batch evaluation and to selection bitmaps by filter
+	std::vector<const Compiled*> predicates;
+	for (auto& program : compiled)
+	{
+		const ProgramHeader& header = *(const ProgramHeader*)&program.byte_code[0];
+		if (header.result_type == Types::BOOL) predicates.push_back(&program);
+	}
+	if (!predicates.empty())
+	{
+		int predicate_count = (int)predicates.size();
+		ns = measure(options, predicate_count * ROWS, [&]() {
+			for (const Compiled* program : predicates)
+			{
+				vm.evaluateBatch(&program->byte_code[0], columns, &output[0], ROWS);
+				g_sink = g_sink + output[ROWS - 1];
+			}
+		});
+		report(options, corpus, "batch_predicates", ns, 1, 0);
+
+		std::vector<uint64> selection(ROWS / 64);
+		ns = measure(options, predicate_count * ROWS, [&]() {
+			for (const Compiled* program : predicates)
+			{
+				std::fill(selection.begin(), selection.end(), ~0ULL);
+				int selected = vm.filter(&program->byte_code[0], columns, &selection[0], ROWS);
+				g_sink = g_sink + (float)selected;
+			}
+		});
+		report(options, corpus, "filter", ns, 1, 0);
+
+		// each predicate looks only at the rows left by the previous ones
+		ns = measure(options, predicate_count * ROWS, [&]() {
+			std::fill(selection.begin(), selection.end(), ~0ULL);
+			for (const Compiled* program : predicates)
+			{
+				int selected = vm.filter(&program->byte_code[0], columns, &selection[0], ROWS);
+				g_sink = g_sink + (float)selected;
+			}
+		});
+		report(options, corpus, "filter_chained", ns, 1, 0);
+	}
+
+	// all programs as one, common subexpressions are computed once
+	ExpressionCompiler compiler;
+	compiler.setVariables(VARIABLES, VARIABLES_COUNT);
+	std::vector<const char*> sources;
+	for (auto& src : corpus.sources) sources.push_back(src.c_str());
+	std::vector<uint8> shared;
+	std::vector<Types> types(sources.size());
+	if ((int)sources.size() <= ExpressionCompiler::MAX_SHARED_RESULTS &&
+		compiler.compileShared(&sources[0], (int)sources.size(), shared, &types[0]) > 0)
+	{
+		compiler.peephole(&shared[0], (int)shared.size());
+		std::vector<float> results_data(sources.size() * ROWS);
+		std::vector<float*> results(sources.size());
+		for (int i = 0; i < (int)sources.size(); ++i) results[i] = &results_data[i * ROWS];
+		ns = measure(options, (int)sources.size() * ROWS, [&]() {
+			vm.evaluateBatch(&shared[0], columns, &results[0], ROWS);
+			g_sink = g_sink + results_data.back();
+		});
+		report(options, corpus, "batch_shared", ns, 1, (double)shared.size() / sources.size());
+	}
+
+	// sums of the numeric expressions, by batch evaluation and a loop over the output against the
+	// reduction fused into the batch loop, both programs come from compileShared
+	std::vector<std::vector<uint8>> sums;
+	std::vector<std::vector<uint8>> summands;
+	for (auto& src : corpus.sources)
+	{
+		std::string sum_src = "sum(" + src + ")";
+		const char* src_ptr = src.c_str();
+		std::vector<uint8> sum;
+		std::vector<uint8> summand;
+		Types type;
+		if (compiler.compileAggregate(sum_src.c_str(), sum) <= 0) continue;
+		if (compiler.compileShared(&src_ptr, 1, summand, &type) <= 0) continue;
+		sums.push_back(sum);
+		summands.push_back(summand);
+	}
+	if (!sums.empty())
+	{
+		int sum_count = (int)sums.size();
+		ns = measure(options, sum_count * ROWS, [&]() {
+			for (auto& program : summands)
+			{
+				vm.evaluateBatch(&program[0], columns, &output[0], ROWS);
+				double total = 0;
+				for (float value : output) total += value;
+				g_sink = g_sink + (float)total;
+			}
+		});
+		report(options, corpus, "batch_sum", ns, 1, 0);
+
+		ns = measure(options, sum_count * ROWS, [&]() {
+			for (auto& program : sums)
+			{
+				ExpressionVM::Accumulator accumulator;
+				vm.aggregate(&program[0], columns, ROWS, accumulator);
+				g_sink = g_sink + (float)accumulator.sum;
+			}
+		});
+		report(options, corpus, "aggregate", ns, 1, 0);
+	}
+
+	if (native)
+	{
+		ns = measure(options, programs * ROWS, [&]() {
+			for (auto& jit : jits)
+			{
+				jit.evaluateBatch(columns, &output[0], ROWS);
+				g_sink = g_sink + output[ROWS - 1];
+			}
+		});
+		report(options, corpus, "batch_jit", ns, 1, 0);
+	}
+}
+
+
+// Prints the most frequent opcode pairs executed by the compiled corpus
+static void profilePairs(const Corpus& corpus, const std::vector<Compiled>& compiled)
+{
+	static const int PROFILED_ROWS = 64;
+	static const int TOP_PAIRS = 10;
+	ExpressionVM vm;
+	ExpressionVM::PairProfile profile;
+	Random random(3);
+	for (auto& program : compiled)
+	{
+		for (int row = 0; row < PROFILED_ROWS; ++row)
+		{
+			float inputs[VARIABLES_COUNT];
+			for (float& input : inputs) input = random.next(2001) * 0.01f - 10.0f;
+			vm.profile(&program.byte_code[0], inputs, profile);
+		}
+	}
+
+	struct Pair
+	{
+		uint32 count;
+		int first;
+		int second;
+	};
+	std::vector<Pair> pairs;
+	double total = 0;
+	for (int first = 0; first < Instruction::COUNT; ++first)
+	{
+		for (int second = 0; second < Instruction::COUNT; ++second)
+		{
+			uint32 count = profile.counts[first][second];
+			total += count;
+			if (count > 0) pairs.push_back({count, first, second});
+		}
+	}
+	std::sort(pairs.begin(), pairs.end(), [](const Pair& a, const Pair& b) {
+		return a.count > b.count;
+	});
+	for (int i = 0; i < (int)pairs.size() && i < TOP_PAIRS; ++i)
+	{
+		printf("%-8s %-22s %-22s %6.2f%%\n",
+			corpus.name,
+			Instruction::getName((uint8)pairs[i].first),
+			Instruction::getName((uint8)pairs[i].second),
+			pairs[i].count * 100.0 / total);
+	}
+}
+
+
+// Every program of the corpus over SCALING_ROWS rows with 1, 2, 4, ... threads, up to the number
+// of hardware threads
+static void benchmarkScaling(const Options& options, const Corpus& corpus)
+{
+	std::vector<Compiled> compiled = compileCorpus(corpus);
+	if (compiled.empty()) return;
+	ExpressionCompiler compiler;
+	std::vector<const uint8*> programs;
+	for (auto& program : compiled)
+	{
+		compiler.peephole(&program.byte_code[0], (int)program.byte_code.size());
+		programs.push_back(&program.byte_code[0]);
+	}
+	int programs_count = (int)programs.size();
+
+	std::vector<float> columns_data(VARIABLES_COUNT * SCALING_ROWS);
+	const float* columns[VARIABLES_COUNT];
+	Random random(4);
+	for (int v = 0; v < VARIABLES_COUNT; ++v)
+	{
+		columns[v] = &columns_data[v * SCALING_ROWS];
+		for (int row = 0; row < SCALING_ROWS; ++row)
+		{
+			columns_data[v * SCALING_ROWS + row] = random.next(2001) * 0.01f - 10.0f;
+		}
+	}
+	std::vector<float> outputs_data((size_t)programs_count * SCALING_ROWS);
+	std::vector<float*> outputs(programs_count);
+	for (int i = 0; i < programs_count; ++i) outputs[i] = &outputs_data[(size_t)i * SCALING_ROWS];
+	std::vector<Types> types(programs_count);
+
+	int max_threads = (int)std::thread::hardware_concurrency();
+	if (max_threads < 1) max_threads = 1;
+	double single_thread_ns = 0;
+	for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+	{
+		ExpressionEngine engine(threads);
+		double ns = measure(options, programs_count * SCALING_ROWS, [&]() {
+			engine.evaluateBatch(&programs[0],
+				programs_count,
+				columns,
+				VARIABLES_COUNT,
+				&outputs[0],
+				SCALING_ROWS,
+				&types[0]);
+			g_sink = g_sink + outputs_data.back();
+		});
+		if (threads == 1) single_thread_ns = ns;
+		double speedup = single_thread_ns / ns;
+		if (options.csv)
+		{
+			printf("%s,%d,%.3f,%.0f,%.3f,%.3f\n",
+				corpus.name,
+				threads,
+				ns,
+				1e9 / ns,
+				speedup,
+				speedup / threads);
+		}
+		else
+		{
+			printf("%-8s %8d %14.3f %16.0f %8.2f %10.2f\n",
+				corpus.name,
+				threads,
+				ns,
+				1e9 / ns,
+				speedup,
+				speedup / threads);
+		}
+		if (threads == max_threads) break;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	Options options;
+	options.csv = false;
+	options.pairs = false;
+	options.threads = false;
+	options.min_seconds = 0.25;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--csv")
+		{
+			options.csv = true;
+		}
+		else if (arg == "--pairs")
+		{
+			options.pairs = true;
+		}
+		else if (arg == "--threads")
+		{
+			options.threads = true;
+		}
+		else if (arg == "--quick")
+		{
+			options.min_seconds = 0.01;
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [--csv] [--quick] [--pairs] [--threads]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<Corpus> corpora = generateCorpora();
+	if (options.pairs)
+	{
+		printf("%-8s %-22s %-22s %7s\n", "corpus", "first", "second", "share");
+		for (auto& corpus : corpora) profilePairs(corpus, compileCorpus(corpus));
+		return 0;
+	}
+
+	if (options.threads)
+	{
+		// ns and rows/s are per program and row
+		if (options.csv) printf("corpus,threads,ns_per_row,rows_per_s,speedup,efficiency\n");
+		else
+		{
+			printf("%-8s %8s %14s %16s %8s %10s\n",
+				"corpus",
+				"threads",
+				"ns/row",
+				"rows/s",
+				"speedup",
+				"efficiency");
+		}
+		for (auto& corpus : corpora) benchmarkScaling(options, corpus);
+		return 0;
+	}
+
+	if (options.csv)
+	{
+		printf("corpus,stage,ns_per_op,rows_per_s,bytecode_bytes\n");
+	}
+	else
+	{
+		printf("%-8s %-18s %14s %16s %10s\n", "corpus", "stage", "ns/op", "rows/s", "bytes");
+	}
+
+	for (auto& corpus : corpora)
+	{
+		std::vector<Compiled> compiled;
+		benchmarkCompiler(options, corpus, compiled);
+		benchmarkEvaluation(options, corpus, compiled);
+	}
+	return 0;
+}
@@ -0,0 +1,5999 @@
+#include "expressions.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#ifdef _WIN32
+	#define NOMINMAX
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#define DebugBreak() __builtin_trap()
+#endif
+
+// labels as values, used for threaded dispatch in ExpressionVM
+#if defined(__GNUC__)
+	#define EXPRESSIONS_COMPUTED_GOTO
+#endif
+
+
+// FNV-1a
+static uint32 hashString(const char* str, uint32 seed = 2166136261U)
+{
+	uint32 hash = seed;
+	for (const char* c = str; *c; ++c)
+	{
+		hash ^= (uint8)*c;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+
+const char* Instruction::getName(uint8 type)
+{
+	static const char* NAMES[] = {"ADD_FLOAT",
+		"SUB_FLOAT",
+		"MUL_FLOAT",
+		"DIV_FLOAT",
+		"UNARY_MINUS",
+		"FLOAT_LT",
+		"FLOAT_GT",
+		"AND",
+		"OR",
+		"CALL",
+		"RET_FLOAT",
+		"RET_BOOL",
+		"JUMP_IF_FALSE",
+		"JUMP_IF_TRUE",
+		"MOVE",
+		"STORE_FLOAT",
+		"STORE_BOOL",
+		"MUL_ADD_FLOAT",
+		"FLOAT_LT_JUMP_IF_FALSE",
+		"FLOAT_LT_JUMP_IF_TRUE",
+		"FLOAT_GT_JUMP_IF_FALSE",
+		"FLOAT_GT_JUMP_IF_TRUE",
+		"OPERAND"};
+	static_assert(sizeof(NAMES) / sizeof(NAMES[0]) == Instruction::COUNT, "Missing name");
+	return type < Instruction::COUNT ? NAMES[type] : nullptr;
+}
+
+
+void ExpressionProfiler::setName(const uint8* code, const char* name)
+{
+	m_names[code] = name;
+}
+
+
+void ExpressionProfiler::reset()
+{
+	memset(m_opcodes, 0, sizeof(m_opcodes));
+	m_programs.clear();
+	m_begin = m_last = 0;
+	m_type = Instruction::COUNT;
+}
+
+
+void ExpressionProfiler::endProgram(const uint8* code)
+{
+	uint64 now = readCycles();
+	m_opcodes[m_type].cycles += now - m_last;
+	uint64 cycles = now - m_begin;
+
+	auto iter = m_programs.find(code);
+	if (iter == m_programs.end())
+	{
+		ProgramStats stats;
+		memset(stats.histogram, 0, sizeof(stats.histogram));
+		stats.code = code;
+		stats.evaluations = 0;
+		stats.cycles = 0;
+		iter = m_programs.emplace(code, stats).first;
+	}
+	ProgramStats& stats = iter->second;
+	++stats.evaluations;
+	stats.cycles += cycles;
+	int bucket = 0;
+	while (bucket < HISTOGRAM_BUCKETS - 1 && cycles >> (bucket + 1)) ++bucket;
+	++stats.histogram[bucket];
+}
+
+
+static void sortPrograms(std::vector<ExpressionProfiler::ProgramStats>& programs)
+{
+	std::sort(programs.begin(),
+		programs.end(),
+		[](const ExpressionProfiler::ProgramStats& a, const ExpressionProfiler::ProgramStats& b) {
+			return a.cycles != b.cycles ? a.cycles > b.cycles : a.code < b.code;
+		});
+}
+
+
+ExpressionProfiler::Snapshot ExpressionProfiler::snapshot() const
+{
+	Snapshot result;
+	memcpy(result.opcodes, m_opcodes, sizeof(result.opcodes));
+	for (auto& iter : m_programs)
+	{
+		result.programs.push_back(iter.second);
+		auto name = m_names.find(iter.first);
+		if (name != m_names.end()) result.programs.back().name = name->second;
+	}
+	sortPrograms(result.programs);
+	return result;
+}
+
+
+void ExpressionProfiler::Snapshot::merge(const Snapshot& other)
+{
+	for (int i = 0; i < Instruction::COUNT; ++i)
+	{
+		opcodes[i].count += other.opcodes[i].count;
+		opcodes[i].cycles += other.opcodes[i].cycles;
+	}
+	for (const ProgramStats& stats : other.programs)
+	{
+		auto iter = std::find_if(programs.begin(), programs.end(), [&](const ProgramStats& p) {
+			return p.code == stats.code;
+		});
+		if (iter == programs.end())
+		{
+			programs.push_back(stats);
+			continue;
+		}
+		iter->evaluations += stats.evaluations;
+		iter->cycles += stats.cycles;
+		for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) iter->histogram[i] += stats.histogram[i];
+		if (iter->name.empty()) iter->name = stats.name;
+	}
+	sortPrograms(programs);
+}
+
+
+static std::string getProgramName(const ExpressionProfiler::ProgramStats& stats)
+{
+	if (!stats.name.empty()) return stats.name;
+	char tmp[32];
+	snprintf(tmp, sizeof(tmp), "%p", (const void*)stats.code);
+	return tmp;
+}
+
+
+// upper bound of the bucket containing the evaluation at `fraction` of all
+static uint64 getPercentile(const ExpressionProfiler::ProgramStats& stats, double fraction)
+{
+	uint64 seen = 0;
+	for (int i = 0; i < ExpressionProfiler::HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += stats.histogram[i];
+		if (seen >= stats.evaluations * fraction) return 2ULL << i;
+	}
+	return 2ULL << (ExpressionProfiler::HISTOGRAM_BUCKETS - 1);
+}
+
+
+void ExpressionProfiler::Snapshot::dumpText(std::string& out) const
+{
+	char line[256];
+	int order[Instruction::COUNT];
+	for (int i = 0; i < Instruction::COUNT; ++i) order[i] = i;
+	std::stable_sort(order, order + Instruction::COUNT, [this](int a, int b) {
+		return opcodes[a].cycles > opcodes[b].cycles;
+	});
+	const char* format = "%-24s %14s %16s %10s\n";
+	snprintf(line, sizeof(line), format, "opcode", "count", "cycles", "cycles/op");
+	out += line;
+	for (int i : order)
+	{
+		const OpcodeStats& stats = opcodes[i];
+		if (stats.count == 0) continue;
+		snprintf(line,
+			sizeof(line),
+			"%-24s %14llu %16llu %10.1f\n",
+			Instruction::getName((uint8)i),
+			stats.count,
+			stats.cycles,
+			(double)stats.cycles / stats.count);
+		out += line;
+	}
+
+	snprintf(line,
+		sizeof(line),
+		"\n%-24s %14s %16s %10s %10s %10s\n",
+		"program",
+		"evaluations",
+		"cycles",
+		"mean",
+		"p50 <",
+		"p99 <");
+	out += line;
+	for (const ProgramStats& stats : programs)
+	{
+		snprintf(line,
+			sizeof(line),
+			"%-24s %14llu %16llu %10.1f %10llu %10llu\n",
+			getProgramName(stats).c_str(),
+			stats.evaluations,
+			stats.cycles,
+			stats.evaluations > 0 ? (double)stats.cycles / stats.evaluations : 0.0,
+			getPercentile(stats, 0.5),
+			getPercentile(stats, 0.99));
+		out += line;
+	}
+}
+
+
+static void appendJSONString(std::string& out, const std::string& str)
+{
+	out += '"';
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if ((uint8)c < 0x20)
+		{
+			char tmp[8];
+			snprintf(tmp, sizeof(tmp), "\\u%04x", (uint8)c);
+			out += tmp;
+		}
+		else
+		{
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+
+void ExpressionProfiler::Snapshot::dumpJSON(std::string& out) const
+{
+	char tmp[64];
+	out += "{\"opcodes\": [";
+	bool first = true;
+	for (int i = 0; i < Instruction::COUNT; ++i)
+	{
+		if (opcodes[i].count == 0) continue;
+		out += first ? "\n" : ",\n";
+		first = false;
+		out += "\t{\"name\": ";
+		appendJSONString(out, Instruction::getName((uint8)i));
+		snprintf(tmp, sizeof(tmp), ", \"count\": %llu", opcodes[i].count);
+		out += tmp;
+		snprintf(tmp, sizeof(tmp), ", \"cycles\": %llu}", opcodes[i].cycles);
+		out += tmp;
+	}
+	out += "],\n\"programs\": [";
+	first = true;
+	for (const ProgramStats& stats : programs)
+	{
+		out += first ? "\n" : ",\n";
+		first = false;
+		out += "\t{\"name\": ";
+		appendJSONString(out, getProgramName(stats));
+		snprintf(tmp, sizeof(tmp), ", \"evaluations\": %llu", stats.evaluations);
+		out += tmp;
+		snprintf(tmp, sizeof(tmp), ", \"cycles\": %llu, \"histogram\": [", stats.cycles);
+		out += tmp;
+		for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		{
+			snprintf(tmp, sizeof(tmp), i > 0 ? ", %llu" : "%llu", stats.histogram[i]);
+			out += tmp;
+		}
+		out += "]}";
+	}
+	out += "]}\n";
+}
+
+
+ExpressionVM::ReturnValue ExpressionVM::evaluate(const uint8* code, const float* inputs)
+{
+#ifdef EXPRESSIONS_PROFILER
+	if (m_profiler) return evaluate<false, true>(code, inputs, nullptr, nullptr);
+#endif
+	return evaluate<false, false>(code, inputs, nullptr, nullptr);
+}
+
+
+ExpressionVM::ReturnValue ExpressionVM::evaluate(const uint8* code,
+	const float* inputs,
+	float* results)
+{
+#ifdef EXPRESSIONS_PROFILER
+	if (m_profiler) return evaluate<false, true>(code, inputs, results, nullptr);
+#endif
+	return evaluate<false, false>(code, inputs, results, nullptr);
+}
+
+
+ExpressionVM::ReturnValue ExpressionVM::profile(const uint8* code,
+	const float* inputs,
+	PairProfile& profile)
+{
+	return evaluate<true, false>(code, inputs, nullptr, &profile);
+}
+
+
+template <bool PROFILE, bool TIMED>
+ExpressionVM::ReturnValue ExpressionVM::evaluate(const uint8* code,
+	const float* inputs,
+	float* results,
+	PairProfile* profile)
+{
+	// without EXPRESSIONS_PROFILER there is no m_profiler and the hooks are never instantiated
+	static_assert(!TIMED || ExpressionProfiler::ENABLED, "Profiling is disabled");
+#ifdef EXPRESSIONS_PROFILER
+	ExpressionProfiler* profiler = m_profiler;
+#else
+	ExpressionProfiler* profiler = nullptr;
+#endif
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	// constants of the other number types are 8 bytes
+	if (header.number_type != Types::FLOAT) return ReturnValue();
+	if (TIMED) profiler->beginProgram();
+	Register* r = m_registers;
+	// a plain loop, memcpy of a few bytes is often a slow `rep movs`
+	const uint8* constants = header.constants();
+	for (int i = 0; i < header.constant_count; ++i)
+	{
+		memcpy(&r[i].f, constants + i * sizeof(float), sizeof(float));
+	}
+	const uint8* slots = header.variables();
+	for (int i = 0; i < header.variable_count; ++i)
+	{
+		uint16 slot;
+		memcpy(&slot, slots + i * sizeof(slot), sizeof(slot));
+		r[header.constant_count + i].f = inputs[slot];
+	}
+
+	const uint8* ip = header.instructions();
+	uint8 prev_type = Instruction::COUNT;
+	for (;;)
+	{
+		uint8 type = ip[0];
+		Register& dst = r[ip[1]];
+		const Register& a = r[ip[2]];
+		const Register& b = r[ip[3]];
+		ip += Instruction::SIZE;
+		if (PROFILE)
+		{
+			if (prev_type < Instruction::COUNT && type < Instruction::COUNT)
+			{
+				++profile->counts[prev_type][type];
+			}
+			prev_type = type;
+		}
+		if (TIMED) profiler->beginInstruction(type);
+		switch (type)
+		{
+			case Instruction::ADD_FLOAT: dst.f = a.f + b.f; break;
+			case Instruction::SUB_FLOAT: dst.f = a.f - b.f; break;
+			case Instruction::MUL_FLOAT: dst.f = a.f * b.f; break;
+			case Instruction::DIV_FLOAT: dst.f = a.f / b.f; break;
+			case Instruction::UNARY_MINUS: dst.f = -a.f; break;
+			case Instruction::FLOAT_LT: dst.b = a.f < b.f; break;
+			case Instruction::FLOAT_GT: dst.b = a.f > b.f; break;
+			case Instruction::AND: dst.b = a.b & b.b; break;
+			case Instruction::OR: dst.b = a.b | b.b; break;
+			case Instruction::CALL: dst.f = callFunction(ip[-1], &a.f); break;
+			case Instruction::MOVE: dst = a; break;
+			case Instruction::STORE_FLOAT: if (results) results[ip[-1]] = a.f; break;
+			case Instruction::STORE_BOOL: if (results) results[ip[-1]] = a.b ? 1.0f : 0.0f; break;
+			case Instruction::RET_FLOAT:
+				if (TIMED) profiler->endProgram(code);
+				return a.f;
+			case Instruction::RET_BOOL:
+				if (TIMED) profiler->endProgram(code);
+				return a.b != 0;
+			case Instruction::JUMP_IF_FALSE: if (!a.b) ip += ip[-1] * Instruction::SIZE; break;
+			case Instruction::JUMP_IF_TRUE: if (a.b) ip += ip[-1] * Instruction::SIZE; break;
+			case Instruction::MUL_ADD_FLOAT:
+				dst.f = a.f * b.f + r[ip[2]].f;
+				ip += Instruction::SIZE;
+				break;
+			case Instruction::FLOAT_LT_JUMP_IF_FALSE:
+				dst.b = a.f < b.f;
+				ip += Instruction::SIZE;
+				if (!dst.b) ip += ip[-1] * Instruction::SIZE;
+				break;
+			case Instruction::FLOAT_LT_JUMP_IF_TRUE:
+				dst.b = a.f < b.f;
+				ip += Instruction::SIZE;
+				if (dst.b) ip += ip[-1] * Instruction::SIZE;
+				break;
+			case Instruction::FLOAT_GT_JUMP_IF_FALSE:
+				dst.b = a.f > b.f;
+				ip += Instruction::SIZE;
+				if (!dst.b) ip += ip[-1] * Instruction::SIZE;
+				break;
+			case Instruction::FLOAT_GT_JUMP_IF_TRUE:
+				dst.b = a.f > b.f;
+				ip += Instruction::SIZE;
+				if (dst.b) ip += ip[-1] * Instruction::SIZE;
+				break;
+			default: DebugBreak(); return ReturnValue();
+		}
+	}
+}
+
+
+bool ExpressionVM::decode(const uint8* code, DecodedProgram& program)
+{
+	const void* const* handlers = nullptr;
+	evaluateDecoded(nullptr, nullptr, nullptr, &handlers);
+
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	if (header.number_type != Types::FLOAT) return false;
+	program.result_type = header.result_type;
+	program.constants.resize(header.constant_count);
+	if (header.constant_count > 0)
+	{
+		memcpy(&program.constants[0], header.constants(), header.constant_count * sizeof(float));
+	}
+	program.variables.resize(header.variable_count);
+	if (header.variable_count > 0)
+	{
+		memcpy(&program.variables[0], header.variables(), header.variable_count * sizeof(uint16));
+	}
+
+	program.instructions.clear();
+	for (const uint8* ip = header.instructions();; ip += Instruction::SIZE)
+	{
+		if (ip[0] >= Instruction::COUNT) return false;
+
+		DecodedInstruction instr;
+		instr.handler = handlers ? handlers[ip[0]] : nullptr;
+		instr.type = ip[0];
+		instr.dst = ip[1];
+		instr.a = ip[2];
+		instr.b = ip[3];
+		program.instructions.push_back(instr);
+		if (ip[0] == Instruction::RET_FLOAT || ip[0] == Instruction::RET_BOOL) return true;
+	}
+}
+
+
+// With `program == nullptr` it only returns addresses of the handlers in `handlers`, they are local
+// labels, so they can not be taken anywhere else.
+ExpressionVM::ReturnValue ExpressionVM::evaluateDecoded(const DecodedProgram* program,
+	const float* inputs,
+	float* results,
+	const void* const** handlers)
+{
+#ifdef EXPRESSIONS_COMPUTED_GOTO
+	static const void* const HANDLERS[] = {&&add_float,
+		&&sub_float,
+		&&mul_float,
+		&&div_float,
+		&&unary_minus,
+		&&float_lt,
+		&&float_gt,
+		&&and_bool,
+		&&or_bool,
+		&&call,
+		&&ret_float,
+		&&ret_bool,
+		&&jump_if_false,
+		&&jump_if_true,
+		&&move,
+		&&store_float,
+		&&store_bool,
+		&&mul_add_float,
+		&&float_lt_jump_if_false,
+		&&float_lt_jump_if_true,
+		&&float_gt_jump_if_false,
+		&&float_gt_jump_if_true,
+		&&operand};
+	static_assert(sizeof(HANDLERS) / sizeof(HANDLERS[0]) == Instruction::COUNT, "Missing handler");
+	if (!program)
+	{
+		*handlers = HANDLERS;
+		return ReturnValue();
+	}
+#else
+	if (!program)
+	{
+		*handlers = nullptr;
+		return ReturnValue();
+	}
+#endif
+
+	Register* r = m_registers;
+	for (int i = 0, c = (int)program->constants.size(); i < c; ++i) r[i].f = program->constants[i];
+	Register* vars = r + program->constants.size();
+	for (int i = 0, c = (int)program->variables.size(); i < c; ++i)
+	{
+		vars[i].f = inputs[program->variables[i]];
+	}
+
+	const DecodedInstruction* ip = &program->instructions[0];
+#ifdef EXPRESSIONS_COMPUTED_GOTO
+	#define DISPATCH() goto *(++ip)->handler
+
+	goto *ip->handler;
+	add_float: r[ip->dst].f = r[ip->a].f + r[ip->b].f; DISPATCH();
+	sub_float: r[ip->dst].f = r[ip->a].f - r[ip->b].f; DISPATCH();
+	mul_float: r[ip->dst].f = r[ip->a].f * r[ip->b].f; DISPATCH();
+	div_float: r[ip->dst].f = r[ip->a].f / r[ip->b].f; DISPATCH();
+	unary_minus: r[ip->dst].f = -r[ip->a].f; DISPATCH();
+	float_lt: r[ip->dst].b = r[ip->a].f < r[ip->b].f; DISPATCH();
+	float_gt: r[ip->dst].b = r[ip->a].f > r[ip->b].f; DISPATCH();
+	and_bool: r[ip->dst].b = r[ip->a].b & r[ip->b].b; DISPATCH();
+	or_bool: r[ip->dst].b = r[ip->a].b | r[ip->b].b; DISPATCH();
+	call: r[ip->dst].f = callFunction(ip->b, &r[ip->a].f); DISPATCH();
+	ret_float: return r[ip->a].f;
+	ret_bool: return r[ip->a].b != 0;
+	jump_if_false: if (!r[ip->a].b) ip += ip->b; DISPATCH();
+	jump_if_true: if (r[ip->a].b) ip += ip->b; DISPATCH();
+	move: r[ip->dst] = r[ip->a]; DISPATCH();
+	store_float: if (results) results[ip->b] = r[ip->a].f; DISPATCH();
+	store_bool: if (results) results[ip->b] = r[ip->a].b ? 1.0f : 0.0f; DISPATCH();
+	mul_add_float:
+		r[ip->dst].f = r[ip->a].f * r[ip->b].f + r[ip[1].a].f;
+		++ip;
+		DISPATCH();
+	float_lt_jump_if_false:
+		r[ip->dst].b = r[ip->a].f < r[ip->b].f;
+		ip += r[ip->dst].b ? 1 : 1 + ip[1].b;
+		DISPATCH();
+	float_lt_jump_if_true:
+		r[ip->dst].b = r[ip->a].f < r[ip->b].f;
+		ip += r[ip->dst].b ? 1 + ip[1].b : 1;
+		DISPATCH();
+	float_gt_jump_if_false:
+		r[ip->dst].b = r[ip->a].f > r[ip->b].f;
+		ip += r[ip->dst].b ? 1 : 1 + ip[1].b;
+		DISPATCH();
+	float_gt_jump_if_true:
+		r[ip->dst].b = r[ip->a].f > r[ip->b].f;
+		ip += r[ip->dst].b ? 1 + ip[1].b : 1;
+		DISPATCH();
+	operand: DebugBreak(); return ReturnValue();
+
+	#undef DISPATCH
+#else
+	for (;; ++ip)
+	{
+		Register& dst = r[ip->dst];
+		const Register& a = r[ip->a];
+		const Register& b = r[ip->b];
+		switch (ip->type)
+		{
+			case Instruction::ADD_FLOAT: dst.f = a.f + b.f; break;
+			case Instruction::SUB_FLOAT: dst.f = a.f - b.f; break;
+			case Instruction::MUL_FLOAT: dst.f = a.f * b.f; break;
+			case Instruction::DIV_FLOAT: dst.f = a.f / b.f; break;
+			case Instruction::UNARY_MINUS: dst.f = -a.f; break;
+			case Instruction::FLOAT_LT: dst.b = a.f < b.f; break;
+			case Instruction::FLOAT_GT: dst.b = a.f > b.f; break;
+			case Instruction::AND: dst.b = a.b & b.b; break;
+			case Instruction::OR: dst.b = a.b | b.b; break;
+			case Instruction::CALL: dst.f = callFunction(ip->b, &a.f); break;
+			case Instruction::MOVE: dst = a; break;
+			case Instruction::STORE_FLOAT: if (results) results[ip->b] = a.f; break;
+			case Instruction::STORE_BOOL: if (results) results[ip->b] = a.b ? 1.0f : 0.0f; break;
+			case Instruction::RET_FLOAT: return a.f;
+			case Instruction::RET_BOOL: return a.b != 0;
+			case Instruction::JUMP_IF_FALSE: if (!a.b) ip += ip->b; break;
+			case Instruction::JUMP_IF_TRUE: if (a.b) ip += ip->b; break;
+			case Instruction::MUL_ADD_FLOAT:
+				dst.f = a.f * b.f + r[ip[1].a].f;
+				++ip;
+				break;
+			case Instruction::FLOAT_LT_JUMP_IF_FALSE:
+				dst.b = a.f < b.f;
+				ip += dst.b ? 1 : 1 + ip[1].b;
+				break;
+			case Instruction::FLOAT_LT_JUMP_IF_TRUE:
+				dst.b = a.f < b.f;
+				ip += dst.b ? 1 + ip[1].b : 1;
+				break;
+			case Instruction::FLOAT_GT_JUMP_IF_FALSE:
+				dst.b = a.f > b.f;
+				ip += dst.b ? 1 : 1 + ip[1].b;
+				break;
+			case Instruction::FLOAT_GT_JUMP_IF_TRUE:
+				dst.b = a.f > b.f;
+				ip += dst.b ? 1 + ip[1].b : 1;
+				break;
+			default: DebugBreak(); return ReturnValue();
+		}
+	}
+#endif
+}
+
+// index of the lowest set bit, `value` is not 0
+static int lowestBit(uint64 value)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(value);
+#elif defined(_M_X64)
+	unsigned long idx;
+	_BitScanForward64(&idx, value);
+	return (int)idx;
+#else
+	int idx = 0;
+	for (; (value & 1) == 0; value >>= 1) ++idx;
+	return idx;
+#endif
+}
+
+
+static int countBits(uint64 value)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(value);
+#else
+	int count = 0;
+	for (; value; value &= value - 1) ++count;
+	return count;
+#endif
+}
+
+
+struct ExpressionVM::Reducer
+{
+	// independent accumulators, so the additions of consecutive vectors do not wait for each other
+	static const int CHAINS = 4;
+
+	void add(int size);
+	template <Aggregate TYPE> void add(int size);
+
+	Aggregate type;
+	// the block of results 0 (the expression) and 1 (the predicate) of the program
+	float values[BATCH_BLOCK_SIZE];
+	float where[BATCH_BLOCK_SIZE];
+	// per SIMD lane
+	Simd::Vec sum[CHAINS];
+	Simd::Vec compensation[CHAINS];
+	Simd::Vec min[CHAINS];
+	Simd::Vec max[CHAINS];
+	int64 count;
+	int64 numbers;
+};
+
+
+void ExpressionVM::Reducer::add(int size)
+{
+	switch (type)
+	{
+		case Aggregate::SUM:
+		case Aggregate::AVG: add<Aggregate::SUM>(size); break;
+		case Aggregate::MIN: add<Aggregate::MIN>(size); break;
+		case Aggregate::MAX: add<Aggregate::MAX>(size); break;
+		case Aggregate::COUNT: add<Aggregate::COUNT>(size); break;
+		default: DebugBreak(); break;
+	}
+}
+
+
+// vectors are aliased with everything, the accumulators are copied to locals so they stay in
+// registers
+template <Aggregate TYPE> void ExpressionVM::Reducer::add(int size)
+{
+	using namespace Simd;
+	static const int STEP = CHAINS * WIDTH;
+	static_assert(BATCH_BLOCK_SIZE % STEP == 0, "blocks must be whole steps");
+	int end = (size + STEP - 1) & ~(STEP - 1);
+	for (int i = size; i < end; ++i) where[i] = 0;
+
+	Vec s[CHAINS];
+	Vec c[CHAINS];
+	Vec lo[CHAINS];
+	Vec hi[CHAINS];
+	for (int j = 0; j < CHAINS; ++j)
+	{
+		s[j] = sum[j];
+		c[j] = compensation[j];
+		lo[j] = min[j];
+		hi[j] = max[j];
+	}
+	int64 n = 0;
+	int64 numbers_n = 0;
+	for (int i = 0; i < end; i += STEP)
+	{
+		// masks of the whole step are counted at once
+		uint64 included_bits = 0;
+		uint64 number_bits = 0;
+		for (int j = 0; j < CHAINS; ++j)
+		{
+			Vec included = load(where + i + j * WIDTH);
+			Vec value = load(values + i + j * WIDTH);
+			if (TYPE == Aggregate::SUM)
+			{
+				// Kahan summation, `c` is the rounding error of the last addition
+				Vec y = sub(logicAnd(included, value), c[j]);
+				Vec t = Simd::add(s[j], y);
+				c[j] = sub(sub(t, s[j]), y);
+				s[j] = t;
+			}
+			if (TYPE == Aggregate::MIN)
+			{
+				lo[j] = minimum(select(included, value, splat(INFINITY)), lo[j]);
+				number_bits |= (uint64)movemask(logicAnd(included, ordered(value))) << (j * WIDTH);
+			}
+			if (TYPE == Aggregate::MAX)
+			{
+				hi[j] = maximum(select(included, value, splat(-INFINITY)), hi[j]);
+				number_bits |= (uint64)movemask(logicAnd(included, ordered(value))) << (j * WIDTH);
+			}
+			if (TYPE == Aggregate::COUNT) included = logicAnd(included, value);
+			included_bits |= (uint64)movemask(included) << (j * WIDTH);
+		}
+		n += countBits(included_bits);
+		numbers_n += countBits(number_bits);
+	}
+	for (int j = 0; j < CHAINS; ++j)
+	{
+		sum[j] = s[j];
+		compensation[j] = c[j];
+		min[j] = lo[j];
+		max[j] = hi[j];
+	}
+	count += n;
+	numbers += numbers_n;
+}
+
+
+Types ExpressionVM::evaluateBatch(const uint8* code,
+	const float* const* inputs,
+	float* const* results,
+	float* output,
+	int count,
+	Reducer* reducer)
+{
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	if (header.number_type != Types::FLOAT) return Types::NONE;
+	if (m_batch_registers.size() < header.register_count * BATCH_BLOCK_SIZE)
+	{
+		m_batch_registers.resize(header.register_count * BATCH_BLOCK_SIZE);
+	}
+
+	// every register has its own block in m_batch_registers, variables point directly to the
+	// columns in `inputs` unless the block has to be padded
+	float* blocks = &m_batch_registers[0];
+	const float* columns[MAX_REGISTERS];
+	for (int i = 0; i < header.constant_count; ++i)
+	{
+		float value;
+		memcpy(&value, header.constants() + i * sizeof(value), sizeof(value));
+		Simd::fill(blocks + i * BATCH_BLOCK_SIZE, value, BATCH_BLOCK_SIZE);
+		columns[i] = blocks + i * BATCH_BLOCK_SIZE;
+	}
+
+	for (int row = 0; row < count; row += BATCH_BLOCK_SIZE)
+	{
+		int block_size = count - row < BATCH_BLOCK_SIZE ? count - row : BATCH_BLOCK_SIZE;
+		int simd_size = (block_size + Simd::WIDTH - 1) & ~(Simd::WIDTH - 1);
+
+		const uint8* slots = header.variables();
+		for (int i = 0; i < header.variable_count; ++i)
+		{
+			uint16 slot;
+			memcpy(&slot, slots + i * sizeof(slot), sizeof(slot));
+			int reg = header.constant_count + i;
+			if (block_size == simd_size)
+			{
+				columns[reg] = inputs[slot] + row;
+			}
+			else
+			{
+				float* block = blocks + reg * BATCH_BLOCK_SIZE;
+				memcpy(block, inputs[slot] + row, block_size * sizeof(float));
+				memset(block + block_size, 0, (simd_size - block_size) * sizeof(float));
+				columns[reg] = block;
+			}
+		}
+
+		const uint8* ip = header.instructions();
+		for (;;)
+		{
+			uint8 type = ip[0];
+			float* dst = blocks + ip[1] * BATCH_BLOCK_SIZE;
+			const float* a = columns[ip[2]];
+			const float* b = columns[ip[3]];
+			ip += Instruction::SIZE;
+
+			// the block can skip the other operand only if all its rows agree
+			if (type == Instruction::JUMP_IF_FALSE)
+			{
+				if (!Simd::anyTrue(a, simd_size)) ip += ip[-1] * Instruction::SIZE;
+				continue;
+			}
+			if (type == Instruction::JUMP_IF_TRUE)
+			{
+				if (Simd::allTrue(a, simd_size)) ip += ip[-1] * Instruction::SIZE;
+				continue;
+			}
+			// instructions write only to their own block, so a move just redirects the column
+			if (type == Instruction::MOVE)
+			{
+				columns[ip[1 - Instruction::SIZE]] = a;
+				continue;
+			}
+			if (type == Instruction::MUL_ADD_FLOAT)
+			{
+				Simd::mulAdd(dst, a, b, columns[ip[2]], simd_size);
+				columns[ip[1 - Instruction::SIZE]] = dst;
+				ip += Instruction::SIZE;
+				continue;
+			}
+			bool fused_lt = type == Instruction::FLOAT_LT_JUMP_IF_FALSE ||
+							type == Instruction::FLOAT_LT_JUMP_IF_TRUE;
+			bool fused_gt = type == Instruction::FLOAT_GT_JUMP_IF_FALSE ||
+							type == Instruction::FLOAT_GT_JUMP_IF_TRUE;
+			if (fused_lt || fused_gt)
+			{
+				bool if_true = type == Instruction::FLOAT_LT_JUMP_IF_TRUE ||
+							   type == Instruction::FLOAT_GT_JUMP_IF_TRUE;
+				if (fused_lt) Simd::binary<Simd::lt>(dst, a, b, simd_size);
+				else Simd::binary<Simd::gt>(dst, a, b, simd_size);
+				columns[ip[1 - Instruction::SIZE]] = dst;
+				bool skip =
+					if_true ? Simd::allTrue(dst, simd_size) : !Simd::anyTrue(dst, simd_size);
+				ip += (skip ? 1 + ip[3] : 1) * Instruction::SIZE;
+				continue;
+			}
+
+			switch (type)
+			{
+				case Instruction::ADD_FLOAT: Simd::binary<Simd::add>(dst, a, b, simd_size); break;
+				case Instruction::SUB_FLOAT: Simd::binary<Simd::sub>(dst, a, b, simd_size); break;
+				case Instruction::MUL_FLOAT: Simd::binary<Simd::mul>(dst, a, b, simd_size); break;
+				case Instruction::DIV_FLOAT: Simd::binary<Simd::div>(dst, a, b, simd_size); break;
+				case Instruction::UNARY_MINUS: Simd::negate(dst, a, simd_size); break;
+				case Instruction::FLOAT_LT: Simd::binary<Simd::lt>(dst, a, b, simd_size); break;
+				case Instruction::FLOAT_GT: Simd::binary<Simd::gt>(dst, a, b, simd_size); break;
+				case Instruction::AND: Simd::binary<Simd::logicAnd>(dst, a, b, simd_size); break;
+				case Instruction::OR: Simd::binary<Simd::logicOr>(dst, a, b, simd_size); break;
+				case Instruction::CALL:
+					callFunctionBatch(ip[-1],
+						dst,
+						columns + ip[2 - Instruction::SIZE],
+						simd_size,
+						header.math_tier);
+					break;
+				case Instruction::STORE_FLOAT:
+				case Instruction::STORE_BOOL:
+					if (reducer && ip[-1] < 2)
+					{
+						float* block = ip[-1] == 0 ? reducer->values : reducer->where;
+						memcpy(block, a, simd_size * sizeof(float));
+					}
+					else if (results && type == Instruction::STORE_FLOAT)
+					{
+						memcpy(results[ip[-1]] + row, a, block_size * sizeof(float));
+					}
+					else if (results)
+					{
+						Simd::maskToFloat(results[ip[-1]] + row, a, block_size);
+					}
+					continue;
+				case Instruction::RET_FLOAT:
+					if (output) memcpy(output + row, a, block_size * sizeof(float));
+					break;
+				case Instruction::RET_BOOL:
+					if (output) Simd::maskToFloat(output + row, a, block_size);
+					break;
+				default: DebugBreak(); return Types::NONE;
+			}
+			if (type == Instruction::RET_FLOAT || type == Instruction::RET_BOOL) break;
+			columns[ip[1 - Instruction::SIZE]] = dst;
+		}
+		if (reducer) reducer->add(block_size);
+	}
+	return header.result_type;
+}
+
+
+int ExpressionVM::filter(const uint8* code,
+	const float* const* inputs,
+	uint64* selection,
+	int count)
+{
+	static const int WORDS = BATCH_BLOCK_SIZE / 64;
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	if (header.number_type != Types::FLOAT || header.result_type != Types::BOOL) return -1;
+	if (m_batch_registers.size() < header.register_count * BATCH_BLOCK_SIZE)
+	{
+		m_batch_registers.resize(header.register_count * BATCH_BLOCK_SIZE);
+	}
+	if (m_batch_bits.size() < header.register_count * WORDS)
+	{
+		m_batch_bits.resize(header.register_count * WORDS);
+	}
+
+	// a register holds floats (masks for booleans) in `columns` or booleans packed to bits in
+	// `bitmaps` or both, one is converted to the other on demand
+	enum
+	{
+		HAS_FLOATS = 1,
+		HAS_BITS = 2
+	};
+	float* blocks = &m_batch_registers[0];
+	uint64* bit_blocks = &m_batch_bits[0];
+	const float* columns[MAX_REGISTERS];
+	const uint64* bitmaps[MAX_REGISTERS];
+	uint8 state[MAX_REGISTERS];
+	for (int i = 0; i < header.constant_count; ++i)
+	{
+		float value;
+		memcpy(&value, header.constants() + i * sizeof(value), sizeof(value));
+		Simd::fill(blocks + i * BATCH_BLOCK_SIZE, value, BATCH_BLOCK_SIZE);
+		for (int j = 0; j < WORDS; ++j) bit_blocks[i * WORDS + j] = Simd::bits(value) ? ~0ULL : 0;
+		columns[i] = blocks + i * BATCH_BLOCK_SIZE;
+		bitmaps[i] = bit_blocks + i * WORDS;
+		state[i] = HAS_FLOATS | HAS_BITS;
+	}
+
+	int simd_size = 0;
+	auto getBits = [&](int reg) {
+		if ((state[reg] & HAS_BITS) == 0)
+		{
+			Simd::maskToBits(bit_blocks + reg * WORDS, columns[reg], simd_size);
+			bitmaps[reg] = bit_blocks + reg * WORDS;
+			state[reg] |= HAS_BITS;
+		}
+		return bitmaps[reg];
+	};
+	auto getMasks = [&](int reg) {
+		if ((state[reg] & HAS_FLOATS) == 0)
+		{
+			Simd::bitsToMask(blocks + reg * BATCH_BLOCK_SIZE, bitmaps[reg], simd_size);
+			columns[reg] = blocks + reg * BATCH_BLOCK_SIZE;
+			state[reg] |= HAS_FLOATS;
+		}
+	};
+
+	int selected = 0;
+	int rows[BATCH_BLOCK_SIZE];
+	for (int row = 0; row < count;)
+	{
+		// a block of all selected rows is evaluated in place, otherwise the next selected rows are
+		// gathered, whole words while they fit
+		int n = 0;
+		bool dense = count - row >= BATCH_BLOCK_SIZE;
+		for (int i = 0; dense && i < WORDS; ++i) dense = selection[(row >> 6) + i] == ~0ULL;
+		if (dense)
+		{
+			rows[0] = row;
+			n = BATCH_BLOCK_SIZE;
+			row += BATCH_BLOCK_SIZE;
+		}
+		for (; !dense && row < count && n <= BATCH_BLOCK_SIZE - 64; row += 64)
+		{
+			uint64 word = selection[row >> 6];
+			if (count - row < 64) word &= (1ULL << (count - row)) - 1;
+			for (; word; word &= word - 1) rows[n++] = row + lowestBit(word);
+		}
+		if (n == 0) continue;
+
+		simd_size = (n + Simd::WIDTH - 1) & ~(Simd::WIDTH - 1);
+		int words = (n + 63) >> 6;
+		uint64 valid[WORDS];
+		for (int i = 0; i < words; ++i)
+		{
+			valid[i] = n - i * 64 >= 64 ? ~0ULL : (1ULL << (n - i * 64)) - 1;
+		}
+
+		const uint8* slots = header.variables();
+		for (int i = 0; i < header.variable_count; ++i)
+		{
+			uint16 slot;
+			memcpy(&slot, slots + i * sizeof(slot), sizeof(slot));
+			int reg = header.constant_count + i;
+			state[reg] = HAS_FLOATS;
+			if (dense)
+			{
+				columns[reg] = inputs[slot] + rows[0];
+				continue;
+			}
+			float* block = blocks + reg * BATCH_BLOCK_SIZE;
+			for (int j = 0; j < n; ++j) block[j] = inputs[slot][rows[j]];
+			memset(block + n, 0, (simd_size - n) * sizeof(float));
+			columns[reg] = block;
+		}
+
+		const uint8* ip = header.instructions();
+		for (;;)
+		{
+			uint8 type = ip[0];
+			int dst_reg = ip[1];
+			int a_reg = ip[2];
+			int b_reg = ip[3];
+			float* dst = blocks + dst_reg * BATCH_BLOCK_SIZE;
+			uint64* dst_bits = bit_blocks + dst_reg * WORDS;
+			const float* a = columns[a_reg];
+			const float* b = columns[b_reg];
+			ip += Instruction::SIZE;
+
+			bool jump_if_false = type == Instruction::JUMP_IF_FALSE ||
+								 type == Instruction::FLOAT_LT_JUMP_IF_FALSE ||
+								 type == Instruction::FLOAT_GT_JUMP_IF_FALSE;
+			bool jump_if_true = type == Instruction::JUMP_IF_TRUE ||
+								type == Instruction::FLOAT_LT_JUMP_IF_TRUE ||
+								type == Instruction::FLOAT_GT_JUMP_IF_TRUE;
+			const uint64* condition = nullptr;
+			switch (type)
+			{
+				case Instruction::ADD_FLOAT: Simd::binary<Simd::add>(dst, a, b, simd_size); break;
+				case Instruction::SUB_FLOAT: Simd::binary<Simd::sub>(dst, a, b, simd_size); break;
+				case Instruction::MUL_FLOAT: Simd::binary<Simd::mul>(dst, a, b, simd_size); break;
+				case Instruction::DIV_FLOAT: Simd::binary<Simd::div>(dst, a, b, simd_size); break;
+				case Instruction::UNARY_MINUS: Simd::negate(dst, a, simd_size); break;
+				case Instruction::MUL_ADD_FLOAT:
+					Simd::mulAdd(dst, a, b, columns[ip[2]], simd_size);
+					ip += Instruction::SIZE;
+					break;
+				case Instruction::CALL:
+					for (int i = 0; i < FunctionRegistry::get(b_reg).arity; ++i)
+					{
+						getMasks(a_reg + i);
+					}
+					callFunctionBatch(b_reg, dst, columns + a_reg, simd_size, header.math_tier);
+					break;
+				case Instruction::FLOAT_LT:
+				case Instruction::FLOAT_LT_JUMP_IF_FALSE:
+				case Instruction::FLOAT_LT_JUMP_IF_TRUE:
+					Simd::compareBits<Simd::lt>(dst_bits, a, b, simd_size);
+					break;
+				case Instruction::FLOAT_GT:
+				case Instruction::FLOAT_GT_JUMP_IF_FALSE:
+				case Instruction::FLOAT_GT_JUMP_IF_TRUE:
+					Simd::compareBits<Simd::gt>(dst_bits, a, b, simd_size);
+					break;
+				case Instruction::AND:
+				case Instruction::OR:
+				{
+					const uint64* a_bits = getBits(a_reg);
+					const uint64* b_bits = getBits(b_reg);
+					if (type == Instruction::AND)
+					{
+						for (int i = 0; i < words; ++i) dst_bits[i] = a_bits[i] & b_bits[i];
+					}
+					else
+					{
+						for (int i = 0; i < words; ++i) dst_bits[i] = a_bits[i] | b_bits[i];
+					}
+				}
+				break;
+				case Instruction::JUMP_IF_FALSE:
+				case Instruction::JUMP_IF_TRUE: condition = getBits(a_reg); break;
+				// instructions write only to their own block, so a move just redirects the column
+				case Instruction::MOVE:
+					columns[dst_reg] = a;
+					bitmaps[dst_reg] = bitmaps[a_reg];
+					state[dst_reg] = state[a_reg];
+					continue;
+				case Instruction::STORE_FLOAT:
+				case Instruction::STORE_BOOL: continue;
+				case Instruction::RET_BOOL:
+				{
+					const uint64* result = getBits(a_reg);
+					for (int i = 0; i < words; ++i)
+					{
+						uint64 passed = result[i] & valid[i];
+						selected += countBits(passed);
+						if (dense)
+						{
+							selection[(rows[0] >> 6) + i] = passed;
+							continue;
+						}
+						for (uint64 failed = valid[i] & ~passed; failed; failed &= failed - 1)
+						{
+							int failed_row = rows[i * 64 + lowestBit(failed)];
+							selection[failed_row >> 6] &= ~(1ULL << (failed_row & 63));
+						}
+					}
+				}
+				break;
+				default: DebugBreak(); return -1;
+			}
+			if (type == Instruction::RET_BOOL) break;
+
+			if (jump_if_false || jump_if_true)
+			{
+				// fused comparisons wrote their result, the jump length is in the OPERAND slot
+				int length = ip[-1];
+				if (!condition)
+				{
+					bitmaps[dst_reg] = dst_bits;
+					state[dst_reg] = HAS_BITS;
+					condition = dst_bits;
+					length = ip[3];
+					ip += Instruction::SIZE;
+				}
+				// the block can skip the other operand only if all its rows agree
+				bool skip = true;
+				for (int i = 0; i < words; ++i)
+				{
+					uint64 value = condition[i] & valid[i];
+					if (jump_if_false ? value != 0 : value != valid[i]) skip = false;
+				}
+				if (skip) ip += length * Instruction::SIZE;
+				continue;
+			}
+
+			bool bits_result = type == Instruction::FLOAT_LT || type == Instruction::FLOAT_GT ||
+							   type == Instruction::AND || type == Instruction::OR;
+			if (bits_result) bitmaps[dst_reg] = dst_bits;
+			else columns[dst_reg] = dst;
+			state[dst_reg] = bits_result ? HAS_BITS : HAS_FLOATS;
+		}
+	}
+	return selected;
+}
+
+
+bool ExpressionVM::aggregate(const uint8* code,
+	const float* const* inputs,
+	int count,
+	Accumulator& accumulator)
+{
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	if (header.aggregate == Aggregate::NONE) return false;
+
+	static const int LANES = Reducer::CHAINS * Simd::WIDTH;
+	Reducer reducer;
+	reducer.type = header.aggregate;
+	// without a predicate all rows are included, rows past the end of the last block are excluded
+	Simd::fill(reducer.where, Simd::mask(0xffFFffFF), BATCH_BLOCK_SIZE);
+	Simd::fill(reducer.values, 0, BATCH_BLOCK_SIZE);
+	for (int i = 0; i < Reducer::CHAINS; ++i)
+	{
+		reducer.sum[i] = reducer.compensation[i] = Simd::splat(0);
+		reducer.min[i] = Simd::splat(INFINITY);
+		reducer.max[i] = Simd::splat(-INFINITY);
+	}
+	reducer.count = reducer.numbers = 0;
+	if (evaluateBatch(code, inputs, nullptr, nullptr, count, &reducer) == Types::NONE) return false;
+
+	float sums[LANES];
+	float compensations[LANES];
+	float mins[LANES];
+	float maxs[LANES];
+	for (int i = 0; i < Reducer::CHAINS; ++i)
+	{
+		Simd::store(sums + i * Simd::WIDTH, reducer.sum[i]);
+		Simd::store(compensations + i * Simd::WIDTH, reducer.compensation[i]);
+		Simd::store(mins + i * Simd::WIDTH, reducer.min[i]);
+		Simd::store(maxs + i * Simd::WIDTH, reducer.max[i]);
+	}
+	Accumulator result;
+	for (int i = 0; i < LANES; ++i)
+	{
+		result.sum += (double)sums[i] - compensations[i];
+		if (mins[i] < result.min) result.min = mins[i];
+		if (maxs[i] > result.max) result.max = maxs[i];
+	}
+	result.count = reducer.count;
+	result.numbers = reducer.numbers;
+	accumulator.merge(result);
+	return true;
+}
+
+
+float ExpressionVM::Accumulator::get(Aggregate type) const
+{
+	switch (type)
+	{
+		case Aggregate::SUM: return (float)sum;
+		case Aggregate::MIN: return numbers > 0 ? min : NAN;
+		case Aggregate::MAX: return numbers > 0 ? max : NAN;
+		case Aggregate::AVG: return count > 0 ? (float)(sum / count) : NAN;
+		case Aggregate::COUNT: return (float)count;
+		default: return NAN;
+	}
+}
+
+
+ExpressionVM::ReturnValue ExpressionVM::compileAndRun(ExpressionCompiler& compiler,
+	const char* src,
+	const float* inputs)
+{
+	// programs of other number types need TypedExpressionVM
+	if (compiler.getNumberType() != Types::FLOAT)
+	{
+		compiler.m_compile_time_error = ExpressionCompiler::Error::INCORRECT_TYPE_ARGS;
+		compiler.m_compile_time_offset = 0;
+		return ReturnValue();
+	}
+	// programs found in the file or the cache succeed as if compile() did
+	compiler.m_compile_time_error = ExpressionCompiler::Error::NONE;
+	compiler.m_compile_time_offset = 0;
+	uint32 signature = compiler.getSignature();
+	const ProgramFile* file = m_program_file;
+	if (file && file->getCount() > 0 && file->getSignature() == signature)
+	{
+		int idx = file->find(src);
+		if (idx >= 0) return evaluate(file->getProgram(idx), inputs);
+	}
+	if (m_cache && m_cache->get(src, signature, m_byte_code) > 0)
+	{
+		return evaluate(&m_byte_code[0], inputs);
+	}
+
+	int size = compiler.compile(src, m_arena, m_byte_code);
+	if (size <= 0) return ReturnValue();
+	if (m_cache) m_cache->put(src, signature, &m_byte_code[0], size);
+	return evaluate(&m_byte_code[0], inputs);
+}
+
+
+// Arithmetic of TypedExpressionVM, int64 wraps around instead of overflowing
+template <typename T> struct TypedArithmetic
+{
+	static T add(T a, T b) { return a + b; }
+	static T sub(T a, T b) { return a - b; }
+	static T mul(T a, T b) { return a * b; }
+	static T div(T a, T b) { return a / b; }
+	static T negate(T a) { return -a; }
+	static T fromFloat(float value) { return value; }
+};
+
+
+template <> struct TypedArithmetic<int64>
+{
+	static int64 add(int64 a, int64 b) { return (int64)((uint64)a + (uint64)b); }
+	static int64 sub(int64 a, int64 b) { return (int64)((uint64)a - (uint64)b); }
+	static int64 mul(int64 a, int64 b) { return (int64)((uint64)a * (uint64)b); }
+	static int64 negate(int64 a) { return (int64)(0 - (uint64)a); }
+
+	static int64 div(int64 a, int64 b)
+	{
+		if (b == 0) return 0;
+		// LLONG_MIN / -1 overflows
+		if (b == -1) return negate(a);
+		return a / b;
+	}
+
+	// NaN and values out of range give 0
+	static int64 fromFloat(float value)
+	{
+		return value > -9.2e18f && value < 9.2e18f ? (int64)value : 0;
+	}
+};
+
+
+template <typename T>
+typename TypedExpressionVM<T>::ReturnValue TypedExpressionVM<T>::evaluate(const uint8* code,
+	const T* inputs,
+	T* results)
+{
+	typedef TypedArithmetic<T> Math;
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	if (header.number_type != NUMBER_TYPE) return ReturnValue();
+
+	Register* r = m_registers;
+	const uint8* constants = header.constants();
+	for (int i = 0; i < header.constant_count; ++i)
+	{
+		memcpy(&r[i].value, constants + i * sizeof(T), sizeof(T));
+	}
+	const uint8* slots = header.variables();
+	for (int i = 0; i < header.variable_count; ++i)
+	{
+		uint16 slot;
+		memcpy(&slot, slots + i * sizeof(slot), sizeof(slot));
+		r[header.constant_count + i].value = inputs[slot];
+	}
+
+	const uint8* ip = header.instructions();
+	for (;;)
+	{
+		uint8 type = ip[0];
+		Register& dst = r[ip[1]];
+		const Register& a = r[ip[2]];
+		const Register& b = r[ip[3]];
+		ip += Instruction::SIZE;
+		switch (type)
+		{
+			case Instruction::ADD_FLOAT: dst.value = Math::add(a.value, b.value); break;
+			case Instruction::SUB_FLOAT: dst.value = Math::sub(a.value, b.value); break;
+			case Instruction::MUL_FLOAT: dst.value = Math::mul(a.value, b.value); break;
+			case Instruction::DIV_FLOAT: dst.value = Math::div(a.value, b.value); break;
+			case Instruction::UNARY_MINUS: dst.value = Math::negate(a.value); break;
+			case Instruction::FLOAT_LT: dst.b = a.value < b.value; break;
+			case Instruction::FLOAT_GT: dst.b = a.value > b.value; break;
+			case Instruction::AND: dst.b = a.b & b.b; break;
+			case Instruction::OR: dst.b = a.b | b.b; break;
+			case Instruction::CALL:
+			{
+				const FunctionRegistry::Function& fn = FunctionRegistry::get(ip[-1]);
+				float args[FunctionRegistry::MAX_ARGS];
+				for (int i = 0; i < fn.arity; ++i)
+				{
+					const Register& arg = (&a)[i];
+					if (fn.args[i] == Types::BOOL) args[i] = Simd::mask(arg.b ? 0xffFFffFF : 0);
+					else args[i] = (float)arg.value;
+				}
+				float value = fn.call(args);
+				if (fn.ret_type == Types::BOOL) dst.b = Simd::bits(value) != 0;
+				else dst.value = Math::fromFloat(value);
+			}
+			break;
+			case Instruction::MOVE: dst = a; break;
+			case Instruction::STORE_FLOAT: if (results) results[ip[-1]] = a.value; break;
+			case Instruction::STORE_BOOL: if (results) results[ip[-1]] = a.b ? 1 : 0; break;
+			case Instruction::RET_FLOAT: return a.value;
+			case Instruction::RET_BOOL: return a.b != 0;
+			case Instruction::JUMP_IF_FALSE: if (!a.b) ip += ip[-1] * Instruction::SIZE; break;
+			case Instruction::JUMP_IF_TRUE: if (a.b) ip += ip[-1] * Instruction::SIZE; break;
+			case Instruction::MUL_ADD_FLOAT:
+				dst.value = Math::add(Math::mul(a.value, b.value), r[ip[2]].value);
+				ip += Instruction::SIZE;
+				break;
+			case Instruction::FLOAT_LT_JUMP_IF_FALSE:
+			case Instruction::FLOAT_LT_JUMP_IF_TRUE:
+			case Instruction::FLOAT_GT_JUMP_IF_FALSE:
+			case Instruction::FLOAT_GT_JUMP_IF_TRUE:
+			{
+				bool lt = type == Instruction::FLOAT_LT_JUMP_IF_FALSE ||
+						  type == Instruction::FLOAT_LT_JUMP_IF_TRUE;
+				bool if_true = type == Instruction::FLOAT_LT_JUMP_IF_TRUE ||
+							   type == Instruction::FLOAT_GT_JUMP_IF_TRUE;
+				dst.b = lt ? a.value < b.value : a.value > b.value;
+				ip += Instruction::SIZE;
+				if ((dst.b != 0) == if_true) ip += ip[-1] * Instruction::SIZE;
+			}
+			break;
+			default: DebugBreak(); return ReturnValue();
+		}
+	}
+}
+
+
+template <typename T>
+Types TypedExpressionVM<T>::evaluateBatch(const uint8* code,
+	const T* const* inputs,
+	T* output,
+	int count)
+{
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	if (header.number_type != NUMBER_TYPE) return Types::NONE;
+
+	// evaluate() reads inputs by slot, so gather a row of the used slots
+	int max_slot = -1;
+	for (int i = 0; i < header.variable_count; ++i)
+	{
+		uint16 slot;
+		memcpy(&slot, header.variables() + i * sizeof(slot), sizeof(slot));
+		if (slot > max_slot) max_slot = slot;
+	}
+	m_row.resize(max_slot >= 0 ? max_slot + 1 : 1);
+	for (int row = 0; row < count; ++row)
+	{
+		for (int i = 0; i < header.variable_count; ++i)
+		{
+			uint16 slot;
+			memcpy(&slot, header.variables() + i * sizeof(slot), sizeof(slot));
+			m_row[slot] = inputs[slot][row];
+		}
+		ReturnValue value = evaluate(code, &m_row[0]);
+		if (value.type == Types::NONE) return Types::NONE;
+		output[row] = value.type == Types::BOOL ? (value.b_value ? 1 : 0) : value.value;
+	}
+	return header.result_type;
+}
+
+
+template class TypedExpressionVM<double>;
+template class TypedExpressionVM<int64>;
+
+
+ExpressionArena::ExpressionArena(int chunk_size)
+	: m_chunks(nullptr)
+	, m_cursor(nullptr)
+	, m_end(nullptr)
+	, m_chunk_size(chunk_size > 0 ? chunk_size : 1)
+	, m_capacity(0)
+	, m_heap_allocations(0)
+{
+}
+
+
+ExpressionArena::~ExpressionArena()
+{
+	freeChunks();
+}
+
+
+void ExpressionArena::freeChunks()
+{
+	while (m_chunks)
+	{
+		Chunk* next = m_chunks->next;
+		free(m_chunks);
+		m_chunks = next;
+	}
+	m_cursor = m_end = nullptr;
+	m_capacity = 0;
+}
+
+
+bool ExpressionArena::addChunk(size_t size)
+{
+	// the data is aligned like the chunk header, alignments up to it cost no padding
+	Chunk* chunk = (Chunk*)malloc(sizeof(Chunk) + size);
+	if (!chunk) return false;
+	++m_heap_allocations;
+	chunk->next = m_chunks;
+	chunk->size = size;
+	m_chunks = chunk;
+	m_capacity += size;
+	m_cursor = (uint8*)(chunk + 1);
+	m_end = m_cursor + size;
+	return true;
+}
+
+
+void* ExpressionArena::allocate(size_t size, size_t align)
+{
+	uintptr_t aligned = ((uintptr_t)m_cursor + align - 1) & ~(uintptr_t)(align - 1);
+	if (!m_cursor || aligned + size > (uintptr_t)m_end)
+	{
+		size_t chunk_size = m_capacity > m_chunk_size ? m_capacity : m_chunk_size;
+		if (chunk_size < size + align) chunk_size = size + align;
+		if (!addChunk(chunk_size)) return nullptr;
+		aligned = ((uintptr_t)m_cursor + align - 1) & ~(uintptr_t)(align - 1);
+	}
+	m_cursor = (uint8*)(aligned + size);
+	return (void*)aligned;
+}
+
+
+void ExpressionArena::reset()
+{
+	if (!m_chunks) return;
+	if (m_chunks->next)
+	{
+		size_t capacity = m_capacity;
+		freeChunks();
+		addChunk(capacity);
+		return;
+	}
+	m_cursor = (uint8*)(m_chunks + 1);
+}
+
+
+ExpressionCompiler::ExpressionCompiler()
+	: m_compile_time_error(Error::NONE)
+	, m_compile_time_offset(0)
+	, m_variables(nullptr)
+	, m_variables_count(0)
+	, m_variables_hash(0)
+	, m_number_type(Types::FLOAT)
+	, m_math_tier(MathTier::STANDARD)
+{
+}
+
+
+uint32 ExpressionCompiler::getSignature() const
+{
+	uint32 signature = m_variables_hash ^ (uint32)FunctionRegistry::getCount();
+	if (m_number_type != Types::FLOAT) signature = (signature ^ (uint32)m_number_type) * 16777619U;
+	if (m_math_tier != MathTier::STANDARD)
+	{
+		signature = (signature ^ ((uint32)m_math_tier << 8)) * 16777619U;
+	}
+	return signature;
+}
+
+
+bool ExpressionCompiler::getNumber(const char* src, const Token& token, uint64& bits)
+{
+	bits = 0;
+	double value;
+	bool is_const = token.type == Token::IDENTIFIER && getConstValue(src, token, value);
+	if (m_number_type == Types::FLOAT)
+	{
+		float float_value = is_const ? (float)value : token.number;
+		memcpy(&bits, &float_value, sizeof(float_value));
+		return true;
+	}
+
+	// the lexer rounds numbers to float, so parse them again
+	const char* token_end = src + token.offset + token.size;
+	char* end = nullptr;
+	errno = 0;
+	if (m_number_type == Types::DOUBLE)
+	{
+		if (!is_const) value = strtod(src + token.offset, &end);
+		memcpy(&bits, &value, sizeof(value));
+		if (is_const || end == token_end) return true;
+	}
+	else if (m_number_type == Types::INT64 && !is_const)
+	{
+		int64 int_value = strtoll(src + token.offset, &end, 10);
+		memcpy(&bits, &int_value, sizeof(int_value));
+		if (end == token_end && errno == 0) return true;
+	}
+	m_compile_time_error = Error::INCORRECT_TYPE_ARGS;
+	m_compile_time_offset = token.offset;
+	return false;
+}
+
+
+uint16 ExpressionCompiler::getFunctionIdx(const char* src, const ExpressionCompiler::Token& token)
+{
+	return FunctionRegistry::find(src + token.offset, token.size);
+}
+
+
+void ExpressionCompiler::setVariables(const char* const* names, int count)
+{
+	m_variables = names;
+	m_variables_count = count;
+	m_variables_hash = 0;
+	if (count == 0) return;
+
+	m_variables_hash = hashString("");
+	for (int i = 0; i < count; ++i)
+	{
+		m_variables_hash = hashString(names[i], m_variables_hash);
+		m_variables_hash = hashString(",", m_variables_hash);
+	}
+}
+
+
+ExpressionCache::ExpressionCache(int capacity)
+	: m_capacity(capacity)
+	, m_most_recent(-1)
+	, m_least_recent(-1)
+{
+	m_stats.hits = 0;
+	m_stats.misses = 0;
+	m_stats.evictions = 0;
+	m_entries.reserve(capacity);
+	m_map.reserve(capacity);
+}
+
+
+void ExpressionCache::unlink(int idx)
+{
+	Entry& entry = m_entries[idx];
+	if (entry.prev >= 0) m_entries[entry.prev].next = entry.next;
+	else m_most_recent = entry.next;
+	if (entry.next >= 0) m_entries[entry.next].prev = entry.prev;
+	else m_least_recent = entry.prev;
+}
+
+
+void ExpressionCache::pushFront(int idx)
+{
+	Entry& entry = m_entries[idx];
+	entry.prev = -1;
+	entry.next = m_most_recent;
+	if (m_most_recent >= 0) m_entries[m_most_recent].prev = idx;
+	m_most_recent = idx;
+	if (m_least_recent < 0) m_least_recent = idx;
+}
+
+
+ExpressionCache::Entry* ExpressionCache::find(const char* src, uint32 signature)
+{
+	auto iter = m_map.find(hashString(src, signature));
+	if (iter == m_map.end()) return nullptr;
+	Entry& entry = m_entries[iter->second];
+	return entry.signature == signature && entry.src == src ? &entry : nullptr;
+}
+
+
+int ExpressionCache::get(const char* src, uint32 signature, uint8* byte_code, int max_size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Entry* entry = find(src, signature);
+	int size = entry ? (int)entry->byte_code.size() : 0;
+	if (!entry || size > max_size)
+	{
+		++m_stats.misses;
+		return 0;
+	}
+
+	++m_stats.hits;
+	int idx = int(entry - &m_entries[0]);
+	unlink(idx);
+	pushFront(idx);
+	memcpy(byte_code, &entry->byte_code[0], size);
+	return size;
+}
+
+
+int ExpressionCache::get(const char* src, uint32 signature, std::vector<uint8>& byte_code)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Entry* entry = find(src, signature);
+	if (!entry)
+	{
+		++m_stats.misses;
+		return 0;
+	}
+
+	++m_stats.hits;
+	int idx = int(entry - &m_entries[0]);
+	unlink(idx);
+	pushFront(idx);
+	byte_code.assign(entry->byte_code.begin(), entry->byte_code.end());
+	return (int)byte_code.size();
+}
+
+
+void ExpressionCache::put(const char* src, uint32 signature, const uint8* byte_code, int size)
+{
+	if (m_capacity <= 0) return;
+
+	uint32 hash = hashString(src, signature);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int idx;
+	auto iter = m_map.find(hash);
+	if (iter != m_map.end())
+	{
+		// same source compiled concurrently, or a hash collision; the newer program wins
+		idx = iter->second;
+		unlink(idx);
+	}
+	else if ((int)m_entries.size() < m_capacity)
+	{
+		idx = (int)m_entries.size();
+		m_entries.emplace_back();
+	}
+	else
+	{
+		idx = m_least_recent;
+		unlink(idx);
+		m_map.erase(m_entries[idx].hash);
+		++m_stats.evictions;
+	}
+
+	Entry& entry = m_entries[idx];
+	entry.hash = hash;
+	entry.signature = signature;
+	entry.src = src;
+	entry.byte_code.assign(byte_code, byte_code + size);
+	m_map[hash] = idx;
+	pushFront(idx);
+}
+
+
+ExpressionCache::Stats ExpressionCache::getStats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+
+// FNV-1a style, a word at a time, with a shift so high bits reach the low ones
+static uint32 checksum(const uint8* data, int size)
+{
+	uint32 hash = 2166136261U;
+	int i = 0;
+	for (; i + 4 <= size; i += 4)
+	{
+		uint32 word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 16777619U;
+		hash ^= hash >> 15;
+	}
+	for (; i < size; ++i) hash = (hash ^ data[i]) * 16777619U;
+	return hash;
+}
+
+
+int ExpressionCompiler::serialize(const char* const* sources, int count, std::vector<uint8>& out)
+{
+	static const int ALIGNMENT = ProgramFileHeader::ALIGNMENT;
+
+	std::vector<ProgramFileEntry> entries(count);
+	std::vector<uint8> programs;
+	ExpressionArena arena;
+	std::vector<uint8> byte_code;
+	for (int i = 0; i < count; ++i)
+	{
+		const char* src = sources[i];
+		int size = compile(src, arena, byte_code);
+		if (size <= 0) return -1;
+
+		entries[i].source_hash = hashString(src);
+		entries[i].program_offset = (uint32)programs.size();
+		entries[i].program_size = size;
+		programs.insert(programs.end(), byte_code.begin(), byte_code.begin() + size);
+		programs.resize((programs.size() + ALIGNMENT - 1) & ~(ALIGNMENT - 1), 0);
+	}
+
+	std::vector<uint32> lookup(count);
+	for (int i = 0; i < count; ++i) lookup[i] = i;
+	std::sort(lookup.begin(), lookup.end(), [&entries](uint32 a, uint32 b) {
+		if (entries[a].source_hash != entries[b].source_hash)
+		{
+			return entries[a].source_hash < entries[b].source_hash;
+		}
+		return a < b;
+	});
+
+	uint32 entries_offset = sizeof(ProgramFileHeader);
+	uint32 lookup_offset = entries_offset + count * sizeof(ProgramFileEntry);
+	uint32 programs_offset = lookup_offset + count * sizeof(uint32);
+	uint32 sources_offset = programs_offset + (uint32)programs.size();
+	uint32 file_size = sources_offset;
+	for (int i = 0; i < count; ++i)
+	{
+		entries[i].program_offset += programs_offset;
+		entries[i].source_offset = file_size;
+		file_size += (uint32)strlen(sources[i]) + 1;
+	}
+
+	out.assign(file_size, 0);
+	uint8* data = &out[0];
+	if (count > 0)
+	{
+		memcpy(data + entries_offset, &entries[0], count * sizeof(ProgramFileEntry));
+		memcpy(data + lookup_offset, &lookup[0], count * sizeof(uint32));
+	}
+	if (!programs.empty()) memcpy(data + programs_offset, &programs[0], programs.size());
+	for (int i = 0; i < count; ++i)
+	{
+		memcpy(data + entries[i].source_offset, sources[i], strlen(sources[i]) + 1);
+	}
+
+	ProgramFileHeader header;
+	header.magic = ProgramFileHeader::MAGIC;
+	header.version = ProgramFileHeader::VERSION;
+	header.header_size = sizeof(ProgramFileHeader);
+	header.file_size = file_size;
+	header.checksum = checksum(data + sizeof(header), file_size - sizeof(header));
+	header.signature = getSignature();
+	header.program_count = count;
+	memcpy(data, &header, sizeof(header));
+	return (int)file_size;
+}
+
+
+ProgramFile::ProgramFile()
+	: m_data(nullptr)
+	, m_size(0)
+	, m_mapped(false)
+	, m_error(Error::NONE)
+{
+}
+
+
+ProgramFile::~ProgramFile()
+{
+	close();
+}
+
+
+bool ProgramFile::open(const char* path)
+{
+	close();
+	m_error = Error::CANNOT_OPEN;
+	void* data = nullptr;
+	int size = 0;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER file_size;
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && file_size.QuadPart < INT_MAX)
+	{
+		size = (int)file_size.QuadPart;
+		// the view keeps the mapping alive
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+		{
+			data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	if (!data) return false;
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < INT_MAX)
+	{
+		size = (int)st.st_size;
+		data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) data = nullptr;
+	}
+	::close(fd);
+	if (!data) return false;
+#endif
+
+	m_data = (const uint8*)data;
+	m_size = size;
+	m_mapped = true;
+	if (validate()) return true;
+
+	Error error = m_error;
+	close();
+	m_error = error;
+	return false;
+}
+
+
+bool ProgramFile::open(const void* data, int size)
+{
+	close();
+	m_data = (const uint8*)data;
+	m_size = size;
+	if (validate()) return true;
+
+	m_data = nullptr;
+	m_size = 0;
+	return false;
+}
+
+
+void ProgramFile::close()
+{
+	if (m_mapped)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(m_data);
+#else
+		munmap((void*)m_data, m_size);
+#endif
+	}
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+}
+
+
+bool ProgramFile::validate()
+{
+	m_error = Error::INVALID_FORMAT;
+	// fields are read in place
+	if (!m_data || (size_t)m_data % ProgramFileHeader::ALIGNMENT != 0) return false;
+	if (m_size < (int)sizeof(ProgramFileHeader)) return false;
+
+	const ProgramFileHeader& h = header();
+	if (h.magic != ProgramFileHeader::MAGIC) return false;
+	if (h.version != ProgramFileHeader::VERSION)
+	{
+		m_error = Error::UNSUPPORTED_VERSION;
+		return false;
+	}
+	if (h.header_size != sizeof(ProgramFileHeader) || h.file_size != (uint32)m_size) return false;
+	uint32 tables_size = sizeof(ProgramFileEntry) + sizeof(uint32);
+	if (h.program_count > (m_size - sizeof(ProgramFileHeader)) / tables_size) return false;
+	// sources are at the end of the file, so every one of them is terminated
+	if (h.program_count > 0 && m_data[m_size - 1] != '\0') return false;
+
+	uint32 programs_offset = sizeof(ProgramFileHeader) + h.program_count * tables_size;
+	for (uint32 i = 0; i < h.program_count; ++i)
+	{
+		const ProgramFileEntry& entry = entries()[i];
+		if (entry.program_offset < programs_offset) return false;
+		if (entry.program_offset % ProgramFileHeader::ALIGNMENT != 0) return false;
+		if (entry.program_offset > (uint32)m_size) return false;
+		if (entry.program_size < sizeof(ProgramHeader)) return false;
+		if (entry.program_size > m_size - entry.program_offset) return false;
+		if (entry.source_offset < programs_offset) return false;
+		if (entry.source_offset >= (uint32)m_size) return false;
+		const ProgramHeader& program = *(const ProgramHeader*)getProgram(i);
+		if (program.instructions() + Instruction::SIZE > getProgram(i) + entry.program_size)
+		{
+			return false;
+		}
+		if (lookup()[i] >= h.program_count) return false;
+	}
+
+	const uint8* payload = m_data + sizeof(ProgramFileHeader);
+	if (checksum(payload, m_size - sizeof(ProgramFileHeader)) != h.checksum)
+	{
+		m_error = Error::CHECKSUM_MISMATCH;
+		return false;
+	}
+
+	m_error = Error::NONE;
+	return true;
+}
+
+
+int ProgramFile::find(const char* src) const
+{
+	int count = getCount();
+	if (count == 0) return -1;
+
+	uint32 hash = hashString(src);
+	const uint32* indices = lookup();
+	const uint32* end = indices + count;
+	const uint32* iter = std::lower_bound(indices, end, hash, [this](uint32 idx, uint32 value) {
+		return entries()[idx].source_hash < value;
+	});
+	for (; iter != end && entries()[*iter].source_hash == hash; ++iter)
+	{
+		if (strcmp(getSource(*iter), src) == 0) return *iter;
+	}
+	return -1;
+}
+
+
+int ExpressionCompiler::toPostfix(const Token* input, Token* output, int count)
+{
+	// the stack never holds more than all tokens
+	static const int MAX_STACK_SIZE = 64;
+	if (count > MAX_STACK_SIZE)
+	{
+		std::vector<Token> func_stack(count);
+		std::vector<int> comma_counts(count);
+		return toPostfix(input, output, count, &func_stack[0], &comma_counts[0]);
+	}
+	Token func_stack[MAX_STACK_SIZE];
+	int comma_counts[MAX_STACK_SIZE];
+	return toPostfix(input, output, count, func_stack, comma_counts);
+}
+
+
+// `comma_counts` are for parentheses of function calls the number of commas so far, -1 for other
+// parentheses
+int ExpressionCompiler::toPostfix(const Token* input,
+	Token* output,
+	int count,
+	Token* func_stack,
+	int* comma_counts)
+{
+	int func_stack_idx = 0;
+	Token* out = output;
+	int out_token_count = count;
+	for(int i = 0; i < count; ++i)
+	{
+		const Token& token = input[i];
+		if(token.type == Token::NUMBER || token.type == Token::IDENTIFIER)
+		{
+			*out = token;
+			++out;
+		}
+		else if (token.type == Token::LEFT_PARENTHESIS)
+		{
+			--out_token_count;
+			bool is_call = i > 0 && input[i - 1].type == Token::FUNCTION;
+			comma_counts[func_stack_idx] = is_call ? 0 : -1;
+			func_stack[func_stack_idx] = token;
+			++func_stack_idx;
+		}
+		else if (token.type == Token::RIGHT_PARENTHESIS || token.type == Token::COMMA)
+		{
+			--out_token_count;
+			// empty argument
+			bool after_parenthesis = i > 0 && input[i - 1].type == Token::LEFT_PARENTHESIS;
+			if (i > 0 && (input[i - 1].type == Token::COMMA ||
+							 (token.type == Token::COMMA && after_parenthesis)))
+			{
+				m_compile_time_error = ExpressionCompiler::Error::UNEXPECTED_CHAR;
+				m_compile_time_offset = token.offset;
+				return -1;
+			}
+			while (func_stack_idx > 0 &&
+				   func_stack[func_stack_idx - 1].type != Token::LEFT_PARENTHESIS)
+			{
+				--func_stack_idx;
+				*out = func_stack[func_stack_idx];
+				++out;
+			}
+
+			if (func_stack_idx == 0)
+			{
+				m_compile_time_error = token.type == Token::COMMA
+										   ? ExpressionCompiler::Error::UNEXPECTED_CHAR
+										   : ExpressionCompiler::Error::MISSING_LEFT_PARENTHESIS;
+				m_compile_time_offset = token.offset;
+				return -1;
+			}
+
+			int& comma_count = comma_counts[func_stack_idx - 1];
+			if (token.type == Token::COMMA)
+			{
+				if (comma_count < 0)
+				{
+					m_compile_time_error = ExpressionCompiler::Error::UNEXPECTED_CHAR;
+					m_compile_time_offset = token.offset;
+					return -1;
+				}
+				++comma_count;
+				continue;
+			}
+
+			--func_stack_idx;
+			if (comma_count >= 0)
+			{
+				// the function is right below its parenthesis
+				const Token& function = func_stack[func_stack_idx - 1];
+				int args = input[i - 1].type == Token::LEFT_PARENTHESIS ? 0 : comma_count + 1;
+				int arity = FunctionRegistry::get(function.function).arity;
+				if (args != arity)
+				{
+					m_compile_time_error = args < arity
+										   ? ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS
+										   : ExpressionCompiler::Error::TOO_MANY_PARAMETERS;
+					m_compile_time_offset = function.offset;
+					return -1;
+				}
+			}
+		}
+		else
+		{
+			// only single argument functions can be called without parentheses, e.g. `sin x`
+			bool is_call = i + 1 < count && input[i + 1].type == Token::LEFT_PARENTHESIS;
+			if (token.type == Token::FUNCTION && !is_call &&
+				FunctionRegistry::get(token.function).arity != 1)
+			{
+				m_compile_time_error = ExpressionCompiler::Error::MISSING_LEFT_PARENTHESIS;
+				m_compile_time_offset = token.offset;
+				return -1;
+			}
+
+			// prefix operators bind to what follows them, binary operators are left associative
+			bool is_prefix = token.type == Token::FUNCTION || token.oper == Token::UNARY_MINUS;
+			int prio = getOperatorPriority(token);
+			while(!is_prefix && func_stack_idx > 0 &&
+				  getOperatorPriority(func_stack[func_stack_idx - 1]) >= prio)
+			{
+				--func_stack_idx;
+				*out = func_stack[func_stack_idx];
+				++out;
+			}
+
+			func_stack[func_stack_idx] = token;
+			++func_stack_idx;
+		}
+	}
+
+	for(int i = func_stack_idx - 1; i >= 0; --i)
+	{
+		if(func_stack[i].type == Token::LEFT_PARENTHESIS)
+		{
+			m_compile_time_error = ExpressionCompiler::Error::MISSING_RIGHT_PARENTHESIS;
+			m_compile_time_offset = func_stack[i].offset;
+			return -1;
+		}
+		*out = func_stack[i];
+		++out;
+	}
+
+	return out_token_count;
+}
+
+
+const int FunctionRegistry::MAX_ARGS;
+const int FunctionRegistry::MAX_FUNCTIONS;
+const uint16 FunctionRegistry::INVALID_INDEX;
+
+
+static float builtinSin(float x)
+{
+	return sin(x);
+}
+
+
+static float builtinCos(float x)
+{
+	return cos(x);
+}
+
+
+static float builtinExp(float x)
+{
+	return exp(x);
+}
+
+
+static float builtinLog(float x)
+{
+	return log(x);
+}
+
+
+static float builtinSqrt(float x)
+{
+	return sqrt(x);
+}
+
+
+namespace Simd
+{
+	// ((c[0] * x + c[1]) * x + ...) + c[N - 1]
+	template <int N> static Vec horner(Vec x, const float (&c)[N])
+	{
+		Vec r = splat(c[0]);
+		for (int i = 1; i < N; ++i) r = add(mul(r, x), splat(c[i]));
+		return r;
+	}
+
+
+	// Polynomials of cephes sinf and cosf on x = n * pi/2 + r, |r| <= pi/4. pi/2 is split in three
+	// 12 bit parts and the rest, so n * part is exact for |x| <= 4096. OFFSET 1 shifts the quadrant
+	// to get the cosine.
+	template <bool FAST, int OFFSET> static Vec polySinCos(Vec x, Vec& ok)
+	{
+		static const float SIN[] = {-1.9515295891e-4f, 8.3321608736e-3f, -1.6666654611e-1f};
+		static const float COS[] = {
+			2.443315711809948e-5f, -1.388731625493765e-3f, 4.166664568298827e-2f};
+		static const float FAST_SIN[] = {8.163281716e-3f, -1.666339040e-1f};
+		static const float FAST_COS[] = {-1.359185320e-3f, 4.165577888e-2f, -4.999988377e-1f, 1.0f};
+
+		ok = lt(abs(x), splat(4096.0f));
+		x = logicAnd(ok, x);
+		Vec n = nearest(mul(x, splat(0.636619772367581343f)));
+		Vec r = sub(x, mul(n, splat(1.5703125f)));
+		r = sub(r, mul(n, splat(4.837512969970703125e-4f)));
+		r = sub(r, mul(n, splat(7.54953362047672271729e-8f)));
+		r = sub(r, mul(n, splat(2.56334406825708960298e-12f)));
+		Vec z = mul(r, r);
+
+		Vec s, c;
+		if (FAST)
+		{
+			s = add(r, mul(mul(r, z), horner(z, FAST_SIN)));
+			c = horner(z, FAST_COS);
+		}
+		else
+		{
+			s = add(r, mul(mul(r, z), horner(z, SIN)));
+			c = add(sub(splat(1.0f), mul(z, splat(0.5f))), mul(mul(z, z), horner(z, COS)));
+		}
+
+		// quadrant in [-2, 2], odd ones swap sin and cos, -2, -1 and 2 flip the sign
+		Vec q = add(n, splat((float)OFFSET));
+		q = sub(q, mul(splat(4.0f), nearest(mul(q, splat(0.25f)))));
+		Vec odd = logicAnd(gt(abs(q), splat(0.5f)), lt(abs(q), splat(1.5f)));
+		Vec negative = logicOr(lt(q, splat(-0.5f)), gt(q, splat(1.5f)));
+		Vec y = select(odd, c, s);
+		return select(negative, neg(y), y);
+	}
+
+
+	// cephes expf, x = n * ln2 + r, |r| <= ln2 / 2, exp(x) = 2^n * exp(r)
+	template <bool FAST> static Vec polyExp(Vec x, Vec& ok)
+	{
+		static const float EXP[] = {1.9875691500e-4f,
+			1.3981999507e-3f,
+			8.3334519073e-3f,
+			4.1665795894e-2f,
+			1.6666665459e-1f,
+			5.0000001201e-1f};
+		static const float FAST_EXP[] = {4.127768800e-2f, 1.675352752e-1f, 5.000512004e-1f};
+
+		ok = logicAnd(gt(x, splat(-87.0f)), lt(x, splat(88.0f)));
+		x = logicAnd(ok, x);
+		Vec n = nearest(mul(x, splat(1.44269504088896341f)));
+		Vec r = sub(x, mul(n, splat(0.693359375f)));
+		r = sub(r, mul(n, splat(-2.12194440e-4f)));
+		Vec p = FAST ? horner(r, FAST_EXP) : horner(r, EXP);
+		Vec y = add(add(mul(p, mul(r, r)), r), splat(1.0f));
+		// 2^n built from its exponent bits, n + 127 is in [1, 254]
+		return mul(y, toBits(mul(add(n, splat(127.0f)), splat(8388608.0f))));
+	}
+
+
+	// cephes logf, x = m * 2^e, m in [sqrt(0.5), sqrt(2)), log(x) = log(m) + e * ln2
+	template <bool FAST> static Vec polyLog(Vec x, Vec& ok)
+	{
+		static const float LOG[] = {7.0376836292e-2f,
+			-1.1514610310e-1f,
+			1.1676998740e-1f,
+			-1.2420140846e-1f,
+			1.4249322787e-1f,
+			-1.6668057665e-1f,
+			2.0000714765e-1f,
+			-2.4999993993e-1f,
+			3.3333331174e-1f};
+		static const float FAST_LOG[] = {
+			-1.459219456e-1f, 2.177642137e-1f, -2.524501979e-1f, 3.328547478e-1f};
+
+		// normal positive numbers only
+		ok = logicAnd(gt(x, splat(1.17549435e-38f)), lt(x, splat(3.40282347e+38f)));
+		x = select(ok, x, splat(1.0f));
+		Vec e = mul(fromBits(logicAnd(x, splat(mask(0x7f800000)))), splat(1.0f / 8388608.0f));
+		e = sub(e, splat(126.0f));
+		Vec m = logicOr(logicAnd(x, splat(mask(0x007fffff))), splat(0.5f));
+		Vec small = lt(m, splat(0.707106781186547524f));
+		e = sub(e, logicAnd(small, splat(1.0f)));
+		Vec f = sub(add(m, logicAnd(small, m)), splat(1.0f));
+
+		Vec z = mul(f, f);
+		Vec y = mul(mul(FAST ? horner(f, FAST_LOG) : horner(f, LOG), f), z);
+		y = add(y, mul(e, splat(-2.12194440e-4f)));
+		y = sub(y, mul(z, splat(0.5f)));
+		return add(add(f, y), mul(e, splat(0.693359375f)));
+	}
+
+
+	// runs KERNEL on WIDTH values at once, lanes it does not cover fall back to SCALAR
+	template <Vec (*KERNEL)(Vec, Vec&), float (*SCALAR)(float)>
+	static void apply(float* out, const float* a, int count)
+	{
+		for (int i = 0; i < count; i += WIDTH)
+		{
+			int size = count - i < WIDTH ? count - i : WIDTH;
+			float in[WIDTH] = {};
+			const float* src = a + i;
+			if (size < WIDTH)
+			{
+				memcpy(in, src, size * sizeof(float));
+				src = in;
+			}
+
+			Vec ok;
+			Vec y = KERNEL(load(src), ok);
+			int ok_lanes = movemask(ok);
+			if (size == WIDTH && ok_lanes == (1 << WIDTH) - 1)
+			{
+				store(out + i, y);
+				continue;
+			}
+
+			// `out` can be `a`, so src is read before anything is written
+			float result[WIDTH];
+			store(result, y);
+			for (int j = 0; j < size; ++j)
+			{
+				if ((ok_lanes & (1 << j)) == 0) result[j] = SCALAR(src[j]);
+			}
+			memcpy(out + i, result, size * sizeof(float));
+		}
+	}
+
+
+	template <float (*SCALAR)(float)>
+	static void applyScalar(float* out, const float* a, int count)
+	{
+		for (int i = 0; i < count; ++i) out[i] = SCALAR(a[i]);
+	}
+
+
+	void sin(float* out, const float* a, int count, MathTier tier)
+	{
+		if (tier == MathTier::STANDARD) applyScalar<builtinSin>(out, a, count);
+		else if (tier == MathTier::FAST) apply<polySinCos<true, 0>, builtinSin>(out, a, count);
+		else apply<polySinCos<false, 0>, builtinSin>(out, a, count);
+	}
+
+
+	void cos(float* out, const float* a, int count, MathTier tier)
+	{
+		if (tier == MathTier::STANDARD) applyScalar<builtinCos>(out, a, count);
+		else if (tier == MathTier::FAST) apply<polySinCos<true, 1>, builtinCos>(out, a, count);
+		else apply<polySinCos<false, 1>, builtinCos>(out, a, count);
+	}
+
+
+	void exp(float* out, const float* a, int count, MathTier tier)
+	{
+		if (tier == MathTier::STANDARD) applyScalar<builtinExp>(out, a, count);
+		else if (tier == MathTier::FAST) apply<polyExp<true>, builtinExp>(out, a, count);
+		else apply<polyExp<false>, builtinExp>(out, a, count);
+	}
+
+
+	void log(float* out, const float* a, int count, MathTier tier)
+	{
+		if (tier == MathTier::STANDARD) applyScalar<builtinLog>(out, a, count);
+		else if (tier == MathTier::FAST) apply<polyLog<true>, builtinLog>(out, a, count);
+		else apply<polyLog<false>, builtinLog>(out, a, count);
+	}
+
+
+	// the instruction is correctly rounded, so all tiers give the same results
+	void sqrt(float* out, const float* a, int count, MathTier)
+	{
+		int i = 0;
+		for (; i + WIDTH <= count; i += WIDTH) store(out + i, sqrt(load(a + i)));
+		for (; i < count; ++i) out[i] = builtinSqrt(a[i]);
+	}
+}
+
+
+FunctionRegistry::Table::Table()
+	: count(0)
+{
+	static const struct
+	{
+		const char* name;
+		float (*function)(float);
+		void (*batch)(float*, const float*, int, MathTier);
+	} BUILTINS[] = {{"sin", &builtinSin, &Simd::sin},
+		{"cos", &builtinCos, &Simd::cos},
+		{"exp", &builtinExp, &Simd::exp},
+		{"log", &builtinLog, &Simd::log},
+		{"sqrt", &builtinSqrt, &Simd::sqrt}};
+
+	memset(buckets, 0, sizeof(buckets));
+	for (const auto& builtin : BUILTINS)
+	{
+		Function fn = makeFunction(builtin.function, true);
+		fn.batch = builtin.batch;
+		insert(*this, builtin.name, fn);
+	}
+}
+
+
+FunctionRegistry::Table& FunctionRegistry::getTable()
+{
+	static Table table;
+	return table;
+}
+
+
+static uint32 hashName(const char* name, int size)
+{
+	uint32 hash = 2166136261U;
+	for (int i = 0; i < size; ++i)
+	{
+		hash ^= (uint8)name[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+uint16 FunctionRegistry::find(const char* name, int size)
+{
+	const Table& table = getTable();
+	static const int MASK = sizeof(table.buckets) / sizeof(table.buckets[0]) - 1;
+	for (uint32 i = hashName(name, size);; ++i)
+	{
+		int idx = table.buckets[i & MASK] - 1;
+		if (idx < 0) return INVALID_INDEX;
+
+		const std::string& fn_name = table.functions[idx].name;
+		if ((int)fn_name.size() == size && memcmp(fn_name.c_str(), name, size) == 0) return idx;
+	}
+}
+
+
+uint16 FunctionRegistry::insert(Table& table, const char* name, const Function& function)
+{
+	static const int MASK = sizeof(table.buckets) / sizeof(table.buckets[0]) - 1;
+	int size = (int)strlen(name);
+	if (table.count >= MAX_FUNCTIONS || size == 0) return INVALID_INDEX;
+
+	// the table is at most half full, so there is always an empty bucket
+	uint32 i = hashName(name, size);
+	for (; table.buckets[i & MASK] != 0; ++i)
+	{
+		const std::string& fn_name = table.functions[table.buckets[i & MASK] - 1].name;
+		if (fn_name == name) return INVALID_INDEX;
+	}
+
+	uint16 idx = (uint16)table.count;
+	table.functions[idx] = function;
+	table.functions[idx].name = name;
+	table.buckets[i & MASK] = idx + 1;
+	++table.count;
+	return idx;
+}
+
+
+float ExpressionVM::callFunction(uint8 idx, const float* args)
+{
+	return FunctionRegistry::get(idx).call(args);
+}
+
+
+void ExpressionVM::callFunctionBatch(uint8 idx,
+	float* out,
+	const float* const* args,
+	int count,
+	MathTier tier)
+{
+	const FunctionRegistry::Function& fn = FunctionRegistry::get(idx);
+	if (fn.batch)
+	{
+		fn.batch(out, args[0], count, tier);
+		return;
+	}
+	if (fn.unary)
+	{
+		const float* arg = args[0];
+		for (int i = 0; i < count; ++i) out[i] = fn.unary(arg[i]);
+		return;
+	}
+
+	// `out` can be the block of the first argument
+	float values[FunctionRegistry::MAX_ARGS];
+	for (int i = 0; i < count; ++i)
+	{
+		for (int j = 0; j < fn.arity; ++j) values[j] = args[j][i];
+		out[i] = fn.call(values);
+	}
+}
+
+
+static const struct
+{
+	ExpressionCompiler::Token::Operator op;
+	Types ret_type;
+	Instruction::Type instr;
+	Types args[9];
+	int priority;
+
+	int arity() const
+	{
+		for (int i = 0; i < (int)(sizeof(args) / sizeof(args[0])); ++i)
+		{
+			if (args[i] == Types::NONE) return i;
+		}
+		return 0;
+	}
+
+	bool checkArgTypes(const Types* stack, int idx) const
+	{
+		for (int i = 0; i < arity(); ++i)
+		{
+			if (args[i] != stack[idx - i - 1]) return false;
+		}
+		return true;
+	}
+} OPERATOR_FUNCTIONS[] = {
+	{ExpressionCompiler::Token::ADD,
+		Types::FLOAT,
+		Instruction::ADD_FLOAT,
+		{Types::FLOAT, Types::FLOAT, Types::NONE},
+		3},
+	{ExpressionCompiler::Token::MULTIPLY,
+		Types::FLOAT,
+		Instruction::MUL_FLOAT,
+		{Types::FLOAT, Types::FLOAT, Types::NONE},
+		4},
+	{ExpressionCompiler::Token::DIVIDE,
+		Types::FLOAT,
+		Instruction::DIV_FLOAT,
+		{Types::FLOAT, Types::FLOAT, Types::NONE},
+		4},
+	{ExpressionCompiler::Token::SUBTRACT,
+		Types::FLOAT,
+		Instruction::SUB_FLOAT,
+		{Types::FLOAT, Types::FLOAT, Types::NONE},
+		3},
+	{ExpressionCompiler::Token::UNARY_MINUS,
+		Types::FLOAT,
+		Instruction::UNARY_MINUS,
+		{Types::FLOAT, Types::NONE},
+		4},
+	{ExpressionCompiler::Token::LESS_THAN,
+		Types::BOOL,
+		Instruction::FLOAT_LT,
+		{Types::FLOAT, Types::FLOAT, Types::NONE},
+		2},
+	{ExpressionCompiler::Token::GREATER_THAN,
+		Types::BOOL,
+		Instruction::FLOAT_GT,
+		{Types::FLOAT, Types::FLOAT, Types::NONE},
+		2},
+	{ExpressionCompiler::Token::AND,
+		Types::BOOL,
+		Instruction::AND,
+		{Types::BOOL, Types::BOOL, Types::NONE},
+		1},
+	{ExpressionCompiler::Token::OR,
+		Types::BOOL,
+		Instruction::OR,
+		{Types::BOOL, Types::BOOL, Types::NONE},
+		0}};
+
+
+int ExpressionCompiler::getOperatorPriority(const Token& token)
+{
+	if (token.type == Token::FUNCTION) return 5;
+	if (token.type == Token::LEFT_PARENTHESIS) return -1;
+	if (token.type != Token::OPERATOR) DebugBreak();
+	
+	for (auto& i : OPERATOR_FUNCTIONS)
+	{
+		if (i.op == token.oper) return i.priority;
+	}
+	return -1;
+}
+
+
+static int getTokenArity(const ExpressionCompiler::Token& token)
+{
+	if (token.type == ExpressionCompiler::Token::FUNCTION)
+	{
+		return FunctionRegistry::get(token.function).arity;
+	}
+	if (token.type != ExpressionCompiler::Token::OPERATOR) return 0;
+
+	for (auto& i : OPERATOR_FUNCTIONS)
+	{
+		if (i.op == token.oper) return i.arity();
+	}
+	return 0;
+}
+
+static bool isConstant(const ExpressionCompiler::Token& token)
+{
+	return token.type == ExpressionCompiler::Token::NUMBER ||
+		   token.type == ExpressionCompiler::Token::BOOLEAN;
+}
+
+
+static ExpressionCompiler::Token makeConstant(const ExpressionCompiler::Token& token,
+	Types type,
+	float value)
+{
+	ExpressionCompiler::Token res = token;
+	res.type = type == Types::BOOL ? ExpressionCompiler::Token::BOOLEAN
+								   : ExpressionCompiler::Token::NUMBER;
+	res.number = value;
+	return res;
+}
+
+
+static float getBoolConstant(const ExpressionCompiler::Token& token)
+{
+	return Simd::mask(token.number != 0 ? 0xffFFffFF : 0);
+}
+
+
+static float foldOperator(Instruction::Type instr, float a, float b)
+{
+	switch (instr)
+	{
+		case Instruction::ADD_FLOAT: return a + b;
+		case Instruction::SUB_FLOAT: return a - b;
+		case Instruction::MUL_FLOAT: return a * b;
+		case Instruction::DIV_FLOAT: return a / b;
+		case Instruction::UNARY_MINUS: return -a;
+		case Instruction::FLOAT_LT: return a < b ? 1.0f : 0.0f;
+		case Instruction::FLOAT_GT: return a > b ? 1.0f : 0.0f;
+		case Instruction::AND: return a != 0 && b != 0 ? 1.0f : 0.0f;
+		case Instruction::OR: return a != 0 || b != 0 ? 1.0f : 0.0f;
+		default: DebugBreak(); return 0;
+	}
+}
+
+
+int ExpressionCompiler::optimize(const char* src, Token* tokens, int count)
+{
+	// tokens hold numbers as floats, folding them would lose the precision of other number types
+	if (m_number_type != Types::FLOAT) return count;
+
+	// every operand is a continuous range of tokens starting at `start`, a constant operand is
+	// a single NUMBER or BOOLEAN token
+	struct Operand
+	{
+		int start;
+		Types type;
+	};
+	static const int MAX_OPERANDS = 256;
+	Operand stack[MAX_OPERANDS] = {};
+	int stack_size = 0;
+	int out = 0;
+	int i = 0;
+	for (; i < count; ++i)
+	{
+		Token token = tokens[i];
+		float const_value;
+		if (token.type == Token::IDENTIFIER && getConstValue(src, token, const_value))
+		{
+			token = makeConstant(token, Types::FLOAT, const_value);
+		}
+		// compile() reports the error, it must not be pruned with an and/or operand
+		if (token.type == Token::IDENTIFIER && getVariableIdx(src, token) == 0xffFF) break;
+
+		int arity = getTokenArity(token);
+		if (arity > stack_size || stack_size - arity >= MAX_OPERANDS) break;
+
+		Operand* args = stack + stack_size - arity;
+		if (arity == 0 && token.type != Token::FUNCTION)
+		{
+			tokens[out] = token;
+			args[0].start = out;
+			args[0].type = token.type == Token::BOOLEAN ? Types::BOOL : Types::FLOAT;
+			++out;
+			++stack_size;
+			continue;
+		}
+
+		int start = arity > 0 ? args[0].start : out;
+		Types ret_type = Types::FLOAT;
+		Instruction::Type instr = Instruction::CALL;
+		bool type_error = false;
+		bool pure = true;
+		if (token.type == Token::FUNCTION)
+		{
+			const FunctionRegistry::Function& fn = FunctionRegistry::get(token.function);
+			for (int j = 0; j < arity; ++j) type_error = type_error || fn.args[j] != args[j].type;
+			ret_type = fn.ret_type;
+			pure = fn.pure;
+		}
+		else
+		{
+			for (auto& fn : OPERATOR_FUNCTIONS)
+			{
+				if (fn.op != token.oper) continue;
+				for (int j = 0; j < arity; ++j)
+				{
+					type_error = type_error || fn.args[j] != args[j].type;
+				}
+				ret_type = fn.ret_type;
+				instr = fn.instr;
+				break;
+			}
+		}
+		// compile() reports the error
+		if (type_error) break;
+
+		// operand `j` ends where the next one starts
+		auto isConstantOperand = [&](int j) {
+			int end = j + 1 < arity ? args[j + 1].start : out;
+			return end - args[j].start == 1 && isConstant(tokens[args[j].start]);
+		};
+		bool all_const = true;
+		for (int j = 0; j < arity; ++j) all_const = all_const && isConstantOperand(j);
+
+		if (all_const && pure)
+		{
+			float value;
+			if (token.type == Token::FUNCTION)
+			{
+				// functions take booleans as masks
+				float values[FunctionRegistry::MAX_ARGS];
+				for (int j = 0; j < arity; ++j)
+				{
+					const Token& arg = tokens[args[j].start];
+					values[j] = arg.type == Token::BOOLEAN ? getBoolConstant(arg) : arg.number;
+				}
+				value = ExpressionVM::callFunction((uint8)token.function, values);
+				if (ret_type == Types::BOOL) value = Simd::bits(value) != 0 ? 1.0f : 0.0f;
+			}
+			else
+			{
+				float a = tokens[args[0].start].number;
+				float b = arity > 1 ? tokens[args[1].start].number : 0;
+				value = foldOperator(instr, a, b);
+			}
+			out = start;
+			tokens[out] = makeConstant(token, ret_type, value);
+			++out;
+		}
+		else if (instr == Instruction::AND || instr == Instruction::OR)
+		{
+			// `false and x` is false, `true and x` is x, `or` the other way round
+			float absorbing = instr == Instruction::AND ? 0.0f : 1.0f;
+			const Token& left = tokens[args[0].start];
+			const Token& right = tokens[args[1].start];
+			bool left_const = isConstantOperand(0);
+			bool right_const = isConstantOperand(1);
+			if ((left_const && (left.number != 0) == (absorbing != 0)) ||
+				(right_const && (right.number != 0) == (absorbing != 0)))
+			{
+				out = args[0].start;
+				tokens[out] = makeConstant(token, Types::BOOL, absorbing);
+				++out;
+			}
+			else if (left_const)
+			{
+				memmove(&tokens[args[0].start],
+					&tokens[args[1].start],
+					(out - args[1].start) * sizeof(Token));
+				--out;
+			}
+			else if (right_const)
+			{
+				out = args[1].start;
+			}
+			else
+			{
+				tokens[out] = token;
+				++out;
+			}
+		}
+		else
+		{
+			tokens[out] = token;
+			++out;
+		}
+		stack_size -= arity - 1;
+		args[0].start = start;
+		args[0].type = ret_type;
+	}
+
+	if (i < count && out != i) memmove(&tokens[out], &tokens[i], (count - i) * sizeof(Token));
+	return out + count - i;
+}
+
+
+
+// bool registers are masks, so batch evaluation can use them directly
+static int findConstant(const uint64* constants, int count, uint64 value)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		if (memcmp(&constants[i], &value, sizeof(value)) == 0) return i;
+	}
+	return -1;
+}
+
+
+static int findVariable(const uint16* variables, int count, uint16 slot)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		if (variables[i] == slot) return i;
+	}
+	return -1;
+}
+
+
+int ExpressionCompiler::compile(const char* src,
+	const Token* tokens,
+	int token_count,
+	uint8* byte_code,
+	int max_size)
+{
+	static const int MAX_REGISTERS = 256;
+
+	// constants and variables are loaded into the first registers before the program runs,
+	// so collect them first
+	// bits of the constants in the number type of the program
+	uint64 constants[MAX_REGISTERS];
+	uint16 variables[MAX_REGISTERS];
+	int constant_count = 0;
+	int variable_count = 0;
+	double const_value;
+	for (int i = 0; i < token_count; ++i)
+	{
+		auto& token = tokens[i];
+		uint64 value;
+		if (token.type == Token::BOOLEAN)
+		{
+			value = Simd::bits(getBoolConstant(token));
+		}
+		else if (token.type != Token::NUMBER && token.type != Token::IDENTIFIER)
+		{
+			continue;
+		}
+		else if (token.type == Token::NUMBER || getConstValue(src, token, const_value))
+		{
+			if (!getNumber(src, token, value)) return -1;
+		}
+		else
+		{
+			uint16 var_idx = getVariableIdx(src, token);
+			if (var_idx == 0xffFF) continue;
+			if (findVariable(variables, variable_count, var_idx) >= 0) continue;
+			if (constant_count + variable_count >= MAX_REGISTERS)
+			{
+				m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+				return -1;
+			}
+			variables[variable_count] = var_idx;
+			++variable_count;
+			continue;
+		}
+
+		if (findConstant(constants, constant_count, value) >= 0) continue;
+		if (constant_count + variable_count >= MAX_REGISTERS)
+		{
+			m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+			return -1;
+		}
+		constants[constant_count] = value;
+		++constant_count;
+	}
+
+	int number_size = ProgramHeader::getNumberSize(m_number_type);
+	int variables_size = (variable_count * sizeof(uint16) + 3) & ~3;
+	int prologue_size = sizeof(ProgramHeader) + constant_count * number_size + variables_size;
+	if (max_size < prologue_size)
+	{
+		m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+		return -1;
+	}
+
+	// operands are kept on a stack, temporaries are allocated in stack order right after variables
+	Types type_stack[MAX_REGISTERS];
+	uint8 reg_stack[MAX_REGISTERS];
+	int type_stack_idx = 0;
+	int temp_base = constant_count + variable_count;
+	int temp_count = 0;
+	int register_count = temp_base;
+	uint8* out = byte_code + prologue_size;
+	uint8* end = byte_code + max_size;
+
+	// `and` / `or` skip their right operand if the left one decides the result, so find where
+	// right operands start; in postfix notation every operand is a continuous range of tokens
+	int right_operand_of[MAX_REGISTERS];
+	int jump_offsets[MAX_REGISTERS];
+	bool short_circuit = token_count <= MAX_REGISTERS;
+	if (short_circuit)
+	{
+		int operand_starts[MAX_REGISTERS];
+		int operand_count = 0;
+		for (int i = 0; i < token_count; ++i)
+		{
+			right_operand_of[i] = -1;
+			jump_offsets[i] = -1;
+		}
+		for (int i = 0; i < token_count; ++i)
+		{
+			const Token& token = tokens[i];
+			int arity = getTokenArity(token);
+			// errors are reported by the main loop
+			if (arity > operand_count) break;
+
+			int start = arity > 0 ? operand_starts[operand_count - arity] : i;
+			if (token.type == Token::OPERATOR &&
+				(token.oper == Token::AND || token.oper == Token::OR))
+			{
+				right_operand_of[operand_starts[operand_count - 1]] = i;
+			}
+			operand_count -= arity;
+			operand_starts[operand_count] = start;
+			++operand_count;
+		}
+	}
+
+	auto emit = [&out, end](Instruction::Type instr, int dst, int a, int b) -> bool {
+		if (end - out < Instruction::SIZE) return false;
+		out[0] = instr;
+		out[1] = (uint8)dst;
+		out[2] = (uint8)a;
+		out[3] = (uint8)b;
+		out += Instruction::SIZE;
+		return true;
+	};
+
+	auto pop = [&](int count) {
+		for (int j = 0; j < count; ++j)
+		{
+			--type_stack_idx;
+			if (reg_stack[type_stack_idx] >= temp_base) --temp_count;
+		}
+	};
+
+	// register_count is stored in a byte, so the last register is MAX_REGISTERS - 2
+	auto push = [&](Types type, int reg) -> bool {
+		if (type_stack_idx >= MAX_REGISTERS || reg >= MAX_REGISTERS - 1) return false;
+		type_stack[type_stack_idx] = type;
+		reg_stack[type_stack_idx] = (uint8)reg;
+		++type_stack_idx;
+		if (reg >= temp_base) ++temp_count;
+		if (reg >= register_count) register_count = reg + 1;
+		return true;
+	};
+
+	for (int i = 0; i < token_count; ++i)
+	{
+		auto& token = tokens[i];
+
+		if (short_circuit && right_operand_of[i] >= 0 && type_stack_idx > 0)
+		{
+			int op_idx = right_operand_of[i];
+			Instruction::Type jump = tokens[op_idx].oper == Token::AND ? Instruction::JUMP_IF_FALSE
+																		: Instruction::JUMP_IF_TRUE;
+			jump_offsets[op_idx] = int(out - byte_code);
+			if (!emit(jump, 0, reg_stack[type_stack_idx - 1], 0))
+			{
+				m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+				return -1;
+			}
+		}
+
+		switch(token.type)
+		{
+			case Token::NUMBER:
+				{
+					uint64 value;
+					getNumber(src, token, value);
+					if (!push(Types::FLOAT, findConstant(constants, constant_count, value)))
+					{
+						m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+						return -1;
+					}
+				}
+				break;
+			case Token::BOOLEAN:
+				if (!push(Types::BOOL,
+						findConstant(
+							constants, constant_count, Simd::bits(getBoolConstant(token)))))
+				{
+					m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+					return -1;
+				}
+				break;
+			case Token::OPERATOR:
+				for (auto& fn : OPERATOR_FUNCTIONS)
+				{
+					if (token.oper != fn.op) continue;
+
+					int arity = fn.arity();
+					if (type_stack_idx < arity)
+					{
+						m_compile_time_error = ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS;
+						m_compile_time_offset = token.offset;
+						return -1;
+					}
+					if (!fn.checkArgTypes(type_stack, type_stack_idx))
+					{
+						m_compile_time_error = ExpressionCompiler::Error::INCORRECT_TYPE_ARGS;
+						m_compile_time_offset = token.offset;
+						return -1;
+					}
+					int a = reg_stack[type_stack_idx - arity];
+					int b = reg_stack[type_stack_idx - 1];
+					pop(arity);
+					int dst = temp_base + temp_count;
+					if (!emit(fn.instr, dst, a, b) || !push(fn.ret_type, dst))
+					{
+						m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+						return -1;
+					}
+					if (short_circuit && jump_offsets[i] >= 0)
+					{
+						// the jump leaves the left operand as the result, so it must be in `dst`
+						uint8* jump = byte_code + jump_offsets[i];
+						int skip = int(out - jump) / Instruction::SIZE - 1;
+						jump[3] = dst == a && skip <= 0xff ? (uint8)skip : 0;
+					}
+					break;
+				}
+				break;
+			case Token::FUNCTION:
+				{
+					const FunctionRegistry::Function& fn = FunctionRegistry::get(token.function);
+					if (type_stack_idx < fn.arity)
+					{
+						m_compile_time_error = ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS;
+						m_compile_time_offset = token.offset;
+						return -1;
+					}
+
+					const Types* arg_types = type_stack + type_stack_idx - fn.arity;
+					for (int j = 0; j < fn.arity; ++j)
+					{
+						if (arg_types[j] != fn.args[j])
+						{
+							m_compile_time_error = ExpressionCompiler::Error::INCORRECT_TYPE_ARGS;
+							m_compile_time_offset = token.offset;
+							return -1;
+						}
+					}
+
+					// arguments must be in consecutive registers, a single one can be anywhere;
+					// temporaries of arguments are already in stack order, so moving from the last
+					// argument never overwrites another one
+					const uint8* arg_regs = reg_stack + type_stack_idx - fn.arity;
+					pop(fn.arity);
+					int first = fn.arity == 1 ? arg_regs[0] : temp_base + temp_count;
+					for (int j = fn.arity - 1; j >= 0 && fn.arity > 1; --j)
+					{
+						if (arg_regs[j] == first + j) continue;
+						if (first + j >= MAX_REGISTERS - 1 ||
+							!emit(Instruction::MOVE, first + j, arg_regs[j], 0))
+						{
+							m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+							return -1;
+						}
+					}
+					if (fn.arity > 1 && first + fn.arity > register_count)
+					{
+						register_count = first + fn.arity;
+					}
+
+					int dst = temp_base + temp_count;
+					if (!emit(Instruction::CALL, dst, fn.arity > 0 ? first : 0, token.function) ||
+						!push(fn.ret_type, dst))
+					{
+						m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+						return -1;
+					}
+				}
+				break;
+			case Token::IDENTIFIER:
+				{
+					int reg;
+					uint64 value;
+					if(getConstValue(src, token, const_value))
+					{
+						getNumber(src, token, value);
+						reg = findConstant(constants, constant_count, value);
+					}
+					else
+					{
+						uint16 var_idx = getVariableIdx(src, token);
+						if(var_idx == 0xffFF)
+						{
+							m_compile_time_error = ExpressionCompiler::Error::UNKNOWN_IDENTIFIER;
+							m_compile_time_offset = token.offset;
+							return -1;
+						}
+						reg = constant_count + findVariable(variables, variable_count, var_idx);
+					}
+					if (!push(Types::FLOAT, reg))
+					{
+						m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+						return -1;
+					}
+				}
+				break;
+			default:
+				DebugBreak();
+				break;
+		}
+	}
+	if (type_stack_idx == 0)
+	{
+		m_compile_time_error = ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS;
+		m_compile_time_offset = 0;
+		return -1;
+	}
+
+	Types result_type = type_stack[type_stack_idx - 1];
+	Instruction::Type ret =
+		result_type == Types::BOOL ? Instruction::RET_BOOL : Instruction::RET_FLOAT;
+	if (!emit(ret, 0, reg_stack[type_stack_idx - 1], 0))
+	{
+		m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+		return -1;
+	}
+
+	ProgramHeader header = {};
+	header.register_count = (uint8)register_count;
+	header.constant_count = (uint8)constant_count;
+	header.variable_count = (uint8)variable_count;
+	header.result_type = result_type == Types::BOOL ? Types::BOOL : m_number_type;
+	header.number_type = m_number_type;
+	header.math_tier = m_math_tier;
+	memcpy(byte_code, &header, sizeof(header));
+	// constants are little endian, so the low bytes hold a float
+	for (int i = 0; i < constant_count; ++i)
+	{
+		memcpy(byte_code + sizeof(header) + i * number_size, &constants[i], number_size);
+	}
+	uint8* variables_out = byte_code + sizeof(header) + constant_count * number_size;
+	memset(variables_out, 0, variables_size);
+	memcpy(variables_out, variables, variable_count * sizeof(uint16));
+	return int(out - byte_code);
+}
+
+
+int ExpressionCompiler::compileStages(const char* src,
+	ExpressionArena& arena,
+	std::vector<uint8>& byte_code)
+{
+	static const int MAX_REGISTERS = ExpressionVM::MAX_REGISTERS;
+
+	arena.reset();
+	// every token is at least one char long
+	int max_tokens = (int)strlen(src) + 1;
+	Token* tokens = arena.allocate<Token>(max_tokens);
+	Token* postfix = arena.allocate<Token>(max_tokens);
+	Token* stack = arena.allocate<Token>(max_tokens);
+	int* comma_counts = arena.allocate<int>(max_tokens);
+	if (!tokens || !postfix || !stack || !comma_counts)
+	{
+		m_compile_time_error = Error::OUT_OF_MEMORY;
+		m_compile_time_offset = 0;
+		return -1;
+	}
+	int count = tokenize(src, tokens, max_tokens);
+	if (count <= 0) return -1;
+	count = toPostfix(tokens, postfix, count, stack, comma_counts);
+	if (count <= 0) return -1;
+	count = optimize(src, postfix, count);
+
+	// a constant or variable per register, at most an instruction and a jump per token and the
+	// return, compile() fails with OUT_OF_MEMORY before it runs out of this
+	int max_size = int(sizeof(ProgramHeader) + MAX_REGISTERS * (sizeof(uint64) + sizeof(uint16)) +
+					   (2 * count + 1) * Instruction::SIZE);
+	uint8* code = (uint8*)arena.allocate(max_size, sizeof(uint64));
+	if (!code)
+	{
+		m_compile_time_error = Error::OUT_OF_MEMORY;
+		m_compile_time_offset = 0;
+		return -1;
+	}
+	int size = compile(src, postfix, count, code, max_size);
+	if (size <= 0) return -1;
+	uint8* is_target = arena.allocate<uint8>(size / Instruction::SIZE);
+	if (is_target) peephole(code, size, is_target);
+	byte_code.assign(code, code + size);
+	return size;
+}
+
+// Single pass compiler: precedence climbing reads the tokens as the lexer scans them and every
+// operand and operator is handled the moment toPostfix() would output it, folded the way
+// optimize() folds it and emitted the way compile() emits it, so the programs are the same.
+// Registers are symbolic until the end, temporaries follow the constants and variables, which
+// are counted only once the whole source is read.
+struct ExpressionCompiler::Parser
+{
+	static const int MAX_REGISTERS = ExpressionVM::MAX_REGISTERS;
+	// deeper sources are compiled by the stages, so the native stack stays small
+	static const int MAX_DEPTH = 1024;
+	// operands of prefix operators and functions end at any binary operator
+	static const int PREFIX_PRIORITY = 5;
+	static const int MIN_STACK_SIZE = 16;
+
+	enum Kind : uint8
+	{
+		RAW,
+		CONSTANT,
+		VARIABLE,
+		TEMPORARY
+	};
+
+	// instruction with symbolic operands, `kinds` holds the Kind of dst, a and b in 2 bits each;
+	// the parser passes operands around as reg(kind, index)
+	struct Emitted
+	{
+		uint8 code[Instruction::SIZE];
+		uint8 kinds;
+	};
+
+	// output so far, rollback() to a mark drops everything after it like optimize() drops the
+	// tokens of a folded operand
+	struct Mark
+	{
+		int instructions;
+		int constants;
+		int variables;
+		int tokens;
+	};
+
+	// `reg` of a constant is -1 if it is not in the constant table, `number` is the value of
+	// constants optimize() can fold, booleans are 1 or 0
+	struct Operand
+	{
+		Mark start;
+		Types type;
+		Kind kind;
+		bool constant;
+		int reg;
+		float number;
+		int id;
+	};
+
+	Parser(ExpressionCompiler& compiler, ExpressionArena& arena, const char* src)
+		: compiler(compiler)
+		, arena(arena)
+		, src(src)
+		, cursor(src)
+		, binary(false)
+		, token()
+		, previous(Token::EMPTY)
+		, float_program(compiler.m_number_type == Types::FLOAT)
+	{
+	}
+
+	bool allocate()
+	{
+		// every token is at least one char long and emits at most two instructions
+		int max_tokens = (int)strlen(src) + 1;
+		max_instructions = 2 * max_tokens + 1;
+		stack_limit = max_tokens < MAX_REGISTERS ? max_tokens : MAX_REGISTERS;
+		max_stack = stack_limit < MIN_STACK_SIZE ? stack_limit : MIN_STACK_SIZE;
+		max_constants = max_tokens < MAX_REGISTERS + 1 ? max_tokens : MAX_REGISTERS + 1;
+		max_variables = compiler.m_variables_count < MAX_REGISTERS + 1 ? compiler.m_variables_count
+																		 : MAX_REGISTERS + 1;
+		instructions = arena.allocate<Emitted>(max_instructions);
+		stack = arena.allocate<Operand>(max_stack);
+		constants = arena.allocate<uint64>(max_constants);
+		variables = arena.allocate<uint16>(max_variables + 1);
+		return instructions && stack && constants && variables;
+	}
+
+	bool next()
+	{
+		previous = token.type;
+		if (!compiler.scanToken(src, cursor, binary, token)) return false;
+		output = output || token.type == Token::NUMBER || token.type == Token::IDENTIFIER ||
+				 token.type == Token::OPERATOR || token.type == Token::FUNCTION;
+		return true;
+	}
+
+	bool syntaxError(Error error, int offset)
+	{
+		compiler.m_compile_time_error = error;
+		compiler.m_compile_time_offset = offset;
+		syntax_error = true;
+		return false;
+	}
+
+	// compile() stops at the first error, optimize() does not fold anything after it
+	void compileError(Error code, int offset)
+	{
+		if (error != Error::NONE) return;
+		error = code;
+		error_offset = offset;
+		error_instructions = instruction_count;
+	}
+
+	Mark mark() const
+	{
+		return {instruction_count, constant_count, variable_count, tokens};
+	}
+
+	void rollback(const Mark& mark)
+	{
+		instruction_count = mark.instructions;
+		constant_count = mark.constants;
+		variable_count = mark.variables;
+		tokens = mark.tokens;
+	}
+
+	// most sources need a few operands, so the stack starts small and grows in the arena
+	bool reserve()
+	{
+		if (stack_size < max_stack) return true;
+		int size = 2 * max_stack < stack_limit ? 2 * max_stack : stack_limit;
+		Operand* grown = size > max_stack ? arena.allocate<Operand>(size) : nullptr;
+		if (!grown)
+		{
+			fallback = true;
+			return false;
+		}
+		memcpy(grown, stack, stack_size * sizeof(Operand));
+		stack = grown;
+		max_stack = size;
+		return true;
+	}
+
+	static int reg(Kind kind, int idx) { return kind << 16 | idx; }
+
+	int addConstant(uint64 bits)
+	{
+		int idx = findConstant(constants, constant_count, bits);
+		if (idx >= 0) return idx;
+		if (constant_count >= max_constants)
+		{
+			fallback = true;
+			return -1;
+		}
+		constants[constant_count] = bits;
+		return constant_count++;
+	}
+
+	int addVariable(uint16 slot)
+	{
+		int idx = findVariable(variables, variable_count, slot);
+		if (idx >= 0) return idx;
+		if (variable_count >= max_variables)
+		{
+			fallback = true;
+			return -1;
+		}
+		variables[variable_count] = slot;
+		return variable_count++;
+	}
+
+	int materialize(Operand& operand)
+	{
+		if (operand.kind == CONSTANT && operand.reg < 0)
+		{
+			uint64 bits = operand.type == Types::BOOL ? (operand.number != 0 ? 0xffFFffFF : 0)
+													  : Simd::bits(operand.number);
+			operand.reg = addConstant(bits);
+		}
+		return reg(operand.kind, operand.reg);
+	}
+
+	bool emit(Instruction::Type type, int dst, int a, int b)
+	{
+		if (instruction_count >= max_instructions)
+		{
+			fallback = true;
+			return false;
+		}
+		Emitted& instr = instructions[instruction_count];
+		instr.code[0] = type;
+		instr.code[1] = (uint8)dst;
+		instr.code[2] = (uint8)a;
+		instr.code[3] = (uint8)b;
+		instr.kinds = uint8((dst >> 16) | (a >> 16) << 2 | (b >> 16) << 4);
+		++instruction_count;
+		return true;
+	}
+
+	void push(const Mark& start, Types type, Kind kind, int idx, float number)
+	{
+		Operand& operand = stack[stack_size];
+		operand.start = start;
+		operand.type = type;
+		operand.kind = kind;
+		operand.constant = kind == CONSTANT && float_program;
+		operand.reg = idx;
+		operand.number = number;
+		operand.id = next_id;
+		++next_id;
+		++stack_size;
+		if (kind == TEMPORARY) ++temp_count;
+		++tokens;
+	}
+
+	void pop(int count)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			--stack_size;
+			if (stack[stack_size].kind == TEMPORARY) --temp_count;
+		}
+	}
+
+	// replaces the output since `start` with a folded constant
+	bool pushConstant(const Mark& start, Types type, float value)
+	{
+		rollback(start);
+		uint64 bits = type == Types::BOOL ? (value != 0 ? 0xffFFffFF : 0) : Simd::bits(value);
+		int idx = addConstant(bits);
+		if (fallback) return false;
+		push(start, type, CONSTANT, idx, value);
+		return true;
+	}
+
+	// bits of the constant `token` in the number type, the constant pass of compile() fails at the
+	// first bad number unless it ran out of registers before
+	bool getNumber(uint64& bits)
+	{
+		Error error = compiler.m_compile_time_error;
+		int offset = compiler.m_compile_time_offset;
+		if (compiler.getNumber(src, token, bits)) return true;
+		bool full = constant_count + variable_count > MAX_REGISTERS;
+		scan_error = full ? Error::OUT_OF_MEMORY : compiler.m_compile_time_error;
+		scan_offset = token.offset;
+		compiler.m_compile_time_error = error;
+		compiler.m_compile_time_offset = offset;
+		return false;
+	}
+
+	// NUMBER or IDENTIFIER, after an error it only registers its constant or variable
+	bool parseOperand()
+	{
+		Mark start = mark();
+		Kind kind = VARIABLE;
+		int idx = 0;
+		float number = 0;
+		double const_value;
+		if (token.type == Token::NUMBER || getConstValue(src, token, const_value))
+		{
+			kind = CONSTANT;
+			idx = -1;
+			number = token.type == Token::NUMBER ? token.number : (float)const_value;
+			uint64 bits;
+			if (scan_error == Error::NONE && getNumber(bits)) idx = addConstant(bits);
+		}
+		else
+		{
+			uint16 slot = compiler.getVariableIdx(src, token);
+			if (slot != 0xffFF)
+			{
+				if (scan_error == Error::NONE) idx = addVariable(slot);
+			}
+			else
+			{
+				compileError(Error::UNKNOWN_IDENTIFIER, token.offset);
+			}
+		}
+		if (fallback) return false;
+		if (error != Error::NONE) return true;
+		if (stack_size >= MAX_REGISTERS)
+		{
+			compileError(Error::OUT_OF_MEMORY, token.offset);
+			return true;
+		}
+		if (!reserve()) return false;
+		push(start, Types::FLOAT, kind, idx, number);
+		return true;
+	}
+
+	// jumps over the right operand of and/or, the constant left operand of a float program is
+	// removed by optimize() together with the operator or the operand
+	bool beginShortCircuit(const Token& op, int& jump)
+	{
+		jump = -1;
+		if (error != Error::NONE || stack_size == 0) return true;
+		Operand& left = stack[stack_size - 1];
+		if (left.constant)
+		{
+			if (left.reg >= left.start.constants)
+			{
+				constant_count = left.start.constants;
+				left.reg = -1;
+			}
+			return true;
+		}
+		jump = instruction_count;
+		Instruction::Type type = op.oper == Token::AND ? Instruction::JUMP_IF_FALSE
+													   : Instruction::JUMP_IF_TRUE;
+		return emit(type, reg(RAW, 0), materialize(left), reg(RAW, 0)) && !fallback;
+	}
+
+	// `left` is the stack index of the left operand of a binary operator, identified by
+	// `left_id`, and `jump` is the short circuit jump of and/or
+	bool applyOperator(const Token& op, int left, int left_id, int jump)
+	{
+		if (error != Error::NONE) return true;
+
+		// in the order of Token::Operator
+		const auto& fn = OPERATOR_FUNCTIONS[op.oper];
+		int arity = fn.arity();
+		if (stack_size < arity)
+		{
+			compileError(Error::NOT_ENOUGH_PARAMETERS, op.offset);
+			return true;
+		}
+		Operand* args = stack + stack_size - arity;
+		for (int j = 0; j < arity; ++j)
+		{
+			if (args[j].type != fn.args[j])
+			{
+				compileError(Error::INCORRECT_TYPE_ARGS, op.offset);
+				return true;
+			}
+		}
+
+		bool short_circuit = fn.instr == Instruction::AND || fn.instr == Instruction::OR;
+		// operands juxtaposed to the right one, e.g. `a and b c`, move the jump of compile()
+		if (short_circuit && (stack_size - 2 != left || stack[left].id != left_id))
+		{
+			fallback = true;
+			return false;
+		}
+
+		bool all_const = true;
+		for (int j = 0; j < arity; ++j) all_const = all_const && args[j].constant;
+		if (all_const)
+		{
+			float value = foldOperator(fn.instr, args[0].number, arity > 1 ? args[1].number : 0);
+			Mark start = args[0].start;
+			pop(arity);
+			return pushConstant(start, fn.ret_type, value);
+		}
+
+		if (short_circuit)
+		{
+			// `false and x` is false, `true and x` is x, `or` the other way round
+			bool absorbing = fn.instr == Instruction::OR;
+			if ((args[0].constant && (args[0].number != 0) == absorbing) ||
+				(args[1].constant && (args[1].number != 0) == absorbing))
+			{
+				Mark start = args[0].start;
+				pop(2);
+				return pushConstant(start, Types::BOOL, absorbing ? 1.0f : 0.0f);
+			}
+			if (args[0].constant)
+			{
+				Mark start = args[0].start;
+				args[0] = args[1];
+				args[0].start = start;
+				--stack_size;
+				--tokens;
+				return true;
+			}
+			if (args[1].constant)
+			{
+				rollback(args[1].start);
+				pop(1);
+				instruction_count = jump;
+				return true;
+			}
+		}
+
+		int a = materialize(args[0]);
+		int b = materialize(args[arity - 1]);
+		if (fallback) return false;
+		Mark start = args[0].start;
+		pop(arity);
+		int dst = reg(TEMPORARY, temp_count);
+		if (!emit(fn.instr, dst, a, b)) return false;
+		push(start, fn.ret_type, TEMPORARY, temp_count, 0);
+		if (jump >= 0)
+		{
+			// the jump leaves the left operand as the result, so it must be in `dst`
+			int skip = instruction_count - jump - 1;
+			instructions[jump].code[3] = dst == a && skip <= 0xff ? (uint8)skip : 0;
+		}
+		return true;
+	}
+
+	bool applyFunction(const Token& function)
+	{
+		if (error != Error::NONE) return true;
+
+		const FunctionRegistry::Function& fn = FunctionRegistry::get(function.function);
+		int arity = fn.arity;
+		if (stack_size < arity)
+		{
+			compileError(Error::NOT_ENOUGH_PARAMETERS, function.offset);
+			return true;
+		}
+		Operand* args = stack + stack_size - arity;
+		for (int j = 0; j < arity; ++j)
+		{
+			if (args[j].type != fn.args[j])
+			{
+				compileError(Error::INCORRECT_TYPE_ARGS, function.offset);
+				return true;
+			}
+		}
+		if (arity == 0 && stack_size >= MAX_REGISTERS)
+		{
+			compileError(Error::OUT_OF_MEMORY, function.offset);
+			return true;
+		}
+		if (arity == 0 && !reserve()) return false;
+
+		bool all_const = float_program && fn.pure;
+		for (int j = 0; j < arity; ++j) all_const = all_const && args[j].constant;
+		if (all_const)
+		{
+			// functions take booleans as masks
+			float values[FunctionRegistry::MAX_ARGS];
+			for (int j = 0; j < arity; ++j)
+			{
+				values[j] = args[j].type == Types::BOOL
+								? Simd::mask(args[j].number != 0 ? 0xffFFffFF : 0)
+								: args[j].number;
+			}
+			float value = ExpressionVM::callFunction((uint8)function.function, values);
+			if (fn.ret_type == Types::BOOL) value = Simd::bits(value) != 0 ? 1.0f : 0.0f;
+			Mark start = arity > 0 ? args[0].start : mark();
+			pop(arity);
+			return pushConstant(start, fn.ret_type, value);
+		}
+
+		// arguments must be in consecutive registers, a single one can be anywhere
+		int arg_regs[FunctionRegistry::MAX_ARGS];
+		for (int j = 0; j < arity; ++j) arg_regs[j] = materialize(args[j]);
+		if (fallback) return false;
+		Mark start = arity > 0 ? args[0].start : mark();
+		pop(arity);
+		int first = arity == 1 ? arg_regs[0] : reg(TEMPORARY, temp_count);
+		for (int j = arity - 1; j >= 0 && arity > 1; --j)
+		{
+			if (arg_regs[j] == first + j) continue;
+			if (temp_count + j >= MAX_REGISTERS)
+			{
+				compileError(Error::OUT_OF_MEMORY, function.offset);
+				return true;
+			}
+			if (!emit(Instruction::MOVE, first + j, arg_regs[j], reg(RAW, 0))) return false;
+		}
+		int dst = reg(TEMPORARY, temp_count);
+		int a = arity > 0 ? first : reg(RAW, 0);
+		if (!emit(Instruction::CALL, dst, a, reg(RAW, function.function & 0xff))) return false;
+		push(start, fn.ret_type, TEMPORARY, temp_count, 0);
+		return true;
+	}
+
+	// parses until `)`, `,`, the end or a binary operator of lower priority than `min_priority`,
+	// juxtaposed operands stay on the stack like in toPostfix()
+	bool parseExpression(int min_priority)
+	{
+		if (depth >= MAX_DEPTH)
+		{
+			fallback = true;
+			return false;
+		}
+		++depth;
+		for (;;)
+		{
+			switch (token.type)
+			{
+				case Token::NUMBER:
+				case Token::IDENTIFIER:
+					if (!parseOperand() || !next()) return false;
+					break;
+				case Token::LEFT_PARENTHESIS:
+					if (!parseGroup()) return false;
+					break;
+				case Token::FUNCTION:
+					if (!parseFunction()) return false;
+					break;
+				case Token::OPERATOR:
+				{
+					Token op = token;
+					if (op.oper == Token::UNARY_MINUS)
+					{
+						if (!next() || !parseExpression(PREFIX_PRIORITY)) return false;
+						if (!applyOperator(op, -1, -1, -1)) return false;
+						break;
+					}
+					// binary operators are left associative
+					int priority = OPERATOR_FUNCTIONS[op.oper].priority;
+					if (priority < min_priority)
+					{
+						--depth;
+						return true;
+					}
+					int left = stack_size - 1;
+					int left_id = left >= 0 ? stack[left].id : -1;
+					int jump = -1;
+					if ((op.oper == Token::AND || op.oper == Token::OR) &&
+						!beginShortCircuit(op, jump))
+					{
+						return false;
+					}
+					if (!next() || !parseExpression(priority + 1)) return false;
+					if (!applyOperator(op, left, left_id, jump)) return false;
+				}
+				break;
+				default:
+					--depth;
+					return true;
+			}
+		}
+	}
+
+	bool parseGroup()
+	{
+		Token parenthesis = token;
+		if (!next() || !parseExpression(0)) return false;
+		if (token.type == Token::COMMA) return syntaxError(Error::UNEXPECTED_CHAR, token.offset);
+		if (token.type == Token::EMPTY)
+		{
+			return syntaxError(Error::MISSING_RIGHT_PARENTHESIS, parenthesis.offset);
+		}
+		return next();
+	}
+
+	bool parseFunction()
+	{
+		Token function = token;
+		int arity = FunctionRegistry::get(function.function).arity;
+		if (!next()) return false;
+		if (token.type == Token::LEFT_PARENTHESIS)
+		{
+			Token parenthesis = token;
+			int comma_count = 0;
+			if (!next()) return false;
+			for (;;)
+			{
+				if (!parseExpression(0)) return false;
+				if (token.type == Token::EMPTY)
+				{
+					return syntaxError(Error::MISSING_RIGHT_PARENTHESIS, parenthesis.offset);
+				}
+				// empty argument
+				if (previous == Token::COMMA ||
+					(token.type == Token::COMMA && previous == Token::LEFT_PARENTHESIS))
+				{
+					return syntaxError(Error::UNEXPECTED_CHAR, token.offset);
+				}
+				if (token.type == Token::RIGHT_PARENTHESIS) break;
+				++comma_count;
+				if (!next()) return false;
+			}
+			int args = previous == Token::LEFT_PARENTHESIS ? 0 : comma_count + 1;
+			if (args != arity)
+			{
+				Error arity_error = args < arity ? Error::NOT_ENOUGH_PARAMETERS
+												 : Error::TOO_MANY_PARAMETERS;
+				return syntaxError(arity_error, function.offset);
+			}
+			if (!next()) return false;
+		}
+		else if (arity != 1)
+		{
+			// only single argument functions can be called without parentheses, e.g. `sin x`
+			return syntaxError(Error::MISSING_LEFT_PARENTHESIS, function.offset);
+		}
+		// operands juxtaposed to the arguments are arguments too, like in toPostfix()
+		if (!parseExpression(PREFIX_PRIORITY)) return false;
+		return applyFunction(function);
+	}
+
+	bool parse()
+	{
+		if (!next() || !parseExpression(0)) return false;
+		if (token.type == Token::RIGHT_PARENTHESIS)
+		{
+			return syntaxError(Error::MISSING_LEFT_PARENTHESIS, token.offset);
+		}
+		if (token.type == Token::COMMA) return syntaxError(Error::UNEXPECTED_CHAR, token.offset);
+		return true;
+	}
+
+	// reports the errors of compile() in its order and lays out the program
+	int finish(ExpressionArena& arena, std::vector<uint8>& byte_code)
+	{
+		if (!output) return -1;
+		if (scan_error != Error::NONE)
+		{
+			compiler.m_compile_time_error = scan_error;
+			if (scan_error != Error::OUT_OF_MEMORY) compiler.m_compile_time_offset = scan_offset;
+			return -1;
+		}
+		// optimize() stopped at the error before it removed these
+		for (int i = 0; i < stack_size; ++i) materialize(stack[i]);
+		if (fallback) return -1;
+		if (constant_count + variable_count > MAX_REGISTERS)
+		{
+			compiler.m_compile_time_error = Error::OUT_OF_MEMORY;
+			return -1;
+		}
+
+		int temp_base = constant_count + variable_count;
+		int end = error != Error::NONE ? error_instructions : instruction_count;
+		int temp_count = 0;
+		for (int i = 0; i < end; ++i)
+		{
+			const Emitted& instr = instructions[i];
+			int count = instr.code[1] + 1;
+			if ((instr.kinds & 3) == TEMPORARY && count > temp_count) temp_count = count;
+		}
+		// register_count is stored in a byte
+		if (temp_base + temp_count >= MAX_REGISTERS)
+		{
+			compiler.m_compile_time_error = Error::OUT_OF_MEMORY;
+			return -1;
+		}
+		if (error != Error::NONE)
+		{
+			compiler.m_compile_time_error = error;
+			if (error != Error::OUT_OF_MEMORY) compiler.m_compile_time_offset = error_offset;
+			return -1;
+		}
+		if (stack_size == 0)
+		{
+			compiler.m_compile_time_error = Error::NOT_ENOUGH_PARAMETERS;
+			compiler.m_compile_time_offset = 0;
+			return -1;
+		}
+
+		Operand& result = stack[stack_size - 1];
+		Instruction::Type ret =
+			result.type == Types::BOOL ? Instruction::RET_BOOL : Instruction::RET_FLOAT;
+		if (!emit(ret, reg(RAW, 0), materialize(result), reg(RAW, 0))) return -1;
+
+		// compile() leaves out the jumps of long programs
+		int count = instruction_count;
+		if (tokens > MAX_REGISTERS)
+		{
+			count = 0;
+			for (int i = 0; i < instruction_count; ++i)
+			{
+				Instruction::Type type = (Instruction::Type)instructions[i].code[0];
+				bool jump = type == Instruction::JUMP_IF_FALSE || type == Instruction::JUMP_IF_TRUE;
+				if (jump) continue;
+				instructions[count] = instructions[i];
+				++count;
+			}
+		}
+
+		Types number_type = compiler.m_number_type;
+		int number_size = ProgramHeader::getNumberSize(number_type);
+		int variables_size = (variable_count * sizeof(uint16) + 3) & ~3;
+		int prologue_size = sizeof(ProgramHeader) + constant_count * number_size + variables_size;
+		int size = prologue_size + count * Instruction::SIZE;
+		byte_code.resize(size);
+		uint8* code = &byte_code[0];
+
+		ProgramHeader header = {};
+		header.register_count = (uint8)(temp_base + temp_count);
+		header.constant_count = (uint8)constant_count;
+		header.variable_count = (uint8)variable_count;
+		header.result_type = result.type == Types::BOOL ? Types::BOOL : number_type;
+		header.number_type = number_type;
+		header.math_tier = compiler.m_math_tier;
+		memcpy(code, &header, sizeof(header));
+		// constants are little endian, so the low bytes hold a float
+		for (int i = 0; i < constant_count; ++i)
+		{
+			memcpy(code + sizeof(header) + i * number_size, &constants[i], number_size);
+		}
+		uint8* variables_out = code + sizeof(header) + constant_count * number_size;
+		memset(variables_out, 0, variables_size);
+		memcpy(variables_out, variables, variable_count * sizeof(uint16));
+
+		const int bases[] = {0, 0, constant_count, temp_base};
+		uint8* out = code + prologue_size;
+		for (int i = 0; i < count; ++i)
+		{
+			const Emitted& instr = instructions[i];
+			out[0] = instr.code[0];
+			for (int j = 1; j < Instruction::SIZE; ++j)
+			{
+				out[j] = uint8(instr.code[j] + bases[(instr.kinds >> (2 * j - 2)) & 3]);
+			}
+			out += Instruction::SIZE;
+		}
+
+		uint8* is_target = arena.allocate<uint8>(size / Instruction::SIZE);
+		if (is_target) compiler.peephole(code, size, is_target);
+		return size;
+	}
+
+	ExpressionCompiler& compiler;
+	ExpressionArena& arena;
+	const char* src;
+	const char* cursor;
+	bool binary;
+	Token token;
+	Token::Type previous;
+	bool float_program;
+	bool output = false;
+	bool syntax_error = false;
+	bool fallback = false;
+	int depth = 0;
+
+	Emitted* instructions = nullptr;
+	int instruction_count = 0;
+	int max_instructions = 0;
+	uint64* constants = nullptr;
+	int constant_count = 0;
+	int max_constants = 0;
+	uint16* variables = nullptr;
+	int variable_count = 0;
+	int max_variables = 0;
+	Operand* stack = nullptr;
+	int stack_size = 0;
+	int max_stack = 0;
+	int stack_limit = 0;
+	int temp_count = 0;
+	// tokens of the optimized postfix notation
+	int tokens = 0;
+	int next_id = 0;
+
+	Error error = Error::NONE;
+	int error_offset = 0;
+	int error_instructions = 0;
+	Error scan_error = Error::NONE;
+	int scan_offset = 0;
+};
+
+
+int ExpressionCompiler::compile(const char* src,
+	ExpressionArena& arena,
+	std::vector<uint8>& byte_code)
+{
+	arena.reset();
+	m_compile_time_error = Error::NONE;
+	Parser parser(*this, arena, src);
+	if (!parser.allocate())
+	{
+		m_compile_time_error = Error::OUT_OF_MEMORY;
+		m_compile_time_offset = 0;
+		return -1;
+	}
+	if (!parser.parse())
+	{
+		if (parser.fallback) return compileStages(src, arena, byte_code);
+		if (parser.syntax_error)
+		{
+			// tokenize() reports lexer errors anywhere in the source before toPostfix() runs
+			Token token;
+			while (scanToken(src, parser.cursor, parser.binary, token) &&
+				   token.type != Token::EMPTY)
+			{
+			}
+		}
+		return -1;
+	}
+	int size = parser.finish(arena, byte_code);
+	if (parser.fallback) return compileStages(src, arena, byte_code);
+	return size;
+}
+
+
+
+// Node of the expression DAG built by compileShared(), `op` is the instruction of operators, the
+// FunctionRegistry index of functions and the variable index of variables
+struct SharedNode
+{
+	ExpressionCompiler::Token::Type kind;
+	Types type;
+	uint16 op;
+	uint64 value; // bits of constants in the number type
+	int arity;
+	int args[FunctionRegistry::MAX_ARGS];
+};
+
+
+static uint32 hashNode(const SharedNode& node)
+{
+	uint32 hash = 2166136261U;
+	uint32 words[] = {(uint32)node.kind,
+		(uint32)node.type,
+		node.op,
+		(uint32)node.value,
+		(uint32)(node.value >> 32)};
+	for (uint32 word : words) hash = (hash ^ word) * 16777619U;
+	for (int i = 0; i < node.arity; ++i) hash = (hash ^ (uint32)node.args[i]) * 16777619U;
+	return hash;
+}
+
+
+// constants are compared bitwise, so 0 and -0 stay distinct
+static bool isNodeEqual(const SharedNode& a, const SharedNode& b)
+{
+	if (a.kind != b.kind || a.type != b.type || a.op != b.op || a.arity != b.arity) return false;
+	if (a.value != b.value) return false;
+	for (int i = 0; i < a.arity; ++i)
+	{
+		if (a.args[i] != b.args[i]) return false;
+	}
+	return true;
+}
+
+
+int ExpressionCompiler::compileShared(const char* const* sources,
+	int count,
+	std::vector<uint8>& byte_code,
+	Types* types)
+{
+	static const int MAX_REGISTERS = ExpressionVM::MAX_REGISTERS;
+
+	if (count <= 0 || count > MAX_SHARED_RESULTS)
+	{
+		m_compile_time_error = count <= 0 ? Error::NOT_ENOUGH_PARAMETERS : Error::OUT_OF_MEMORY;
+		m_compile_time_offset = 0;
+		return -1;
+	}
+
+	// hash-consing, a subexpression already in `nodes` is not added again
+	std::vector<SharedNode> nodes;
+	std::unordered_multimap<uint32, int> node_map;
+	auto addNode = [&](const SharedNode& node, bool pure) -> int {
+		uint32 hash = hashNode(node);
+		auto range = node_map.equal_range(hash);
+		for (auto it = range.first; pure && it != range.second; ++it)
+		{
+			if (isNodeEqual(nodes[it->second], node)) return it->second;
+		}
+		nodes.push_back(node);
+		node_map.emplace(hash, (int)nodes.size() - 1);
+		return (int)nodes.size() - 1;
+	};
+
+	std::vector<int> roots(count);
+	std::vector<Token> tokens;
+	std::vector<Token> postfix;
+	std::vector<int> stack;
+	for (int i = 0; i < count; ++i)
+	{
+		const char* src = sources[i];
+		// every token is at least one char long
+		int max_tokens = (int)strlen(src) + 1;
+		tokens.resize(max_tokens);
+		postfix.resize(max_tokens);
+		int token_count = tokenize(src, &tokens[0], max_tokens);
+		if (token_count <= 0) return -1;
+		token_count = toPostfix(&tokens[0], &postfix[0], token_count);
+		if (token_count <= 0) return -1;
+		token_count = optimize(src, &postfix[0], token_count);
+
+		stack.clear();
+		for (int j = 0; j < token_count; ++j)
+		{
+			const Token& token = postfix[j];
+			SharedNode node;
+			memset(&node, 0, sizeof(node));
+			node.kind = token.type;
+			bool pure = true;
+			switch (token.type)
+			{
+				case Token::NUMBER:
+					node.type = Types::FLOAT;
+					if (!getNumber(src, token, node.value)) return -1;
+					break;
+				case Token::BOOLEAN:
+					node.kind = Token::NUMBER;
+					node.type = Types::BOOL;
+					node.value = Simd::bits(getBoolConstant(token));
+					break;
+				case Token::IDENTIFIER:
+				{
+					node.type = Types::FLOAT;
+					double const_value;
+					if (getConstValue(src, token, const_value))
+					{
+						if (!getNumber(src, token, node.value)) return -1;
+						node.kind = Token::NUMBER;
+						break;
+					}
+					node.op = getVariableIdx(src, token);
+					if (node.op == 0xffFF)
+					{
+						m_compile_time_error = Error::UNKNOWN_IDENTIFIER;
+						m_compile_time_offset = token.offset;
+						return -1;
+					}
+				}
+				break;
+				case Token::OPERATOR:
+				case Token::FUNCTION:
+				{
+					const Types* arg_types = nullptr;
+					if (token.type == Token::OPERATOR)
+					{
+						for (auto& fn : OPERATOR_FUNCTIONS)
+						{
+							if (fn.op != token.oper) continue;
+							node.op = fn.instr;
+							node.type = fn.ret_type;
+							node.arity = fn.arity();
+							arg_types = fn.args;
+						}
+					}
+					else
+					{
+						const FunctionRegistry::Function& fn =
+							FunctionRegistry::get(token.function);
+						node.op = token.function;
+						node.type = fn.ret_type;
+						node.arity = fn.arity;
+						arg_types = fn.args;
+						pure = fn.pure;
+					}
+					if ((int)stack.size() < node.arity)
+					{
+						m_compile_time_error = Error::NOT_ENOUGH_PARAMETERS;
+						m_compile_time_offset = token.offset;
+						return -1;
+					}
+					for (int k = 0; k < node.arity; ++k)
+					{
+						node.args[k] = stack[stack.size() - node.arity + k];
+						if (nodes[node.args[k]].type != arg_types[k])
+						{
+							m_compile_time_error = Error::INCORRECT_TYPE_ARGS;
+							m_compile_time_offset = token.offset;
+							return -1;
+						}
+					}
+					stack.resize(stack.size() - node.arity);
+				}
+				break;
+				default:
+					DebugBreak();
+					break;
+			}
+			stack.push_back(addNode(node, pure));
+		}
+		if (stack.empty())
+		{
+			m_compile_time_error = Error::NOT_ENOUGH_PARAMETERS;
+			m_compile_time_offset = 0;
+			return -1;
+		}
+		roots[i] = stack.back();
+		if (types) types[i] = nodes[roots[i]].type == Types::BOOL ? Types::BOOL : m_number_type;
+	}
+
+	// constants and variables are loaded into the first registers, like in compile()
+	int node_count = (int)nodes.size();
+	std::vector<int> regs(node_count, -1);
+	std::vector<uint64> constants;
+	std::vector<uint16> variables;
+	for (int i = 0; i < node_count; ++i)
+	{
+		if (nodes[i].kind == Token::NUMBER)
+		{
+			regs[i] = (int)constants.size();
+			constants.push_back(nodes[i].value);
+		}
+	}
+	for (int i = 0; i < node_count; ++i)
+	{
+		if (nodes[i].kind == Token::IDENTIFIER)
+		{
+			regs[i] = (int)(constants.size() + variables.size());
+			variables.push_back(nodes[i].op);
+		}
+	}
+	int temp_base = (int)(constants.size() + variables.size());
+	if (temp_base >= MAX_REGISTERS)
+	{
+		m_compile_time_error = Error::OUT_OF_MEMORY;
+		m_compile_time_offset = 0;
+		return -1;
+	}
+
+	// a temporary is released after its last reader, the last result is kept for the return
+	std::vector<int> last_use(node_count, -1);
+	for (int i = 0; i < node_count; ++i)
+	{
+		for (int k = 0; k < nodes[i].arity; ++k) last_use[nodes[i].args[k]] = i;
+	}
+	last_use[roots[count - 1]] = node_count;
+	std::vector<std::vector<int>> stores(node_count);
+	for (int i = 0; i < count; ++i) stores[roots[i]].push_back(i);
+
+	bool used[MAX_REGISTERS] = {};
+	int register_count = temp_base;
+	// `size` consecutive free temporaries, returns the first one or -1
+	auto allocate = [&](int size) -> int {
+		for (int first = temp_base; first + size < MAX_REGISTERS; ++first)
+		{
+			int j = 0;
+			while (j < size && !used[first + j]) ++j;
+			if (j < size) continue;
+			for (j = 0; j < size; ++j) used[first + j] = true;
+			if (first + size > register_count) register_count = first + size;
+			return first;
+		}
+		return -1;
+	};
+
+	int number_size = ProgramHeader::getNumberSize(m_number_type);
+	int variables_size = (int)(variables.size() * sizeof(uint16) + 3) & ~3;
+	int constants_size = int(constants.size() * number_size);
+	int prologue_size = (int)sizeof(ProgramHeader) + constants_size + variables_size;
+	byte_code.assign(prologue_size, 0);
+	auto emit = [&byte_code](Instruction::Type instr, int dst, int a, int b) {
+		uint8 code[] = {(uint8)instr, (uint8)dst, (uint8)a, (uint8)b};
+		byte_code.insert(byte_code.end(), code, code + Instruction::SIZE);
+	};
+
+	for (int i = 0; i < node_count; ++i)
+	{
+		const SharedNode& node = nodes[i];
+		if (node.kind == Token::OPERATOR || node.kind == Token::FUNCTION)
+		{
+			int a = node.arity > 0 ? regs[node.args[0]] : 0;
+			int b = node.arity > 0 ? regs[node.args[node.arity - 1]] : 0;
+			// arguments of calls must be in consecutive registers, the block is allocated before
+			// arguments are released, so moves never overwrite another argument
+			int moved = -1;
+			if (node.kind == Token::FUNCTION && node.arity > 1)
+			{
+				bool consecutive = true;
+				for (int k = 1; k < node.arity; ++k)
+				{
+					consecutive = consecutive && regs[node.args[k]] == a + k;
+				}
+				if (!consecutive)
+				{
+					moved = allocate(node.arity);
+					if (moved < 0)
+					{
+						m_compile_time_error = Error::OUT_OF_MEMORY;
+						m_compile_time_offset = 0;
+						return -1;
+					}
+					for (int k = 0; k < node.arity; ++k)
+					{
+						emit(Instruction::MOVE, moved + k, regs[node.args[k]], 0);
+					}
+					a = moved;
+				}
+			}
+			for (int k = 0; k < node.arity; ++k)
+			{
+				int arg = node.args[k];
+				if (last_use[arg] == i && regs[arg] >= temp_base) used[regs[arg]] = false;
+			}
+			for (int k = 0; moved >= 0 && k < node.arity; ++k) used[moved + k] = false;
+
+			int dst = allocate(1);
+			if (dst < 0)
+			{
+				m_compile_time_error = Error::OUT_OF_MEMORY;
+				m_compile_time_offset = 0;
+				return -1;
+			}
+			regs[i] = dst;
+			if (node.kind == Token::OPERATOR) emit((Instruction::Type)node.op, dst, a, b);
+			else emit(Instruction::CALL, dst, a, node.op);
+		}
+
+		Instruction::Type store =
+			node.type == Types::BOOL ? Instruction::STORE_BOOL : Instruction::STORE_FLOAT;
+		for (int result : stores[i]) emit(store, 0, regs[i], result);
+		if (last_use[i] < 0 && regs[i] >= temp_base) used[regs[i]] = false;
+	}
+
+	int last = roots[count - 1];
+	Types result_type = nodes[last].type;
+	Instruction::Type ret =
+		result_type == Types::BOOL ? Instruction::RET_BOOL : Instruction::RET_FLOAT;
+	emit(ret, 0, regs[last], 0);
+
+	ProgramHeader header = {};
+	header.register_count = (uint8)register_count;
+	header.constant_count = (uint8)constants.size();
+	header.variable_count = (uint8)variables.size();
+	header.result_type = result_type == Types::BOOL ? Types::BOOL : m_number_type;
+	header.number_type = m_number_type;
+	header.math_tier = m_math_tier;
+	memcpy(&byte_code[0], &header, sizeof(header));
+	for (int i = 0; i < (int)constants.size(); ++i)
+	{
+		memcpy(&byte_code[sizeof(header) + i * number_size], &constants[i], number_size);
+	}
+	if (!variables.empty())
+	{
+		memcpy(&byte_code[sizeof(header) + constants.size() * number_size],
+			&variables[0],
+			variables.size() * sizeof(uint16));
+	}
+	return (int)byte_code.size();
+}
+
+
+int ExpressionCompiler::compileAggregate(const char* src, std::vector<uint8>& byte_code)
+{
+	static const struct
+	{
+		const char* name;
+		Aggregate type;
+	} REDUCERS[] = {{"sum", Aggregate::SUM},
+		{"min", Aggregate::MIN},
+		{"max", Aggregate::MAX},
+		{"avg", Aggregate::AVG},
+		{"count", Aggregate::COUNT}};
+
+	auto fail = [this](Error error, const char* at, const char* src) {
+		m_compile_time_error = error;
+		m_compile_time_offset = int(at - src);
+		return -1;
+	};
+	auto skipSpaces = [](const char* c) {
+		while (isspace((uint8)*c)) ++c;
+		return c;
+	};
+	auto isIdentifierChar = [](char c) { return isalnum((uint8)c) || c == '_'; };
+
+	if (m_number_type != Types::FLOAT) return fail(Error::INCORRECT_TYPE_ARGS, src, src);
+
+	const char* name = skipSpaces(src);
+	const char* c = name;
+	while (isIdentifierChar(*c)) ++c;
+	Aggregate type = Aggregate::NONE;
+	for (auto& reducer : REDUCERS)
+	{
+		if (strlen(reducer.name) == size_t(c - name) && strncmp(reducer.name, name, c - name) == 0)
+		{
+			type = reducer.type;
+		}
+	}
+	if (type == Aggregate::NONE) return fail(Error::UNKNOWN_IDENTIFIER, name, src);
+
+	c = skipSpaces(c);
+	if (*c != '(') return fail(Error::MISSING_LEFT_PARENTHESIS, c, src);
+	const char* expr_begin = c + 1;
+	int depth = 1;
+	for (++c; *c && depth > 0; ++c)
+	{
+		if (*c == '(') ++depth;
+		if (*c == ')') --depth;
+	}
+	if (depth > 0) return fail(Error::MISSING_RIGHT_PARENTHESIS, c, src);
+	std::string expr(expr_begin, c - 1);
+
+	// the rest is empty or `where predicate`
+	c = skipSpaces(c);
+	const char* predicate = nullptr;
+	if (*c)
+	{
+		if (strncmp(c, "where", 5) != 0 || isIdentifierChar(c[5]))
+		{
+			return fail(Error::UNEXPECTED_CHAR, c, src);
+		}
+		predicate = c + 5;
+	}
+	if (*skipSpaces(expr.c_str()) == 0) return fail(Error::NOT_ENOUGH_PARAMETERS, expr_begin, src);
+	if (predicate && *skipSpaces(predicate) == 0)
+	{
+		return fail(Error::NOT_ENOUGH_PARAMETERS, predicate, src);
+	}
+
+	const char* sources[] = {expr.c_str(), predicate};
+	Types types[2];
+	if (compileShared(sources, predicate ? 2 : 1, byte_code, types) < 0)
+	{
+		// the offset is in the part which failed
+		Error error = m_compile_time_error;
+		int offset = m_compile_time_offset;
+		if (predicate && compileShared(sources, 1, byte_code, types) >= 0)
+		{
+			m_compile_time_error = error;
+			m_compile_time_offset = int(predicate - src) + offset;
+		}
+		else
+		{
+			m_compile_time_offset += int(expr_begin - src);
+		}
+		return -1;
+	}
+	Types expected = type == Aggregate::COUNT ? Types::BOOL : Types::FLOAT;
+	if (types[0] != expected) return fail(Error::INCORRECT_TYPE_ARGS, expr_begin, src);
+	if (predicate && types[1] != Types::BOOL)
+	{
+		return fail(Error::INCORRECT_TYPE_ARGS, predicate, src);
+	}
+
+	((ProgramHeader*)&byte_code[0])->aggregate = type;
+	return (int)byte_code.size();
+}
+
+static bool isCppIdentifier(const char* name)
+{
+	if (!(isalpha((uint8)name[0]) || name[0] == '_')) return false;
+	for (const char* c = name; *c; ++c)
+	{
+		if (!isalnum((uint8)*c) && *c != '_') return false;
+	}
+	return true;
+}
+
+
+// float literal which reads back as the same float
+static std::string toCppLiteral(float value)
+{
+	char tmp[32];
+	if (value != value || value - value != 0)
+	{
+		snprintf(tmp, sizeof(tmp), "Simd::mask(0x%08xU)", Simd::bits(value));
+		return tmp;
+	}
+	snprintf(tmp, sizeof(tmp), "%.9g", value);
+	std::string literal = tmp;
+	if (literal.find_first_of(".e") == std::string::npos) literal += ".0";
+	literal += "f";
+	return tmp[0] == '-' ? "(" + literal + ")" : literal;
+}
+
+
+static std::string toCppString(const char* str)
+{
+	std::string res = "\"";
+	for (const char* c = str; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\') res += '\\';
+		if (*c == '\n') res += "\\n";
+		else if (*c == '\t') res += "\\t";
+		else res += *c;
+	}
+	return res + "\"";
+}
+
+
+int ExpressionCompiler::transpile(const char* name_space,
+	const char* const* names,
+	const char* const* sources,
+	int count,
+	std::string& out)
+{
+	// C++ of a subexpression, scalar and batch differ in variables and and/or
+	struct Operand
+	{
+		std::string scalar;
+		std::string batch;
+		Types type;
+	};
+
+	m_compile_time_error = ExpressionCompiler::Error::NONE;
+	if (m_number_type != Types::FLOAT)
+	{
+		m_compile_time_error = ExpressionCompiler::Error::INCORRECT_TYPE_ARGS;
+		return -1;
+	}
+	if (!isCppIdentifier(name_space))
+	{
+		m_compile_time_error = ExpressionCompiler::Error::UNEXPECTED_CHAR;
+		return -1;
+	}
+
+	std::string code = "// Generated by ExpressionCompiler::transpile(), do not edit\n"
+					   "#include \"expressions.h\"\n"
+					   "\n\n"
+					   "namespace " + std::string(name_space) + "\n"
+					   "{\n"
+					   "namespace\n"
+					   "{\n"
+					   "\t// booleans are passed to and returned from functions as masks\n"
+					   "\tinline float toMask(bool value) "
+					   "{ return Simd::mask(value ? 0xffFFffFF : 0); }\n"
+					   "\tinline bool fromMask(float value) { return Simd::bits(value) != 0; }\n"
+					   "\n"
+					   "\n"
+					   "\tinline float call(uint16 function, "
+					   "float a0 = 0, float a1 = 0, float a2 = 0, float a3 = 0)\n"
+					   "\t{\n"
+					   "\t\tconst float args[] = {a0, a1, a2, a3};\n"
+					   "\t\treturn FunctionRegistry::get(function).call(args);\n"
+					   "\t}\n";
+
+	std::vector<Token> tokens;
+	std::vector<Token> postfix;
+	std::vector<uint8> byte_code;
+	std::vector<Operand> stack;
+	for (int i = 0; i < count; ++i)
+	{
+		const char* src = sources[i];
+		bool unique = true;
+		for (int j = 0; j < i; ++j) unique = unique && strcmp(names[i], names[j]) != 0;
+		if (!unique || !isCppIdentifier(names[i]))
+		{
+			m_compile_time_error = ExpressionCompiler::Error::UNEXPECTED_CHAR;
+			return -1;
+		}
+
+		// compile() checks the program, so the tokens are valid below
+		int max_tokens = (int)strlen(src) + 1;
+		tokens.resize(max_tokens);
+		postfix.resize(max_tokens);
+		int token_count = tokenize(src, &tokens[0], max_tokens);
+		if (token_count <= 0) return -1;
+		token_count = toPostfix(&tokens[0], &postfix[0], token_count);
+		if (token_count <= 0) return -1;
+		token_count = optimize(src, &postfix[0], token_count);
+		int max_size = sizeof(ProgramHeader) + ExpressionVM::MAX_REGISTERS * 6 +
+					   (token_count + 1) * Instruction::SIZE * (FunctionRegistry::MAX_ARGS + 2);
+		byte_code.resize(max_size);
+		if (compile(src, &postfix[0], token_count, &byte_code[0], max_size) <= 0) return -1;
+
+		// registry indices are looked up by name on first use, functions are registered at runtime
+		std::vector<bool> used_slots(m_variables_count, false);
+		bool used_functions[FunctionRegistry::MAX_FUNCTIONS] = {};
+		stack.clear();
+		for (int j = 0; j < token_count; ++j)
+		{
+			const Token& token = postfix[j];
+			Operand operand = {"", "", Types::FLOAT};
+			double const_value;
+			switch (token.type)
+			{
+				case Token::NUMBER: operand.scalar = toCppLiteral(token.number); break;
+				case Token::BOOLEAN:
+					operand.scalar = token.number != 0 ? "true" : "false";
+					operand.type = Types::BOOL;
+					break;
+				case Token::IDENTIFIER:
+					if (getConstValue(src, token, const_value))
+					{
+						operand.scalar = toCppLiteral((float)const_value);
+					}
+					else
+					{
+						uint16 slot = getVariableIdx(src, token);
+						used_slots[slot] = true;
+						operand.scalar = "inputs[" + std::to_string(slot) + "]";
+						operand.batch = "in" + std::to_string(slot) + "[i]";
+					}
+					break;
+				case Token::OPERATOR:
+					for (auto& fn : OPERATOR_FUNCTIONS)
+					{
+						if (token.oper != fn.op) continue;
+
+						operand.type = fn.ret_type;
+						if (fn.arity() == 1)
+						{
+							const Operand& a = stack.back();
+							operand.scalar = "(-" + a.scalar + ")";
+							operand.batch = "(-" + a.batch + ")";
+							stack.pop_back();
+							break;
+						}
+						static const char* const CPP_OPERATORS[] = {
+							"+", "*", "/", "-", "", "<", ">"};
+						bool logical = token.oper == Token::AND || token.oper == Token::OR;
+						const char* scalar_op = !logical ? CPP_OPERATORS[token.oper]
+												: token.oper == Token::AND ? "&&" : "||";
+						const char* batch_op = !logical ? CPP_OPERATORS[token.oper]
+											   : token.oper == Token::AND ? "&" : "|";
+						const Operand& a = stack[stack.size() - 2];
+						const Operand& b = stack.back();
+						operand.scalar = "(" + a.scalar + " " + scalar_op + " " + b.scalar + ")";
+						operand.batch = "(" + a.batch + " " + batch_op + " " + b.batch + ")";
+						stack.resize(stack.size() - 2);
+						break;
+					}
+					break;
+				case Token::FUNCTION:
+				{
+					const FunctionRegistry::Function& fn = FunctionRegistry::get(token.function);
+					used_functions[token.function] = true;
+					std::string function = "fn" + std::to_string(token.function);
+					operand.scalar = "call(" + function;
+					operand.batch = operand.scalar;
+					for (int k = 0; k < fn.arity; ++k)
+					{
+						const Operand& arg = stack[stack.size() - fn.arity + k];
+						bool mask = arg.type == Types::BOOL;
+						operand.scalar += ", " + (mask ? "toMask(" + arg.scalar + ")" : arg.scalar);
+						operand.batch += ", " + (mask ? "toMask(" + arg.batch + ")" : arg.batch);
+					}
+					operand.scalar += ")";
+					operand.batch += ")";
+					if (fn.ret_type == Types::BOOL)
+					{
+						operand.scalar = "fromMask(" + operand.scalar + ")";
+						operand.batch = "fromMask(" + operand.batch + ")";
+					}
+					operand.type = fn.ret_type;
+					stack.resize(stack.size() - fn.arity);
+				}
+				break;
+				default: DebugBreak(); return -1;
+			}
+			if (operand.batch.empty()) operand.batch = operand.scalar;
+			stack.push_back(operand);
+		}
+
+		std::string name = names[i];
+		std::string functions;
+		for (int j = 0; j < FunctionRegistry::MAX_FUNCTIONS; ++j)
+		{
+			if (!used_functions[j]) continue;
+			const std::string& fn_name = FunctionRegistry::get((uint16)j).name;
+			functions += "\t\tstatic const uint16 fn" + std::to_string(j) +
+						 " = FunctionRegistry::find(" + toCppString(fn_name.c_str()) + ", " +
+						 std::to_string(fn_name.size()) + ");\n";
+		}
+		std::string comment = src;
+		std::replace(comment.begin(), comment.end(), '\n', ' ');
+		bool has_inputs = false;
+		for (bool used : used_slots) has_inputs = has_inputs || used;
+		bool boolean = stack.back().type == Types::BOOL;
+
+		code += "\n\n\t// " + comment + "\n";
+		code += "\tinline ExpressionVM::ReturnValue " + name + "(const float*" +
+				(has_inputs ? " inputs" : "") + ")\n\t{\n" + functions;
+		code += "\t\treturn ExpressionVM::ReturnValue(" + stack.back().scalar + ");\n\t}\n\n\n";
+		code += "\tinline Types " + name + "Batch(const float* const*" +
+				(has_inputs ? " inputs" : "") + ", float* output, int count)\n\t{\n" + functions;
+		for (int slot = 0; slot < m_variables_count; ++slot)
+		{
+			if (!used_slots[slot]) continue;
+			code += "\t\tconst float* __restrict in" + std::to_string(slot) + " = inputs[" +
+					std::to_string(slot) + "];\n";
+		}
+		// without aliasing the loop is vectorized without runtime checks
+		code += "\t\tfloat* __restrict out = output;\n";
+		code += "\t\tfor (int i = 0; i < count; ++i)\n\t\t{\n";
+		const std::string& batch = stack.back().batch;
+		code += "\t\t\tout[i] = " + (boolean ? "(" + batch + ") ? 1.0f : 0.0f" : batch) + ";\n";
+		code += "\t\t}\n";
+		code += std::string("\t\treturn Types::") + (boolean ? "BOOL" : "FLOAT") + ";\n\t}\n";
+	}
+	code += "}\n\n\n";
+
+	code += "extern const int EXPRESSIONS_COUNT = " + std::to_string(count) + ";\n";
+	code += "// terminated by an entry with null members\n";
+	code += "extern const TranspiledExpression EXPRESSIONS[] = {\n";
+	for (int i = 0; i < count; ++i)
+	{
+		std::string name = names[i];
+		code += "\t{" + toCppString(names[i]) + ", " + toCppString(sources[i]) + ", &" + name +
+				", &" + name + "Batch},\n";
+	}
+	code += "\t{nullptr, nullptr, nullptr, nullptr}};\n\n\n";
+	code += "// the expression called `name` or nullptr\n"
+			"const TranspiledExpression* find(const char* name)\n"
+			"{\n"
+			"\tfor (const TranspiledExpression* i = EXPRESSIONS; i->name; ++i)\n"
+			"\t{\n"
+			"\t\tif (strcmp(i->name, name) == 0) return i;\n"
+			"\t}\n"
+			"\treturn nullptr;\n"
+			"}\n"
+			"}\n";
+	out.swap(code);
+	return (int)out.size();
+}
+
+
+// Pairs fused by peephole(), picked from ExpressionVM::profile() of typical workloads:
+// multiply-accumulate in arithmetic, compare followed by the short circuit jump in conditions
+static const struct
+{
+	Instruction::Type first;
+	Instruction::Type second;
+	Instruction::Type fused;
+} FUSED_PAIRS[] = {
+	{Instruction::MUL_FLOAT, Instruction::ADD_FLOAT, Instruction::MUL_ADD_FLOAT},
+	{Instruction::FLOAT_LT, Instruction::JUMP_IF_FALSE, Instruction::FLOAT_LT_JUMP_IF_FALSE},
+	{Instruction::FLOAT_LT, Instruction::JUMP_IF_TRUE, Instruction::FLOAT_LT_JUMP_IF_TRUE},
+	{Instruction::FLOAT_GT, Instruction::JUMP_IF_FALSE, Instruction::FLOAT_GT_JUMP_IF_FALSE},
+	{Instruction::FLOAT_GT, Instruction::JUMP_IF_TRUE, Instruction::FLOAT_GT_JUMP_IF_TRUE}
+};
+
+
+// FUSED_PAIRS indexed by opcodes, COUNT where nothing is fused
+struct FusionTable
+{
+	FusionTable()
+	{
+		memset(fused, Instruction::COUNT, sizeof(fused));
+		for (const auto& pair : FUSED_PAIRS) fused[pair.first][pair.second] = pair.fused;
+	}
+
+	uint8 fused[Instruction::COUNT][Instruction::COUNT];
+};
+
+
+// true if no instruction from `from` on reads `reg` before overwriting it on every path
+static bool isDeadRegister(const uint8* instructions, int count, int from, uint8 reg)
+{
+	// jumps only go forward, a write which a jump can skip does not count
+	int jump_end = from;
+	for (int i = from; i < count; ++i)
+	{
+		const uint8* ip = instructions + i * Instruction::SIZE;
+		int reads_count = 0;
+		uint8 reads[2];
+		bool writes = false;
+		switch (ip[0])
+		{
+			case Instruction::CALL:
+			{
+				const FunctionRegistry::Function& fn = FunctionRegistry::get(ip[3]);
+				if (reg >= ip[2] && reg < ip[2] + fn.arity) return false;
+				writes = true;
+			}
+			break;
+			case Instruction::UNARY_MINUS:
+			case Instruction::MOVE:
+				reads[reads_count++] = ip[2];
+				writes = true;
+				break;
+			case Instruction::STORE_FLOAT:
+			case Instruction::STORE_BOOL:
+				reads[reads_count++] = ip[2];
+				break;
+			case Instruction::RET_FLOAT:
+			case Instruction::RET_BOOL:
+				return ip[2] != reg;
+			case Instruction::JUMP_IF_FALSE:
+			case Instruction::JUMP_IF_TRUE:
+				reads[reads_count++] = ip[2];
+				if (i + 1 + ip[3] > jump_end) jump_end = i + 1 + ip[3];
+				break;
+			case Instruction::FLOAT_LT_JUMP_IF_FALSE:
+			case Instruction::FLOAT_LT_JUMP_IF_TRUE:
+			case Instruction::FLOAT_GT_JUMP_IF_FALSE:
+			case Instruction::FLOAT_GT_JUMP_IF_TRUE:
+				reads[reads_count++] = ip[2];
+				reads[reads_count++] = ip[3];
+				writes = true;
+				if (i + 2 + ip[7] > jump_end) jump_end = i + 2 + ip[7];
+				break;
+			case Instruction::OPERAND:
+				// c of MUL_ADD_FLOAT, n of jumps is not a register
+				if (ip[-Instruction::SIZE] == Instruction::MUL_ADD_FLOAT)
+				{
+					reads[reads_count++] = ip[2];
+				}
+				break;
+			default:
+				reads[reads_count++] = ip[2];
+				reads[reads_count++] = ip[3];
+				writes = true;
+				break;
+		}
+		for (int j = 0; j < reads_count; ++j)
+		{
+			if (reads[j] == reg) return false;
+		}
+		if (writes && ip[1] == reg && i >= jump_end) return true;
+	}
+	return true;
+}
+
+
+int ExpressionCompiler::peephole(uint8* byte_code, int size)
+{
+	static const int MAX_STACK_INSTRUCTIONS = 256;
+	int max_count = size / Instruction::SIZE;
+	if (max_count > MAX_STACK_INSTRUCTIONS)
+	{
+		std::vector<uint8> is_target(max_count);
+		return peephole(byte_code, size, &is_target[0]);
+	}
+	uint8 is_target[MAX_STACK_INSTRUCTIONS];
+	return peephole(byte_code, size, is_target);
+}
+
+
+int ExpressionCompiler::peephole(uint8* byte_code, int size, uint8* is_target)
+{
+	static const FusionTable table;
+	const ProgramHeader& header = *(const ProgramHeader*)byte_code;
+	uint8* instructions = byte_code + (header.instructions() - byte_code);
+	int count = int(byte_code + size - instructions) / Instruction::SIZE;
+
+	// the second instruction of a pair can not be fused if a jump lands on it
+	memset(is_target, 0, count);
+	for (int i = 0; i < count; ++i)
+	{
+		const uint8* ip = instructions + i * Instruction::SIZE;
+		if (ip[0] == Instruction::JUMP_IF_FALSE || ip[0] == Instruction::JUMP_IF_TRUE)
+		{
+			if (i + 1 + ip[3] < count) is_target[i + 1 + ip[3]] = true;
+		}
+	}
+
+	int fused_count = 0;
+	for (int i = 0; i + 1 < count; ++i)
+	{
+		uint8* first = instructions + i * Instruction::SIZE;
+		uint8* second = first + Instruction::SIZE;
+		if (is_target[i + 1]) continue;
+		if (first[0] >= Instruction::COUNT || second[0] >= Instruction::COUNT) continue;
+		uint8 fused = table.fused[first[0]][second[0]];
+		if (fused == Instruction::COUNT) continue;
+
+		uint8 result = first[1];
+		if (fused == Instruction::MUL_ADD_FLOAT)
+		{
+			// the product is not written, so it must not be needed after the sum
+			if ((second[2] == result) == (second[3] == result)) continue;
+			if (second[1] != result && !isDeadRegister(instructions, count, i + 2, result))
+			{
+				continue;
+			}
+			uint8 addend = second[2] == result ? second[3] : second[2];
+			first[1] = second[1];
+			second[2] = addend;
+			second[3] = 0;
+		}
+		else
+		{
+			// the jump must test the result of the comparison
+			if (second[2] != result) continue;
+			second[2] = 0;
+		}
+		first[0] = fused;
+		second[0] = Instruction::OPERAND;
+		second[1] = 0;
+		++fused_count;
+		++i;
+	}
+	return fused_count;
+}
+
+
+// Character classes driving ExpressionCompiler::tokenize
+namespace Lexer
+{
+	enum CharClass : uint8
+	{
+		INVALID,
+		SPACE,
+		DIGIT,
+		IDENTIFIER,
+		BINARY_OPERATOR,
+		MINUS,
+		LEFT_PARENTHESIS,
+		RIGHT_PARENTHESIS,
+		COMMA
+	};
+
+	struct Table
+	{
+		Table()
+		{
+			memset(classes, INVALID, sizeof(classes));
+			memset(operators, 0, sizeof(operators));
+			classes[' '] = classes['\n'] = classes['\t'] = SPACE;
+			for (int c = '0'; c <= '9'; ++c) classes[c] = DIGIT;
+			for (int c = 'a'; c <= 'z'; ++c) classes[c] = IDENTIFIER;
+			for (int c = 'A'; c <= 'Z'; ++c) classes[c] = IDENTIFIER;
+			classes['_'] = IDENTIFIER;
+			classes['-'] = MINUS;
+			classes['('] = LEFT_PARENTHESIS;
+			classes[')'] = RIGHT_PARENTHESIS;
+			classes[','] = COMMA;
+			setOperator('*', ExpressionCompiler::Token::MULTIPLY);
+			setOperator('+', ExpressionCompiler::Token::ADD);
+			setOperator('/', ExpressionCompiler::Token::DIVIDE);
+			setOperator('<', ExpressionCompiler::Token::LESS_THAN);
+			setOperator('>', ExpressionCompiler::Token::GREATER_THAN);
+		}
+
+		void setOperator(char c, ExpressionCompiler::Token::Operator op)
+		{
+			classes[(uint8)c] = BINARY_OPERATOR;
+			operators[(uint8)c] = op;
+		}
+
+		CharClass classes[256];
+		ExpressionCompiler::Token::Operator operators[256];
+	};
+
+	static const Table TABLE;
+
+
+	// keywords are binary operators, KEYWORDS[hashKeyword()] is the only candidate
+	static const struct
+	{
+		const char* name;
+		int size;
+		ExpressionCompiler::Token::Operator op;
+	} KEYWORDS[8] = {{nullptr},
+		{"or", 2, ExpressionCompiler::Token::OR},
+		{nullptr},
+		{nullptr},
+		{"and", 3, ExpressionCompiler::Token::AND},
+		{nullptr},
+		{nullptr},
+		{nullptr}};
+
+
+	inline int hashKeyword(const char* c, int size)
+	{
+		return (size + (uint8)c[0]) & 7;
+	}
+
+
+	// Returns the end of the number. A mantissa up to 2^24 and a power of ten up to 1e10 are exact
+	// floats, so a single multiplication or division is correctly rounded and matches strtof.
+	// Anything else is left to strtof.
+	static const char* scanNumber(const char* c, float& value)
+	{
+		static const float POWERS_OF_TEN[] = {
+			1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+		static const uint32 MAX_MANTISSA = 1 << 24;
+
+		const char* start = c;
+		uint32 mantissa = 0;
+		int exponent = 0;
+		bool exact = true;
+		for (; TABLE.classes[(uint8)*c] == DIGIT; ++c)
+		{
+			mantissa = mantissa * 10 + (*c - '0');
+			exact = exact && mantissa <= MAX_MANTISSA;
+		}
+		if (*c == '.')
+		{
+			for (++c; TABLE.classes[(uint8)*c] == DIGIT; ++c)
+			{
+				mantissa = mantissa * 10 + (*c - '0');
+				exact = exact && mantissa <= MAX_MANTISSA;
+				--exponent;
+			}
+		}
+		if ((*c == 'e' || *c == 'E') && exact)
+		{
+			const char* e = c + 1;
+			bool negative = *e == '-';
+			if (*e == '-' || *e == '+') ++e;
+			if (TABLE.classes[(uint8)*e] == DIGIT)
+			{
+				int exp_value = 0;
+				for (; TABLE.classes[(uint8)*e] == DIGIT && exp_value < 100; ++e)
+				{
+					exp_value = exp_value * 10 + (*e - '0');
+				}
+				exponent += negative ? -exp_value : exp_value;
+				exact = TABLE.classes[(uint8)*e] != DIGIT;
+				c = e;
+			}
+		}
+		// hexadecimal numbers
+		exact = exact && *c != 'x' && *c != 'X';
+
+		if (!exact || exponent < -10 || exponent > 10)
+		{
+			char* end;
+			value = strtof(start, &end);
+			return end;
+		}
+		value = exponent < 0 ? mantissa / POWERS_OF_TEN[-exponent]
+							 : mantissa * POWERS_OF_TEN[exponent];
+		return c;
+	}
+}
+
+
+bool ExpressionCompiler::scanToken(const char* src, const char*& c, bool& binary, Token& token)
+{
+	while (Lexer::TABLE.classes[(uint8)*c] == Lexer::SPACE) ++c;
+	token = {Token::EMPTY, int(c - src), 1};
+	if (!*c) return true;
+
+	switch (Lexer::TABLE.classes[(uint8)*c])
+	{
+		case Lexer::DIGIT:
+			token.type = Token::NUMBER;
+			c = Lexer::scanNumber(c, token.number);
+			token.size = int(c - src) - token.offset;
+			binary = true;
+			break;
+		case Lexer::IDENTIFIER:
+		{
+			const char* start = c;
+			for (++c; Lexer::TABLE.classes[(uint8)*c] == Lexer::IDENTIFIER; ++c);
+			token.size = int(c - start);
+
+			const auto& keyword = Lexer::KEYWORDS[Lexer::hashKeyword(start, token.size)];
+			if (keyword.size == token.size && memcmp(keyword.name, start, token.size) == 0)
+			{
+				if (!binary)
+				{
+					m_compile_time_error = ExpressionCompiler::Error::MISSING_BINARY_OPERAND;
+					m_compile_time_offset = token.offset;
+					return false;
+				}
+				token.type = Token::OPERATOR;
+				token.oper = keyword.op;
+				binary = false;
+				break;
+			}
+
+			token.function = getFunctionIdx(src, token);
+			token.type = token.function != FunctionRegistry::INVALID_INDEX ? Token::FUNCTION
+																			: Token::IDENTIFIER;
+			binary = token.type == Token::IDENTIFIER;
+		}
+		break;
+		case Lexer::BINARY_OPERATOR:
+			if (!binary)
+			{
+				m_compile_time_error = ExpressionCompiler::Error::MISSING_BINARY_OPERAND;
+				m_compile_time_offset = token.offset;
+				return false;
+			}
+			token.type = Token::OPERATOR;
+			token.oper = Lexer::TABLE.operators[(uint8)*c];
+			binary = false;
+			++c;
+			break;
+		case Lexer::MINUS:
+			token.type = Token::OPERATOR;
+			token.oper = binary ? Token::SUBTRACT : Token::UNARY_MINUS;
+			binary = false;
+			++c;
+			break;
+		case Lexer::LEFT_PARENTHESIS:
+			token.type = Token::LEFT_PARENTHESIS;
+			binary = false;
+			++c;
+			break;
+		case Lexer::RIGHT_PARENTHESIS:
+			token.type = Token::RIGHT_PARENTHESIS;
+			binary = true;
+			++c;
+			break;
+		case Lexer::COMMA:
+			token.type = Token::COMMA;
+			binary = false;
+			++c;
+			break;
+		default:
+			m_compile_time_error = ExpressionCompiler::Error::UNEXPECTED_CHAR;
+			m_compile_time_offset = token.offset;
+			return false;
+	}
+	return true;
+}
+
+
+int ExpressionCompiler::tokenize(const char* src, Token* tokens, int max_size)
+{
+	m_compile_time_error = ExpressionCompiler::Error::NONE;
+	const char* c = src;
+	int token_count = 0;
+	// true if the last token can be the left operand of a binary operator
+	bool binary = false;
+	for (;;)
+	{
+		Token token;
+		if (!scanToken(src, c, binary, token)) return -1;
+		if (token.type == Token::EMPTY) break;
+
+		if (token_count >= max_size)
+		{
+			m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
+			return -1;
+		}
+		tokens[token_count] = token;
+		++token_count;
+	}
+	return token_count;
+}
+
+
+#ifdef EXPRESSIONS_JIT
+namespace Jit
+{
+	enum Reg
+	{
+		RAX = 0,
+		RCX = 1,
+		RDX = 2,
+		RBX = 3,
+		RSP = 4,
+		RSI = 6,
+		RDI = 7,
+		R8 = 8,
+		R12 = 12,
+		R13 = 13,
+		R14 = 14,
+		RIP = -1,
+		NO_REG = -2
+	};
+
+#ifdef _WIN32
+	static const Reg ARGS[] = {RCX, RDX, R8};
+	static const int SHADOW_SPACE = 32;
+#else
+	static const Reg ARGS[] = {RDI, RSI, RDX};
+	static const int SHADOW_SPACE = 0;
+#endif
+
+	// [base + index * 4 + disp] or [rip + disp] relative to the data section
+	struct Mem
+	{
+		int base;
+		int index;
+		int disp;
+	};
+
+	inline Mem mem(int base, int disp) { Mem m = {base, NO_REG, disp}; return m; }
+	inline Mem mem(int base, int index, int disp) { Mem m = {base, index, disp}; return m; }
+
+
+	class Emitter
+	{
+	public:
+		std::vector<uint8> code;
+
+		// disp32 of RIP relative operands, patched once the data section is placed after code
+		struct DataFixup
+		{
+			int pos;
+			int instr_end;
+			int data_offset;
+		};
+		std::vector<DataFixup> data_fixups;
+
+		void byte(int b) { code.push_back((uint8)b); }
+		void dword(uint32 v) { for (int i = 0; i < 4; ++i) byte(v >> (i * 8)); }
+		int pos() const { return (int)code.size(); }
+
+		void patchRel32(int pos, int target)
+		{
+			uint32 rel = uint32(target - (pos + 4));
+			for (int i = 0; i < 4; ++i) code[pos + i] = uint8(rel >> (i * 8));
+		}
+
+		void rex(bool w, int reg, int index, int base, bool force = false)
+		{
+			int r = 0x40 | (w ? 8 : 0) | (reg >= 8 ? 4 : 0);
+			r |= (index >= 8 ? 2 : 0) | (base >= 8 ? 1 : 0);
+			if (r != 0x40 || force) byte(r);
+		}
+
+		// ModRM + SIB + disp32 for a memory operand, `imm_size` bytes follow the operand
+		void modrm(int reg, const Mem& m, int imm_size)
+		{
+			if (m.base == RIP)
+			{
+				byte(((reg & 7) << 3) | 5);
+				DataFixup fixup = {pos(), pos() + 4 + imm_size, m.disp};
+				data_fixups.push_back(fixup);
+				dword(0);
+				return;
+			}
+			if (m.index != NO_REG)
+			{
+				byte(0x80 | ((reg & 7) << 3) | 4);
+				byte((2 << 6) | ((m.index & 7) << 3) | (m.base & 7));
+			}
+			else if ((m.base & 7) == RSP)
+			{
+				byte(0x80 | ((reg & 7) << 3) | 4);
+				byte(0x24);
+			}
+			else
+			{
+				byte(0x80 | ((reg & 7) << 3) | (m.base & 7));
+			}
+			dword(m.disp);
+		}
+
+		int baseOf(const Mem& m) const { return m.base == RIP ? 0 : m.base; }
+		int indexOf(const Mem& m) const { return m.index == NO_REG ? 0 : m.index; }
+
+		// SSE instruction xmm, [mem], `prefix` is 0xF3 for scalar single, 0 for packed single
+		void sse(int prefix, int opcode, int xmm, const Mem& m, int imm = -1)
+		{
+			if (prefix) byte(prefix);
+			rex(false, xmm, indexOf(m), baseOf(m));
+			byte(0x0F);
+			byte(opcode);
+			modrm(xmm, m, imm >= 0 ? 1 : 0);
+			if (imm >= 0) byte(imm);
+		}
+
+		void sse(int prefix, int opcode, int dst, int src, int imm = -1)
+		{
+			if (prefix) byte(prefix);
+			rex(false, dst, 0, src);
+			byte(0x0F);
+			byte(opcode);
+			byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+			if (imm >= 0) byte(imm);
+		}
+
+		void push(int reg)
+		{
+			rex(false, 0, 0, reg);
+			byte(0x50 | (reg & 7));
+		}
+
+		void pop(int reg)
+		{
+			rex(false, 0, 0, reg);
+			byte(0x58 | (reg & 7));
+		}
+
+		// mov dst, src; 64 bit
+		void mov(int dst, int src)
+		{
+			rex(true, src, 0, dst);
+			byte(0x89);
+			byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+		}
+
+		// movsxd dst, src32
+		void movsxd(int dst, int src)
+		{
+			rex(true, dst, 0, src);
+			byte(0x63);
+			byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+		}
+
+		// mov dst, [mem]; 64 bit
+		void load(int dst, const Mem& m)
+		{
+			rex(true, dst, indexOf(m), baseOf(m));
+			byte(0x8B);
+			modrm(dst, m, 0);
+		}
+
+		void lea(int dst, const Mem& m)
+		{
+			rex(true, dst, indexOf(m), baseOf(m));
+			byte(0x8D);
+			modrm(dst, m, 0);
+		}
+
+		void movImm32(int dst, uint32 value)
+		{
+			rex(false, 0, 0, dst);
+			byte(0xB8 | (dst & 7));
+			dword(value);
+		}
+
+		void callAbsolute(const void* fn)
+		{
+			// mov rax, imm64; call rax
+			byte(0x48);
+			byte(0xB8);
+			unsigned long long address = (unsigned long long)fn;
+			dword(uint32(address));
+			dword(uint32(address >> 32));
+			byte(0xFF);
+			byte(0xD0);
+		}
+
+		// add/sub rsp, imm32
+		void addRsp(int value)
+		{
+			byte(0x48);
+			byte(0x81);
+			byte(value >= 0 ? 0xC4 : 0xEC);
+			dword(value >= 0 ? value : -value);
+		}
+
+		// jcc rel32 (`cc` is the low nibble of the opcode) or jmp rel32 with cc < 0, returns
+		// position of rel32
+		int jump(int cc)
+		{
+			if (cc < 0)
+			{
+				byte(0xE9);
+			}
+			else
+			{
+				byte(0x0F);
+				byte(0x80 | cc);
+			}
+			dword(0);
+			return pos() - 4;
+		}
+	};
+
+	enum Condition
+	{
+		CC_E = 0x4,
+		CC_NE = 0x5,
+		CC_GE = 0xD,
+		JMP = -1
+	};
+
+	enum SseOpcode
+	{
+		MOVUPS_LOAD = 0x10,
+		MOVUPS_STORE = 0x11,
+		ANDPS = 0x54,
+		ORPS = 0x56,
+		XORPS = 0x57,
+		ADD = 0x58,
+		MUL = 0x59,
+		SUB = 0x5C,
+		DIV = 0x5E,
+		CMP = 0xC2,
+		CMP_LT = 1
+	};
+
+	// data section, constant k is at CONSTANTS + k * 16, broadcast to 4 floats
+	static const int SIGN_MASK = 0;
+	static const int ONE = 16;
+	static const int CONSTANTS = 32;
+
+	static void callFunction(uint32 idx, const float* args, float* result)
+	{
+		*result = ExpressionVM::callFunction((uint8)idx, args);
+	}
+
+
+	// argument `j` of row `i` is args[j * 4 + i], bits 8-15 of `idx` are the MathTier
+	static void callFunctionPacked(uint32 idx, const float* args, float* result)
+	{
+		const FunctionRegistry::Function& fn = FunctionRegistry::get((uint8)idx);
+		if (fn.batch)
+		{
+			fn.batch(result, args, 4, (MathTier)(idx >> 8));
+			return;
+		}
+		if (fn.unary)
+		{
+			for (int i = 0; i < 4; ++i) result[i] = fn.unary(args[i]);
+			return;
+		}
+		for (int i = 0; i < 4; ++i)
+		{
+			float values[FunctionRegistry::MAX_ARGS];
+			for (int j = 0; j < fn.arity; ++j) values[j] = args[j * 4 + i];
+			result[i] = fn.call(values);
+		}
+	}
+
+
+	// Generates a function evaluating `header`. Registers: rbx inputs, r12 output, r13 row count,
+	// r14 row, temporaries are on the stack. Packed code reads and writes 4 rows at once.
+	static bool generate(const ProgramHeader& header, bool packed, Emitter& e)
+	{
+		const int prefix = packed ? 0 : 0xF3;
+		const int temp_base = header.constant_count + header.variable_count;
+		const int temp_count = header.register_count - temp_base;
+		// 4 pushes + return address keep rsp 8 bytes off 16 byte alignment
+		// stack frame: shadow space, function arguments, temporaries
+		const int args_offset = SHADOW_SPACE;
+		const int temps_offset = args_offset + FunctionRegistry::MAX_ARGS * 16;
+		const int frame = ((temps_offset + temp_count * 16 + 15) & ~15) + 8;
+
+		e.push(RBX);
+		e.push(R12);
+		e.push(R13);
+		e.push(R14);
+		e.addRsp(-frame);
+		e.mov(RBX, ARGS[0]);
+		int loop = 0;
+		int loop_exit = 0;
+		if (packed)
+		{
+			e.mov(R12, ARGS[1]);
+			e.movsxd(R13, ARGS[2]);
+			// xor r14d, r14d
+			e.byte(0x45);
+			e.byte(0x31);
+			e.byte(0xF6);
+			loop = e.pos();
+			// cmp r14, r13
+			e.byte(0x4D);
+			e.byte(0x39);
+			e.byte(0xEE);
+			loop_exit = e.jump(CC_GE);
+		}
+
+		const uint8* slots = header.variables();
+		auto operand = [&](int reg) -> Mem {
+			if (reg < header.constant_count) return mem(RIP, CONSTANTS + reg * 16);
+			if (reg >= temp_base) return mem(RSP, temps_offset + (reg - temp_base) * 16);
+
+			uint16 slot;
+			memcpy(&slot, slots + (reg - header.constant_count) * sizeof(slot), sizeof(slot));
+			if (!packed) return mem(RBX, slot * sizeof(float));
+			e.load(RAX, mem(RBX, slot * sizeof(float*)));
+			return mem(RAX, R14, 0);
+		};
+		auto load = [&](int xmm, int reg) { e.sse(prefix, MOVUPS_LOAD, xmm, operand(reg)); };
+		auto store = [&](int reg, int xmm) { e.sse(prefix, MOVUPS_STORE, xmm, operand(reg)); };
+
+		struct JumpFixup
+		{
+			int pos;
+			int target;
+		};
+		std::vector<JumpFixup> jump_fixups;
+		std::vector<int> instruction_pos;
+
+		// xmm0 = a < b or a > b
+		auto compare = [&](bool lt, int a, int b) {
+			// a > b is b < a, NLE would be true for NaN
+			load(0, lt ? a : b);
+			load(1, lt ? b : a);
+			e.sse(prefix, CMP, 0, 1, CMP_LT);
+		};
+
+		// jumps to instruction `target` if xmm0 is true (`if_true`) or false
+		auto jumpIf = [&](bool if_true, int target) {
+			Condition cc;
+			if (packed)
+			{
+				// movmskps eax, xmm0, skip only if the whole vector agrees
+				e.byte(0x0F);
+				e.byte(0x50);
+				e.byte(0xC0);
+				if (if_true)
+				{
+					// cmp eax, 15
+					e.byte(0x83);
+					e.byte(0xF8);
+					e.byte(0x0F);
+				}
+				else
+				{
+					// test eax, eax
+					e.byte(0x85);
+					e.byte(0xC0);
+				}
+				cc = CC_E;
+			}
+			else
+			{
+				// movd eax, xmm0; test eax, eax
+				e.byte(0x66);
+				e.byte(0x0F);
+				e.byte(0x7E);
+				e.byte(0xC0);
+				e.byte(0x85);
+				e.byte(0xC0);
+				cc = if_true ? CC_NE : CC_E;
+			}
+			JumpFixup fixup = {e.jump(cc), target};
+			jump_fixups.push_back(fixup);
+		};
+
+		const uint8* ip = header.instructions();
+		for (int idx = 0;; ++idx, ip += Instruction::SIZE)
+		{
+			instruction_pos.push_back(e.pos());
+			int dst = ip[1];
+			int a = ip[2];
+			int b = ip[3];
+			switch (ip[0])
+			{
+				case Instruction::ADD_FLOAT:
+				case Instruction::SUB_FLOAT:
+				case Instruction::MUL_FLOAT:
+				case Instruction::DIV_FLOAT:
+				case Instruction::AND:
+				case Instruction::OR:
+				{
+					static const int OPCODES[] = {ADD, SUB, MUL, DIV};
+					load(0, a);
+					load(1, b);
+					if (ip[0] == Instruction::AND) e.sse(0, ANDPS, 0, 1);
+					else if (ip[0] == Instruction::OR) e.sse(0, ORPS, 0, 1);
+					else e.sse(prefix, OPCODES[ip[0] - Instruction::ADD_FLOAT], 0, 1);
+					store(dst, 0);
+				}
+				break;
+				case Instruction::FLOAT_LT:
+				case Instruction::FLOAT_GT:
+					compare(ip[0] == Instruction::FLOAT_LT, a, b);
+					store(dst, 0);
+					break;
+				case Instruction::UNARY_MINUS:
+					load(0, a);
+					e.sse(prefix, MOVUPS_LOAD, 1, mem(RIP, SIGN_MASK));
+					e.sse(0, XORPS, 0, 1);
+					store(dst, 0);
+					break;
+				case Instruction::CALL:
+				{
+					if (dst < temp_base) return false;
+					int arity = FunctionRegistry::get(b).arity;
+					for (int j = 0; j < arity; ++j)
+					{
+						load(0, a + j);
+						int arg_offset = args_offset + j * (packed ? 16 : 4);
+						e.sse(prefix, MOVUPS_STORE, 0, mem(RSP, arg_offset));
+					}
+					e.movImm32(ARGS[0], packed ? b | (uint32)header.math_tier << 8 : b);
+					e.lea(ARGS[1], mem(RSP, args_offset));
+					e.lea(ARGS[2], operand(dst));
+					e.callAbsolute(
+						packed ? (const void*)&callFunctionPacked : (const void*)&callFunction);
+				}
+				break;
+				case Instruction::MOVE:
+					load(0, a);
+					store(dst, 0);
+					break;
+				case Instruction::JUMP_IF_FALSE:
+				case Instruction::JUMP_IF_TRUE:
+					load(0, a);
+					jumpIf(ip[0] == Instruction::JUMP_IF_TRUE, idx + 1 + b);
+					break;
+				case Instruction::MUL_ADD_FLOAT:
+					load(0, a);
+					load(1, b);
+					e.sse(prefix, MUL, 0, 1);
+					load(1, ip[Instruction::SIZE + 2]);
+					e.sse(prefix, ADD, 0, 1);
+					store(dst, 0);
+					break;
+				case Instruction::FLOAT_LT_JUMP_IF_FALSE:
+				case Instruction::FLOAT_LT_JUMP_IF_TRUE:
+				case Instruction::FLOAT_GT_JUMP_IF_FALSE:
+				case Instruction::FLOAT_GT_JUMP_IF_TRUE:
+				{
+					bool lt = ip[0] == Instruction::FLOAT_LT_JUMP_IF_FALSE ||
+							  ip[0] == Instruction::FLOAT_LT_JUMP_IF_TRUE;
+					bool if_true = ip[0] == Instruction::FLOAT_LT_JUMP_IF_TRUE ||
+								   ip[0] == Instruction::FLOAT_GT_JUMP_IF_TRUE;
+					compare(lt, a, b);
+					store(dst, 0);
+					jumpIf(if_true, idx + 2 + ip[Instruction::SIZE + 3]);
+				}
+				break;
+				// operands of the previous instruction
+				case Instruction::OPERAND: break;
+				case Instruction::RET_FLOAT:
+				case Instruction::RET_BOOL:
+					load(0, a);
+					if (packed)
+					{
+						if (ip[0] == Instruction::RET_BOOL)
+						{
+							e.sse(0, MOVUPS_LOAD, 1, mem(RIP, ONE));
+							e.sse(0, ANDPS, 0, 1);
+						}
+						e.sse(0, MOVUPS_STORE, 0, mem(R12, R14, 0));
+						// add r14, 4
+						e.byte(0x49);
+						e.byte(0x83);
+						e.byte(0xC6);
+						e.byte(0x04);
+						e.patchRel32(e.jump(JMP), loop);
+						e.patchRel32(loop_exit, e.pos());
+					}
+					break;
+				default: return false;
+			}
+			if (ip[0] == Instruction::RET_FLOAT || ip[0] == Instruction::RET_BOOL) break;
+		}
+
+		for (auto& fixup : jump_fixups)
+		{
+			if (fixup.target >= (int)instruction_pos.size()) return false;
+			e.patchRel32(fixup.pos, instruction_pos[fixup.target]);
+		}
+
+		e.addRsp(frame);
+		e.pop(R14);
+		e.pop(R13);
+		e.pop(R12);
+		e.pop(RBX);
+		e.byte(0xC3);
+		return true;
+	}
+
+
+	static void emitData(const ProgramHeader& header, Emitter& e, std::vector<uint8>& out)
+	{
+		while (e.code.size() % 16) e.byte(0xCC);
+		int data_start = e.pos();
+		for (auto& fixup : e.data_fixups)
+		{
+			uint32 rel = uint32(data_start + fixup.data_offset - fixup.instr_end);
+			for (int i = 0; i < 4; ++i) e.code[fixup.pos + i] = uint8(rel >> (i * 8));
+		}
+		for (int i = 0; i < 4; ++i) e.dword(0x80000000);
+		for (int i = 0; i < 4; ++i) e.dword(0x3F800000);
+		for (int k = 0; k < header.constant_count; ++k)
+		{
+			uint32 value;
+			memcpy(&value, header.constants() + k * sizeof(value), sizeof(value));
+			for (int i = 0; i < 4; ++i) e.dword(value);
+		}
+		out.insert(out.end(), e.code.begin(), e.code.end());
+	}
+}
+#endif
+
+
+ExpressionJIT::ExpressionJIT()
+	: m_memory(nullptr)
+	, m_memory_size(0)
+	, m_scalar_function(nullptr)
+	, m_batch_function(nullptr)
+{
+}
+
+
+ExpressionJIT::~ExpressionJIT()
+{
+	release();
+}
+
+
+void ExpressionJIT::release()
+{
+#ifdef EXPRESSIONS_JIT
+	if (m_memory)
+	{
+	#ifdef _WIN32
+		VirtualFree(m_memory, 0, MEM_RELEASE);
+	#else
+		munmap(m_memory, m_memory_size);
+	#endif
+	}
+#endif
+	m_memory = nullptr;
+	m_memory_size = 0;
+	m_scalar_function = nullptr;
+	m_batch_function = nullptr;
+}
+
+
+bool ExpressionJIT::compile(const uint8* code, int size)
+{
+	release();
+	m_program.assign(code, code + size);
+	const ProgramHeader& header = *(const ProgramHeader*)&m_program[0];
+
+	int max_slot = -1;
+	for (int i = 0; i < header.variable_count; ++i)
+	{
+		uint16 slot;
+		memcpy(&slot, header.variables() + i * sizeof(slot), sizeof(slot));
+		if (slot > max_slot) max_slot = slot;
+	}
+	m_tail_columns.assign(max_slot + 1, nullptr);
+	m_tail_rows.assign(header.variable_count * 4, 0.0f);
+	if (header.number_type != Types::FLOAT) return false;
+
+#ifdef EXPRESSIONS_JIT
+	// both functions share one allocation, the batch one starts at a 16 byte boundary
+	Jit::Emitter scalar;
+	Jit::Emitter batch;
+	if (!Jit::generate(header, false, scalar) || !Jit::generate(header, true, batch)) return false;
+
+	std::vector<uint8> image;
+	Jit::emitData(header, scalar, image);
+	int batch_offset = (int)image.size();
+	Jit::emitData(header, batch, image);
+
+	int memory_size = ((int)image.size() + 4095) & ~4095;
+	#ifdef _WIN32
+		void* memory = VirtualAlloc(nullptr, memory_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (!memory) return false;
+		memcpy(memory, &image[0], image.size());
+		DWORD old_protect;
+		if (!VirtualProtect(memory, memory_size, PAGE_EXECUTE_READ, &old_protect))
+		{
+			VirtualFree(memory, 0, MEM_RELEASE);
+			return false;
+		}
+	#else
+		void* memory =
+			mmap(nullptr, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED) return false;
+		memcpy(memory, &image[0], image.size());
+		if (mprotect(memory, memory_size, PROT_READ | PROT_EXEC) != 0)
+		{
+			munmap(memory, memory_size);
+			return false;
+		}
+	#endif
+	m_memory = memory;
+	m_memory_size = memory_size;
+	m_scalar_function = (ScalarFunction)memory;
+	m_batch_function = (BatchFunction)((uint8*)memory + batch_offset);
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+ExpressionVM::ReturnValue ExpressionJIT::evaluate(const float* inputs)
+{
+	if (!m_scalar_function) return m_vm.evaluate(&m_program[0], inputs);
+
+	float value = m_scalar_function(inputs);
+	const ProgramHeader& header = *(const ProgramHeader*)&m_program[0];
+	if (header.result_type == Types::BOOL) return ExpressionVM::ReturnValue(Simd::bits(value) != 0);
+	return ExpressionVM::ReturnValue(value);
+}
+
+
+Types ExpressionJIT::evaluateBatch(const float* const* inputs, float* output, int count)
+{
+	if (!m_batch_function) return m_vm.evaluateBatch(&m_program[0], inputs, output, count);
+
+	const ProgramHeader& header = *(const ProgramHeader*)&m_program[0];
+	int full = count & ~3;
+	m_batch_function(inputs, output, full);
+	if (full == count) return header.result_type;
+
+	// pad the last rows to a whole vector
+	for (int i = 0; i < header.variable_count; ++i)
+	{
+		uint16 slot;
+		memcpy(&slot, header.variables() + i * sizeof(slot), sizeof(slot));
+		float* rows = &m_tail_rows[i * 4];
+		for (int j = 0; j < 4; ++j) rows[j] = full + j < count ? inputs[slot][full + j] : 0;
+		m_tail_columns[slot] = rows;
+	}
+	float tail_output[4];
+	m_batch_function(m_tail_columns.empty() ? nullptr : &m_tail_columns[0], tail_output, 4);
+	memcpy(output + full, tail_output, (count - full) * sizeof(float));
+	return header.result_type;
+}
+
+
+ExpressionEngine::ExpressionEngine(int thread_count)
+	: m_generation(0)
+	, m_active(0)
+	, m_exit(false)
+	, m_programs(nullptr)
+	, m_inputs(nullptr)
+	, m_input_count(0)
+	, m_outputs(nullptr)
+{
+	if (thread_count <= 0) thread_count = (int)std::thread::hardware_concurrency();
+	if (thread_count <= 0) thread_count = 1;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		m_workers.emplace_back(new Worker);
+		m_workers.back()->begin = m_workers.back()->end = 0;
+	}
+	// worker 0 is the thread calling evaluateBatch
+	for (int i = 1; i < thread_count; ++i)
+	{
+		m_threads.emplace_back(&ExpressionEngine::threadMain, this, i);
+	}
+}
+
+
+ExpressionEngine::~ExpressionEngine()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_exit = true;
+	}
+	m_wake.notify_all();
+	for (auto& thread : m_threads) thread.join();
+}
+
+
+void ExpressionEngine::threadMain(int worker_idx)
+{
+	uint32 generation = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [&]() { return m_exit || m_generation != generation; });
+			if (m_exit) return;
+			generation = m_generation;
+			++m_active;
+		}
+		work(worker_idx);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_active;
+		}
+		m_done.notify_one();
+	}
+}
+
+
+bool ExpressionEngine::popTask(Worker& worker, bool steal, int& task)
+{
+	std::lock_guard<std::mutex> lock(worker.mutex);
+	if (worker.begin >= worker.end) return false;
+	task = steal ? worker.begin++ : --worker.end;
+	return true;
+}
+
+
+// job members are read only after a task is taken, publishing the task ranges under the worker
+// mutexes makes them visible
+void ExpressionEngine::work(int worker_idx)
+{
+	Worker& worker = *m_workers[worker_idx];
+	int workers_count = (int)m_workers.size();
+	for (;;)
+	{
+		int task_idx;
+		bool found = popTask(worker, false, task_idx);
+		for (int i = 1; !found && i < workers_count; ++i)
+		{
+			found = popTask(*m_workers[(worker_idx + i) % workers_count], true, task_idx);
+		}
+		if (!found) return;
+
+		Task& task = m_tasks[task_idx];
+		worker.columns.resize(m_input_count);
+		for (int i = 0; i < m_input_count; ++i) worker.columns[i] = m_inputs[i] + task.begin;
+		const float* const* columns = m_input_count > 0 ? &worker.columns[0] : nullptr;
+		if (!m_outputs)
+		{
+			bool success = worker.vm.aggregate(m_programs[task.program],
+				columns,
+				task.end - task.begin,
+				task.partial);
+			task.result_type = success ? Types::FLOAT : Types::NONE;
+			continue;
+		}
+		task.result_type = worker.vm.evaluateBatch(m_programs[task.program],
+			columns,
+			m_outputs[task.program] + task.begin,
+			task.end - task.begin);
+	}
+}
+
+
+// splits the current job to tasks and runs them, returns the number of tasks per program
+int ExpressionEngine::run(int program_count, int count)
+{
+	// tasks of one program are adjacent, so a worker's range covers few programs
+	int blocks = count > 0 ? (count + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+	m_tasks.resize(program_count * blocks);
+	for (int i = 0; i < (int)m_tasks.size(); ++i)
+	{
+		Task& task = m_tasks[i];
+		task.program = i / blocks;
+		task.begin = i % blocks * BLOCK_SIZE;
+		task.end = task.begin + BLOCK_SIZE < count ? task.begin + BLOCK_SIZE : count;
+		task.result_type = Types::NONE;
+		task.partial = ExpressionVM::Accumulator();
+	}
+
+	int workers_count = (int)m_workers.size();
+	int tasks_count = (int)m_tasks.size();
+	for (int i = 0; i < workers_count; ++i)
+	{
+		std::lock_guard<std::mutex> lock(m_workers[i]->mutex);
+		m_workers[i]->begin = (int)((long long)tasks_count * i / workers_count);
+		m_workers[i]->end = (int)((long long)tasks_count * (i + 1) / workers_count);
+	}
+
+	if (!m_threads.empty())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_generation;
+		}
+		m_wake.notify_all();
+	}
+	work(0);
+	// all ranges are empty now, wait for tasks still running on other workers
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [&]() { return m_active == 0; });
+	}
+	return blocks;
+}
+
+
+bool ExpressionEngine::evaluateBatch(const uint8* const* programs,
+	int program_count,
+	const float* const* inputs,
+	int input_count,
+	float* const* outputs,
+	int count,
+	Types* types)
+{
+	m_programs = programs;
+	m_inputs = inputs;
+	m_input_count = input_count;
+	m_outputs = outputs;
+	int blocks = run(program_count, count);
+
+	bool success = true;
+	for (int i = 0; i < program_count; ++i)
+	{
+		types[i] = m_tasks[i * blocks].result_type;
+		for (int j = 1; j < blocks; ++j)
+		{
+			if (m_tasks[i * blocks + j].result_type != types[i]) types[i] = Types::NONE;
+		}
+		success = success && types[i] != Types::NONE;
+	}
+	return success;
+}
+
+
+bool ExpressionEngine::aggregate(const uint8* const* programs,
+	int program_count,
+	const float* const* inputs,
+	int input_count,
+	int count,
+	ExpressionVM::Accumulator* results)
+{
+	m_programs = programs;
+	m_inputs = inputs;
+	m_input_count = input_count;
+	m_outputs = nullptr;
+	int blocks = run(program_count, count);
+
+	// partials are merged in row order, so the result does not depend on the scheduling
+	bool success = true;
+	for (int i = 0; i < program_count; ++i)
+	{
+		results[i] = ExpressionVM::Accumulator();
+		for (int j = 0; j < blocks; ++j)
+		{
+			const Task& task = m_tasks[i * blocks + j];
+			success = success && task.result_type != Types::NONE;
+			results[i].merge(task.partial);
+		}
+	}
+	return success;
+}
+
+
+ExpressionGraph::ExpressionGraph(int slot_count)
+	: m_slots(slot_count > 0 ? slot_count : 1, 0.0f)
+	, m_readers(slot_count > 0 ? slot_count : 1)
+	, m_writers(slot_count > 0 ? slot_count : 1, -1)
+	, m_order_valid(true)
+	, m_dirty_count(0)
+{
+	resetStats();
+}
+
+
+int ExpressionGraph::add(const uint8* code, int output_slot)
+{
+	const ProgramHeader& header = *(const ProgramHeader*)code;
+	int slot_count = (int)m_slots.size();
+	std::vector<uint16> reads(header.variable_count);
+	if (header.variable_count > 0)
+	{
+		memcpy(&reads[0], header.variables(), header.variable_count * sizeof(uint16));
+	}
+	for (uint16 slot : reads)
+	{
+		if (slot >= slot_count || slot == output_slot) return -1;
+	}
+	if (output_slot != NO_SLOT)
+	{
+		if (output_slot < 0 || output_slot >= slot_count || m_writers[output_slot] >= 0) return -1;
+
+		// a cycle exists if the program reads anything computed from its own output
+		std::vector<uint8> visited(slot_count, 0);
+		std::vector<int> stack(1, output_slot);
+		visited[output_slot] = 1;
+		while (!stack.empty())
+		{
+			int slot = stack.back();
+			stack.pop_back();
+			for (int reader : m_readers[slot])
+			{
+				int written = m_programs[reader].output_slot;
+				if (written == NO_SLOT || visited[written]) continue;
+				if (std::find(reads.begin(), reads.end(), written) != reads.end()) return -1;
+				visited[written] = 1;
+				stack.push_back(written);
+			}
+		}
+	}
+
+	Program program;
+	if (!m_vm.decode(code, program.decoded)) return -1;
+	program.output_slot = output_slot;
+	program.dirty = true;
+	int idx = (int)m_programs.size();
+	m_programs.push_back(program);
+	for (uint16 slot : reads) m_readers[slot].push_back(idx);
+	if (output_slot != NO_SLOT) m_writers[output_slot] = idx;
+	++m_dirty_count;
+	m_order_valid = false;
+	return idx;
+}
+
+
+void ExpressionGraph::markReaders(int slot)
+{
+	for (int reader : m_readers[slot])
+	{
+		Program& program = m_programs[reader];
+		if (program.dirty) continue;
+		program.dirty = true;
+		++m_dirty_count;
+	}
+}
+
+
+void ExpressionGraph::set(int slot, float value)
+{
+	// bitwise, so NaN == NaN and 0 != -0
+	if (memcmp(&m_slots[slot], &value, sizeof(value)) == 0) return;
+	m_slots[slot] = value;
+	markReaders(slot);
+}
+
+
+// Kahn's algorithm, add() rejects cycles, so every program gets into the order
+void ExpressionGraph::sort()
+{
+	int count = (int)m_programs.size();
+	std::vector<int> pending(count, 0);
+	for (int i = 0; i < count; ++i)
+	{
+		for (uint16 slot : m_programs[i].decoded.variables)
+		{
+			if (m_writers[slot] >= 0) ++pending[i];
+		}
+	}
+	m_order.clear();
+	for (int i = 0; i < count; ++i)
+	{
+		if (pending[i] == 0) m_order.push_back(i);
+	}
+	for (int i = 0; i < (int)m_order.size(); ++i)
+	{
+		int slot = m_programs[m_order[i]].output_slot;
+		if (slot == NO_SLOT) continue;
+		for (int reader : m_readers[slot])
+		{
+			if (--pending[reader] == 0) m_order.push_back(reader);
+		}
+	}
+	m_order_valid = true;
+}
+
+
+int ExpressionGraph::update()
+{
+	++m_stats.updates;
+	if (!m_order_valid) sort();
+	int evaluated = 0;
+	for (int i = 0; i < (int)m_order.size() && m_dirty_count > 0; ++i)
+	{
+		Program& program = m_programs[m_order[i]];
+		if (!program.dirty) continue;
+
+		program.result = m_vm.evaluate(program.decoded, &m_slots[0]);
+		program.dirty = false;
+		--m_dirty_count;
+		++evaluated;
+		if (program.output_slot != NO_SLOT)
+		{
+			bool boolean = program.result.type == Types::BOOL;
+			float value = boolean ? (program.result.b_value ? 1.0f : 0.0f) : program.result.f_value;
+			set(program.output_slot, value);
+		}
+	}
+	m_stats.evaluated += evaluated;
+	m_stats.skipped += (uint32)m_programs.size() - evaluated;
+	return evaluated;
+}
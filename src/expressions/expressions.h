@@ -0,0 +1,1438 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#if defined(__AVX__)
+	#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86_FP) && _M_IX86_FP >= 2
+	#include <emmintrin.h>
+	#define EXPRESSIONS_SSE2
+#endif
+
+// native code generation in ExpressionJIT, otherwise it falls back to ExpressionVM
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(EXPRESSIONS_NO_JIT)
+	#define EXPRESSIONS_JIT
+#endif
+
+// define EXPRESSIONS_PROFILER to build ExpressionVM with the hooks of ExpressionProfiler
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	#include <intrin.h>
+#endif
+
+typedef unsigned char uint8;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
+typedef long long int64;
+typedef unsigned long long uint64;
+
+#ifdef _MSC_VER
+	#define ALIGN_16 __declspec(align(16))
+#else
+	#define ALIGN_16 __attribute__((aligned(16)))
+#endif
+
+
+enum class Types : uint8
+{
+	FLOAT,
+	BOOL,
+	DOUBLE, // number type of programs compiled by ExpressionCompiler::setNumberType()
+	INT64,
+
+	NONE
+};
+
+
+// Accuracy of the builtin math functions in batch evaluation, see
+// ExpressionCompiler::setMathTier(). Maximum errors are measured against double precision over all
+// floats. Arguments the polynomials do not cover (|x| >= 4096 for sin and cos, x outside (-87, 88)
+// for exp, zero, subnormals, negative numbers and infinity for log, NaN) are computed by <cmath>
+// in every tier.
+enum class MathTier : uint8
+{
+	STANDARD, // <cmath> for every row, the same results as the scalar evaluation
+	PRECISE, // SIMD polynomials, sin and cos 3 ulp, exp and log 1 ulp, sqrt correctly rounded
+	FAST // lower degree SIMD polynomials, sin and cos 27 ulp, exp 70 ulp, log 207 ulp
+};
+
+
+// Reducer of programs compiled by ExpressionCompiler::compileAggregate()
+enum class Aggregate : uint8
+{
+	NONE, // not an aggregation
+	SUM,
+	MIN,
+	MAX,
+	AVG,
+	COUNT
+};
+
+
+// Every instruction is 4 bytes: opcode, destination register, register a, register b
+namespace Instruction
+{
+	enum Type : uint8
+	{
+		ADD_FLOAT, // dst = a + b
+		SUB_FLOAT, // dst = a - b
+		MUL_FLOAT, // dst = a * b
+		DIV_FLOAT, // dst = a / b
+		UNARY_MINUS, // dst = -a
+		FLOAT_LT, // dst = a < b
+		FLOAT_GT, // dst = a > b
+		AND, // dst = a and b
+		OR, // dst = a or b
+		CALL, // dst = function b (a, a + 1, ...), arguments are in consecutive registers
+		RET_FLOAT, // return a
+		RET_BOOL, // return a
+		JUMP_IF_FALSE, // if a is false skip next b instructions
+		JUMP_IF_TRUE, // if a is true skip next b instructions
+		MOVE, // dst = a
+		STORE_FLOAT, // results[b] = a, only in programs of ExpressionCompiler::compileShared()
+		STORE_BOOL, // results[b] = a ? 1.0f : 0.0f
+
+		// Superinstructions created by ExpressionCompiler::peephole(), they take two slots, the
+		// second one is OPERAND with the remaining operands, so fusing keeps jump offsets
+		MUL_ADD_FLOAT, // dst = a * b + c, c is a of OPERAND, rounded like MUL and ADD
+		FLOAT_LT_JUMP_IF_FALSE, // dst = a < b, if false skip next n instructions, n is b of OPERAND
+		FLOAT_LT_JUMP_IF_TRUE, // dst = a < b, if true skip next n instructions
+		FLOAT_GT_JUMP_IF_FALSE, // dst = a > b, if false skip next n instructions
+		FLOAT_GT_JUMP_IF_TRUE, // dst = a > b, if true skip next n instructions
+		OPERAND, // never executed
+
+		COUNT
+	};
+
+	static const int SIZE = 4;
+
+	// name of the enum value, nullptr past COUNT
+	const char* getName(uint8 type);
+}
+
+
+// Compiled program starts with this header, followed by
+//   constants[constant_count], float, double or int64 by number_type
+//   uint16 variables[variable_count], input slots, padded to 4 bytes
+//   instructions
+// Registers [0, constant_count) hold the constants, next variable_count registers hold the
+// variables, the rest are temporaries. Instructions are the same for all number types, FLOAT in
+// their names means the number type of the program.
+struct ProgramHeader
+{
+	uint8 register_count;
+	uint8 constant_count;
+	uint8 variable_count;
+	Types result_type; // BOOL or number_type
+	Types number_type;
+	MathTier math_tier; // used only by batch evaluation
+	Aggregate aggregate;
+	uint8 padding;
+
+	static int getNumberSize(Types type) { return type == Types::FLOAT ? sizeof(float) : 8; }
+	const uint8* constants() const { return (const uint8*)(this + 1); }
+	const uint8* variables() const
+	{
+		return constants() + constant_count * getNumberSize(number_type);
+	}
+	const uint8* instructions() const
+	{
+		return variables() + ((variable_count * sizeof(uint16) + 3) & ~3);
+	}
+};
+
+
+// Bump allocator for the scratch memory of ExpressionCompiler::compile(). Memory comes from chunks
+// allocated as needed, each at least as large as all previous ones together. reset() releases
+// everything at once and merges the chunks into one, so an arena reused across compiles stops
+// allocating once it has held the largest one.
+class ExpressionArena
+{
+public:
+	explicit ExpressionArena(int chunk_size = 4096);
+	~ExpressionArena();
+
+	// `align` is a power of two, the memory is valid until reset()
+	void* allocate(size_t size, size_t align);
+	template <typename T> T* allocate(int count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "Destructors are never called");
+		return (T*)allocate(count * sizeof(T), alignof(T));
+	}
+	void reset();
+	size_t getCapacity() const { return m_capacity; }
+	// chunks allocated from the heap since construction
+	int getHeapAllocations() const { return m_heap_allocations; }
+
+private:
+	struct Chunk
+	{
+		Chunk* next;
+		size_t size; // of the data following the chunk
+	};
+
+	ExpressionArena(const ExpressionArena&);
+	void operator=(const ExpressionArena&);
+	bool addChunk(size_t size);
+	void freeChunks();
+
+private:
+	Chunk* m_chunks;
+	uint8* m_cursor;
+	uint8* m_end;
+	size_t m_chunk_size;
+	size_t m_capacity;
+	int m_heap_allocations;
+};
+
+
+class ExpressionCompiler
+{
+public:
+	struct Token
+	{
+		enum Type
+		{
+			EMPTY,
+			NUMBER,
+			OPERATOR,
+			IDENTIFIER,
+			FUNCTION,
+			LEFT_PARENTHESIS,
+			RIGHT_PARENTHESIS,
+			COMMA,
+			BOOLEAN // only created by optimize(), `number` is 1 for true, 0 for false
+		};
+		Type type;
+
+		enum Operator
+		{
+			ADD,
+			MULTIPLY,
+			DIVIDE,
+			SUBTRACT,
+			UNARY_MINUS,
+			LESS_THAN,
+			GREATER_THAN,
+			AND,
+			OR
+		};
+
+		int offset;
+		int size;
+
+		float number;
+		Operator oper;
+		uint16 function; // FunctionRegistry index of FUNCTION tokens
+	};
+
+
+	enum class Error
+	{
+		NONE,
+		UNKNOWN_IDENTIFIER,
+		MISSING_LEFT_PARENTHESIS,
+		MISSING_RIGHT_PARENTHESIS,
+		UNEXPECTED_CHAR,
+		OUT_OF_MEMORY,
+		MISSING_BINARY_OPERAND,
+		NOT_ENOUGH_PARAMETERS,
+		INCORRECT_TYPE_ARGS,
+		TOO_MANY_PARAMETERS
+	};
+
+	public:
+	ExpressionCompiler();
+
+	void setVariables(const char* const* names, int count);
+	// Types::FLOAT (default), Types::DOUBLE or Types::INT64, programs of other types than FLOAT
+	// are evaluated by TypedExpressionVM. Their numbers are parsed from the source in full
+	// precision, optimize() leaves them untouched.
+	void setNumberType(Types type) { m_number_type = type; }
+	Types getNumberType() const { return m_number_type; }
+	// accuracy of the builtin math functions when the programs are evaluated in batches, the
+	// scalar evaluation always uses <cmath>, MathTier::STANDARD by default
+	void setMathTier(MathTier tier) { m_math_tier = tier; }
+	MathTier getMathTier() const { return m_math_tier; }
+	int tokenize(const char* src, Token* tokens, int max_size);
+	int compile(const char* src,
+		const Token* tokens,
+		int token_count,
+		uint8* byte_code,
+		int max_size);
+	int toPostfix(const Token* input, Token* output, int count);
+	// Compiles `src` in a single pass, the parser emits the instructions while it reads the
+	// tokens, and copies the fused program to `byte_code`. The program, the error and its offset
+	// are the same as those of tokenize(), toPostfix(), optimize(), compile() and peephole(). The
+	// scratch memory comes from `arena`, which is reset first. No limit but the register count
+	// applies to the size of the source, and nothing is allocated once the arena and `byte_code`
+	// have grown to the largest source. Returns the size of the program or -1, getError() tells
+	// why.
+	int compile(const char* src, ExpressionArena& arena, std::vector<uint8>& byte_code);
+	// Folds constant subexpressions and prunes and/or branches known at compile time, `tokens` are
+	// in postfix notation and are rewritten in place. Returns the new token count. Invalid input is
+	// left untouched from the first error on, compile() reports it.
+	int optimize(const char* src, Token* tokens, int count);
+	// Fuses instruction pairs of a compiled program into superinstructions in place, the program
+	// size does not change. Returns the number of fused pairs.
+	int peephole(uint8* byte_code, int size);
+	ExpressionCompiler::Error getError() const { return m_compile_time_error; }
+	// identifies the compile settings (variable table, registered functions), programs compiled
+	// from the same source with the same signature are identical
+	uint32 getSignature() const;
+	// Compiles `sources` and writes them to `out` as a program file, see ProgramFile. Returns the
+	// size of the file or -1 if any source fails to compile, getError() tells why.
+	int serialize(const char* const* sources, int count, std::vector<uint8>& out);
+	// Compiles `sources` and writes them to `out` as a C++ translation unit to build with the
+	// application. Every source becomes an inline function and a batch loop the compiler can
+	// vectorize, looked up by `names[i]` with `name_space::find()`, see TranspiledExpression. Names
+	// must be distinct C++ identifiers, otherwise the error is UNEXPECTED_CHAR. Only float programs
+	// are supported. Returns the size of `out` or -1, getError() tells why.
+	int transpile(const char* name_space,
+		const char* const* names,
+		const char* const* sources,
+		int count,
+		std::string& out);
+	// Compiles `sources` to one program which computes every distinct subexpression once per row
+	// and stores the result of sources[i] to results[i], see ExpressionVM::evaluate(). Both
+	// operands of and/or are always computed, since they can be shared. types[i] is the type of
+	// sources[i], at most MAX_SHARED_RESULTS sources. Returns the size of the program written to
+	// `byte_code` or -1, getError() tells why.
+	int compileShared(const char* const* sources,
+		int count,
+		std::vector<uint8>& byte_code,
+		Types* types);
+	// Compiles `reducer(expression)` or `reducer(expression) where predicate`, reducer is sum, min,
+	// max, avg or count, count takes a boolean expression. The program is a compileShared() program
+	// of the expression and the predicate, evaluate it by ExpressionVM::aggregate(). Returns the
+	// size of the program written to `byte_code` or -1, getError() tells why.
+	int compileAggregate(const char* src, std::vector<uint8>& byte_code);
+
+	static const int MAX_SHARED_RESULTS = 256;
+
+
+private:
+	struct Parser;
+
+	static int getOperatorPriority(const Token& token);
+	// Reads the token at `c` and moves `c` past it, the token is EMPTY at the end of the source.
+	// `binary` is true if the previous token can be the left operand of a binary operator.
+	bool scanToken(const char* src, const char*& c, bool& binary, Token& token);
+	// compile() through the stages, for sources the single pass parser cannot hold
+	int compileStages(const char* src, ExpressionArena& arena, std::vector<uint8>& byte_code);
+	// `stack` and `comma_counts` have room for `count` entries
+	int toPostfix(const Token* input, Token* output, int count, Token* stack, int* comma_counts);
+	// `is_target` has room for size / Instruction::SIZE entries
+	int peephole(uint8* byte_code, int size, uint8* is_target);
+
+
+	static bool isTokenEqual(const char* src,
+		const ExpressionCompiler::Token& token,
+		const char* name)
+	{
+		return strncmp(src + token.offset, name, token.size) == 0 && name[token.size] == '\0';
+	}
+
+
+	static uint16 getFunctionIdx(const char* src, const ExpressionCompiler::Token& token);
+
+
+	uint16 getVariableIdx(const char* src, const ExpressionCompiler::Token& token) const
+	{
+		for(int i = 0; i < m_variables_count; ++i)
+		{
+			if(isTokenEqual(src, token, m_variables[i])) return i;
+		}
+		return 0xffFF;
+	}
+
+
+	static bool getConstValue(const char* src, const ExpressionCompiler::Token& token, float& value)
+	{
+		double double_value;
+		if (!getConstValue(src, token, double_value)) return false;
+		value = (float)double_value;
+		return true;
+	}
+
+
+	static bool getConstValue(const char* src,
+		const ExpressionCompiler::Token& token,
+		double& value)
+	{
+		static const struct { const char* name; double value; } CONSTS[] =
+		{
+			{"PI", 3.14159265358979323846}
+		};
+		for(const auto& i : CONSTS)
+		{
+			if(isTokenEqual(src, token, i.name))
+			{
+				value = i.value;
+				return true;
+			}
+		}
+		return false;
+	}
+
+
+	// bits of the NUMBER or IDENTIFIER constant `token` in the number type, 0 extended
+	bool getNumber(const char* src, const Token& token, uint64& bits);
+
+
+private:
+	// compileAndRun reports compilers of other number types
+	friend class ExpressionVM;
+
+	ExpressionCompiler::Error m_compile_time_error;
+	int m_compile_time_offset;
+	const char* const* m_variables;
+	int m_variables_count;
+	uint32 m_variables_hash;
+	Types m_number_type;
+	MathTier m_math_tier;
+};
+
+
+// Bounded LRU cache of compiled programs keyed by source text and compiler signature. All methods
+// are thread safe, so one cache can be shared by many VMs. Programs are copied out of the cache,
+// so an entry evicted by another thread never invalidates a program being evaluated.
+class ExpressionCache
+{
+public:
+	struct Stats
+	{
+		int hits;
+		int misses;
+		int evictions;
+	};
+
+public:
+	explicit ExpressionCache(int capacity);
+
+	// copies the cached program to `byte_code` and returns its size, returns 0 if not found
+	int get(const char* src, uint32 signature, uint8* byte_code, int max_size);
+	// copies the cached program to `byte_code`, which grows only if it is too small
+	int get(const char* src, uint32 signature, std::vector<uint8>& byte_code);
+	void put(const char* src, uint32 signature, const uint8* byte_code, int size);
+	Stats getStats() const;
+
+private:
+	struct Entry
+	{
+		uint32 hash;
+		uint32 signature;
+		std::string src;
+		std::vector<uint8> byte_code;
+		int prev;
+		int next;
+	};
+
+	void unlink(int idx);
+	void pushFront(int idx);
+	// the entry of `src` or nullptr, m_mutex must be locked
+	Entry* find(const char* src, uint32 signature);
+
+private:
+	mutable std::mutex m_mutex;
+	int m_capacity;
+	std::vector<Entry> m_entries;
+	std::unordered_map<uint32, int> m_map;
+	int m_most_recent;
+	int m_least_recent;
+	Stats m_stats;
+};
+
+
+// Precompiled programs written by ExpressionCompiler::serialize(), all integers are little endian:
+//   ProgramFileHeader
+//   ProgramFileEntry entries[program_count], in the order of the sources
+//   uint32 lookup[program_count], entry indices sorted by source hash
+//   programs, each aligned to ProgramFileHeader::ALIGNMENT
+//   sources, zero terminated
+// Programs are executed in place, so a mapped file is ready to use once the header is validated.
+struct ProgramFileHeader
+{
+	static const uint32 MAGIC = 0x52505845; // "EXPR"
+	// bump when the layout, the opcodes or the program header change
+	static const uint16 VERSION = 4;
+	static const int ALIGNMENT = 4;
+
+	uint32 magic;
+	uint16 version;
+	uint16 header_size;
+	uint32 file_size;
+	uint32 checksum; // of everything after the header
+	uint32 signature; // ExpressionCompiler::getSignature() of the compiler which wrote the file
+	uint32 program_count;
+};
+
+
+struct ProgramFileEntry
+{
+	uint32 source_hash;
+	uint32 source_offset;
+	uint32 program_offset;
+	uint32 program_size;
+};
+
+
+// Read only view of a program file, either memory mapped by open(path) or borrowed from the
+// caller. Opening validates the header, the offsets and the checksum, it does not copy or parse
+// programs. Program files are trusted, the bytecode itself is not verified.
+class ProgramFile
+{
+public:
+	enum class Error
+	{
+		NONE,
+		CANNOT_OPEN,
+		INVALID_FORMAT,
+		UNSUPPORTED_VERSION,
+		CHECKSUM_MISMATCH
+	};
+
+public:
+	ProgramFile();
+	~ProgramFile();
+
+	bool open(const char* path);
+	// `data` must stay valid and unchanged until close()
+	bool open(const void* data, int size);
+	void close();
+	Error getError() const { return m_error; }
+
+	uint32 getSignature() const { return header().signature; }
+	int getCount() const { return m_data ? header().program_count : 0; }
+	const uint8* getProgram(int idx) const { return m_data + entries()[idx].program_offset; }
+	int getProgramSize(int idx) const { return entries()[idx].program_size; }
+	const char* getSource(int idx) const
+	{
+		return (const char*)m_data + entries()[idx].source_offset;
+	}
+	// returns the index of the program compiled from `src` or -1
+	int find(const char* src) const;
+
+private:
+	ProgramFile(const ProgramFile&);
+	void operator=(const ProgramFile&);
+	bool validate();
+	const ProgramFileHeader& header() const { return *(const ProgramFileHeader*)m_data; }
+	const ProgramFileEntry* entries() const
+	{
+		return (const ProgramFileEntry*)(m_data + sizeof(ProgramFileHeader));
+	}
+	const uint32* lookup() const { return (const uint32*)(entries() + header().program_count); }
+
+private:
+	const uint8* m_data;
+	int m_size;
+	bool m_mapped;
+	Error m_error;
+};
+
+
+// Kernels used by the batch evaluation, unless noted otherwise they process `count` floats,
+// where `count` is a multiple of Simd::WIDTH. Booleans are stored as masks (all bits set for
+// true) in float sized slots, so comparisons and logical operators map to single SIMD
+// instructions.
+namespace Simd
+{
+	inline uint32 bits(float f) { uint32 u; memcpy(&u, &f, sizeof(u)); return u; }
+	inline float mask(uint32 u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+
+
+	// minimum() and maximum() return `b` if either is NaN. andNot(a, b) is ~a & b. nearest() rounds
+	// to the nearest integer, ties to even, for |a| < 2^31. toBits() reinterprets the integer value
+	// of `a` as float bits, fromBits() is its inverse. ordered() is the mask of the lanes that are
+	// not NaN.
+#if defined(__AVX__)
+	static const int WIDTH = 8;
+	typedef __m256 Vec;
+	inline Vec load(const float* p) { return _mm256_loadu_ps(p); }
+	inline void store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+	inline Vec splat(float f) { return _mm256_set1_ps(f); }
+	inline Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+	inline Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+	inline Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+	inline Vec div(Vec a, Vec b) { return _mm256_div_ps(a, b); }
+	inline Vec lt(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	inline Vec gt(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	inline Vec ordered(Vec a) { return _mm256_cmp_ps(a, a, _CMP_ORD_Q); }
+	inline Vec logicAnd(Vec a, Vec b) { return _mm256_and_ps(a, b); }
+	inline Vec logicOr(Vec a, Vec b) { return _mm256_or_ps(a, b); }
+	inline Vec neg(Vec a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+	inline int movemask(Vec a) { return _mm256_movemask_ps(a); }
+	inline Vec minimum(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+	inline Vec maximum(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+	inline Vec andNot(Vec a, Vec b) { return _mm256_andnot_ps(a, b); }
+	inline Vec sqrt(Vec a) { return _mm256_sqrt_ps(a); }
+	inline Vec nearest(Vec a)
+	{
+		return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	}
+	inline Vec toBits(Vec a) { return _mm256_castsi256_ps(_mm256_cvtps_epi32(a)); }
+	inline Vec fromBits(Vec a) { return _mm256_cvtepi32_ps(_mm256_castps_si256(a)); }
+#elif defined(EXPRESSIONS_SSE2)
+	static const int WIDTH = 4;
+	typedef __m128 Vec;
+	inline Vec load(const float* p) { return _mm_loadu_ps(p); }
+	inline void store(float* p, Vec v) { _mm_storeu_ps(p, v); }
+	inline Vec splat(float f) { return _mm_set1_ps(f); }
+	inline Vec add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+	inline Vec sub(Vec a, Vec b) { return _mm_sub_ps(a, b); }
+	inline Vec mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+	inline Vec div(Vec a, Vec b) { return _mm_div_ps(a, b); }
+	inline Vec lt(Vec a, Vec b) { return _mm_cmplt_ps(a, b); }
+	inline Vec gt(Vec a, Vec b) { return _mm_cmpgt_ps(a, b); }
+	inline Vec ordered(Vec a) { return _mm_cmpord_ps(a, a); }
+	inline Vec logicAnd(Vec a, Vec b) { return _mm_and_ps(a, b); }
+	inline Vec logicOr(Vec a, Vec b) { return _mm_or_ps(a, b); }
+	inline Vec neg(Vec a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+	inline int movemask(Vec a) { return _mm_movemask_ps(a); }
+	inline Vec minimum(Vec a, Vec b) { return _mm_min_ps(a, b); }
+	inline Vec maximum(Vec a, Vec b) { return _mm_max_ps(a, b); }
+	inline Vec andNot(Vec a, Vec b) { return _mm_andnot_ps(a, b); }
+	inline Vec sqrt(Vec a) { return _mm_sqrt_ps(a); }
+	inline Vec nearest(Vec a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+	inline Vec toBits(Vec a) { return _mm_castsi128_ps(_mm_cvtps_epi32(a)); }
+	inline Vec fromBits(Vec a) { return _mm_cvtepi32_ps(_mm_castps_si128(a)); }
+#else
+	static const int WIDTH = 1;
+	typedef float Vec;
+	inline Vec load(const float* p) { return *p; }
+	inline void store(float* p, Vec v) { *p = v; }
+	inline Vec splat(float f) { return f; }
+	inline Vec add(Vec a, Vec b) { return a + b; }
+	inline Vec sub(Vec a, Vec b) { return a - b; }
+	inline Vec mul(Vec a, Vec b) { return a * b; }
+	inline Vec div(Vec a, Vec b) { return a / b; }
+	inline Vec lt(Vec a, Vec b) { return mask(a < b ? 0xffFFffFF : 0); }
+	inline Vec gt(Vec a, Vec b) { return mask(a > b ? 0xffFFffFF : 0); }
+	inline Vec ordered(Vec a) { return mask(a == a ? 0xffFFffFF : 0); }
+	inline Vec logicAnd(Vec a, Vec b) { return mask(bits(a) & bits(b)); }
+	inline Vec logicOr(Vec a, Vec b) { return mask(bits(a) | bits(b)); }
+	inline Vec neg(Vec a) { return -a; }
+	inline int movemask(Vec a) { return bits(a) >> 31; }
+	inline Vec minimum(Vec a, Vec b) { return a < b ? a : b; }
+	inline Vec maximum(Vec a, Vec b) { return a > b ? a : b; }
+	inline Vec andNot(Vec a, Vec b) { return mask(~bits(a) & bits(b)); }
+	inline Vec sqrt(Vec a) { return std::sqrt(a); }
+	inline Vec nearest(Vec a) { return std::nearbyint(a); }
+	inline Vec toBits(Vec a) { return mask((uint32)(int)a); }
+	inline Vec fromBits(Vec a) { return (float)(int)bits(a); }
+#endif
+
+
+	inline Vec select(Vec mask, Vec a, Vec b)
+	{
+		return logicOr(logicAnd(mask, a), andNot(mask, b));
+	}
+	inline Vec abs(Vec a) { return andNot(splat(-0.0f), a); }
+
+
+	template <Vec (*OP)(Vec, Vec)>
+	void binary(float* out, const float* a, const float* b, int count)
+	{
+		for (int i = 0; i < count; i += WIDTH)
+		{
+			store(out + i, OP(load(a + i), load(b + i)));
+		}
+	}
+
+
+	inline void mulAdd(float* out, const float* a, const float* b, const float* c, int count)
+	{
+		for (int i = 0; i < count; i += WIDTH)
+		{
+			store(out + i, add(mul(load(a + i), load(b + i)), load(c + i)));
+		}
+	}
+
+
+	inline void negate(float* out, const float* a, int count)
+	{
+		for (int i = 0; i < count; i += WIDTH) store(out + i, neg(load(a + i)));
+	}
+
+
+	inline void fill(float* out, float value, int count)
+	{
+		Vec v = splat(value);
+		for (int i = 0; i < count; i += WIDTH) store(out + i, v);
+	}
+
+
+	inline bool anyTrue(const float* a, int count)
+	{
+		for (int i = 0; i < count; i += WIDTH)
+		{
+			if (movemask(load(a + i))) return true;
+		}
+		return false;
+	}
+
+
+	inline bool allTrue(const float* a, int count)
+	{
+		for (int i = 0; i < count; i += WIDTH)
+		{
+			if (movemask(load(a + i)) != (1 << WIDTH) - 1) return false;
+		}
+		return true;
+	}
+
+
+	// converts masks to 1.0f / 0.0f, `count` does not have to be a multiple of WIDTH
+	inline void maskToFloat(float* out, const float* a, int count)
+	{
+		Vec one = splat(1.0f);
+		int i = 0;
+		for (; i + WIDTH <= count; i += WIDTH) store(out + i, logicAnd(load(a + i), one));
+		for (; i < count; ++i) out[i] = bits(a[i]) ? 1.0f : 0.0f;
+	}
+
+
+	// Booleans packed to bits for ExpressionVM::filter(), row i is bit i % 64 of bits[i / 64],
+	// words are filled up to `count` rounded up to 64 rows
+	template <Vec (*OP)(Vec, Vec)>
+	void compareBits(uint64* out, const float* a, const float* b, int count)
+	{
+		for (int word = 0; word * 64 < count; ++word)
+		{
+			uint64 value = 0;
+			for (int i = 0; i < 64 && word * 64 + i < count; i += WIDTH)
+			{
+				int row = word * 64 + i;
+				value |= (uint64)movemask(OP(load(a + row), load(b + row))) << i;
+			}
+			out[word] = value;
+		}
+	}
+
+
+	inline Vec isTrue(Vec a, Vec) { return a; }
+
+
+	inline void maskToBits(uint64* out, const float* a, int count)
+	{
+		compareBits<isTrue>(out, a, a, count);
+	}
+
+
+	inline void bitsToMask(float* out, const uint64* bits, int count)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			out[i] = mask((bits[i >> 6] >> (i & 63) & 1) ? 0xffFFffFF : 0);
+		}
+	}
+
+
+	// Builtin math functions of the batch evaluation, `count` does not have to be a multiple of
+	// WIDTH and `out` can be `a`. MathTier::STANDARD calls <cmath> for every value.
+	void sin(float* out, const float* a, int count, MathTier tier);
+	void cos(float* out, const float* a, int count, MathTier tier);
+	void exp(float* out, const float* a, int count, MathTier tier);
+	void log(float* out, const float* a, int count, MathTier tier);
+	void sqrt(float* out, const float* a, int count, MathTier tier);
+}
+
+
+// Native functions callable from expressions, e.g.
+//   static float clamp(float x, float lo, float hi) { ... }
+//   FunctionRegistry::add("clamp", &clamp);
+// Arity and argument types are deduced from the signature, float and bool are supported.
+// Programs refer to functions by index, so register them at startup, before anything is compiled
+// or evaluated, and in the same order in every process sharing compiled programs. The builtins sin,
+// cos, exp, log and sqrt are always registered first, in this order.
+class FunctionRegistry
+{
+public:
+	static const int MAX_ARGS = 4;
+	static const int MAX_FUNCTIONS = 256;
+	static const uint16 INVALID_INDEX = 0xffFF;
+
+	typedef void (*GenericFunction)();
+	// calls `function` with `args`, booleans are passed and returned as masks
+	typedef float (*Invoker)(GenericFunction function, const float* args);
+
+	struct Function
+	{
+		float call(const float* args) const { return invoke(function, args); }
+
+		std::string name;
+		Invoker invoke;
+		GenericFunction function;
+		// set for float(float) functions, batch evaluation calls it directly
+		float (*unary)(float);
+		// set for the builtin math functions, batch evaluation calls it instead of `unary`
+		void (*batch)(float* out, const float* a, int count, MathTier tier);
+		Types ret_type;
+		Types args[MAX_ARGS];
+		int arity;
+		// pure functions depend only on their arguments, so calls with constant arguments are
+		// folded
+		bool pure;
+	};
+
+	// returns the index of the function or INVALID_INDEX if the name is taken or the registry
+	// is full
+	template <typename R, typename... Args>
+	static uint16 add(const char* name, R (*function)(Args...), bool pure = true);
+	static uint16 find(const char* name, int size);
+	static const Function& get(uint16 idx) { return getTable().functions[idx]; }
+	static int getCount() { return getTable().count; }
+
+private:
+	template <int... I> struct IndexList {};
+	template <int N, int... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+	template <int... I> struct MakeIndexList<0, I...>
+	{
+		typedef IndexList<I...> Type;
+	};
+
+	template <typename T> struct Arg
+	{
+		static_assert(sizeof(T) == 0, "Only float and bool arguments are supported");
+	};
+
+	template <typename R, typename... Args> struct Call
+	{
+		template <int... I>
+		static float call(GenericFunction function, const float* args, IndexList<I...>)
+		{
+			R (*fn)(Args...) = (R (*)(Args...))function;
+			return Arg<R>::toRegister(fn(Arg<Args>::fromRegister(args[I])...));
+		}
+
+		static float invoke(GenericFunction function, const float* args)
+		{
+			return call(function, args, typename MakeIndexList<sizeof...(Args)>::Type());
+		}
+	};
+
+	static float (*getUnary(float (*function)(float)))(float) { return function; }
+	template <typename F> static float (*getUnary(F))(float) { return nullptr; }
+
+	// open addressing, buckets hold function index + 1, 0 is empty
+	struct Table
+	{
+		Table();
+
+		Function functions[MAX_FUNCTIONS];
+		uint16 buckets[MAX_FUNCTIONS * 2];
+		int count;
+	};
+
+	template <typename R, typename... Args>
+	static Function makeFunction(R (*function)(Args...), bool pure);
+	static uint16 insert(Table& table, const char* name, const Function& function);
+	static Table& getTable();
+};
+
+
+template <> struct FunctionRegistry::Arg<float>
+{
+	static const Types type = Types::FLOAT;
+	static float fromRegister(float value) { return value; }
+	static float toRegister(float value) { return value; }
+};
+
+
+template <> struct FunctionRegistry::Arg<bool>
+{
+	static const Types type = Types::BOOL;
+	static bool fromRegister(float value) { return Simd::bits(value) != 0; }
+	static float toRegister(bool value) { return Simd::mask(value ? 0xffFFffFF : 0); }
+};
+
+
+template <typename R, typename... Args>
+FunctionRegistry::Function FunctionRegistry::makeFunction(R (*function)(Args...), bool pure)
+{
+	static_assert(sizeof...(Args) <= MAX_ARGS, "Too many arguments");
+
+	Function fn;
+	fn.invoke = &Call<R, Args...>::invoke;
+	fn.function = (GenericFunction)function;
+	fn.unary = getUnary(function);
+	fn.batch = nullptr;
+	fn.ret_type = Arg<R>::type;
+	const Types arg_types[] = {Arg<Args>::type..., Types::NONE};
+	for (int i = 0; i < MAX_ARGS; ++i)
+	{
+		fn.args[i] = i < (int)sizeof...(Args) ? arg_types[i] : Types::NONE;
+	}
+	fn.arity = sizeof...(Args);
+	fn.pure = pure;
+	return fn;
+}
+
+
+template <typename R, typename... Args>
+uint16 FunctionRegistry::add(const char* name, R (*function)(Args...), bool pure)
+{
+	return insert(getTable(), name, makeFunction(function, pure));
+}
+
+
+// Opcode and program statistics of ExpressionVM::evaluate() of byte code. The VM reports to a
+// profiler only when built with EXPRESSIONS_PROFILER, otherwise ExpressionVM::setProfiler() does
+// not exist and evaluate() has no instrumentation at all. Cycles are read by rdtsc on x86, so they
+// include the overhead of the measurement, compare them relative to each other. Programs are told
+// apart by the address of their code. Not thread safe, give every VM its own profiler and merge
+// their snapshots.
+class ExpressionProfiler
+{
+public:
+	static const bool ENABLED =
+#ifdef EXPRESSIONS_PROFILER
+		true;
+#else
+		false;
+#endif
+	static const int HISTOGRAM_BUCKETS = 32;
+
+	struct OpcodeStats
+	{
+		uint64 count; // a superinstruction counts once, its OPERAND never
+		uint64 cycles;
+	};
+
+	struct ProgramStats
+	{
+		const uint8* code;
+		std::string name;
+		uint64 evaluations;
+		uint64 cycles;
+		// latencies, bucket i counts evaluations of [2^i, 2^(i+1)) cycles, the last one also longer
+		uint64 histogram[HISTOGRAM_BUCKETS];
+	};
+
+	struct Snapshot
+	{
+		Snapshot() { memset(opcodes, 0, sizeof(opcodes)); }
+
+		// adds `other`, programs are matched by their code
+		void merge(const Snapshot& other);
+		// human readable tables, opcodes and programs sorted by cycles
+		void dumpText(std::string& out) const;
+		// {"opcodes": [{"name", "count", "cycles"}...],
+		//  "programs": [{"name", "evaluations", "cycles", "histogram": [...]}...]}
+		void dumpJSON(std::string& out) const;
+
+		OpcodeStats opcodes[Instruction::COUNT];
+		std::vector<ProgramStats> programs; // by cycles, descending
+	};
+
+public:
+	ExpressionProfiler() { reset(); }
+
+	// `name` is shown in dumps instead of the address of `code`
+	void setName(const uint8* code, const char* name);
+	Snapshot snapshot() const;
+	// clears the statistics, names are kept
+	void reset();
+
+	static uint64 readCycles()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+		return __builtin_ia32_rdtsc();
+#else
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+	}
+
+private:
+	friend class ExpressionVM;
+
+	void beginProgram()
+	{
+		m_begin = m_last = readCycles();
+		m_type = Instruction::COUNT;
+	}
+
+	// the previous instruction took the cycles up to now
+	void beginInstruction(uint8 type)
+	{
+		uint64 now = readCycles();
+		m_opcodes[m_type].cycles += now - m_last;
+		++m_opcodes[type].count;
+		m_type = type;
+		m_last = now;
+	}
+
+	void endProgram(const uint8* code);
+
+private:
+	// the last one collects the prologue before the first instruction
+	OpcodeStats m_opcodes[Instruction::COUNT + 1];
+	std::unordered_map<const uint8*, ProgramStats> m_programs;
+	std::unordered_map<const uint8*, std::string> m_names;
+	uint64 m_begin;
+	uint64 m_last;
+	uint8 m_type;
+};
+
+
+class ExpressionVM
+{
+public:
+	static const int MAX_REGISTERS = 256;
+	static const int BATCH_BLOCK_SIZE = 256;
+
+	struct ReturnValue
+	{
+		ReturnValue()
+		{
+			type = Types::NONE;
+		}
+
+		ReturnValue(float f)
+		{
+			f_value = f;
+			type = Types::FLOAT;
+		}
+
+		ReturnValue(bool b)
+		{
+			b_value = b;
+			type = Types::BOOL;
+		}
+
+		Types type;
+		union
+		{
+			float f_value;
+			bool b_value;
+		};
+	};
+
+	struct DecodedInstruction
+	{
+		const void* handler;
+		uint8 type;
+		uint8 dst;
+		uint8 a;
+		uint8 b;
+	};
+
+	// How often each opcode is directly followed by another one, counts[first][second]
+	struct PairProfile
+	{
+		PairProfile() { memset(counts, 0, sizeof(counts)); }
+
+		uint32 counts[Instruction::COUNT][Instruction::COUNT];
+	};
+
+	// Program prepared for threaded dispatch, see decode()
+	struct DecodedProgram
+	{
+		std::vector<float> constants;
+		std::vector<uint16> variables;
+		std::vector<DecodedInstruction> instructions;
+		Types result_type;
+	};
+
+	// Partial result of aggregate(), partials of disjoint row ranges are merged in any order, sums
+	// may differ in the last bits
+	struct Accumulator
+	{
+		Accumulator() : sum(0), count(0), numbers(0), min(INFINITY), max(-INFINITY) {}
+
+		void merge(const Accumulator& other)
+		{
+			sum += other.sum;
+			count += other.count;
+			numbers += other.numbers;
+			if (other.min < min) min = other.min;
+			if (other.max > max) max = other.max;
+		}
+
+		// result of the reducer, avg of no rows and min and max of no numbers are NaN
+		float get(Aggregate type) const;
+
+		double sum;
+		int64 count; // rows passing the where predicate, true ones of them for Aggregate::COUNT
+		int64 numbers; // non-NaN values of those rows, counted for Aggregate::MIN and MAX only
+		float min; // NaN values are skipped by min and max
+		float max;
+	};
+
+public:
+	ExpressionVM() : m_cache(nullptr), m_program_file(nullptr) {}
+
+	// compileAndRun looks up compiled programs in `cache` before invoking the compiler
+	void setCache(ExpressionCache* cache) { m_cache = cache; }
+	// compileAndRun runs programs precompiled in `file` if the compiler signature matches
+	void setProgramFile(const ProgramFile* file) { m_program_file = file; }
+	// returns Types::NONE for programs of another number type than float
+	ReturnValue evaluate(const uint8* code) { return evaluate(code, nullptr); }
+	ReturnValue evaluate(const uint8* code, const float* inputs);
+	// also writes every result of a program compiled by ExpressionCompiler::compileShared() to
+	// `results`, returns the last one
+	ReturnValue evaluate(const uint8* code, const float* inputs, float* results);
+	// compilers of another number type than float fail with Error::INCORRECT_TYPE_ARGS
+	ReturnValue compileAndRun(ExpressionCompiler& compile,
+		const char* src,
+		const float* inputs = nullptr);
+	// evaluate() which also adds executed opcode pairs to `profile`, it is slower, run it over
+	// a representative workload to find sequences worth fusing into superinstructions
+	ReturnValue profile(const uint8* code, const float* inputs, PairProfile& profile);
+#ifdef EXPRESSIONS_PROFILER
+	// evaluate() of byte code reports to `profiler`, nullptr stops it
+	void setProfiler(ExpressionProfiler* profiler) { m_profiler = profiler; }
+#endif
+
+	// Decodes a compiled program once, replacing opcodes with addresses of their handlers, so
+	// every handler jumps directly to the next one (computed goto on GCC/Clang). Other compilers
+	// use the switch dispatch on the decoded program. Returns false on an unknown instruction.
+	bool decode(const uint8* code, DecodedProgram& program);
+	ReturnValue evaluate(const DecodedProgram& program,
+		const float* inputs,
+		float* results = nullptr)
+	{
+		return evaluateDecoded(&program, inputs, results, nullptr);
+	}
+
+	// calls function `idx` of FunctionRegistry, the compiler uses this to fold pure functions
+	static float callFunction(uint8 idx, const float* args);
+
+	// Evaluates `code` for `count` rows, `inputs[slot][row]` is the value of the variable in
+	// `slot`. Every instruction is executed once per block of BATCH_BLOCK_SIZE rows. Booleans are
+	// written to `output` as 1.0f / 0.0f. Returns the type of the result or Types::NONE on error.
+	Types evaluateBatch(const uint8* code, const float* const* inputs, float* output, int count)
+	{
+		return evaluateBatch(code, inputs, nullptr, output, count, nullptr);
+	}
+	// evaluateBatch() of a compileShared() program, results[i][row] is the result i
+	Types evaluateBatch(const uint8* code,
+		const float* const* inputs,
+		float* const* results,
+		int count)
+	{
+		return evaluateBatch(code, inputs, results, nullptr, count, nullptr);
+	}
+	// Evaluates the BOOL program `code` as a filter over `count` rows. `selection` has a bit per
+	// row, row i is bit i % 64 of selection[i / 64]. Selected rows are gathered into blocks, so the
+	// program looks only at them, and the rows it returns false for are cleared. Set all bits to
+	// filter the whole table, pass the result to the next filter to chain them. Comparisons and
+	// logical operators work on booleans packed to bits. Returns the number of selected rows or -1
+	// if the program does not return BOOL.
+	int filter(const uint8* code, const float* const* inputs, uint64* selection, int count);
+	// Evaluates a program of ExpressionCompiler::compileAggregate() for `count` rows and adds them
+	// to `accumulator`. The reduction is fused into the batch loop, each block of values is reduced
+	// while it is in the registers, no column is written. Sums use Kahan summation in every SIMD
+	// lane. Returns false if `code` is not an aggregation.
+	bool aggregate(const uint8* code,
+		const float* const* inputs,
+		int count,
+		Accumulator& accumulator);
+
+private:
+	union Register
+	{
+		float f;
+		uint32 b;
+	};
+
+	// reduces the blocks of aggregate()
+	struct Reducer;
+
+	// PROFILE counts opcode pairs to `profile`, TIMED reports to m_profiler
+	template <bool PROFILE, bool TIMED>
+	ReturnValue evaluate(const uint8* code,
+		const float* inputs,
+		float* results,
+		PairProfile* profile);
+	ReturnValue evaluateDecoded(const DecodedProgram* program,
+		const float* inputs,
+		float* results,
+		const void* const** handlers);
+	// `results`, `output` or `reducer` can be null, results go to the reducer if set
+	Types evaluateBatch(const uint8* code,
+		const float* const* inputs,
+		float* const* results,
+		float* output,
+		int count,
+		Reducer* reducer);
+	static void callFunctionBatch(uint8 idx,
+		float* out,
+		const float* const* args,
+		int count,
+		MathTier tier);
+
+private:
+	ALIGN_16 Register m_registers[MAX_REGISTERS];
+	std::vector<float> m_batch_registers;
+	std::vector<uint64> m_batch_bits;
+	ExpressionCache* m_cache;
+	const ProgramFile* m_program_file;
+	// reused by compileAndRun
+	ExpressionArena m_arena;
+	std::vector<uint8> m_byte_code;
+#ifdef EXPRESSIONS_PROFILER
+	ExpressionProfiler* m_profiler = nullptr;
+#endif
+};
+
+
+// Expression compiled to C++ by ExpressionCompiler::transpile(), the functions take the same
+// arguments as ExpressionVM::evaluate() and ExpressionVM::evaluateBatch() without the program.
+// Results match ExpressionVM, except NaN payloads and unless the C++ compiler contracts
+// multiplications and additions to fused multiply-adds. The batch loop always evaluates both
+// operands of and/or. The generated translation unit defines, in the namespace passed to
+// transpile():
+//   const TranspiledExpression* find(const char* name); // nullptr if not found
+//   extern const TranspiledExpression EXPRESSIONS[]; // terminated by an entry of nulls
+//   extern const int EXPRESSIONS_COUNT;
+struct TranspiledExpression
+{
+	const char* name;
+	const char* source;
+	ExpressionVM::ReturnValue (*evaluate)(const float* inputs);
+	Types (*evaluateBatch)(const float* const* inputs, float* output, int count);
+};
+
+
+// Evaluates programs compiled with ExpressionCompiler::setNumberType(), T is double for
+// Types::DOUBLE and int64 for Types::INT64. Floats stay in ExpressionVM. Functions are called with
+// their arguments converted to float. int64 arithmetic wraps around, division by zero gives 0.
+template <typename T>
+class TypedExpressionVM
+{
+public:
+	static const Types NUMBER_TYPE =
+		std::is_floating_point<T>::value ? Types::DOUBLE : Types::INT64;
+
+	struct ReturnValue
+	{
+		ReturnValue() { type = Types::NONE; }
+
+		ReturnValue(T v)
+		{
+			value = v;
+			type = NUMBER_TYPE;
+		}
+
+		ReturnValue(bool b)
+		{
+			b_value = b;
+			type = Types::BOOL;
+		}
+
+		Types type;
+		union
+		{
+			T value;
+			bool b_value;
+		};
+	};
+
+public:
+	// returns Types::NONE for programs of another number type, `results` as in ExpressionVM
+	ReturnValue evaluate(const uint8* code, const T* inputs, T* results = nullptr);
+	// a row at a time, booleans are written to `output` as 1 / 0
+	Types evaluateBatch(const uint8* code, const T* const* inputs, T* output, int count);
+
+private:
+	union Register
+	{
+		T value;
+		uint64 b;
+	};
+
+private:
+	Register m_registers[ExpressionVM::MAX_REGISTERS];
+	std::vector<T> m_row;
+};
+
+typedef TypedExpressionVM<double> DoubleExpressionVM;
+typedef TypedExpressionVM<int64> Int64ExpressionVM;
+
+
+// Translates compiled programs to native x86-64 SSE code. The scalar entry point evaluates one row
+// like ExpressionVM::evaluate, the batch one evaluates 4 rows per iteration with packed
+// instructions. On other architectures, or with EXPRESSIONS_NO_JIT defined, programs are
+// evaluated by the interpreter.
+class ExpressionJIT
+{
+public:
+	ExpressionJIT();
+	~ExpressionJIT();
+
+	// returns true if native code was generated, otherwise the interpreter is used, programs of
+	// other number types than float are not supported
+	bool compile(const uint8* code, int size);
+	bool isNative() const { return m_scalar_function != nullptr; }
+	ExpressionVM::ReturnValue evaluate(const float* inputs);
+	Types evaluateBatch(const float* const* inputs, float* output, int count);
+
+private:
+	typedef float (*ScalarFunction)(const float* inputs);
+	typedef void (*BatchFunction)(const float* const* inputs, float* output, int count);
+
+	ExpressionJIT(const ExpressionJIT&);
+	void operator=(const ExpressionJIT&);
+	void release();
+
+private:
+	std::vector<uint8> m_program;
+	ExpressionVM m_vm;
+	void* m_memory;
+	int m_memory_size;
+	ScalarFunction m_scalar_function;
+	BatchFunction m_batch_function;
+	// rows which do not fill a whole SIMD vector are copied to m_tail_rows
+	std::vector<const float*> m_tail_columns;
+	std::vector<float> m_tail_rows;
+};
+
+
+// Evaluates many programs over many rows on a pool of threads. Every (program, block of rows) pair
+// is a task, tasks are split evenly between workers and a worker which runs out of its own tasks
+// steals from the others. Each worker has its own ExpressionVM and every task writes only its own
+// rows, so the output does not depend on the number of threads or on the schedule.
+class ExpressionEngine
+{
+public:
+	static const int BLOCK_SIZE = 16 * ExpressionVM::BATCH_BLOCK_SIZE;
+
+	// `thread_count` includes the calling thread, 0 means one thread per hardware thread
+	explicit ExpressionEngine(int thread_count = 0);
+	~ExpressionEngine();
+
+	int getThreadCount() const { return (int)m_workers.size(); }
+	// Evaluates programs[i] for `count` rows to outputs[i], `inputs` are `input_count` columns
+	// like in ExpressionVM::evaluateBatch. types[i] is the type of programs[i] or Types::NONE on
+	// error, returns false if any program failed. Blocks until all tasks are done.
+	bool evaluateBatch(const uint8* const* programs,
+		int program_count,
+		const float* const* inputs,
+		int input_count,
+		float* const* outputs,
+		int count,
+		Types* types);
+	// Evaluates programs[i] compiled by ExpressionCompiler::compileAggregate() for `count` rows
+	// to results[i], like ExpressionVM::aggregate. The result does not depend on the thread count.
+	// Returns false if any program failed.
+	bool aggregate(const uint8* const* programs,
+		int program_count,
+		const float* const* inputs,
+		int input_count,
+		int count,
+		ExpressionVM::Accumulator* results);
+
+private:
+	struct Task
+	{
+		int program;
+		int begin;
+		int end;
+		Types result_type;
+		ExpressionVM::Accumulator partial;
+	};
+
+	// owner takes tasks from the end of [begin, end), thieves from the beginning
+	struct Worker
+	{
+		std::mutex mutex;
+		int begin;
+		int end;
+		ExpressionVM vm;
+		std::vector<const float*> columns;
+	};
+
+	ExpressionEngine(const ExpressionEngine&);
+	void operator=(const ExpressionEngine&);
+	void threadMain(int worker_idx);
+	void work(int worker_idx);
+	int run(int program_count, int count);
+	bool popTask(Worker& worker, bool steal, int& task);
+
+private:
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::vector<std::thread> m_threads;
+	std::vector<Task> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	uint32 m_generation;
+	int m_active;
+	bool m_exit;
+	// current job, valid while there are tasks
+	const uint8* const* m_programs;
+	const float* const* m_inputs;
+	int m_input_count;
+	float* const* m_outputs; // nullptr while aggregating
+};
+
+
+// Re-evaluates a set of programs after some of their inputs change. Programs read input slots like
+// ExpressionVM::evaluate, a program can also write its result to a slot, so other programs build on
+// it. set() marks programs reading the slot dirty, update() evaluates only dirty programs in
+// dependency order and keeps the cached results of the others. A result which does not change
+// does not make the programs reading it dirty.
+class ExpressionGraph
+{
+public:
+	static const int NO_SLOT = -1;
+
+	// cumulative since construction or resetStats()
+	struct Stats
+	{
+		uint32 updates;
+		uint32 evaluated; // programs evaluated by update()
+		uint32 skipped; // programs whose cached result was reused by update()
+	};
+
+public:
+	explicit ExpressionGraph(int slot_count);
+
+	// Returns the index of the program or -1 if it reads or writes a slot out of range, writes a
+	// slot written by another program or would form a cycle. New programs are dirty.
+	int add(const uint8* code, int output_slot = NO_SLOT);
+	// booleans are written to `output_slot` as 1.0f / 0.0f
+	void set(int slot, float value);
+	float get(int slot) const { return m_slots[slot]; }
+	const float* getSlots() const { return &m_slots[0]; }
+	// returns the number of evaluated programs
+	int update();
+	ExpressionVM::ReturnValue getResult(int program) const { return m_programs[program].result; }
+	Stats getStats() const { return m_stats; }
+	void resetStats() { memset(&m_stats, 0, sizeof(m_stats)); }
+
+private:
+	struct Program
+	{
+		ExpressionVM::DecodedProgram decoded;
+		int output_slot;
+		bool dirty;
+		ExpressionVM::ReturnValue result;
+	};
+
+	void markReaders(int slot);
+	void sort();
+
+private:
+	ExpressionVM m_vm;
+	std::vector<Program> m_programs;
+	std::vector<float> m_slots;
+	std::vector<std::vector<int>> m_readers; // programs reading the slot
+	std::vector<int> m_writers; // program writing the slot or -1
+	std::vector<int> m_order; // programs sorted so every one comes after the programs it reads
+	bool m_order_valid;
+	int m_dirty_count;
+	Stats m_stats;
+};
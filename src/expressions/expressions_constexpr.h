@@ -0,0 +1,823 @@
+#pragma once
+
+#include "expressions.h"
+#include <array>
+#include <utility>
+
+// C++14 constexpr functions with loops and mutable locals, Visual Studio 2017 and later
+#if __cpp_constexpr >= 201304 || defined(_MSC_VER) && _MSC_VER >= 1910
+	#define EXPRESSIONS_CONSTEXPR
+#endif
+
+#ifdef EXPRESSIONS_CONSTEXPR
+
+// Compiles expressions at C++ compile time, see EXPR. The grammar and the errors are those of
+// ExpressionCompiler and programs are identical to tokenize(), toPostfix() and compile() at
+// runtime, without optimize() and peephole(). Only float programs are supported, the only known
+// functions are the builtin ones and the only constant is PI. Numbers which strtof would parse at
+// runtime are computed in double and rounded to float, the rare ones which need more precision
+// fail with UNEXPECTED_CHAR.
+class ConstexprCompiler
+{
+public:
+	typedef ExpressionCompiler::Token Token;
+	typedef ExpressionCompiler::Error Error;
+
+	static const int MAX_VARIABLES = 32;
+	static const int MAX_TOKENS = 256;
+	static const int MAX_SIZE = 1024;
+
+	// the source and the names of variables, the index of a name is its input slot
+	struct Source
+	{
+		const char* src;
+		const char* variables[MAX_VARIABLES];
+	};
+
+	struct Result
+	{
+		uint8 byte_code[MAX_SIZE];
+		int size; // 0 on error
+		Error error;
+		int error_offset;
+	};
+
+	static constexpr Result compile(const Source& source)
+	{
+		ConstexprCompiler compiler(source);
+		Result result = {};
+		if (compiler.tokenize() && compiler.toPostfix() && compiler.compile())
+		{
+			for (int i = 0; i < compiler.m_size; ++i) result.byte_code[i] = compiler.m_code[i];
+			result.size = compiler.m_size;
+		}
+		result.error = compiler.m_error;
+		result.error_offset = compiler.m_error_offset;
+		return result;
+	}
+
+	template <int SIZE> static constexpr std::array<uint8, SIZE> toArray(const Result& result)
+	{
+		return toArray<SIZE>(result, std::make_index_sequence<SIZE>());
+	}
+
+	// instantiated with the error of an invalid expression, so the compiler shows it
+	template <Error ERROR, int OFFSET> struct CheckError
+	{
+		static_assert(ERROR == Error::NONE, "Invalid expression, see the arguments of CheckError");
+		static const bool value = true;
+	};
+
+private:
+	static const int MAX_REGISTERS = 256;
+	static const int MAX_STACK = 64;
+
+	constexpr explicit ConstexprCompiler(const Source& source)
+		: m_src(source.src)
+		, m_variables(source.variables)
+		, m_tokens()
+		, m_token_count(0)
+		, m_postfix()
+		, m_postfix_count(0)
+		, m_constants()
+		, m_constant_count(0)
+		, m_slots()
+		, m_slot_count(0)
+		, m_type_stack()
+		, m_reg_stack()
+		, m_stack_size(0)
+		, m_temp_base(0)
+		, m_temp_count(0)
+		, m_register_count(0)
+		, m_code()
+		, m_size(0)
+		, m_error(Error::NONE)
+		, m_error_offset(0)
+	{
+	}
+
+
+	template <int SIZE, size_t... I>
+	static constexpr std::array<uint8, SIZE> toArray(const Result& result,
+		std::index_sequence<I...>)
+	{
+		return {{result.byte_code[I]...}};
+	}
+
+
+	static constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+
+	static constexpr bool isIdentifier(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+	}
+
+
+	constexpr bool isTokenEqual(const Token& token, const char* name) const
+	{
+		for (int i = 0; i < token.size; ++i)
+		{
+			if (name[i] != m_src[token.offset + i]) return false;
+		}
+		return name[token.size] == '\0';
+	}
+
+
+	// builtin functions in the order FunctionRegistry registers them, so the indices match; all
+	// of them take one float and return a float
+	constexpr uint16 getFunctionIdx(const Token& token) const
+	{
+		const char* const NAMES[] = {"sin", "cos", "exp", "log", "sqrt"};
+		for (uint16 i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); ++i)
+		{
+			if (isTokenEqual(token, NAMES[i])) return i;
+		}
+		return FunctionRegistry::INVALID_INDEX;
+	}
+
+
+	constexpr int getVariableIdx(const Token& token) const
+	{
+		for (int i = 0; i < MAX_VARIABLES && m_variables[i]; ++i)
+		{
+			if (isTokenEqual(token, m_variables[i])) return i;
+		}
+		return -1;
+	}
+
+
+	constexpr bool isPI(const Token& token) const { return isTokenEqual(token, "PI"); }
+
+
+	static constexpr int getOperatorPriority(const Token& token)
+	{
+		if (token.type == Token::FUNCTION) return 5;
+		if (token.type == Token::LEFT_PARENTHESIS) return -1;
+		switch (token.oper)
+		{
+			case Token::ADD:
+			case Token::SUBTRACT: return 3;
+			case Token::MULTIPLY:
+			case Token::DIVIDE:
+			case Token::UNARY_MINUS: return 4;
+			case Token::LESS_THAN:
+			case Token::GREATER_THAN: return 2;
+			case Token::AND: return 1;
+			case Token::OR: return 0;
+		}
+		return -1;
+	}
+
+
+	static constexpr int getTokenArity(const Token& token)
+	{
+		if (token.type == Token::FUNCTION) return 1;
+		if (token.type != Token::OPERATOR) return 0;
+		return token.oper == Token::UNARY_MINUS ? 1 : 2;
+	}
+
+
+	static constexpr Instruction::Type getInstruction(Token::Operator oper)
+	{
+		switch (oper)
+		{
+			case Token::ADD: return Instruction::ADD_FLOAT;
+			case Token::SUBTRACT: return Instruction::SUB_FLOAT;
+			case Token::MULTIPLY: return Instruction::MUL_FLOAT;
+			case Token::DIVIDE: return Instruction::DIV_FLOAT;
+			case Token::UNARY_MINUS: return Instruction::UNARY_MINUS;
+			case Token::LESS_THAN: return Instruction::FLOAT_LT;
+			case Token::GREATER_THAN: return Instruction::FLOAT_GT;
+			case Token::AND: return Instruction::AND;
+			case Token::OR: return Instruction::OR;
+		}
+		return Instruction::COUNT;
+	}
+
+
+	static constexpr bool isLogical(Token::Operator oper)
+	{
+		return oper == Token::AND || oper == Token::OR;
+	}
+
+
+	static constexpr Types getReturnType(Token::Operator oper)
+	{
+		return oper == Token::LESS_THAN || oper == Token::GREATER_THAN || isLogical(oper)
+				   ? Types::BOOL
+				   : Types::FLOAT;
+	}
+
+
+	// bits of a finite, non-negative and normal or zero float
+	static constexpr uint32 getFloatBits(float value)
+	{
+		if (value == 0) return 0;
+		int exponent = 0;
+		double mantissa = value;
+		while (mantissa >= 2)
+		{
+			mantissa /= 2;
+			++exponent;
+		}
+		while (mantissa < 1)
+		{
+			mantissa *= 2;
+			--exponent;
+		}
+		return uint32(exponent + 127) << 23 | uint32((mantissa - 1) * (1 << 23));
+	}
+
+
+	constexpr uint32 getConstantBits(const Token& token) const
+	{
+		// ExpressionCompiler::getConstValue()
+		float value = token.type == Token::NUMBER ? token.number : (float)3.14159265358979323846;
+		return getFloatBits(value);
+	}
+
+
+	constexpr bool fail(Error error, int offset)
+	{
+		m_error = error;
+		m_error_offset = offset;
+		return false;
+	}
+
+
+	// Lexer::scanNumber(), returns the end of the number or -1 if it is not supported
+	constexpr int scanNumber(int i, float& value) const
+	{
+		const float POWERS_OF_TEN[] = {
+			1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+		const uint32 MAX_MANTISSA = 1 << 24;
+
+		int start = i;
+		uint32 mantissa = 0;
+		int exponent = 0;
+		bool exact = true;
+		for (; isDigit(m_src[i]); ++i)
+		{
+			mantissa = mantissa * 10 + (m_src[i] - '0');
+			exact = exact && mantissa <= MAX_MANTISSA;
+		}
+		if (m_src[i] == '.')
+		{
+			for (++i; isDigit(m_src[i]); ++i)
+			{
+				mantissa = mantissa * 10 + (m_src[i] - '0');
+				exact = exact && mantissa <= MAX_MANTISSA;
+				--exponent;
+			}
+		}
+		if ((m_src[i] == 'e' || m_src[i] == 'E') && exact)
+		{
+			int e = i + 1;
+			bool negative = m_src[e] == '-';
+			if (m_src[e] == '-' || m_src[e] == '+') ++e;
+			if (isDigit(m_src[e]))
+			{
+				int exp_value = 0;
+				for (; isDigit(m_src[e]) && exp_value < 100; ++e)
+				{
+					exp_value = exp_value * 10 + (m_src[e] - '0');
+				}
+				exponent += negative ? -exp_value : exp_value;
+				exact = !isDigit(m_src[e]);
+				i = e;
+			}
+		}
+		exact = exact && m_src[i] != 'x' && m_src[i] != 'X';
+
+		if (!exact || exponent < -10 || exponent > 10) return scanLongNumber(start, value);
+		value = exponent < 0 ? mantissa / POWERS_OF_TEN[-exponent]
+							 : mantissa * POWERS_OF_TEN[exponent];
+		return i;
+	}
+
+
+	// what strtof parses, a mantissa up to 2^53 and a power of ten up to 1e22 are exact doubles
+	constexpr int scanLongNumber(int i, float& value) const
+	{
+		const uint64 MAX_MANTISSA = 1ULL << 53;
+
+		// hexadecimal numbers
+		if (m_src[i] == '0' && (m_src[i + 1] == 'x' || m_src[i + 1] == 'X')) return -1;
+
+		uint64 mantissa = 0;
+		int exponent = 0;
+		for (; isDigit(m_src[i]); ++i)
+		{
+			if (mantissa > MAX_MANTISSA) return -1;
+			mantissa = mantissa * 10 + (m_src[i] - '0');
+		}
+		if (m_src[i] == '.')
+		{
+			for (++i; isDigit(m_src[i]); ++i)
+			{
+				if (mantissa > MAX_MANTISSA) return -1;
+				mantissa = mantissa * 10 + (m_src[i] - '0');
+				--exponent;
+			}
+		}
+		if (m_src[i] == 'e' || m_src[i] == 'E')
+		{
+			int e = i + 1;
+			bool negative = m_src[e] == '-';
+			if (m_src[e] == '-' || m_src[e] == '+') ++e;
+			if (isDigit(m_src[e]))
+			{
+				int exp_value = 0;
+				for (; isDigit(m_src[e]); ++e)
+				{
+					if (exp_value < 1000) exp_value = exp_value * 10 + (m_src[e] - '0');
+				}
+				exponent += negative ? -exp_value : exp_value;
+				i = e;
+			}
+		}
+
+		if (mantissa == 0)
+		{
+			value = 0;
+			return i;
+		}
+		if (mantissa > MAX_MANTISSA || exponent < -22 || exponent > 22) return -1;
+		double power = 1;
+		for (int j = 0; j < exponent || j < -exponent; ++j) power *= 10;
+		value = float(exponent < 0 ? mantissa / power : mantissa * power);
+		return i;
+	}
+
+
+	// ExpressionCompiler::tokenize()
+	constexpr bool tokenize()
+	{
+		int i = 0;
+		// true if the last token can be the left operand of a binary operator
+		bool binary = false;
+		while (m_src[i])
+		{
+			Token token = {Token::EMPTY, i, 1};
+			char c = m_src[i];
+			if (c == ' ' || c == '\n' || c == '\t')
+			{
+				++i;
+				continue;
+			}
+			else if (isDigit(c))
+			{
+				token.type = Token::NUMBER;
+				i = scanNumber(i, token.number);
+				if (i < 0) return fail(Error::UNEXPECTED_CHAR, token.offset);
+				token.size = i - token.offset;
+				binary = true;
+			}
+			else if (isIdentifier(c))
+			{
+				for (++i; isIdentifier(m_src[i]); ++i);
+				token.size = i - token.offset;
+
+				if (isTokenEqual(token, "and") || isTokenEqual(token, "or"))
+				{
+					if (!binary) return fail(Error::MISSING_BINARY_OPERAND, token.offset);
+					token.type = Token::OPERATOR;
+					token.oper = token.size == 3 ? Token::AND : Token::OR;
+					binary = false;
+				}
+				else
+				{
+					token.function = getFunctionIdx(token);
+					bool known = token.function != FunctionRegistry::INVALID_INDEX;
+					token.type = known ? Token::FUNCTION : Token::IDENTIFIER;
+					binary = token.type == Token::IDENTIFIER;
+				}
+			}
+			else if (c == '*' || c == '+' || c == '/' || c == '<' || c == '>')
+			{
+				if (!binary) return fail(Error::MISSING_BINARY_OPERAND, token.offset);
+				token.type = Token::OPERATOR;
+				token.oper = c == '*' ? Token::MULTIPLY
+						   : c == '+' ? Token::ADD
+						   : c == '/' ? Token::DIVIDE
+						   : c == '<' ? Token::LESS_THAN
+									  : Token::GREATER_THAN;
+				binary = false;
+				++i;
+			}
+			else if (c == '-')
+			{
+				token.type = Token::OPERATOR;
+				token.oper = binary ? Token::SUBTRACT : Token::UNARY_MINUS;
+				binary = false;
+				++i;
+			}
+			else if (c == '(' || c == ')' || c == ',')
+			{
+				token.type = c == '(' ? Token::LEFT_PARENTHESIS
+						   : c == ')' ? Token::RIGHT_PARENTHESIS
+									  : Token::COMMA;
+				binary = c == ')';
+				++i;
+			}
+			else
+			{
+				return fail(Error::UNEXPECTED_CHAR, token.offset);
+			}
+
+			if (m_token_count >= MAX_TOKENS) return fail(Error::OUT_OF_MEMORY, token.offset);
+			m_tokens[m_token_count] = token;
+			++m_token_count;
+		}
+		return true;
+	}
+
+
+	// ExpressionCompiler::toPostfix()
+	constexpr bool toPostfix()
+	{
+		Token func_stack[MAX_STACK] = {};
+		// for parentheses of function calls the number of commas so far, -1 for other parentheses
+		int comma_counts[MAX_STACK] = {};
+		int func_stack_idx = 0;
+		for (int i = 0; i < m_token_count; ++i)
+		{
+			const Token& token = m_tokens[i];
+			if (token.type == Token::NUMBER || token.type == Token::IDENTIFIER)
+			{
+				m_postfix[m_postfix_count] = token;
+				++m_postfix_count;
+			}
+			else if (token.type == Token::LEFT_PARENTHESIS)
+			{
+				if (func_stack_idx >= MAX_STACK) return fail(Error::OUT_OF_MEMORY, token.offset);
+				bool is_call = i > 0 && m_tokens[i - 1].type == Token::FUNCTION;
+				comma_counts[func_stack_idx] = is_call ? 0 : -1;
+				func_stack[func_stack_idx] = token;
+				++func_stack_idx;
+			}
+			else if (token.type == Token::RIGHT_PARENTHESIS || token.type == Token::COMMA)
+			{
+				// empty argument
+				if (i > 0 && (m_tokens[i - 1].type == Token::COMMA ||
+								 (token.type == Token::COMMA &&
+									 m_tokens[i - 1].type == Token::LEFT_PARENTHESIS)))
+				{
+					return fail(Error::UNEXPECTED_CHAR, token.offset);
+				}
+				while (func_stack_idx > 0 &&
+					   func_stack[func_stack_idx - 1].type != Token::LEFT_PARENTHESIS)
+				{
+					--func_stack_idx;
+					m_postfix[m_postfix_count] = func_stack[func_stack_idx];
+					++m_postfix_count;
+				}
+
+				if (func_stack_idx == 0)
+				{
+					return fail(token.type == Token::COMMA ? Error::UNEXPECTED_CHAR
+														   : Error::MISSING_LEFT_PARENTHESIS,
+						token.offset);
+				}
+
+				int& comma_count = comma_counts[func_stack_idx - 1];
+				if (token.type == Token::COMMA)
+				{
+					if (comma_count < 0) return fail(Error::UNEXPECTED_CHAR, token.offset);
+					++comma_count;
+					continue;
+				}
+
+				--func_stack_idx;
+				if (comma_count >= 0)
+				{
+					// the function is right below its parenthesis
+					const Token& function = func_stack[func_stack_idx - 1];
+					bool empty = m_tokens[i - 1].type == Token::LEFT_PARENTHESIS;
+					int args = empty ? 0 : comma_count + 1;
+					int arity = getTokenArity(function);
+					if (args != arity)
+					{
+						return fail(args < arity ? Error::NOT_ENOUGH_PARAMETERS
+												 : Error::TOO_MANY_PARAMETERS,
+							function.offset);
+					}
+				}
+			}
+			else
+			{
+				// prefix operators bind to what follows them, binary operators are left associative
+				bool is_prefix = token.type == Token::FUNCTION || token.oper == Token::UNARY_MINUS;
+				int prio = getOperatorPriority(token);
+				while (!is_prefix && func_stack_idx > 0 &&
+					   getOperatorPriority(func_stack[func_stack_idx - 1]) >= prio)
+				{
+					--func_stack_idx;
+					m_postfix[m_postfix_count] = func_stack[func_stack_idx];
+					++m_postfix_count;
+				}
+
+				if (func_stack_idx >= MAX_STACK) return fail(Error::OUT_OF_MEMORY, token.offset);
+				func_stack[func_stack_idx] = token;
+				++func_stack_idx;
+			}
+		}
+
+		for (int i = func_stack_idx - 1; i >= 0; --i)
+		{
+			if (func_stack[i].type == Token::LEFT_PARENTHESIS)
+			{
+				return fail(Error::MISSING_RIGHT_PARENTHESIS, func_stack[i].offset);
+			}
+			m_postfix[m_postfix_count] = func_stack[i];
+			++m_postfix_count;
+		}
+		return true;
+	}
+
+
+	constexpr int findConstant(uint32 value) const
+	{
+		for (int i = 0; i < m_constant_count; ++i)
+		{
+			if (m_constants[i] == value) return i;
+		}
+		return -1;
+	}
+
+
+	constexpr int findSlot(int slot) const
+	{
+		for (int i = 0; i < m_slot_count; ++i)
+		{
+			if (m_slots[i] == slot) return i;
+		}
+		return -1;
+	}
+
+
+	constexpr bool emit(Instruction::Type instr, int dst, int a, int b)
+	{
+		if (MAX_SIZE - m_size < Instruction::SIZE) return false;
+		m_code[m_size] = instr;
+		m_code[m_size + 1] = (uint8)dst;
+		m_code[m_size + 2] = (uint8)a;
+		m_code[m_size + 3] = (uint8)b;
+		m_size += Instruction::SIZE;
+		return true;
+	}
+
+
+	constexpr void pop(int count)
+	{
+		for (int j = 0; j < count; ++j)
+		{
+			--m_stack_size;
+			if (m_reg_stack[m_stack_size] >= m_temp_base) --m_temp_count;
+		}
+	}
+
+
+	constexpr bool push(Types type, int reg)
+	{
+		// the register count is stored in a byte
+		if (m_stack_size >= MAX_REGISTERS || reg >= MAX_REGISTERS - 1) return false;
+		m_type_stack[m_stack_size] = type;
+		m_reg_stack[m_stack_size] = (uint8)reg;
+		++m_stack_size;
+		if (reg >= m_temp_base) ++m_temp_count;
+		if (reg >= m_register_count) m_register_count = reg + 1;
+		return true;
+	}
+
+
+	// ExpressionCompiler::compile()
+	constexpr bool compile()
+	{
+		// constants and variables are loaded into the first registers before the program runs
+		for (int i = 0; i < m_postfix_count; ++i)
+		{
+			const Token& token = m_postfix[i];
+			if (token.type == Token::NUMBER || (token.type == Token::IDENTIFIER && isPI(token)))
+			{
+				uint32 value = getConstantBits(token);
+				if (findConstant(value) >= 0) continue;
+				if (m_constant_count + m_slot_count >= MAX_REGISTERS)
+				{
+					return fail(Error::OUT_OF_MEMORY, token.offset);
+				}
+				m_constants[m_constant_count] = value;
+				++m_constant_count;
+			}
+			else if (token.type == Token::IDENTIFIER)
+			{
+				int slot = getVariableIdx(token);
+				if (slot < 0 || findSlot(slot) >= 0) continue;
+				if (m_constant_count + m_slot_count >= MAX_REGISTERS)
+				{
+					return fail(Error::OUT_OF_MEMORY, token.offset);
+				}
+				m_slots[m_slot_count] = (uint16)slot;
+				++m_slot_count;
+			}
+		}
+
+		int slots_size = (m_slot_count * (int)sizeof(uint16) + 3) & ~3;
+		int constants_size = m_constant_count * (int)sizeof(float);
+		int prologue_size = (int)sizeof(ProgramHeader) + constants_size + slots_size;
+		if (MAX_SIZE < prologue_size) return fail(Error::OUT_OF_MEMORY, 0);
+		m_size = prologue_size;
+		m_temp_base = m_constant_count + m_slot_count;
+		m_register_count = m_temp_base;
+
+		// `and` / `or` skip their right operand if the left one decides the result, so find where
+		// right operands start; in postfix notation every operand is a continuous range of tokens
+		int right_operand_of[MAX_TOKENS] = {};
+		int jump_offsets[MAX_TOKENS] = {};
+		int operand_starts[MAX_TOKENS] = {};
+		int operand_count = 0;
+		for (int i = 0; i < m_postfix_count; ++i)
+		{
+			right_operand_of[i] = -1;
+			jump_offsets[i] = -1;
+		}
+		for (int i = 0; i < m_postfix_count; ++i)
+		{
+			const Token& token = m_postfix[i];
+			int arity = getTokenArity(token);
+			// errors are reported by the main loop
+			if (arity > operand_count) break;
+
+			int start = arity > 0 ? operand_starts[operand_count - arity] : i;
+			if (token.type == Token::OPERATOR && isLogical(token.oper))
+			{
+				right_operand_of[operand_starts[operand_count - 1]] = i;
+			}
+			operand_count -= arity;
+			operand_starts[operand_count] = start;
+			++operand_count;
+		}
+
+		for (int i = 0; i < m_postfix_count; ++i)
+		{
+			const Token& token = m_postfix[i];
+
+			if (right_operand_of[i] >= 0 && m_stack_size > 0)
+			{
+				int op_idx = right_operand_of[i];
+				Instruction::Type jump = m_postfix[op_idx].oper == Token::AND
+											 ? Instruction::JUMP_IF_FALSE
+											 : Instruction::JUMP_IF_TRUE;
+				jump_offsets[op_idx] = m_size;
+				if (!emit(jump, 0, m_reg_stack[m_stack_size - 1], 0))
+				{
+					return fail(Error::OUT_OF_MEMORY, token.offset);
+				}
+			}
+
+			switch (token.type)
+			{
+				case Token::NUMBER:
+					if (!push(Types::FLOAT, findConstant(getConstantBits(token))))
+					{
+						return fail(Error::OUT_OF_MEMORY, token.offset);
+					}
+					break;
+				case Token::OPERATOR:
+				{
+					int arity = getTokenArity(token);
+					if (m_stack_size < arity)
+					{
+						return fail(Error::NOT_ENOUGH_PARAMETERS, token.offset);
+					}
+					Types arg_type = isLogical(token.oper) ? Types::BOOL : Types::FLOAT;
+					for (int j = 0; j < arity; ++j)
+					{
+						if (m_type_stack[m_stack_size - j - 1] != arg_type)
+						{
+							return fail(Error::INCORRECT_TYPE_ARGS, token.offset);
+						}
+					}
+					int a = m_reg_stack[m_stack_size - arity];
+					int b = m_reg_stack[m_stack_size - 1];
+					pop(arity);
+					int dst = m_temp_base + m_temp_count;
+					if (!emit(getInstruction(token.oper), dst, a, b) ||
+						!push(getReturnType(token.oper), dst))
+					{
+						return fail(Error::OUT_OF_MEMORY, token.offset);
+					}
+					if (jump_offsets[i] >= 0)
+					{
+						// the jump leaves the left operand as the result, so it must be in `dst`
+						int skip = (m_size - jump_offsets[i]) / Instruction::SIZE - 1;
+						m_code[jump_offsets[i] + 3] = dst == a && skip <= 0xff ? (uint8)skip : 0;
+					}
+				}
+				break;
+				case Token::FUNCTION:
+				{
+					if (m_stack_size < 1) return fail(Error::NOT_ENOUGH_PARAMETERS, token.offset);
+					if (m_type_stack[m_stack_size - 1] != Types::FLOAT)
+					{
+						return fail(Error::INCORRECT_TYPE_ARGS, token.offset);
+					}
+					// a single argument can be in any register
+					int arg = m_reg_stack[m_stack_size - 1];
+					pop(1);
+					int dst = m_temp_base + m_temp_count;
+					if (!emit(Instruction::CALL, dst, arg, token.function) ||
+						!push(Types::FLOAT, dst))
+					{
+						return fail(Error::OUT_OF_MEMORY, token.offset);
+					}
+				}
+				break;
+				case Token::IDENTIFIER:
+				{
+					int reg = 0;
+					if (isPI(token))
+					{
+						reg = findConstant(getConstantBits(token));
+					}
+					else
+					{
+						int slot = getVariableIdx(token);
+						if (slot < 0) return fail(Error::UNKNOWN_IDENTIFIER, token.offset);
+						reg = m_constant_count + findSlot(slot);
+					}
+					if (!push(Types::FLOAT, reg)) return fail(Error::OUT_OF_MEMORY, token.offset);
+				}
+				break;
+				default: return fail(Error::UNEXPECTED_CHAR, token.offset);
+			}
+		}
+		if (m_stack_size == 0) return fail(Error::NOT_ENOUGH_PARAMETERS, 0);
+
+		Types result_type = m_type_stack[m_stack_size - 1];
+		Instruction::Type ret = result_type == Types::BOOL ? Instruction::RET_BOOL
+														   : Instruction::RET_FLOAT;
+		if (!emit(ret, 0, m_reg_stack[m_stack_size - 1], 0)) return fail(Error::OUT_OF_MEMORY, 0);
+
+		// ProgramHeader, constants and variables, little endian
+		static_assert(sizeof(ProgramHeader) == 8, "ProgramHeader changed");
+		m_code[0] = (uint8)m_register_count;
+		m_code[1] = (uint8)m_constant_count;
+		m_code[2] = (uint8)m_slot_count;
+		m_code[3] = (uint8)result_type;
+		m_code[4] = (uint8)Types::FLOAT;
+		uint8* out = m_code + sizeof(ProgramHeader);
+		for (int i = 0; i < m_constant_count; ++i)
+		{
+			for (int j = 0; j < 4; ++j) out[i * 4 + j] = uint8(m_constants[i] >> (j * 8));
+		}
+		out += m_constant_count * sizeof(float);
+		for (int i = 0; i < m_slot_count; ++i)
+		{
+			out[i * 2] = uint8(m_slots[i]);
+			out[i * 2 + 1] = uint8(m_slots[i] >> 8);
+		}
+		return true;
+	}
+
+
+private:
+	const char* m_src;
+	const char* const* m_variables;
+	Token m_tokens[MAX_TOKENS];
+	int m_token_count;
+	Token m_postfix[MAX_TOKENS];
+	int m_postfix_count;
+	uint32 m_constants[MAX_REGISTERS];
+	int m_constant_count;
+	uint16 m_slots[MAX_REGISTERS];
+	int m_slot_count;
+	Types m_type_stack[MAX_REGISTERS];
+	uint8 m_reg_stack[MAX_REGISTERS];
+	int m_stack_size;
+	int m_temp_base;
+	int m_temp_count;
+	int m_register_count;
+	uint8 m_code[MAX_SIZE];
+	int m_size;
+	Error m_error;
+	int m_error_offset;
+};
+
+
+// The program of an expression literal compiled at C++ compile time, a const std::array<uint8, N>&
+// with static storage. The source is followed by the names of its variables in input order, e.g.
+// EXPR("x * 2 + sin(y)", "x", "y"). An invalid expression fails the build with the error and its
+// offset in the arguments of ConstexprCompiler::CheckError.
+#define EXPR(...) \
+	([]() -> const auto& { \
+		static constexpr ConstexprCompiler::Result result = \
+			ConstexprCompiler::compile(ConstexprCompiler::Source{__VA_ARGS__}); \
+		static_assert( \
+			ConstexprCompiler::CheckError<result.error, result.error_offset>::value, ""); \
+		static constexpr auto byte_code = ConstexprCompiler::toArray<result.size>(result); \
+		return byte_code; \
+	}())
+
+#endif // EXPRESSIONS_CONSTEXPR
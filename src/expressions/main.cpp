@@ -1,678 +1,79 @@
 #define CATCH_CONFIG_MAIN
 #include "catch/catch.hpp"
+#include "expressions.h"
+#include "expressions_constexpr.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cfloat>
+#include <climits>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
 
-typedef unsigned char uint8;
-typedef unsigned int uint16;
-typedef unsigned int uint32;
 
-
-enum class Types : uint8
-{
-	FLOAT,
-	BOOL,
-
-	NONE
-};
+// heap allocations of the process, see the "Arena" test; all forms are replaced, so none of them
+// is paired with a library (or sanitizer) counterpart
+#if defined(__GNUC__) && __GNUC__ >= 11
+	// operator new is malloc here, inlined deletes look mismatched to gcc
+	#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<int> g_heap_allocations(0);
 
 
-namespace Instruction
+void* operator new(size_t size)
 {
-	enum Type : uint8
-	{
-		PUSH_FLOAT,
-		POP_FLOAT,
-		ADD_FLOAT,
-		MUL_FLOAT,
-		DIV_FLOAT,
-		RET_FLOAT,
-		RET_BOOL,
-		SUB_FLOAT,
-		UNARY_MINUS,
-		CALL,
-		FLOAT_LT,
-		FLOAT_GT,
-		AND,
-		OR
-	};
+	++g_heap_allocations;
+	void* ptr = malloc(size > 0 ? size : 1);
+	if (!ptr) throw std::bad_alloc();
+	return ptr;
 }
 
 
-class ExpressionCompiler
-{
-public:
-	struct Token
-	{
-		enum Type
-		{
-			EMPTY,
-			NUMBER,
-			OPERATOR,
-			IDENTIFIER,
-			LEFT_PARENTHESIS,
-			RIGHT_PARENTHESIS
-		};
-		Type type;
-
-		enum Operator
-		{
-			ADD,
-			MULTIPLY,
-			DIVIDE,
-			SUBTRACT,
-			UNARY_MINUS,
-			LESS_THAN,
-			GREATER_THAN,
-			AND,
-			OR
-		};
-
-		int offset;
-		int size;
-
-		float number;
-		Operator oper;
-	};
-
-
-	enum class Error
-	{
-		NONE,
-		UNKNOWN_IDENTIFIER,
-		MISSING_LEFT_PARENTHESIS,
-		MISSING_RIGHT_PARENTHESIS,
-		UNEXPECTED_CHAR,
-		OUT_OF_MEMORY,
-		MISSING_BINARY_OPERAND,
-		NOT_ENOUGH_PARAMETERS,
-		INCORRECT_TYPE_ARGS
-	};
-
-	public:
-	int tokenize(const char* src, Token* tokens, int max_size);
-	int compile(const char* src,
-		const Token* tokens,
-		int token_count,
-		uint8* byte_code,
-		int max_size);
-	int toPostfix(const Token* input, Token* output, int count);
-	ExpressionCompiler::Error getError() const { return m_compile_time_error; }
-
-
-private:
-	static int getOperatorPriority(const Token& token);
-
-
-	static bool isIdentifierChar(char c)
-	{
-		return c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z' || c == '_';
-	}
-
-
-	static const uint16 getFunctionIdx(const char* src, const ExpressionCompiler::Token& token)
-	{
-		static const char* functs[] = {"sin", "cos"};
-		for(int i = 0; i < sizeof(functs) / sizeof(*functs); ++i)
-		{
-			if(strncmp(src + token.offset, functs[i], token.size) == 0) return i;
-		}
-		return 0xffFF;
-	}
-
-
-	static bool getConstValue(const char* src, const ExpressionCompiler::Token& token, float& value)
-	{
-		static const struct { const char* name; float value; } CONSTS[] =
-		{
-			{"PI", 3.14159265358979323846f}
-		};
-		for(const auto& i : CONSTS)
-		{
-			if(strncmp(i.name, src + token.offset, token.size) == 0)
-			{
-				value = i.value;
-				return true;
-			}
-		}
-		return false;
-	}
-
-
-private:
-	ExpressionCompiler::Error m_compile_time_error;
-	int m_compile_time_offset;
-};
-
-
-class ExpressionVM
-{
-public:
-	static const int STACK_SIZE = 50;
-
-	struct ReturnValue
-	{
-		ReturnValue()
-		{
-			type = Types::NONE;
-		}
-
-		ReturnValue(float f)
-		{
-			f_value = f;
-			type = Types::FLOAT;
-		}
-
-		ReturnValue(bool b)
-		{
-			b_value = b;
-			type = Types::BOOL;
-		}
-
-		Types type;
-		union
-		{
-			float f_value;
-			bool b_value;
-		};
-	};
-
-public:
-	ReturnValue evaluate(const uint8* code);
-	ReturnValue compileAndRun(ExpressionCompiler& compile, const char* src);
-
-private:
-	void callFunction(uint16 idx);
-
-	template<typename T>
-	T& pop()
-	{
-		m_stack_pointer -= sizeof(T);
-		return *(T*)(m_stack + m_stack_pointer);
-	}
-
-
-	template <typename T>
-	const uint8* pushStackConst(const uint8* cp)
-	{
-		*(T*)(m_stack + m_stack_pointer) = *(T*)cp;
-		m_stack_pointer += sizeof(T);
-		return cp + sizeof(T);
-	}
-
-
-	template <typename T>
-	void push(T value)
-	{
-		*(T*)(m_stack + m_stack_pointer) = value;
-		m_stack_pointer += sizeof(T);
-	}
-
-private:
-	uint8 m_stack[STACK_SIZE];
-	int m_stack_pointer;
-};
-
-
-ExpressionVM::ReturnValue ExpressionVM::evaluate(const uint8* code)
+void* operator new[](size_t size)
 {
-	m_stack_pointer = 0;
-	const uint8* cp = code;
-	for (;;)
-	{
-		uint8 type = *cp;
-		++cp;
-		switch (type)
-		{
-			case Instruction::CALL:
-				callFunction(*(uint16*)cp);
-				cp += sizeof(cp);
-				break;
-			case Instruction::RET_FLOAT: return pop<float>();
-			case Instruction::RET_BOOL: return pop<bool>();
-			case Instruction::ADD_FLOAT: push<float>(pop<float>() + pop<float>()); break;
-			case Instruction::SUB_FLOAT: push<float>(-pop<float>() + pop<float>()); break;
-			case Instruction::PUSH_FLOAT: cp = pushStackConst<float>(cp); break;
-			case Instruction::FLOAT_LT: push<bool>(pop<float>() > pop<float>()); break;
-			case Instruction::FLOAT_GT: push<bool>(pop<float>() < pop<float>()); break;
-			case Instruction::MUL_FLOAT: push<float>(pop<float>() * pop<float>()); break;
-			case Instruction::DIV_FLOAT:
-			{
-				float f = pop<float>();
-				push<float>(pop<float>() / f);
-			}
-			break;
-			case Instruction::UNARY_MINUS: push<float>(-pop<float>()); break;
-			case Instruction::OR:
-			{
-				bool b1 = pop<bool>();
-				bool b2 = pop<bool>();
-				push<bool>(b1 || b2);
-			}
-			break;
-			case Instruction::AND:
-			{
-				bool b1 = pop<bool>();
-				bool b2 = pop<bool>();
-				push<bool>(b1 && b2);
-			}
-			break;
-			default: DebugBreak(); break;
-		}
-	}
+	return operator new(size);
 }
 
 
-ExpressionVM::ReturnValue ExpressionVM::compileAndRun(ExpressionCompiler& compiler, const char* src)
+void* operator new(size_t size, const std::nothrow_t&) noexcept
 {
-	static const int MAX_TOKENS_COUNT = 50;
-	static const int MAX_BYTECODE_SIZE = 50;
-	uint8 byte_code[MAX_BYTECODE_SIZE];
-	ExpressionCompiler::Token tokens[MAX_TOKENS_COUNT];
-	ExpressionCompiler::Token postfix_tokens[MAX_TOKENS_COUNT];
-	int tokens_count = compiler.tokenize(src, tokens, MAX_TOKENS_COUNT);
-	if (tokens_count <= 0) return ReturnValue();
-
-	int postfix_tokens_count = compiler.toPostfix(tokens, postfix_tokens, tokens_count);
-	if (postfix_tokens_count <= 0) return ReturnValue();
-
-	int size = compiler.compile(src, postfix_tokens, postfix_tokens_count, byte_code, MAX_BYTECODE_SIZE);
-	if (size <= 0) return ReturnValue();
-
-	return evaluate(byte_code);
+	++g_heap_allocations;
+	return malloc(size > 0 ? size : 1);
 }
 
 
-int ExpressionCompiler::toPostfix(const Token* input, Token* output, int count)
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
 {
-	Token func_stack[64];
-	int func_stack_idx = 0;
-	Token* out = output;
-	int out_token_count = count;
-	for(int i = 0; i < count; ++i)
-	{
-		const Token& token = input[i];
-		if(token.type == Token::NUMBER)
-		{
-			*out = token;
-			++out;
-		}
-		else if (token.type == Token::LEFT_PARENTHESIS)
-		{
-			--out_token_count;
-			func_stack[func_stack_idx] = token;
-			++func_stack_idx;
-		}
-		else if (token.type == Token::RIGHT_PARENTHESIS)
-		{
-			--out_token_count;
-			while (func_stack_idx > 0 && func_stack[func_stack_idx - 1].type != Token::LEFT_PARENTHESIS)
-			{
-				--func_stack_idx;
-				*out = func_stack[func_stack_idx];
-				++out;
-			}
-
-			if (func_stack_idx > 0)
-			{
-				--func_stack_idx;
-			}
-			else
-			{
-				m_compile_time_error = ExpressionCompiler::Error::MISSING_LEFT_PARENTHESIS;
-				m_compile_time_offset = token.offset;
-				return -1;
-			}
-		}
-		else
-		{
-			int prio = getOperatorPriority(token);
-			while(func_stack_idx > 0 && getOperatorPriority(func_stack[func_stack_idx - 1]) > prio)
-			{
-				--func_stack_idx;
-				*out = func_stack[func_stack_idx];
-				++out;
-			}
-
-			func_stack[func_stack_idx] = token;
-			++func_stack_idx;
-		}
-	}
-
-	for(int i = func_stack_idx - 1; i >= 0; --i)
-	{
-		if(func_stack[i].type == Token::LEFT_PARENTHESIS)
-		{
-			m_compile_time_error = ExpressionCompiler::Error::MISSING_RIGHT_PARENTHESIS;
-			m_compile_time_offset = func_stack[i].offset;
-			return -1;
-		}
-		*out = func_stack[i];
-		++out;
-	}
-
-	return out_token_count;
+	return operator new(size, tag);
 }
 
 
-void ExpressionVM::callFunction(uint16 idx)
+void operator delete(void* ptr) noexcept
 {
-	switch(idx)
-	{
-		case 0: push<float>(sin(pop<float>())); break;
-		case 1: push<float>(cos(pop<float>())); break;
-		default: DebugBreak(); break;
-	}
+	free(ptr);
 }
 
 
-static const struct
+void operator delete[](void* ptr) noexcept
 {
-	ExpressionCompiler::Token::Operator op;
-	Types ret_type;
-	Instruction::Type instr;
-	Types args[9];
-	int priority;
-
-	int arity() const
-	{
-		for (int i = 0; i < sizeof(args) / sizeof(args[0]); ++i)
-		{
-			if (args[i] == Types::NONE) return i;
-		}
-		return 0;
-	}
-
-	bool checkArgTypes(const Types* stack, int idx) const
-	{
-		for (int i = 0; i < arity(); ++i)
-		{
-			if (args[i] != stack[idx - i - 1]) return false;
-		}
-		return true;
-	}
-} OPERATOR_FUNCTIONS[] = {
-	{ExpressionCompiler::Token::ADD,
-		Types::FLOAT,
-		Instruction::ADD_FLOAT,
-		{Types::FLOAT, Types::FLOAT, Types::NONE},
-		3},
-	{ExpressionCompiler::Token::MULTIPLY,
-		Types::FLOAT,
-		Instruction::MUL_FLOAT,
-		{Types::FLOAT, Types::FLOAT, Types::NONE},
-		4},
-	{ExpressionCompiler::Token::DIVIDE,
-		Types::FLOAT,
-		Instruction::DIV_FLOAT,
-		{Types::FLOAT, Types::FLOAT, Types::NONE},
-		4},
-	{ExpressionCompiler::Token::SUBTRACT,
-		Types::FLOAT,
-		Instruction::SUB_FLOAT,
-		{Types::FLOAT, Types::FLOAT, Types::NONE},
-		3},
-	{ExpressionCompiler::Token::UNARY_MINUS,
-		Types::FLOAT,
-		Instruction::UNARY_MINUS,
-		{Types::FLOAT, Types::NONE},
-		4},
-	{ExpressionCompiler::Token::LESS_THAN,
-		Types::BOOL,
-		Instruction::FLOAT_LT,
-		{Types::FLOAT, Types::FLOAT, Types::NONE},
-		2},
-	{ExpressionCompiler::Token::GREATER_THAN,
-		Types::BOOL,
-		Instruction::FLOAT_GT,
-		{Types::FLOAT, Types::FLOAT, Types::NONE},
-		2},
-	{ExpressionCompiler::Token::AND,
-		Types::BOOL,
-		Instruction::AND,
-		{Types::BOOL, Types::BOOL, Types::NONE},
-		1},
-	{ExpressionCompiler::Token::OR,
-		Types::BOOL,
-		Instruction::OR,
-		{Types::BOOL, Types::BOOL, Types::NONE},
-		0}};
-
-
-int ExpressionCompiler::getOperatorPriority(const Token& token)
-{
-	if (token.type == Token::IDENTIFIER) return 3;
-	if (token.type == Token::LEFT_PARENTHESIS) return -1;
-	if (token.type != Token::OPERATOR) DebugBreak();
-	
-	for (auto& i : OPERATOR_FUNCTIONS)
-	{
-		if (i.op == token.oper) return i.priority;
-	}
-	return -1;
+	operator delete(ptr);
 }
 
 
-int ExpressionCompiler::compile(const char* src,
-	const Token* tokens,
-	int token_count,
-	uint8* byte_code,
-	int max_size)
+void operator delete(void* ptr, size_t) noexcept
 {
-	Types type_stack[50];
-	int type_stack_idx = 0;
-	uint8* out = byte_code;
-	for (int i = 0; i < token_count; ++i)
-	{
-		auto& token = tokens[i];
-
-		switch(token.type)
-		{
-			case Token::NUMBER:
-				if (max_size - (out - byte_code) < sizeof(float) + 1)
-				{
-					m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
-					return -1;
-				}
-				*out = Instruction::PUSH_FLOAT;
-				type_stack[type_stack_idx] = Types::FLOAT;
-				++type_stack_idx;
-				++out;
-				*(float*)out = token.number;
-				out += sizeof(float);
-				break;
-			case Token::OPERATOR:
-				for (auto& fn : OPERATOR_FUNCTIONS)
-				{
-					if (token.oper != fn.op) continue;
-
-					if (type_stack_idx < fn.arity())
-					{
-						m_compile_time_error = ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS;
-						m_compile_time_offset = token.offset;
-						return -1;
-					}
-					if (!fn.checkArgTypes(type_stack, type_stack_idx))
-					{
-						m_compile_time_error = ExpressionCompiler::Error::INCORRECT_TYPE_ARGS;
-						m_compile_time_offset = token.offset;
-						return -1;
-					}
-					type_stack_idx -= fn.arity();
-					type_stack[type_stack_idx] = fn.ret_type;
-					++type_stack_idx;
-					*out = fn.instr;
-					++out;
-					break;
-				}
-				break;
-			case Token::IDENTIFIER:
-				{
-					uint16 func_idx = getFunctionIdx(src, token);
-					if(func_idx != 0xffFF)
-					{
-						if (type_stack_idx < 1)
-						{
-							m_compile_time_error = ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS;
-							m_compile_time_offset = token.offset;
-							return -1;
-						}
-
-						if (type_stack[type_stack_idx - 1] != Types::FLOAT)
-						{
-							m_compile_time_error = ExpressionCompiler::Error::INCORRECT_TYPE_ARGS;
-							m_compile_time_offset = token.offset;
-							return -1;
-						}
-
-						*out = Instruction::CALL;
-						++out;
-						*(uint16*)out = func_idx;
-						out += sizeof(uint16);
-					}
-					else
-					{
-						*out = Instruction::PUSH_FLOAT;
-						type_stack[type_stack_idx] = Types::FLOAT;
-						++type_stack_idx;
-						++out;
-						float const_value;
-						if(!getConstValue(src, token, const_value))
-						{
-							m_compile_time_error = ExpressionCompiler::Error::UNKNOWN_IDENTIFIER;
-							m_compile_time_offset = token.offset;
-							return -1;
-						}
-						*(float*)out = const_value;
-						out += sizeof(float);
-					}
-				}
-				break;
-			default:
-				DebugBreak();
-				break;
-		}
-	}
-	if (max_size - (out - byte_code) < 1)
-	{
-		m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
-		return -1;
-	}
-	switch(type_stack[type_stack_idx - 1])
-	{
-		case Types::FLOAT: *out = Instruction::RET_FLOAT; break;
-		case Types::BOOL: *out = Instruction::RET_BOOL; break;
-		default: DebugBreak(); break;
-	}
-	++out;
-	return int(out - byte_code);
+	operator delete(ptr);
 }
 
 
-int ExpressionCompiler::tokenize(const char* src, Token* tokens, int max_size)
+void operator delete[](void* ptr, size_t) noexcept
 {
-	static const struct { const char* c; bool binary; ExpressionCompiler::Token::Operator op; } OPERATORS[] =
-	{
-		{"*", true, ExpressionCompiler::Token::MULTIPLY},
-		{"+", true, ExpressionCompiler::Token::ADD},
-		{"/", true, ExpressionCompiler::Token::DIVIDE},
-		{"<", true, ExpressionCompiler::Token::LESS_THAN},
-		{">", true, ExpressionCompiler::Token::GREATER_THAN},
-		{"and", true, ExpressionCompiler::Token::AND},
-		{"or", true, ExpressionCompiler::Token::OR}
-	};
-
-	m_compile_time_error = ExpressionCompiler::Error::NONE;
-	const char* c = src;
-	int token_count = 0;
-	bool binary = false;
-	while (*c)
-	{
-		ExpressionCompiler::Token token = { Token::EMPTY, int(c - src) };
-
-		for (auto& i : OPERATORS)
-		{
-			if (strncmp(c, i.c, strlen(i.c) != 0)) continue;
-			if (i.binary && !binary)
-			{
-				m_compile_time_error = ExpressionCompiler::Error::MISSING_BINARY_OPERAND;
-				m_compile_time_offset = token.offset;
-				return -1;
-			}
-
-			token.type = Token::OPERATOR;
-			token.oper = i.op;
-			binary = false;
-			c += strlen(i.c) - 1;
-			break;
-		}
-
-		if (token.type == Token::EMPTY)
-		{
-			switch (*c)
-			{
-			case ' ':
-			case '\n':
-			case '\t': ++c; continue;
-			case '-':
-				token.type = Token::OPERATOR;
-				token.oper = binary ? Token::SUBTRACT : Token::UNARY_MINUS;
-				binary = false;
-				break;
-			}
-		}
-
-		if (token.type == Token::EMPTY)
-		{
-			if (isIdentifierChar(*c))
-			{
-				token.offset = int(c - src);
-				++c;
-				token.type = Token::IDENTIFIER;
-				while (isIdentifierChar(*c)) ++c;
-				token.size = int(c - src) - token.offset;
-				--c;
-			}
-			else if (*c == '(')
-			{
-				binary = false;
-				token.type = Token::LEFT_PARENTHESIS;
-			}
-			else if (*c == ')')
-			{
-				binary = false;
-				token.type = Token::RIGHT_PARENTHESIS;
-				binary = true;
-			}
-			else if (*c >= '0' && *c <= '9')
-			{
-				token.type = Token::NUMBER;
-				char* out;
-				token.number = strtof(c, &out);
-				c = out - 1;
-				binary = true;
-			}
-			else
-			{
-				m_compile_time_error = ExpressionCompiler::Error::UNEXPECTED_CHAR;
-				m_compile_time_offset = token.offset;
-			}
-		}
-		if(token.type != Token::EMPTY)
-		{
-			if(token_count < max_size)
-			{
-				tokens[token_count] = token;
-			}
-			else
-			{
-				m_compile_time_error = ExpressionCompiler::Error::OUT_OF_MEMORY;
-				return -1;
-			}
-			++token_count;
-		}
-		++c;
-	}
-	return token_count;
+	operator delete(ptr);
 }
 
 
@@ -689,20 +90,21 @@ auto c = [](float f, int i) -> uint8
 
 
 #define FLOAT_BYTES(f) \
-	Instruction::PUSH_FLOAT, c((f), 0), c((f), 1), c((f), 2), c((f), 3)
+	c((f), 0), c((f), 1), c((f), 2), c((f), 3)
 
 ExpressionVM::ReturnValue floatBinaryOperator(float f1, float f2, Instruction::Type type)
 {
 	ExpressionVM vm;
 	uint8 code[] = {
+		3, 2, 0, (uint8)Types::FLOAT, (uint8)Types::FLOAT, 0, 0, 0,
 		FLOAT_BYTES(f1),
 		FLOAT_BYTES(f2),
-		type,
-		Instruction::RET_FLOAT};
+		type, 2, 0, 1,
+		Instruction::RET_FLOAT, 0, 2, 0};
 	 return vm.evaluate(code);
 }
 
-#undef FLOAT_BYTES2
+#undef FLOAT_BYTES
 
 
 TEST_CASE("Compile time erros", "Report compile time errors") {
@@ -768,7 +170,12 @@ TEST_CASE("Compile time erros", "Report compile time errors") {
 	vm.compileAndRun(compiler, "2 > 1 > 0");
 	CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
 
-	vm.compileAndRun(compiler, "1*1*1*1*1*1*1*1*1*1*1*1*1*1*1*1*1*1*");
+	// constants would be folded, so use a variable; every nested operand holds a register
+	static const char* VARIABLES[] = {"x"};
+	compiler.setVariables(VARIABLES, 1);
+	std::string nested = "x";
+	for (int i = 0; i < ExpressionVM::MAX_REGISTERS; ++i) nested = "x*(" + nested + ")";
+	vm.compileAndRun(compiler, nested.c_str());
 	CHECK(compiler.getError() == ExpressionCompiler::Error::OUT_OF_MEMORY);
 }
 
@@ -783,6 +190,8 @@ TEST_CASE("Function", "Call different functions") {
 	CHECK(vm.compileAndRun(compiler, "cos 0").f_value == Approx(1.0f));
 	CHECK(vm.compileAndRun(compiler, "cos(10 * 0)").f_value == Approx(1.0f));
 	CHECK(vm.compileAndRun(compiler, "cos(PI)").f_value == Approx(-1.0f));
+	CHECK(vm.compileAndRun(compiler, "sin(0) * 2 + cos(0)").f_value == Approx(1.0f));
+	CHECK(vm.compileAndRun(compiler, "cos 0 * 2").f_value == Approx(2.0f));
 }
 
 
@@ -799,6 +208,63 @@ TEST_CASE("Tokenize", "Convert string to tokens") {
 	CHECK(compiler.tokenize("2.5", tokens, MAX_TOKENS) == 1);
 	CHECK(tokens[0].type == ExpressionCompiler::Token::NUMBER);
 	CHECK(compiler.tokenize("", tokens, MAX_TOKENS) == 0);
+
+	CHECK(compiler.tokenize("x and y or android", tokens, MAX_TOKENS) == 5);
+	CHECK(tokens[1].oper == ExpressionCompiler::Token::AND);
+	CHECK(tokens[3].oper == ExpressionCompiler::Token::OR);
+	CHECK(tokens[4].type == ExpressionCompiler::Token::IDENTIFIER);
+	CHECK(tokens[4].size == 7);
+	CHECK(compiler.tokenize("x-(y)*sin(x)", tokens, MAX_TOKENS) == 10);
+	CHECK(tokens[1].oper == ExpressionCompiler::Token::SUBTRACT);
+	CHECK(tokens[6].type == ExpressionCompiler::Token::FUNCTION);
+	CHECK(compiler.tokenize("1 $ 2", tokens, MAX_TOKENS) < 0);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNEXPECTED_CHAR);
+
+	// the number scanner must round exactly like strtof
+	const char* NUMBERS[] = {"0",
+		"7",
+		"0.1",
+		"3.14159",
+		"3.14159265358979323846",
+		"16777216",
+		"16777217",
+		"123456789",
+		"1e10",
+		"1e11",
+		"2.5e-3",
+		"1E+5",
+		"9.999999e-11",
+		"0.000001",
+		"1e",
+		"1.",
+		"1e39",
+		"0x1A"};
+	for (const char* number : NUMBERS)
+	{
+		INFO(number);
+		char* end;
+		float expected = strtof(number, &end);
+		REQUIRE(compiler.tokenize(number, tokens, MAX_TOKENS) >= 1);
+		CHECK(tokens[0].type == ExpressionCompiler::Token::NUMBER);
+		CHECK(tokens[0].size == int(end - number));
+		CHECK(memcmp(&tokens[0].number, &expected, sizeof(expected)) == 0);
+	}
+	uint32 seed = 42;
+	for (int i = 0; i < 10000; ++i)
+	{
+		seed = seed * 1664525U + 1013904223U;
+		char number[32];
+		snprintf(number,
+			sizeof(number),
+			"%u.%ue%d",
+			seed % 100000,
+			(seed >> 8) % 1000,
+			int(seed >> 24) % 24 - 12);
+		char* end;
+		float expected = strtof(number, &end);
+		REQUIRE(compiler.tokenize(number, tokens, MAX_TOKENS) == 1);
+		CHECK(memcmp(&tokens[0].number, &expected, sizeof(expected)) == 0);
+	}
 }
 
 
@@ -816,8 +282,10 @@ TEST_CASE("Compile", "Compile source to bytecode") {
 	static const int BYTE_CODE_SIZE = 150;
 	uint8 byte_code[BYTE_CODE_SIZE];
 
-	int size = compiler.compile(src, postfix_tokens, postfix_tokens_count, byte_code, BYTE_CODE_SIZE);
-	CHECK(size == 24);
+	int size =
+		compiler.compile(src, postfix_tokens, postfix_tokens_count, byte_code, BYTE_CODE_SIZE);
+	// header, 4 constants, MUL, ADD, ADD, RET
+	CHECK(size == 8 + 4 * 4 + 4 * 4);
 
 	float x = vm.evaluate(byte_code).f_value;
 	CHECK(x == Approx(40.0f));
@@ -883,6 +351,7 @@ TEST_CASE("Compile & Run", "Compile source to bytecode and run it") {
 		CHECK(vm.compileAndRun(compiler, "4.5 - 2").f_value == Approx(2.5f));
 		CHECK(vm.compileAndRun(compiler, "4.5 - 5").f_value == Approx(-0.5f));
 		CHECK(vm.compileAndRun(compiler, "2 * (4.5 - 5)").f_value == Approx(-1.0f));
+		CHECK(vm.compileAndRun(compiler, "4 - 1 - 1").f_value == Approx(2.0f));
 	}
 	
 	SECTION("Unary minus") {
@@ -898,21 +367,2235 @@ TEST_CASE("Compile & Run", "Compile source to bytecode and run it") {
 		CHECK(vm.compileAndRun(compiler, "5 / 2").f_value == Approx(2.5f));
 		CHECK(vm.compileAndRun(compiler, "2.5 / 2").f_value == Approx(1.25f));
 		CHECK(vm.compileAndRun(compiler, "1 / 2.0").f_value == Approx(0.5f));
+		CHECK(vm.compileAndRun(compiler, "8 / 2 / 2").f_value == Approx(2.0f));
 	}
 }
 
 
-TEST_CASE("Run", "Execute bytecode") {
-	SECTION("Multiply") {
-		CHECK(floatBinaryOperator(2, 4, Instruction::MUL_FLOAT).f_value == Approx(8.0f));
-		CHECK(floatBinaryOperator(5, -4, Instruction::MUL_FLOAT).f_value == Approx(-20.0f));
-		CHECK(floatBinaryOperator(3, 0, Instruction::MUL_FLOAT).f_value == Approx(0.0f));
+TEST_CASE("Variables", "Bind identifiers to input slots at compile time") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y", "angle", "order"};
+	compiler.setVariables(VARIABLES, 4);
+
+	const char* src = "x * 2 + y";
+	ExpressionCompiler::Token tokens[16];
+	ExpressionCompiler::Token postfix_tokens[16];
+	int tokens_count = compiler.tokenize(src, tokens, 16);
+	REQUIRE(tokens_count == 5);
+	int postfix_tokens_count = compiler.toPostfix(tokens, postfix_tokens, tokens_count);
+	uint8 byte_code[50];
+	// header, constant 2, slots of x and y, MUL, ADD, RET
+	REQUIRE(compiler.compile(src, postfix_tokens, postfix_tokens_count, byte_code, 50) == 28);
+
+	for (int i = 0; i < 100; ++i)
+	{
+		float inputs[] = {(float)i, 0.5f, 0, 0};
+		CHECK(vm.evaluate(byte_code, inputs).f_value == Approx(i * 2 + 0.5f));
 	}
 
-	SECTION("Add") {
-		CHECK(floatBinaryOperator(2, 4, Instruction::ADD_FLOAT).f_value == Approx(6.0f));
-		CHECK(floatBinaryOperator(5, -4, Instruction::ADD_FLOAT).f_value == Approx(1.0f));
-		CHECK(floatBinaryOperator(3, 0, Instruction::ADD_FLOAT).f_value == Approx(3.0f));
-		CHECK(floatBinaryOperator(3, -4, Instruction::ADD_FLOAT).f_value == Approx(-1.0f));
+	float inputs[] = {1, 2, 3, 4};
+	CHECK(vm.compileAndRun(compiler, "sin(angle) < order and x < y", inputs).b_value);
+	CHECK(vm.compileAndRun(compiler, "cos(PI) * x", inputs).f_value == Approx(-1.0f));
+
+	vm.compileAndRun(compiler, "z + 1", inputs);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+	vm.compileAndRun(compiler, "xy", inputs);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+	vm.compileAndRun(compiler, "s(x)", inputs);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+}
+
+
+TEST_CASE("Batch", "Evaluate bytecode over columns of inputs") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	static const int ROWS = 1000;
+	float xs[ROWS];
+	float ys[ROWS];
+	for (int i = 0; i < ROWS; ++i)
+	{
+		xs[i] = i * 0.25f - 100;
+		ys[i] = (i % 17) - 8.5f;
+	}
+	const float* columns[] = {xs, ys};
+
+	const char* sources[] = {"x * 2 + y",
+		"(x - y) / 3 + -x",
+		"sin(x) * cos(y) + PI",
+		"x < y or y > 3 and x > -50",
+		"x"};
+	for (const char* src : sources)
+	{
+		ExpressionCompiler::Token tokens[32];
+		ExpressionCompiler::Token postfix_tokens[32];
+		int tokens_count = compiler.tokenize(src, tokens, 32);
+		int postfix_tokens_count = compiler.toPostfix(tokens, postfix_tokens, tokens_count);
+		uint8 byte_code[100];
+		REQUIRE(compiler.compile(src, postfix_tokens, postfix_tokens_count, byte_code, 100) > 0);
+
+		for (int count : {ROWS, 7, 256, 513})
+		{
+			float output[ROWS];
+			Types type = vm.evaluateBatch(byte_code, columns, output, count);
+			REQUIRE(type != Types::NONE);
+			for (int i = 0; i < count; ++i)
+			{
+				float inputs[] = {xs[i], ys[i]};
+				ExpressionVM::ReturnValue expected = vm.evaluate(byte_code, inputs);
+				REQUIRE(expected.type == type);
+				if (type == Types::FLOAT)
+				{
+					CHECK(output[i] == Approx(expected.f_value));
+				}
+				else
+				{
+					CHECK(output[i] == (expected.b_value ? 1.0f : 0.0f));
+				}
+			}
+		}
+	}
+
+	// the register count is a byte, 253 constants, x and a temporary take the last register
+	ExpressionArena arena;
+	ExpressionJIT jit;
+	for (int constants : {253, 254})
+	{
+		std::string src = "x";
+		for (int i = 1; i <= constants; ++i) src += " + " + std::to_string(i);
+		INFO(constants);
+		std::vector<ExpressionCompiler::Token> tokens(src.size() + 1);
+		std::vector<ExpressionCompiler::Token> postfix_tokens(src.size() + 1);
+		int tokens_count = compiler.tokenize(src.c_str(), &tokens[0], (int)tokens.size());
+		int postfix_tokens_count =
+			compiler.toPostfix(&tokens[0], &postfix_tokens[0], tokens_count);
+		std::vector<uint8> staged(4096);
+		int staged_size = compiler.compile(
+			src.c_str(), &postfix_tokens[0], postfix_tokens_count, &staged[0], (int)staged.size());
+		std::vector<uint8> byte_code;
+		int size = compiler.compile(src.c_str(), arena, byte_code);
+		if (constants == 254)
+		{
+			CHECK(staged_size == -1);
+			CHECK(size == -1);
+			CHECK(compiler.getError() == ExpressionCompiler::Error::OUT_OF_MEMORY);
+			continue;
+		}
+		REQUIRE(staged_size > 0);
+		REQUIRE(size > 0);
+		CHECK(((const ProgramHeader*)&byte_code[0])->register_count == 255);
+
+		float sum = constants * (constants + 1) / 2.0f;
+		float output[ROWS];
+		REQUIRE(vm.evaluateBatch(&byte_code[0], columns, output, ROWS) == Types::FLOAT);
+		for (int i = 0; i < ROWS; ++i) CHECK(output[i] == xs[i] + sum);
+		REQUIRE(vm.evaluateBatch(&staged[0], columns, output, ROWS) == Types::FLOAT);
+		for (int i = 0; i < ROWS; ++i) CHECK(output[i] == xs[i] + sum);
+		jit.compile(&byte_code[0], size);
+		REQUIRE(jit.evaluateBatch(columns, output, ROWS) == Types::FLOAT);
+		for (int i = 0; i < ROWS; ++i) CHECK(output[i] == xs[i] + sum);
+	}
+}
+
+
+TEST_CASE("Cache", "Reuse compiled programs") {
+	ExpressionCache cache(2);
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	vm.setCache(&cache);
+
+	CHECK(vm.compileAndRun(compiler, "1 + 2").f_value == Approx(3.0f));
+	CHECK(vm.compileAndRun(compiler, "1 + 2").f_value == Approx(3.0f));
+	CHECK(vm.compileAndRun(compiler, "2 * 3").f_value == Approx(6.0f));
+	CHECK(vm.compileAndRun(compiler, "1 + 2").f_value == Approx(3.0f));
+	ExpressionCache::Stats stats = cache.getStats();
+	CHECK(stats.hits == 2);
+	CHECK(stats.misses == 2);
+	CHECK(stats.evictions == 0);
+
+	// "2 * 3" is the least recently used
+	CHECK(vm.compileAndRun(compiler, "1 < 2").b_value);
+	CHECK(vm.compileAndRun(compiler, "1 + 2").f_value == Approx(3.0f));
+	CHECK(vm.compileAndRun(compiler, "2 * 3").f_value == Approx(6.0f));
+	stats = cache.getStats();
+	CHECK(stats.hits == 3);
+	CHECK(stats.misses == 4);
+	CHECK(stats.evictions == 2);
+
+	// errors are not cached
+	vm.compileAndRun(compiler, "1 +");
+	vm.compileAndRun(compiler, "1 +");
+	CHECK(cache.getStats().misses == 6);
+	// a hit clears the error of the previous compile
+	CHECK(compiler.getError() == ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS);
+	CHECK(vm.compileAndRun(compiler, "2 * 3").f_value == Approx(6.0f));
+	CHECK(cache.getStats().hits == 4);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::NONE);
+
+	// the same source compiled with a different variable table is a different program
+	static const char* XY[] = {"x", "y"};
+	static const char* YX[] = {"y", "x"};
+	float inputs[] = {1, 2};
+	compiler.setVariables(XY, 2);
+	CHECK(vm.compileAndRun(compiler, "x", inputs).f_value == Approx(1.0f));
+	compiler.setVariables(YX, 2);
+	CHECK(vm.compileAndRun(compiler, "x", inputs).f_value == Approx(2.0f));
+
+	SECTION("Shared between threads") {
+		ExpressionCache shared(4);
+		std::thread threads[4];
+		float results[4][100];
+		for (int t = 0; t < 4; ++t)
+		{
+			threads[t] = std::thread([&shared, &results, t]() {
+				ExpressionVM thread_vm;
+				ExpressionCompiler thread_compiler;
+				thread_vm.setCache(&shared);
+				static const char* sources[] = {
+					"1 + 1", "2 + 2", "3 + 3", "4 + 4", "5 + 5", "6 + 6"};
+				for (int i = 0; i < 100; ++i)
+				{
+					const char* src = sources[(i + t) % 6];
+					results[t][i] = thread_vm.compileAndRun(thread_compiler, src).f_value;
+				}
+			});
+		}
+		for (auto& thread : threads) thread.join();
+		for (int t = 0; t < 4; ++t)
+		{
+			for (int i = 0; i < 100; ++i) CHECK(results[t][i] == Approx(((i + t) % 6 + 1) * 2.0f));
+		}
+		ExpressionCache::Stats shared_stats = shared.getStats();
+		CHECK(shared_stats.hits + shared_stats.misses == 400);
+	}
+}
+
+
+static int compileSource(ExpressionCompiler& compiler,
+	const char* src,
+	uint8* byte_code,
+	int max_size)
+{
+	ExpressionCompiler::Token tokens[256];
+	ExpressionCompiler::Token postfix_tokens[256];
+	int tokens_count = compiler.tokenize(src, tokens, 256);
+	if (tokens_count <= 0) return -1;
+	int postfix_tokens_count = compiler.toPostfix(tokens, postfix_tokens, tokens_count);
+	if (postfix_tokens_count <= 0) return -1;
+	return compiler.compile(src, postfix_tokens, postfix_tokens_count, byte_code, max_size);
+}
+
+
+TEST_CASE("Program file", "Precompiled programs executed in place") {
+	static const char* VARIABLES[] = {"x", "y"};
+	static const char* SOURCES[] = {"x * 2 + y", "x < y", "sin(x) + 1", "x * 2 + y", "PI"};
+	ExpressionCompiler compiler;
+	compiler.setVariables(VARIABLES, 2);
+	std::vector<uint8> data;
+	int size = compiler.serialize(SOURCES, 5, data);
+	REQUIRE(size == (int)data.size());
+
+	ProgramFile file;
+	REQUIRE(file.open(&data[0], size));
+	CHECK(file.getError() == ProgramFile::Error::NONE);
+	CHECK(file.getCount() == 5);
+	CHECK(file.getSignature() == compiler.getSignature());
+
+	ExpressionVM vm;
+	float inputs[] = {3, 4};
+	for (int i = 0; i < 5; ++i)
+	{
+		CHECK(strcmp(file.getSource(i), SOURCES[i]) == 0);
+		int found = file.find(SOURCES[i]);
+		REQUIRE(found >= 0);
+		CHECK(strcmp(file.getSource(found), SOURCES[i]) == 0);
+
+		uint8 byte_code[256];
+		int program_size = compileSource(compiler, SOURCES[i], byte_code, sizeof(byte_code));
+		ExpressionVM::ReturnValue expected = vm.evaluate(byte_code, inputs);
+		ExpressionVM::ReturnValue value = vm.evaluate(file.getProgram(i), inputs);
+		CHECK(file.getProgramSize(i) <= program_size);
+		CHECK(value.type == expected.type);
+		if (value.type == Types::FLOAT) CHECK(value.f_value == Approx(expected.f_value));
+		if (value.type == Types::BOOL) CHECK(value.b_value == expected.b_value);
+	}
+	CHECK(file.find("x * 3") == -1);
+	CHECK(file.find("") == -1);
+
+	// compileAndRun prefers the file, so an empty cache stays empty
+	ExpressionCache cache(4);
+	vm.setCache(&cache);
+	vm.setProgramFile(&file);
+	CHECK(vm.compileAndRun(compiler, "x * 2 + y", inputs).f_value == Approx(10.0f));
+	CHECK(cache.getStats().misses == 0);
+	CHECK(vm.compileAndRun(compiler, "x - y", inputs).f_value == Approx(-1.0f));
+	CHECK(cache.getStats().misses == 1);
+	// a hit clears the error of the previous compile
+	CHECK(vm.compileAndRun(compiler, "x +", inputs).type == Types::NONE);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS);
+	CHECK(vm.compileAndRun(compiler, "x * 2 + y", inputs).f_value == Approx(10.0f));
+	CHECK(compiler.getError() == ExpressionCompiler::Error::NONE);
+	CHECK(cache.getStats().misses == 2);
+	// programs compiled with another variable table are not used
+	static const char* YX[] = {"y", "x"};
+	compiler.setVariables(YX, 2);
+	CHECK(vm.compileAndRun(compiler, "x * 2 + y", inputs).f_value == Approx(11.0f));
+	compiler.setVariables(VARIABLES, 2);
+
+	SECTION("Errors") {
+		static const char* INVALID[] = {"x + 1", "x +"};
+		std::vector<uint8> invalid;
+		CHECK(compiler.serialize(INVALID, 2, invalid) == -1);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS);
+
+		std::vector<uint8> copy = data;
+		copy[size - 2] ^= 1;
+		CHECK_FALSE(file.open(&copy[0], size));
+		CHECK(file.getError() == ProgramFile::Error::CHECKSUM_MISMATCH);
+		CHECK(file.getCount() == 0);
+
+		copy = data;
+		copy[4] = ProgramFileHeader::VERSION + 1;
+		CHECK_FALSE(file.open(&copy[0], size));
+		CHECK(file.getError() == ProgramFile::Error::UNSUPPORTED_VERSION);
+
+		// an offset past the end must not wrap the size check around
+		copy = data;
+		ProgramFileEntry* entries = (ProgramFileEntry*)&copy[sizeof(ProgramFileHeader)];
+		entries[1].program_offset = 0xFFFFFFF0;
+		CHECK_FALSE(file.open(&copy[0], size));
+		CHECK(file.getError() == ProgramFile::Error::INVALID_FORMAT);
+
+		CHECK_FALSE(file.open(&data[0], size - 4));
+		CHECK(file.getError() == ProgramFile::Error::INVALID_FORMAT);
+		CHECK_FALSE(file.open(&data[0], 8));
+		CHECK(file.getError() == ProgramFile::Error::INVALID_FORMAT);
+		CHECK_FALSE(file.open("this file does not exist"));
+		CHECK(file.getError() == ProgramFile::Error::CANNOT_OPEN);
+	}
+
+	SECTION("Mapped") {
+		const char* path = "expressions_test.bin";
+		FILE* fp = fopen(path, "wb");
+		REQUIRE(fp);
+		fwrite(&data[0], 1, size, fp);
+		fclose(fp);
+
+		ProgramFile mapped;
+		CHECK(mapped.open(path));
+		CHECK(mapped.getCount() == 5);
+		int idx = mapped.find("x < y");
+		REQUIRE(idx >= 0);
+		CHECK(vm.evaluate(mapped.getProgram(idx), inputs).b_value);
+		mapped.close();
+		remove(path);
+	}
+
+	SECTION("Empty") {
+		std::vector<uint8> empty;
+		CHECK(compiler.serialize(nullptr, 0, empty) == (int)sizeof(ProgramFileHeader));
+		ProgramFile empty_file;
+		CHECK(empty_file.open(&empty[0], (int)empty.size()));
+		CHECK(empty_file.getCount() == 0);
+		CHECK(empty_file.find("x") == -1);
+	}
+}
+
+
+static const char* DISPATCH_SOURCES[] = {"x * 2 + y",
+	"(x - y) / 3 + -x * y",
+	"sin(x) * cos(y) + PI",
+	"x < y or y > 3 and x > -50",
+	"x * x * x - y * y / 2 + x * y - 7 < x + y * 3 - x / 5",
+	"x"};
+
+
+TEST_CASE("Transpile", "Compile expressions to C++ source") {
+	static const char* VARIABLES[] = {"x", "y"};
+	static const char* NAMES[] = {"speed", "inside"};
+	static const char* SOURCES[] = {"x * 2 + sin(y)", "x < 1 and y > 2"};
+	ExpressionCompiler compiler;
+	compiler.setVariables(VARIABLES, 2);
+	std::string code;
+	int size = compiler.transpile("Generated", NAMES, SOURCES, 1, code);
+	REQUIRE(size == (int)code.size());
+	CHECK(code.find("namespace Generated") != std::string::npos);
+	CHECK(code.find("inline ExpressionVM::ReturnValue speed(const float* inputs)") !=
+		  std::string::npos);
+	CHECK(code.find("inline Types speedBatch(const float* const* inputs, float* output, "
+					"int count)") != std::string::npos);
+	CHECK(code.find("((inputs[0] * 2.0f) + call(fn0, inputs[1]))") != std::string::npos);
+	CHECK(code.find("((in0[i] * 2.0f) + call(fn0, in1[i]))") != std::string::npos);
+	CHECK(code.find("{\"speed\", \"x * 2 + sin(y)\", &speed, &speedBatch}") != std::string::npos);
+	CHECK(code.find("const TranspiledExpression* find(const char* name)") != std::string::npos);
+
+	// the scalar function short circuits, the batch loop does not
+	REQUIRE(compiler.transpile("Generated", &NAMES[1], &SOURCES[1], 1, code) > 0);
+	CHECK(code.find("((inputs[0] < 1.0f) && (inputs[1] > 2.0f))") != std::string::npos);
+	CHECK(code.find("out[i] = (((in0[i] < 1.0f) & (in1[i] > 2.0f))) ? 1.0f : 0.0f;") !=
+		  std::string::npos);
+	CHECK(code.find("return Types::BOOL;") != std::string::npos);
+
+	// errors leave `code` untouched
+	std::string previous = code;
+	static const char* UNKNOWN[] = {"z + 1"};
+	CHECK(compiler.transpile("Generated", NAMES, UNKNOWN, 1, code) == -1);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+	static const char* SAME_NAMES[] = {"speed", "speed"};
+	static const char* TWO_SOURCES[] = {"x", "y"};
+	CHECK(compiler.transpile("Generated", SAME_NAMES, TWO_SOURCES, 2, code) == -1);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNEXPECTED_CHAR);
+	static const char* INVALID_NAMES[] = {"2x"};
+	CHECK(compiler.transpile("Generated", INVALID_NAMES, TWO_SOURCES, 1, code) == -1);
+	CHECK(compiler.transpile("Generated::Nested", NAMES, TWO_SOURCES, 1, code) == -1);
+	compiler.setNumberType(Types::DOUBLE);
+	CHECK(compiler.transpile("Generated", NAMES, TWO_SOURCES, 1, code) == -1);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+	CHECK(code == previous);
+}
+
+
+TEST_CASE("Threaded dispatch", "Evaluate decoded programs") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	for (const char* src : DISPATCH_SOURCES)
+	{
+		uint8 byte_code[200];
+		REQUIRE(compileSource(compiler, src, byte_code, sizeof(byte_code)) > 0);
+		ExpressionVM::DecodedProgram program;
+		REQUIRE(vm.decode(byte_code, program));
+		for (int i = 0; i < 100; ++i)
+		{
+			float inputs[] = {i * 0.5f - 25, (i % 7) - 3.0f};
+			ExpressionVM::ReturnValue expected = vm.evaluate(byte_code, inputs);
+			ExpressionVM::ReturnValue value = vm.evaluate(program, inputs);
+			REQUIRE(value.type == expected.type);
+			if (value.type == Types::FLOAT) CHECK(value.f_value == expected.f_value);
+			else CHECK(value.b_value == expected.b_value);
+		}
+	}
+
+	uint8 invalid[] = {1, 0, 0, (uint8)Types::FLOAT, Instruction::COUNT, 0, 0, 0};
+	ExpressionVM::DecodedProgram program;
+	CHECK(!vm.decode(invalid, program));
+}
+
+
+TEST_CASE("Short circuit", "And/or skip the right operand") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	uint8 byte_code[200];
+	REQUIRE(compileSource(compiler, "x < 0 and sin(x) > 1", byte_code, sizeof(byte_code)) > 0);
+	ExpressionVM::DecodedProgram program;
+	REQUIRE(vm.decode(byte_code, program));
+	REQUIRE(program.instructions.size() == 6);
+	CHECK(program.instructions[1].type == Instruction::JUMP_IF_FALSE);
+	CHECK(program.instructions[1].a == program.instructions[4].dst);
+	CHECK(program.instructions[1].b == 3);
+	CHECK(program.instructions[4].type == Instruction::AND);
+
+	REQUIRE(compileSource(compiler, "x < 0 or y < 0", byte_code, sizeof(byte_code)) > 0);
+	REQUIRE(vm.decode(byte_code, program));
+	CHECK(program.instructions[1].type == Instruction::JUMP_IF_TRUE);
+
+	const char* sources[] = {"x < 0 and y < 0",
+		"x < 0 or y < 0",
+		"x < 0 and y < 0 or x > y",
+		"(x < 0 or y < 0) and (x > 10 or y > 10)",
+		"x < 0 and (y < 0 and (x < y or y > 5))"};
+	// blocks where x < 0 is all false, all true and mixed
+	static const int ROWS = 3 * ExpressionVM::BATCH_BLOCK_SIZE;
+	float xs[ROWS];
+	float ys[ROWS];
+	for (int i = 0; i < ROWS; ++i)
+	{
+		int block = i / ExpressionVM::BATCH_BLOCK_SIZE;
+		xs[i] = block == 0 ? 1.0f + i : block == 1 ? -1.0f - i : (i % 2 ? 20.0f : -20.0f);
+		ys[i] = (i % 11) - 5.0f;
+	}
+	const float* columns[] = {xs, ys};
+	for (int k = 0; k < (int)(sizeof(sources) / sizeof(sources[0])); ++k)
+	{
+		REQUIRE(compileSource(compiler, sources[k], byte_code, sizeof(byte_code)) > 0);
+		REQUIRE(vm.decode(byte_code, program));
+		float output[ROWS];
+		REQUIRE(vm.evaluateBatch(byte_code, columns, output, ROWS) == Types::BOOL);
+		for (int i = 0; i < ROWS; ++i)
+		{
+			float inputs[] = {xs[i], ys[i]};
+			bool x_neg = xs[i] < 0;
+			bool y_neg = ys[i] < 0;
+			bool expected;
+			switch (k)
+			{
+				case 0: expected = x_neg && y_neg; break;
+				case 1: expected = x_neg || y_neg; break;
+				case 2: expected = (x_neg && y_neg) || xs[i] > ys[i]; break;
+				case 3: expected = (x_neg || y_neg) && (xs[i] > 10 || ys[i] > 10); break;
+				default: expected = x_neg && (y_neg && (xs[i] < ys[i] || ys[i] > 5)); break;
+			}
+			REQUIRE(vm.evaluate(byte_code, inputs).b_value == expected);
+			REQUIRE(vm.evaluate(program, inputs).b_value == expected);
+			REQUIRE(output[i] == (expected ? 1.0f : 0.0f));
+		}
+	}
+}
+
+
+static int compileOptimized(ExpressionCompiler& compiler,
+	const char* src,
+	uint8* byte_code,
+	int max_size)
+{
+	ExpressionCompiler::Token tokens[256];
+	ExpressionCompiler::Token postfix_tokens[256];
+	int tokens_count = compiler.tokenize(src, tokens, 256);
+	if (tokens_count <= 0) return -1;
+	int postfix_tokens_count = compiler.toPostfix(tokens, postfix_tokens, tokens_count);
+	if (postfix_tokens_count <= 0) return -1;
+	postfix_tokens_count = compiler.optimize(src, postfix_tokens, postfix_tokens_count);
+	return compiler.compile(src, postfix_tokens, postfix_tokens_count, byte_code, max_size);
+}
+
+
+// random well typed expression over variables x and y
+static std::string randomExpression(uint32& seed, bool boolean, int depth)
+{
+	auto next = [&seed](int n) -> int {
+		seed = seed * 1664525U + 1013904223U;
+		return (seed >> 16) % n;
+	};
+	if (boolean)
+	{
+		static const char* COMPARISONS[] = {" < ", " > "};
+		static const char* LOGIC[] = {" and ", " or "};
+		if (depth <= 0 || next(3) == 0)
+		{
+			return "(" + randomExpression(seed, false, depth - 1) + COMPARISONS[next(2)] +
+				   randomExpression(seed, false, depth - 1) + ")";
+		}
+		return "(" + randomExpression(seed, true, depth - 1) + LOGIC[next(2)] +
+			   randomExpression(seed, true, depth - 1) + ")";
+	}
+
+	static const char* LEAVES[] = {"x", "y", "2", "0.5", "0", "PI"};
+	static const char* OPERATORS[] = {" + ", " - ", " * ", " / "};
+	if (depth <= 0) return LEAVES[next(6)];
+	switch (next(6))
+	{
+		case 0: return LEAVES[next(6)];
+		case 1: return "-(" + randomExpression(seed, false, depth - 1) + ")";
+		case 2: return (next(2) ? "sin(" : "cos(") + randomExpression(seed, false, depth - 1) + ")";
+		default:
+			return "(" + randomExpression(seed, false, depth - 1) + OPERATORS[next(4)] +
+				   randomExpression(seed, false, depth - 1) + ")";
+	}
+}
+
+
+TEST_CASE("Optimize", "Fold constants and prune branches") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	const char* src = "cos(PI) * 2 + x";
+	ExpressionCompiler::Token tokens[16];
+	ExpressionCompiler::Token postfix_tokens[16];
+	int count = compiler.toPostfix(tokens, postfix_tokens, compiler.tokenize(src, tokens, 16));
+	REQUIRE(compiler.optimize(src, postfix_tokens, count) == 3);
+	CHECK(postfix_tokens[0].type == ExpressionCompiler::Token::NUMBER);
+	CHECK(postfix_tokens[0].number == Approx(-2.0f));
+	CHECK(postfix_tokens[1].type == ExpressionCompiler::Token::IDENTIFIER);
+	CHECK(postfix_tokens[2].type == ExpressionCompiler::Token::OPERATOR);
+
+	struct
+	{
+		const char* src;
+		int instructions;
+	} PROGRAMS[] = {{"cos(PI) * 2 + x", 2},
+		{"-(2 * 3) + x * (1 + 1)", 3},
+		{"1 < 2", 1},
+		{"1 < 2 or x > y", 1},
+		{"x > y or 1 < 2", 1},
+		{"1 > 2 and x > y", 1},
+		{"x > y and 1 > 2", 1},
+		{"1 < 2 and x > y", 2},
+		{"x > y and 1 < 2", 2},
+		{"x > y or 1 > 2", 2},
+		{"(1 > 2 or x < 0) and (y < 0 or 3 > 2)", 2},
+		{"x < 0 and sin(0) < 1 and y < 0", 5},
+		{"(1 + x) * 2", 3},
+		{"(1 < y) and (y < x)", 5}};
+	for (auto& program : PROGRAMS)
+	{
+		uint8 byte_code[100];
+		uint8 reference_code[100];
+		REQUIRE(compileOptimized(compiler, program.src, byte_code, sizeof(byte_code)) > 0);
+		REQUIRE(compileSource(compiler, program.src, reference_code, sizeof(reference_code)) > 0);
+		ExpressionVM::DecodedProgram decoded;
+		REQUIRE(vm.decode(byte_code, decoded));
+		CHECK(decoded.instructions.size() == program.instructions);
+		for (int i = 0; i < 20; ++i)
+		{
+			float inputs[] = {i - 10.0f, 5.0f - i};
+			ExpressionVM::ReturnValue expected = vm.evaluate(reference_code, inputs);
+			ExpressionVM::ReturnValue value = vm.evaluate(byte_code, inputs);
+			REQUIRE(value.type == expected.type);
+			if (value.type == Types::FLOAT) CHECK(value.f_value == expected.f_value);
+			else CHECK(value.b_value == expected.b_value);
+		}
+	}
+
+	uint8 byte_code[100];
+	CHECK(compileOptimized(compiler, "sin(1 < 5) + 1", byte_code, sizeof(byte_code)) < 0);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+	CHECK(compileOptimized(compiler, "2 > 1 > 0", byte_code, sizeof(byte_code)) < 0);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+	CHECK(compileOptimized(compiler, "1 + 2 +", byte_code, sizeof(byte_code)) < 0);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS);
+	CHECK(compileOptimized(compiler, "1 + 2 + z", byte_code, sizeof(byte_code)) < 0);
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+	// pruned operands are still checked, by the stages and by the single pass parser
+	ExpressionArena arena;
+	std::vector<uint8> pruned;
+	for (const char* unknown : {"1 > 2 and unknown_var > 0", "1 < 2 or nope > 0"})
+	{
+		INFO(unknown);
+		CHECK(compileOptimized(compiler, unknown, byte_code, sizeof(byte_code)) < 0);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+		CHECK(compiler.compile(unknown, arena, pruned) < 0);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+	}
+
+	float inputs[] = {1, 2};
+	CHECK(vm.compileAndRun(compiler, "1 < 2").b_value);
+	CHECK(!vm.compileAndRun(compiler, "1 > 2 or x > y", inputs).b_value);
+	float output[3];
+	const float xs[] = {1, 2, 3};
+	const float* columns[] = {xs, xs};
+	REQUIRE(compileOptimized(compiler, "1 < 2 and 2 < 3", byte_code, sizeof(byte_code)) > 0);
+	CHECK(vm.evaluateBatch(byte_code, columns, output, 3) == Types::BOOL);
+	CHECK(output[0] == 1.0f);
+	CHECK(output[2] == 1.0f);
+}
+
+
+TEST_CASE("Peephole", "Fuse instruction pairs") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+	uint8 byte_code[1024];
+
+	auto instruction = [&byte_code](int idx) {
+		const ProgramHeader& header = *(const ProgramHeader*)byte_code;
+		return header.instructions()[idx * Instruction::SIZE];
+	};
+
+	int size = compileSource(compiler, "x * 2 + y", byte_code, sizeof(byte_code));
+	CHECK(compiler.peephole(byte_code, size) == 1);
+	CHECK(instruction(0) == Instruction::MUL_ADD_FLOAT);
+	CHECK(instruction(1) == Instruction::OPERAND);
+	float inputs[] = {3, 4};
+	CHECK(vm.evaluate(byte_code, inputs).f_value == Approx(10.0f));
+
+	size = compileSource(compiler, "y + x * 2", byte_code, sizeof(byte_code));
+	CHECK(compiler.peephole(byte_code, size) == 1);
+	CHECK(vm.evaluate(byte_code, inputs).f_value == Approx(10.0f));
+
+	// the product is needed twice
+	size = compileSource(compiler, "(x * y) * 2 + 1", byte_code, sizeof(byte_code));
+	CHECK(compiler.peephole(byte_code, size) == 1);
+	CHECK(vm.evaluate(byte_code, inputs).f_value == Approx(25.0f));
+
+	// products added to an accumulator
+	size = compileSource(compiler, "1 + x * y + x * 2 + y * y", byte_code, sizeof(byte_code));
+	CHECK(compiler.peephole(byte_code, size) == 3);
+	CHECK(vm.evaluate(byte_code, inputs).f_value == Approx(35.0f));
+
+	size = compileSource(compiler, "x < 1 and y > 2", byte_code, sizeof(byte_code));
+	CHECK(compiler.peephole(byte_code, size) == 1);
+	CHECK(instruction(0) == Instruction::FLOAT_LT_JUMP_IF_FALSE);
+	CHECK(!vm.evaluate(byte_code, inputs).b_value);
+	CHECK(compiler.peephole(byte_code, size) == 0);
+
+	size = compileSource(compiler, "x > 1 or y < 2", byte_code, sizeof(byte_code));
+	CHECK(compiler.peephole(byte_code, size) == 1);
+	CHECK(instruction(0) == Instruction::FLOAT_GT_JUMP_IF_TRUE);
+	CHECK(vm.evaluate(byte_code, inputs).b_value);
+
+	// results match the unfused program in every evaluator
+	auto same = [](float a, float b) {
+		return Simd::bits(a) == Simd::bits(b) || (a != a && b != b);
+	};
+	static const int ROWS = 19;
+	float xs[ROWS];
+	float ys[ROWS];
+	for (int i = 0; i < ROWS; ++i)
+	{
+		xs[i] = i * 0.75f - 6;
+		ys[i] = 3 - i * 0.5f;
+	}
+	const float* columns[] = {xs, ys};
+	uint32 seed = 4321;
+	int fused = 0;
+	for (int i = 0; i < 200; ++i)
+	{
+		std::string src = randomExpression(seed, i % 2 == 1, 3);
+		INFO(src);
+		uint8 fused_code[1024];
+		size = compileOptimized(compiler, src.c_str(), byte_code, sizeof(byte_code));
+		REQUIRE(size > 0);
+		memcpy(fused_code, byte_code, size);
+		fused += compiler.peephole(fused_code, size);
+
+		ExpressionVM::DecodedProgram program;
+		REQUIRE(vm.decode(fused_code, program));
+		float expected[ROWS];
+		float output[ROWS];
+		REQUIRE(vm.evaluateBatch(byte_code, columns, expected, ROWS) ==
+				vm.evaluateBatch(fused_code, columns, output, ROWS));
+		for (int row = 0; row < ROWS; ++row)
+		{
+			float row_inputs[] = {xs[row], ys[row]};
+			ExpressionVM::ReturnValue value = vm.evaluate(byte_code, row_inputs);
+			ExpressionVM::ReturnValue fused_value = vm.evaluate(fused_code, row_inputs);
+			ExpressionVM::ReturnValue decoded_value = vm.evaluate(program, row_inputs);
+			REQUIRE(fused_value.type == value.type);
+			REQUIRE(decoded_value.type == value.type);
+			if (value.type == Types::FLOAT)
+			{
+				CHECK(same(fused_value.f_value, value.f_value));
+				CHECK(same(decoded_value.f_value, value.f_value));
+			}
+			else
+			{
+				CHECK(fused_value.b_value == value.b_value);
+				CHECK(decoded_value.b_value == value.b_value);
+			}
+			CHECK(same(output[row], expected[row]));
+		}
+	}
+	CHECK(fused > 0);
+
+	SECTION("Profile") {
+		ExpressionVM::PairProfile profile;
+		size = compileSource(compiler, "x * 2 + y", byte_code, sizeof(byte_code));
+		vm.profile(byte_code, inputs, profile);
+		vm.profile(byte_code, inputs, profile);
+		CHECK(profile.counts[Instruction::MUL_FLOAT][Instruction::ADD_FLOAT] == 2);
+		CHECK(profile.counts[Instruction::ADD_FLOAT][Instruction::RET_FLOAT] == 2);
+		CHECK(profile.counts[Instruction::RET_FLOAT][Instruction::MUL_FLOAT] == 0);
+
+		// a taken jump is followed by its target
+		size = compileSource(compiler, "x < 1 and y > 2", byte_code, sizeof(byte_code));
+		ExpressionVM::PairProfile jumps;
+		CHECK(!vm.profile(byte_code, inputs, jumps).b_value);
+		CHECK(jumps.counts[Instruction::FLOAT_LT][Instruction::JUMP_IF_FALSE] == 1);
+		CHECK(jumps.counts[Instruction::JUMP_IF_FALSE][Instruction::RET_BOOL] == 1);
+		CHECK(jumps.counts[Instruction::JUMP_IF_FALSE][Instruction::FLOAT_GT] == 0);
+	}
+}
+
+
+static float testClamp(float x, float lo, float hi)
+{
+	return x < lo ? lo : (x > hi ? hi : x);
+}
+
+
+static float testHypot(float a, float b)
+{
+	return sqrtf(a * a + b * b);
+}
+
+
+static bool testBetween(float x, float lo, float hi)
+{
+	return x > lo && x < hi;
+}
+
+
+static float testSelect(bool condition, float a, float b)
+{
+	return condition ? a : b;
+}
+
+
+static int test_counter_calls = 0;
+static float testCounter()
+{
+	return (float)++test_counter_calls;
+}
+
+
+TEST_CASE("Function registry", "Call registered native functions") {
+	static const uint16 CLAMP = FunctionRegistry::add("clamp", &testClamp);
+	static const uint16 HYPOT = FunctionRegistry::add("hypot", &testHypot);
+	static const uint16 BETWEEN = FunctionRegistry::add("between", &testBetween);
+	static const uint16 SELECT = FunctionRegistry::add("select", &testSelect);
+	static const uint16 COUNTER = FunctionRegistry::add("counter", &testCounter, false);
+	REQUIRE(CLAMP != FunctionRegistry::INVALID_INDEX);
+	REQUIRE(COUNTER != FunctionRegistry::INVALID_INDEX);
+	CHECK(FunctionRegistry::add("clamp", &testHypot) == FunctionRegistry::INVALID_INDEX);
+	CHECK(FunctionRegistry::find("sin", 3) == 0);
+	CHECK(FunctionRegistry::find("hypot", 5) == HYPOT);
+	CHECK(FunctionRegistry::find("hypo", 4) == FunctionRegistry::INVALID_INDEX);
+	CHECK(FunctionRegistry::get(CLAMP).arity == 3);
+	CHECK(FunctionRegistry::get(BETWEEN).ret_type == Types::BOOL);
+	CHECK(FunctionRegistry::get(SELECT).args[0] == Types::BOOL);
+	CHECK(FunctionRegistry::get(COUNTER).arity == 0);
+	CHECK(!FunctionRegistry::get(COUNTER).pure);
+
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+	float inputs[] = {3, -4};
+	CHECK(vm.compileAndRun(compiler, "clamp(x, 0, 1)", inputs).f_value == 1.0f);
+	CHECK(vm.compileAndRun(compiler, "clamp(y, 0, 1)", inputs).f_value == 0.0f);
+	CHECK(vm.compileAndRun(compiler, "hypot(x, y)", inputs).f_value == 5.0f);
+	CHECK(vm.compileAndRun(compiler, "hypot(y, x) * 2", inputs).f_value == 10.0f);
+	CHECK(vm.compileAndRun(compiler, "between(x, 0, 5) and y < 0", inputs).b_value);
+	CHECK(vm.compileAndRun(compiler, "select(x < y, x, y)", inputs).f_value == -4.0f);
+	uint8 nested[200];
+	const char* nested_src = "1 + clamp(hypot(x, y), 0, clamp(x, 0, 2)) * 2";
+	REQUIRE(compileSource(compiler, nested_src, nested, 200) > 0);
+	CHECK(vm.evaluate(nested, inputs).f_value == 5.0f);
+
+	vm.compileAndRun(compiler, "clamp(x, 0)");
+	CHECK(compiler.getError() == ExpressionCompiler::Error::NOT_ENOUGH_PARAMETERS);
+	vm.compileAndRun(compiler, "clamp(x, 0, 1, 2)");
+	CHECK(compiler.getError() == ExpressionCompiler::Error::TOO_MANY_PARAMETERS);
+	vm.compileAndRun(compiler, "clamp x");
+	CHECK(compiler.getError() == ExpressionCompiler::Error::MISSING_LEFT_PARENTHESIS);
+	vm.compileAndRun(compiler, "clamp(x, , 1)");
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNEXPECTED_CHAR);
+	vm.compileAndRun(compiler, "(x, 1)");
+	CHECK(compiler.getError() == ExpressionCompiler::Error::UNEXPECTED_CHAR);
+	vm.compileAndRun(compiler, "select(x, 1, 2)");
+	CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+
+	SECTION("Purity") {
+		// pure calls with constant arguments are folded, impure ones run on every evaluation
+		uint8 byte_code[100];
+		ExpressionVM::DecodedProgram decoded;
+		const char* src = "clamp(5, 0, 1) + hypot(3, 4)";
+		REQUIRE(compileOptimized(compiler, src, byte_code, sizeof(byte_code)) > 0);
+		REQUIRE(vm.decode(byte_code, decoded));
+		CHECK(decoded.instructions.size() == 1);
+		CHECK(vm.evaluate(byte_code, inputs).f_value == 6.0f);
+
+		REQUIRE(compileOptimized(compiler, "counter() + 0 * x", byte_code, sizeof(byte_code)) > 0);
+		int calls = test_counter_calls;
+		float first = vm.evaluate(byte_code, inputs).f_value;
+		CHECK(vm.evaluate(byte_code, inputs).f_value == first + 1);
+		CHECK(test_counter_calls == calls + 2);
+	}
+
+	SECTION("Batch") {
+		static const int ROWS = 13;
+		float xs[ROWS];
+		float ys[ROWS];
+		for (int i = 0; i < ROWS; ++i)
+		{
+			xs[i] = i - 6.0f;
+			ys[i] = 3 - i * 0.5f;
+		}
+		const float* columns[] = {xs, ys};
+		const char* SOURCES[] = {"clamp(x, y, 2)",
+			"hypot(y + 1, x)",
+			"select(between(x, y, 3), x * 2, hypot(x, 1))",
+			"between(clamp(x, -1, 1), y, 1) or x > 4"};
+		for (const char* src : SOURCES)
+		{
+			INFO(src);
+			uint8 byte_code[200];
+			int size = compileSource(compiler, src, byte_code, sizeof(byte_code));
+			REQUIRE(size > 0);
+			ExpressionJIT jit;
+			jit.compile(byte_code, size);
+			float output[ROWS];
+			float jit_output[ROWS];
+			Types type = vm.evaluateBatch(byte_code, columns, output, ROWS);
+			CHECK(jit.evaluateBatch(columns, jit_output, ROWS) == type);
+			for (int i = 0; i < ROWS; ++i)
+			{
+				float row[] = {xs[i], ys[i]};
+				ExpressionVM::ReturnValue value = vm.evaluate(byte_code, row);
+				ExpressionVM::ReturnValue jit_value = jit.evaluate(row);
+				REQUIRE(value.type == type);
+				float expected =
+					type == Types::BOOL ? (value.b_value ? 1.0f : 0.0f) : value.f_value;
+				CHECK(output[i] == expected);
+				CHECK(jit_output[i] == expected);
+				if (type == Types::BOOL) CHECK(jit_value.b_value == value.b_value);
+				else CHECK(jit_value.f_value == value.f_value);
+			}
+		}
+	}
+}
+
+
+TEST_CASE("Shared", "Compile a set of expressions to one program") {
+	static const uint16 HYPOT = FunctionRegistry::add("shared_hypot", &testHypot);
+	static const uint16 COUNTER = FunctionRegistry::add("shared_counter", &testCounter, false);
+	REQUIRE(HYPOT != FunctionRegistry::INVALID_INDEX);
+	REQUIRE(COUNTER != FunctionRegistry::INVALID_INDEX);
+
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	auto same = [](float a, float b) {
+		return Simd::bits(a) == Simd::bits(b) || (a != a && b != b);
+	};
+	auto countInstructions = [](const std::vector<uint8>& byte_code, Instruction::Type type) {
+		const ProgramHeader& header = *(const ProgramHeader*)&byte_code[0];
+		int count = 0;
+		const uint8* end = &byte_code[0] + byte_code.size();
+		for (const uint8* ip = header.instructions(); ip < end; ip += 4)
+		{
+			if (ip[0] == type) ++count;
+		}
+		return count;
+	};
+
+	static const char* SOURCES[] = {"sin(x) * y + 1",
+		"sin(x) * y - shared_hypot(y, x)",
+		"x < y and sin(x) * y > 0",
+		"PI",
+		"y",
+		"sin(x) * y + 1",
+		"shared_hypot(y, x) / 2"};
+	static const int COUNT = sizeof(SOURCES) / sizeof(SOURCES[0]);
+	std::vector<uint8> byte_code;
+	Types types[COUNT];
+	REQUIRE(compiler.compileShared(SOURCES, COUNT, byte_code, types) > 0);
+	CHECK(types[0] == Types::FLOAT);
+	CHECK(types[2] == Types::BOOL);
+	// sin(x) * y and shared_hypot(y, x) are computed once
+	CHECK(countInstructions(byte_code, Instruction::CALL) == 2);
+	CHECK(countInstructions(byte_code, Instruction::MUL_FLOAT) == 1);
+	CHECK(countInstructions(byte_code, Instruction::ADD_FLOAT) == 1);
+	CHECK(countInstructions(byte_code, Instruction::STORE_FLOAT) +
+			  countInstructions(byte_code, Instruction::STORE_BOOL) ==
+		  COUNT);
+
+	static const int ROWS = 37;
+	float xs[ROWS];
+	float ys[ROWS];
+	for (int i = 0; i < ROWS; ++i)
+	{
+		xs[i] = i * 0.5f - 9;
+		ys[i] = 3 - i * 0.25f;
+	}
+	const float* columns[] = {xs, ys};
+	float results_data[COUNT][ROWS];
+	float* results[COUNT];
+	for (int i = 0; i < COUNT; ++i) results[i] = results_data[i];
+	REQUIRE(vm.evaluateBatch(&byte_code[0], columns, results, ROWS) == Types::FLOAT);
+
+	ExpressionVM::DecodedProgram decoded;
+	REQUIRE(vm.decode(&byte_code[0], decoded));
+	for (int row = 0; row < ROWS; ++row)
+	{
+		float inputs[] = {xs[row], ys[row]};
+		float scalar[COUNT];
+		float threaded[COUNT];
+		ExpressionVM::ReturnValue last = vm.evaluate(&byte_code[0], inputs, scalar);
+		vm.evaluate(decoded, inputs, threaded);
+		CHECK(same(last.f_value, scalar[COUNT - 1]));
+		for (int i = 0; i < COUNT; ++i)
+		{
+			ExpressionVM::ReturnValue expected = vm.compileAndRun(compiler, SOURCES[i], inputs);
+			float value = expected.f_value;
+			if (expected.type == Types::BOOL) value = expected.b_value ? 1.0f : 0.0f;
+			CHECK(same(scalar[i], value));
+			CHECK(same(threaded[i], value));
+			CHECK(same(results[i][row], value));
+		}
+	}
+
+	SECTION("Impure functions are not shared") {
+		static const char* IMPURE[] = {"shared_counter() + x", "shared_counter() + x"};
+		REQUIRE(compiler.compileShared(IMPURE, 2, byte_code, types) > 0);
+		CHECK(countInstructions(byte_code, Instruction::CALL) == 2);
+		float inputs[] = {0, 0};
+		float values[2];
+		vm.evaluate(&byte_code[0], inputs, values);
+		CHECK(values[1] == values[0] + 1);
+	}
+
+	SECTION("Errors") {
+		static const char* UNKNOWN[] = {"x + 1", "x + z"};
+		CHECK(compiler.compileShared(UNKNOWN, 2, byte_code, types) == -1);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER);
+		static const char* TYPES[] = {"x < 1 + 2"};
+		CHECK(compiler.compileShared(TYPES, 1, byte_code, types) > 0);
+		static const char* WRONG_TYPES[] = {"(x < 1) + 2"};
+		CHECK(compiler.compileShared(WRONG_TYPES, 1, byte_code, types) == -1);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+		CHECK(compiler.compileShared(SOURCES, 0, byte_code, types) == -1);
+	}
+
+	SECTION("Random") {
+		// every result matches its own program bit for bit, also after peephole and in batches
+		uint32 seed = 777;
+		for (int set = 0; set < 20; ++set)
+		{
+			std::vector<std::string> sources;
+			std::vector<const char*> pointers;
+			for (int i = 0; i < 10; ++i) sources.push_back(randomExpression(seed, i % 3 == 2, 3));
+			for (auto& src : sources) pointers.push_back(src.c_str());
+			Types set_types[10];
+			REQUIRE(compiler.compileShared(&pointers[0], 10, byte_code, set_types) > 0);
+			if (set % 2 == 1) compiler.peephole(&byte_code[0], (int)byte_code.size());
+
+			float batch_data[10][ROWS];
+			float* batch[10];
+			for (int i = 0; i < 10; ++i) batch[i] = batch_data[i];
+			vm.evaluateBatch(&byte_code[0], columns, batch, ROWS);
+			for (int i = 0; i < 10; ++i)
+			{
+				uint8 single[1024];
+				INFO(sources[i]);
+				REQUIRE(compileOptimized(compiler, pointers[i], single, sizeof(single)) > 0);
+				float expected[ROWS];
+				REQUIRE(vm.evaluateBatch(single, columns, expected, ROWS) == set_types[i]);
+				for (int row = 0; row < ROWS; ++row) CHECK(same(batch[i][row], expected[row]));
+			}
+			for (int row = 0; row < ROWS; row += 5)
+			{
+				float inputs[] = {xs[row], ys[row]};
+				float values[10];
+				vm.evaluate(&byte_code[0], inputs, values);
+				for (int i = 0; i < 10; ++i) CHECK(same(values[i], batch[i][row]));
+			}
+		}
+	}
+}
+
+
+TEST_CASE("Number types", "Programs of doubles and int64") {
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+	uint32 float_signature = compiler.getSignature();
+	uint8 byte_code[256];
+
+	SECTION("Double") {
+		compiler.setNumberType(Types::DOUBLE);
+		CHECK(compiler.getSignature() != float_signature);
+		DoubleExpressionVM vm;
+		double inputs[] = {1e9, 3};
+		auto run = [&](const char* src) {
+			int size = compileOptimized(compiler, src, byte_code, sizeof(byte_code));
+			REQUIRE(size > 0);
+			return vm.evaluate(byte_code, inputs);
+		};
+		CHECK(run("x + 0.1").value == 1e9 + 0.1);
+		CHECK(run("x + 0.1").type == Types::DOUBLE);
+		CHECK(run("16777217 + 1").value == 16777218.0);
+		CHECK(run("0.1 + 0.2").value == 0.1 + 0.2);
+		CHECK(run("PI").value == 3.14159265358979323846);
+		CHECK(run("x / y").value == 1e9 / 3);
+		CHECK(run("-y * 2 - x").value == -1e9 - 6);
+		CHECK(run("x > y and y < 4").b_value);
+		CHECK(run("x < y or y > 4").type == Types::BOOL);
+		CHECK(!run("x < y or y > 4").b_value);
+		// functions take floats
+		CHECK(run("sin(y)").value == (double)sinf(3.0f));
+
+		// fused instructions keep the precision
+		int size = compileOptimized(compiler, "x * y + 0.25", byte_code, sizeof(byte_code));
+		CHECK(compiler.peephole(byte_code, size) == 1);
+		CHECK(vm.evaluate(byte_code, inputs).value == 3e9 + 0.25);
+
+		// the float VM and JIT reject the program
+		ExpressionVM float_vm;
+		ExpressionVM::DecodedProgram decoded;
+		CHECK(!float_vm.decode(byte_code, decoded));
+		float float_output[4];
+		const float* float_columns[2] = {float_output, float_output};
+		CHECK(float_vm.evaluateBatch(byte_code, float_columns, float_output, 4) == Types::NONE);
+		ExpressionJIT jit;
+		CHECK(!jit.compile(byte_code, size));
+		float float_inputs[] = {1, 3};
+		CHECK(float_vm.evaluate(byte_code, float_inputs).type == Types::NONE);
+		ExpressionVM::PairProfile pairs;
+		CHECK(float_vm.profile(byte_code, float_inputs, pairs).type == Types::NONE);
+		CHECK(float_vm.compileAndRun(compiler, "1 + 2").type == Types::NONE);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+		Int64ExpressionVM int_vm;
+		int64 int_inputs[] = {1, 2};
+		CHECK(int_vm.evaluate(byte_code, int_inputs).type == Types::NONE);
+
+		double xs[] = {0.1, 0.2, 0.3, 1e10};
+		double ys[] = {1, 2, 3, 4};
+		const double* columns[] = {xs, ys};
+		double output[4];
+		REQUIRE(compileOptimized(compiler, "x * y + 0.1", byte_code, sizeof(byte_code)) > 0);
+		REQUIRE(vm.evaluateBatch(byte_code, columns, output, 4) == Types::DOUBLE);
+		for (int i = 0; i < 4; ++i) CHECK(output[i] == xs[i] * ys[i] + 0.1);
+
+		static const char* SOURCES[] = {"x + 0.1", "(x + 0.1) * y", "x + 0.1 > y"};
+		std::vector<uint8> shared;
+		Types types[3];
+		REQUIRE(compiler.compileShared(SOURCES, 3, shared, types) > 0);
+		CHECK(types[1] == Types::DOUBLE);
+		CHECK(types[2] == Types::BOOL);
+		double results[3];
+		vm.evaluate(&shared[0], inputs, results);
+		CHECK(results[0] == 1e9 + 0.1);
+		CHECK(results[1] == (1e9 + 0.1) * 3);
+		CHECK(results[2] == 1);
+	}
+
+	SECTION("Int64") {
+		compiler.setNumberType(Types::INT64);
+		Int64ExpressionVM vm;
+		int64 inputs[] = {10000000000LL, -7};
+		auto run = [&](const char* src) {
+			int size = compileOptimized(compiler, src, byte_code, sizeof(byte_code));
+			REQUIRE(size > 0);
+			return vm.evaluate(byte_code, inputs);
+		};
+		CHECK(run("x * 3 + 9007199254740993").value == 30000000000LL + 9007199254740993LL);
+		CHECK(run("x").type == Types::INT64);
+		CHECK(run("7 / 2").value == 3);
+		CHECK(run("y / 2").value == -3);
+		CHECK(run("x / 0").value == 0);
+		CHECK(run("9223372036854775807 + 1").value == LLONG_MIN);
+		CHECK(run("-(y) * y").value == -49);
+		CHECK(run("y < 0 and x > 0").b_value);
+		CHECK(run("x > 1 or y > 1").b_value);
+		ExpressionVM float_vm;
+		CHECK(float_vm.evaluate(byte_code).type == Types::NONE);
+		CHECK(float_vm.compileAndRun(compiler, "x").type == Types::NONE);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+
+		CHECK(compileOptimized(compiler, "x + 0.5", byte_code, sizeof(byte_code)) == -1);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+		CHECK(compileOptimized(compiler, "PI * x", byte_code, sizeof(byte_code)) == -1);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::INCORRECT_TYPE_ARGS);
+		const char* too_large = "x + 9223372036854775808";
+		CHECK(compileOptimized(compiler, too_large, byte_code, sizeof(byte_code)) == -1);
+	}
+}
+
+
+#ifdef EXPRESSIONS_CONSTEXPR
+TEST_CASE("Constexpr", "Compile expression literals at C++ compile time") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+	uint8 expected[1024];
+
+	const auto& program = EXPR("x * 2 + sin(y)", "x", "y");
+	int size = compileSource(compiler, "x * 2 + sin(y)", expected, sizeof(expected));
+	REQUIRE(size == (int)program.size());
+	CHECK(memcmp(program.data(), expected, size) == 0);
+	float inputs[] = {3, 0};
+	CHECK(vm.evaluate(program.data(), inputs).f_value == 6);
+	CHECK(vm.evaluate(EXPR("y < x and cos(0) > 0.5", "x", "y").data(), inputs).b_value);
+	CHECK(vm.evaluate(EXPR("-PI / 2").data()).f_value == -3.14159265358979323846f / 2);
+
+	// builtins are resolved by their registry index
+	CHECK(FunctionRegistry::find("sin", 3) == 0);
+	CHECK(FunctionRegistry::find("cos", 3) == 1);
+	CHECK(FunctionRegistry::find("sqrt", 4) == 4);
+
+	constexpr ConstexprCompiler::Result unknown = ConstexprCompiler::compile({"x + z", {"x"}});
+	static_assert(unknown.error == ExpressionCompiler::Error::UNKNOWN_IDENTIFIER, "");
+	static_assert(unknown.error_offset == 4 && unknown.size == 0, "");
+
+	SECTION("Same as runtime") {
+		// compile() also runs at runtime, programs and errors match ExpressionCompiler
+		static const char* SOURCES[] = {"1.5e3 * x - 0.001",
+			"123456789 + 1e-20 + 0.1e11 + 3.0E+2",
+			"sin x * cos -y",
+			"x < 1 and y > 2 or x > y",
+			"(x < 1 or y < 1) and (x > 0 or y > 0)",
+			"x +",
+			"* 1",
+			"sin()",
+			"sin(x, y)",
+			"(x + 1",
+			"x + 1)",
+			"x, y",
+			"x < 1 + 2",
+			"(x < 1) + 2",
+			"x and y",
+			"10 . 5",
+			"z * 2"};
+		uint32 seed = 1234;
+		std::vector<std::string> sources(std::begin(SOURCES), std::end(SOURCES));
+		for (int i = 0; i < 200; ++i) sources.push_back(randomExpression(seed, i % 2 == 0, 4));
+		for (const std::string& src : sources)
+		{
+			INFO(src);
+			ConstexprCompiler::Source source = {src.c_str(), {"x", "y"}};
+			auto result =
+				std::make_unique<ConstexprCompiler::Result>(ConstexprCompiler::compile(source));
+			size = compileSource(compiler, src.c_str(), expected, sizeof(expected));
+			CHECK(result->error == compiler.getError());
+			REQUIRE(result->size == (size < 0 ? 0 : size));
+			CHECK(memcmp(result->byte_code, expected, result->size) == 0);
+		}
+	}
+}
+#endif
+
+
+TEST_CASE("JIT", "Native code matches the interpreter") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	auto same = [](float a, float b) {
+		return Simd::bits(a) == Simd::bits(b) || (a != a && b != b);
+	};
+
+	static const int ROWS = 23;
+	float xs[ROWS];
+	float ys[ROWS];
+	for (int i = 0; i < ROWS; ++i)
+	{
+		xs[i] = i * 0.75f - 8;
+		ys[i] = 4 - i * 0.5f;
+	}
+	const float* columns[] = {xs, ys};
+
+	uint32 seed = 1234;
+	for (int i = 0; i < 200; ++i)
+	{
+		std::string src = randomExpression(seed, i % 2 == 1, 3);
+		uint8 byte_code[1024];
+		auto compile = i % 4 < 2 ? compileSource : compileOptimized;
+		int size = compile(compiler, src.c_str(), byte_code, sizeof(byte_code));
+		INFO(src);
+		REQUIRE(size > 0);
+		if (i % 4 == 3) compiler.peephole(byte_code, size);
+
+		ExpressionJIT jit;
+#ifdef EXPRESSIONS_JIT
+		REQUIRE(jit.compile(byte_code, size));
+		REQUIRE(jit.isNative());
+#else
+		REQUIRE(!jit.compile(byte_code, size));
+#endif
+		for (int row = 0; row < ROWS; ++row)
+		{
+			float inputs[] = {xs[row], ys[row]};
+			ExpressionVM::ReturnValue expected = vm.evaluate(byte_code, inputs);
+			ExpressionVM::ReturnValue value = jit.evaluate(inputs);
+			REQUIRE(value.type == expected.type);
+			if (value.type == Types::FLOAT) CHECK(same(value.f_value, expected.f_value));
+			else CHECK(value.b_value == expected.b_value);
+		}
+
+		for (int count : {0, 3, 4, 17, ROWS})
+		{
+			float expected[ROWS];
+			float output[ROWS + 1];
+			output[count] = 42;
+			Types type = vm.evaluateBatch(byte_code, columns, expected, count);
+			REQUIRE(jit.evaluateBatch(columns, output, count) == type);
+			CHECK(output[count] == 42);
+			for (int row = 0; row < count; ++row) CHECK(same(output[row], expected[row]));
+		}
+	}
+}
+
+
+TEST_CASE("Math tiers", "SIMD builtin math in batch evaluation") {
+	typedef void (*BatchFunction)(float*, const float*, int, MathTier);
+	static const struct
+	{
+		const char* name;
+		BatchFunction batch;
+		double (*reference)(double);
+		double max_ulp[3]; // by MathTier
+	} FUNCTIONS[] = {{"sin", &Simd::sin, ::sin, {1, 3, 27}},
+		{"cos", &Simd::cos, ::cos, {1, 3, 27}},
+		{"exp", &Simd::exp, ::exp, {1, 1, 70}},
+		{"log", &Simd::log, ::log, {1, 1, 207}},
+		{"sqrt", &Simd::sqrt, ::sqrt, {1, 1, 1}}};
+
+	auto ulps = [](float value, double expected) {
+		if (std::isnan(expected)) return std::isnan(value) ? 0.0 : 1e9;
+		if (std::fabs(expected) > FLT_MAX)
+		{
+			return std::isinf(value) && (value > 0) == (expected > 0) ? 0.0 : 1e9;
+		}
+		int exponent;
+		std::frexp(expected == 0 ? FLT_MIN : expected, &exponent);
+		return std::fabs(value - expected) / std::ldexp(1.0, std::max(exponent - 24, -149));
+	};
+
+	// every 4099th float, so all exponents and signs are covered
+	std::vector<float> inputs;
+	for (uint64 bits = 0; bits < 0x100000000ULL; bits += 4099)
+	{
+		inputs.push_back(Simd::mask((uint32)bits));
+	}
+	for (float special :
+		{0.0f, 1.0f, 4096.0f, -87.0f, 88.0f, FLT_MIN, FLT_MAX, INFINITY, -INFINITY, NAN})
+	{
+		inputs.push_back(special);
+	}
+	std::vector<float> outputs(inputs.size());
+	for (const auto& fn : FUNCTIONS)
+	{
+		for (MathTier tier : {MathTier::STANDARD, MathTier::PRECISE, MathTier::FAST})
+		{
+			INFO(fn.name << " tier " << (int)tier);
+			fn.batch(&outputs[0], &inputs[0], (int)inputs.size(), tier);
+			double max_ulp = 0;
+			for (size_t i = 0; i < inputs.size(); ++i)
+			{
+				max_ulp = std::max(max_ulp, ulps(outputs[i], fn.reference(inputs[i])));
+			}
+			CHECK(max_ulp <= fn.max_ulp[(int)tier]);
+
+			// any count, in place
+			float values[] = {0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f, 8.5f, NAN, 1e30f};
+			float expected[11];
+			fn.batch(expected, values, 11, tier);
+			for (int count = 0; count <= 11; ++count)
+			{
+				float copy[12];
+				memcpy(copy, values, sizeof(values));
+				copy[count] = 42;
+				fn.batch(copy, copy, count, tier);
+				CHECK(copy[count] == 42);
+				for (int i = 0; i < count; ++i)
+				{
+					CHECK(Simd::bits(copy[i]) == Simd::bits(expected[i]));
+				}
+			}
+		}
+	}
+
+	SECTION("Batch evaluation") {
+		ExpressionVM vm;
+		ExpressionCompiler compiler;
+		static const char* VARIABLES[] = {"x", "y"};
+		compiler.setVariables(VARIABLES, 2);
+		const char* src = "sin(x) * cos(y) + exp(y) - log(x) * sqrt(x)";
+
+		static const int ROWS = 21;
+		float xs[ROWS];
+		float ys[ROWS];
+		for (int i = 0; i < ROWS; ++i)
+		{
+			xs[i] = 0.25f + i * 1.5f;
+			ys[i] = 2 - i * 0.75f;
+		}
+		const float* columns[] = {xs, ys};
+
+		uint32 signature = compiler.getSignature();
+		uint8 standard[1024];
+		REQUIRE(compileSource(compiler, src, standard, sizeof(standard)) > 0);
+		compiler.setMathTier(MathTier::FAST);
+		CHECK(compiler.getSignature() != signature);
+		uint8 fast[1024];
+		int size = compileSource(compiler, src, fast, sizeof(fast));
+		REQUIRE(size > 0);
+		CHECK(((const ProgramHeader*)fast)->math_tier == MathTier::FAST);
+
+		float standard_output[ROWS];
+		float fast_output[ROWS];
+		REQUIRE(vm.evaluateBatch(standard, columns, standard_output, ROWS) == Types::FLOAT);
+		REQUIRE(vm.evaluateBatch(fast, columns, fast_output, ROWS) == Types::FLOAT);
+		for (int row = 0; row < ROWS; ++row)
+		{
+			float x = xs[row];
+			float y = ys[row];
+			float inputs[] = {x, y};
+			CHECK(standard_output[row] == vm.evaluate(standard, inputs).f_value);
+			// the scalar evaluation ignores the tier
+			CHECK(vm.evaluate(fast, inputs).f_value == vm.evaluate(standard, inputs).f_value);
+			float expected = sinf(x) * cosf(y) + expf(y) - logf(x) * sqrtf(x);
+			CHECK(fast_output[row] == Approx(expected).epsilon(1e-4));
+		}
+
+		ExpressionJIT jit;
+		jit.compile(fast, size);
+		for (int count : {1, 4, 17, ROWS})
+		{
+			float output[ROWS];
+			REQUIRE(jit.evaluateBatch(columns, output, count) == Types::FLOAT);
+			for (int row = 0; row < count; ++row) CHECK(output[row] == fast_output[row]);
+		}
+	}
+}
+
+
+TEST_CASE("Filter", "Selection bitmaps from predicates") {
+	static const uint16 BETWEEN = FunctionRegistry::add("filter_between", &testBetween);
+	static const uint16 SELECT = FunctionRegistry::add("filter_select", &testSelect);
+	REQUIRE(BETWEEN != FunctionRegistry::INVALID_INDEX);
+	REQUIRE(SELECT != FunctionRegistry::INVALID_INDEX);
+
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	// not a multiple of 64, bits past the last row must stay untouched
+	static const int ROWS = 1000;
+	static const int WORDS = (ROWS + 63) / 64;
+	float xs[ROWS];
+	float ys[ROWS];
+	for (int i = 0; i < ROWS; ++i)
+	{
+		xs[i] = (i * 37 % 101) * 0.2f - 10;
+		ys[i] = (i * 53 % 97) * 0.25f - 12;
+	}
+	const float* columns[] = {xs, ys};
+
+	uint64 all[WORDS];
+	uint64 sparse[WORDS];
+	uint64 random[WORDS];
+	uint64 none[WORDS] = {};
+	uint32 seed = 99;
+	for (int i = 0; i < WORDS; ++i)
+	{
+		all[i] = ~0ULL;
+		sparse[i] = 0x8000100002000040ULL;
+		seed = seed * 1664525U + 1013904223U;
+		random[i] = (uint64)seed << 32 | (seed * 1664525U + 1013904223U);
+	}
+	const uint64* SELECTIONS[] = {all, sparse, random, none};
+
+	auto check = [&](const uint8* code, const uint64* initial) {
+		uint64 selection[WORDS];
+		memcpy(selection, initial, sizeof(selection));
+		int expected_count = 0;
+		uint64 expected[WORDS];
+		memcpy(expected, initial, sizeof(expected));
+		for (int row = 0; row < ROWS; ++row)
+		{
+			if ((initial[row >> 6] >> (row & 63) & 1) == 0) continue;
+			float inputs[] = {xs[row], ys[row]};
+			if (vm.evaluate(code, inputs).b_value) ++expected_count;
+			else expected[row >> 6] &= ~(1ULL << (row & 63));
+		}
+		CHECK(vm.filter(code, columns, selection, ROWS) == expected_count);
+		for (int i = 0; i < WORDS; ++i) CHECK(selection[i] == expected[i]);
+	};
+
+	SECTION("Same as scalar") {
+		for (int i = 0; i < 200; ++i)
+		{
+			std::string src = randomExpression(seed, true, 3);
+			if (i % 5 == 4)
+			{
+				src = "filter_between(x, -2, y) or filter_select(" + src + ", x, y) > 0";
+			}
+			uint8 byte_code[1024];
+			auto compile = i % 4 < 2 ? compileSource : compileOptimized;
+			int size = compile(compiler, src.c_str(), byte_code, sizeof(byte_code));
+			INFO(src);
+			REQUIRE(size > 0);
+			if (i % 4 == 3) compiler.peephole(byte_code, size);
+			if (((const ProgramHeader*)byte_code)->result_type != Types::BOOL) continue;
+			for (const uint64* selection : SELECTIONS) check(byte_code, selection);
+		}
+	}
+
+	SECTION("Chained") {
+		uint8 first[1024];
+		uint8 second[1024];
+		uint8 both[1024];
+		REQUIRE(compileSource(compiler, "x < 2 or y > 5", first, sizeof(first)) > 0);
+		REQUIRE(compileSource(compiler, "sin(x) * y > 0", second, sizeof(second)) > 0);
+		const char* both_src = "(x < 2 or y > 5) and sin(x) * y > 0";
+		REQUIRE(compileSource(compiler, both_src, both, sizeof(both)) > 0);
+		uint64 chained[WORDS];
+		uint64 combined[WORDS];
+		memcpy(chained, all, sizeof(chained));
+		memcpy(combined, all, sizeof(combined));
+		int count = vm.filter(first, columns, chained, ROWS);
+		CHECK(count > 0);
+		CHECK(vm.filter(second, columns, chained, ROWS) < count);
+		vm.filter(both, columns, combined, ROWS);
+		CHECK(memcmp(chained, combined, sizeof(chained)) == 0);
+
+		uint8 number[1024];
+		REQUIRE(compileSource(compiler, "x + 1", number, sizeof(number)) > 0);
+		CHECK(vm.filter(number, columns, chained, ROWS) == -1);
+		CHECK(memcmp(chained, combined, sizeof(chained)) == 0);
+	}
+}
+
+
+TEST_CASE("Aggregate", "Reduce expressions over columns") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	// not a multiple of the block size, padded rows must not count
+	static const int ROWS = 3 * ExpressionVM::BATCH_BLOCK_SIZE + 7;
+	std::vector<float> xs(ROWS);
+	std::vector<float> ys(ROWS);
+	for (int i = 0; i < ROWS; ++i)
+	{
+		xs[i] = (i * 37 % 101) * 0.2f - 10;
+		ys[i] = (i * 53 % 97) * 0.25f - 12;
+	}
+	const float* columns[] = {&xs[0], &ys[0]};
+
+	// reference by scalar evaluation of the parts
+	auto reference = [&](const char* expr, const char* predicate, Aggregate type) {
+		uint8 expr_code[1024];
+		uint8 predicate_code[1024];
+		REQUIRE(compileSource(compiler, expr, expr_code, sizeof(expr_code)) > 0);
+		if (predicate)
+		{
+			REQUIRE(compileSource(compiler, predicate, predicate_code, sizeof(predicate_code)) > 0);
+		}
+		ExpressionVM::Accumulator result;
+		for (int row = 0; row < ROWS; ++row)
+		{
+			float inputs[] = {xs[row], ys[row]};
+			if (predicate && !vm.evaluate(predicate_code, inputs).b_value) continue;
+			ExpressionVM::ReturnValue value = vm.evaluate(expr_code, inputs);
+			if (type == Aggregate::COUNT)
+			{
+				if (value.b_value) ++result.count;
+				continue;
+			}
+			++result.count;
+			result.sum += value.f_value;
+			if (value.f_value < result.min) result.min = value.f_value;
+			if (value.f_value > result.max) result.max = value.f_value;
+		}
+		return result;
+	};
+
+	SECTION("Same as scalar") {
+		static const struct
+		{
+			const char* src;
+			const char* expr;
+			const char* predicate;
+			Aggregate type;
+		} CASES[] = {{"sum(x * y)", "x * y", nullptr, Aggregate::SUM},
+			{"  sum ( (x + 1) * (y - 2) ) ", "(x + 1) * (y - 2)", nullptr, Aggregate::SUM},
+			{"min(x - y) where x > 0", "x - y", "x > 0", Aggregate::MIN},
+			{"max(sin(x) * y) where y < 3 and x > -4",
+				"sin(x) * y",
+				"y < 3 and x > -4",
+				Aggregate::MAX},
+			{"avg(x) where x * y > 0", "x", "x * y > 0", Aggregate::AVG},
+			{"count(x > y)", "x > y", nullptr, Aggregate::COUNT},
+			{"count(x > y) where y > 0", "x > y", "y > 0", Aggregate::COUNT},
+			{"sum(x) where x > x", "x", "x > x", Aggregate::SUM},
+			{"sum(2)", "2", nullptr, Aggregate::SUM}};
+		for (auto& test : CASES)
+		{
+			INFO(test.src);
+			std::vector<uint8> byte_code;
+			REQUIRE(compiler.compileAggregate(test.src, byte_code) > 0);
+			CHECK(((const ProgramHeader*)&byte_code[0])->aggregate == test.type);
+			ExpressionVM::Accumulator expected = reference(test.expr, test.predicate, test.type);
+			ExpressionVM::Accumulator result;
+			REQUIRE(vm.aggregate(&byte_code[0], columns, ROWS, result));
+			CHECK(result.count == expected.count);
+			if (test.type == Aggregate::SUM || test.type == Aggregate::AVG)
+			{
+				CHECK(result.sum == Approx(expected.sum).epsilon(1e-6));
+			}
+			if (test.type == Aggregate::MIN) CHECK(result.min == expected.min);
+			if (test.type == Aggregate::MAX) CHECK(result.max == expected.max);
+
+			// in parts, merged
+			ExpressionVM::Accumulator merged;
+			const float* rest[] = {&xs[100], &ys[100]};
+			REQUIRE(vm.aggregate(&byte_code[0], columns, 100, merged));
+			REQUIRE(vm.aggregate(&byte_code[0], rest, ROWS - 100, merged));
+			CHECK(merged.count == result.count);
+			CHECK(merged.get(test.type) == Approx(result.get(test.type)).epsilon(1e-6));
+		}
+	}
+
+	SECTION("Empty") {
+		std::vector<uint8> byte_code;
+		for (const char* src :
+			{"avg(x) where x > 10", "min(x) where x > 10", "max(x) where x > 10"})
+		{
+			REQUIRE(compiler.compileAggregate(src, byte_code) > 0);
+			ExpressionVM::Accumulator result;
+			REQUIRE(vm.aggregate(&byte_code[0], columns, ROWS, result));
+			CHECK(result.count == 0);
+			CHECK(std::isnan(result.get(((const ProgramHeader*)&byte_code[0])->aggregate)));
+		}
+		REQUIRE(compiler.compileAggregate("sum(x)", byte_code) > 0);
+		ExpressionVM::Accumulator result;
+		REQUIRE(vm.aggregate(&byte_code[0], columns, 0, result));
+		CHECK(result.get(Aggregate::SUM) == 0);
+		CHECK(result.get(Aggregate::COUNT) == 0);
+	}
+
+	SECTION("NaN") {
+		std::vector<float> values(ROWS);
+		for (int i = 0; i < ROWS; ++i) values[i] = i % 3 == 0 ? NAN : (float)i;
+		const float* nan_columns[] = {&values[0], &ys[0]};
+		std::vector<uint8> byte_code;
+		REQUIRE(compiler.compileAggregate("min(x)", byte_code) > 0);
+		ExpressionVM::Accumulator result;
+		REQUIRE(vm.aggregate(&byte_code[0], nan_columns, ROWS, result));
+		CHECK(result.get(Aggregate::MIN) == 1);
+		REQUIRE(compiler.compileAggregate("max(x)", byte_code) > 0);
+		result = ExpressionVM::Accumulator();
+		REQUIRE(vm.aggregate(&byte_code[0], nan_columns, ROWS, result));
+		CHECK(result.get(Aggregate::MAX) == (float)((ROWS - 1) % 3 == 0 ? ROWS - 2 : ROWS - 1));
+
+		// rows are included, but there is no number to compare
+		std::fill(values.begin(), values.end(), NAN);
+		for (const char* src : {"min(x)", "max(x)", "min(x) where y > 0", "max(x + y)"})
+		{
+			INFO(src);
+			REQUIRE(compiler.compileAggregate(src, byte_code) > 0);
+			result = ExpressionVM::Accumulator();
+			REQUIRE(vm.aggregate(&byte_code[0], nan_columns, ROWS, result));
+			CHECK(result.count > 0);
+			CHECK(std::isnan(result.get(((const ProgramHeader*)&byte_code[0])->aggregate)));
+		}
+		// a number in one part is kept by the merge
+		values[ROWS - 1] = 5;
+		REQUIRE(compiler.compileAggregate("min(x)", byte_code) > 0);
+		result = ExpressionVM::Accumulator();
+		REQUIRE(vm.aggregate(&byte_code[0], nan_columns, 100, result));
+		const float* rest[] = {&values[100], &ys[100]};
+		REQUIRE(vm.aggregate(&byte_code[0], rest, ROWS - 100, result));
+		CHECK(result.get(Aggregate::MIN) == 5);
+	}
+
+	SECTION("Compensated sum") {
+		// a float accumulator drifts by thousands of ulps here
+		static const int COUNT = 1 << 20;
+		std::vector<float> tenths(COUNT, 0.1f);
+		const float* tenth_columns[] = {&tenths[0], &tenths[0]};
+		std::vector<uint8> byte_code;
+		REQUIRE(compiler.compileAggregate("sum(x)", byte_code) > 0);
+		ExpressionVM::Accumulator result;
+		REQUIRE(vm.aggregate(&byte_code[0], tenth_columns, COUNT, result));
+		CHECK(result.sum == Approx((double)0.1f * COUNT).epsilon(1e-12));
+		float naive = 0;
+		for (float value : tenths) naive += value;
+		CHECK(fabs(naive - (double)0.1f * COUNT) > fabs(result.sum - (double)0.1f * COUNT));
+	}
+
+	SECTION("Engine") {
+		static const char* SOURCES[] = {
+			"sum(x * y)", "avg(y) where x > 0", "count(x < y)", "min(y)"};
+		static const int PROGRAMS = sizeof(SOURCES) / sizeof(SOURCES[0]);
+		static const int ENGINE_ROWS = 2 * ExpressionEngine::BLOCK_SIZE + 100;
+		std::vector<float> engine_xs(ENGINE_ROWS);
+		std::vector<float> engine_ys(ENGINE_ROWS);
+		for (int i = 0; i < ENGINE_ROWS; ++i)
+		{
+			engine_xs[i] = (i % 997) * 0.02f - 10;
+			engine_ys[i] = 5 - (i % 13) * 0.75f;
+		}
+		const float* engine_columns[] = {&engine_xs[0], &engine_ys[0]};
+		std::vector<std::vector<uint8>> programs(PROGRAMS);
+		const uint8* program_pointers[PROGRAMS];
+		for (int i = 0; i < PROGRAMS; ++i)
+		{
+			REQUIRE(compiler.compileAggregate(SOURCES[i], programs[i]) > 0);
+			program_pointers[i] = &programs[i][0];
+		}
+
+		ExpressionVM::Accumulator single[PROGRAMS];
+		{
+			ExpressionEngine engine(1);
+			REQUIRE(engine.aggregate(
+				program_pointers, PROGRAMS, engine_columns, 2, ENGINE_ROWS, single));
+		}
+		for (int i = 0; i < PROGRAMS; ++i)
+		{
+			ExpressionVM::Accumulator expected;
+			REQUIRE(vm.aggregate(program_pointers[i], engine_columns, ENGINE_ROWS, expected));
+			CHECK(single[i].count == expected.count);
+			CHECK(single[i].sum == Approx(expected.sum).epsilon(1e-6));
+			CHECK(single[i].min == expected.min);
+		}
+		// the same bits for any thread count
+		for (int thread_count : {3, 8})
+		{
+			ExpressionEngine engine(thread_count);
+			ExpressionVM::Accumulator results[PROGRAMS];
+			REQUIRE(engine.aggregate(
+				program_pointers, PROGRAMS, engine_columns, 2, ENGINE_ROWS, results));
+			for (int i = 0; i < PROGRAMS; ++i)
+			{
+				CHECK(results[i].count == single[i].count);
+				CHECK(results[i].sum == single[i].sum);
+				CHECK(results[i].min == single[i].min);
+			}
+		}
+
+		uint8 plain[1024];
+		REQUIRE(compileSource(compiler, "x + y", plain, sizeof(plain)) > 0);
+		const uint8* plain_pointers[] = {plain};
+		ExpressionEngine engine(2);
+		ExpressionVM::Accumulator result;
+		CHECK(!engine.aggregate(plain_pointers, 1, engine_columns, 2, ENGINE_ROWS, &result));
+	}
+
+	SECTION("Errors") {
+		using Error = ExpressionCompiler::Error;
+		static const struct
+		{
+			const char* src;
+			Error error;
+		} CASES[] = {{"median(x)", Error::UNKNOWN_IDENTIFIER},
+			{"x + 1", Error::UNKNOWN_IDENTIFIER},
+			{"sum x", Error::MISSING_LEFT_PARENTHESIS},
+			{"sum((x)", Error::MISSING_RIGHT_PARENTHESIS},
+			{"sum(x) + 1", Error::UNEXPECTED_CHAR},
+			{"sum(x) wherever x > 0", Error::UNEXPECTED_CHAR},
+			{"sum(x > 0)", Error::INCORRECT_TYPE_ARGS},
+			{"count(x)", Error::INCORRECT_TYPE_ARGS},
+			{"sum(x) where x + 1", Error::INCORRECT_TYPE_ARGS},
+			{"sum(z)", Error::UNKNOWN_IDENTIFIER},
+			{"sum(x) where z > 0", Error::UNKNOWN_IDENTIFIER},
+			{"sum(x) where", Error::NOT_ENOUGH_PARAMETERS},
+			{"sum( )", Error::NOT_ENOUGH_PARAMETERS}};
+		for (auto& test : CASES)
+		{
+			INFO(test.src);
+			std::vector<uint8> byte_code;
+			CHECK(compiler.compileAggregate(test.src, byte_code) == -1);
+			CHECK(compiler.getError() == test.error);
+		}
+
+		uint8 plain[1024];
+		REQUIRE(compileSource(compiler, "x + y", plain, sizeof(plain)) > 0);
+		ExpressionVM::Accumulator result;
+		CHECK(!vm.aggregate(plain, columns, ROWS, result));
+		compiler.setNumberType(Types::DOUBLE);
+		std::vector<uint8> byte_code;
+		CHECK(compiler.compileAggregate("sum(x)", byte_code) == -1);
+		CHECK(compiler.getError() == Error::INCORRECT_TYPE_ARGS);
+	}
+}
+
+
+TEST_CASE("Engine", "Evaluate programs in parallel") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	static const int PROGRAMS = 24;
+	std::vector<std::vector<uint8>> programs(PROGRAMS);
+	std::vector<const uint8*> program_pointers(PROGRAMS);
+	uint32 seed = 4321;
+	for (int i = 0; i < PROGRAMS; ++i)
+	{
+		std::string src = randomExpression(seed, i % 3 == 0, 3);
+		uint8 byte_code[1024];
+		int size = compileOptimized(compiler, src.c_str(), byte_code, sizeof(byte_code));
+		REQUIRE(size > 0);
+		programs[i].assign(byte_code, byte_code + size);
+		program_pointers[i] = &programs[i][0];
+	}
+
+	// rows do not fill the last block
+	static const int ROWS = 3 * ExpressionEngine::BLOCK_SIZE + 100;
+	std::vector<float> xs(ROWS);
+	std::vector<float> ys(ROWS);
+	for (int i = 0; i < ROWS; ++i)
+	{
+		xs[i] = (i % 997) * 0.02f - 10;
+		ys[i] = 5 - (i % 13) * 0.75f;
+	}
+	const float* columns[] = {&xs[0], &ys[0]};
+
+	std::vector<std::vector<float>> expected(PROGRAMS, std::vector<float>(ROWS));
+	Types expected_types[PROGRAMS];
+	for (int i = 0; i < PROGRAMS; ++i)
+	{
+		expected_types[i] = vm.evaluateBatch(program_pointers[i], columns, &expected[i][0], ROWS);
+	}
+
+	for (int thread_count : {1, 3, 8})
+	{
+		ExpressionEngine engine(thread_count);
+		CHECK(engine.getThreadCount() == thread_count);
+		for (int count : {0, 5, ExpressionEngine::BLOCK_SIZE, ROWS, ROWS})
+		{
+			std::vector<std::vector<float>> outputs(PROGRAMS, std::vector<float>(ROWS + 1, 42.0f));
+			std::vector<float*> output_pointers(PROGRAMS);
+			for (int i = 0; i < PROGRAMS; ++i) output_pointers[i] = &outputs[i][0];
+			Types types[PROGRAMS];
+			REQUIRE(engine.evaluateBatch(
+				&program_pointers[0], PROGRAMS, columns, 2, &output_pointers[0], count, types));
+			for (int i = 0; i < PROGRAMS; ++i)
+			{
+				CHECK(types[i] == expected_types[i]);
+				CHECK(memcmp(&outputs[i][0], &expected[i][0], count * sizeof(float)) == 0);
+				CHECK(outputs[i][count] == 42.0f);
+			}
+		}
+	}
+}
+
+
+TEST_CASE("Incremental", "Re-evaluate only programs whose inputs changed") {
+	ExpressionCompiler compiler;
+	enum { X, Y, Z, A, B, C, SLOTS };
+	static const char* VARIABLES[] = {"x", "y", "z", "a", "b", "c"};
+	compiler.setVariables(VARIABLES, SLOTS);
+	auto compile = [&compiler](const char* src) {
+		std::vector<uint8> byte_code(256);
+		REQUIRE(compileOptimized(compiler, src, &byte_code[0], (int)byte_code.size()) > 0);
+		return byte_code;
+	};
+
+	ExpressionGraph graph(SLOTS);
+	// added before the programs computing its inputs
+	int b3 = graph.add(&compile("b * 3")[0]);
+	int a = graph.add(&compile("x * 2")[0], A);
+	int b = graph.add(&compile("a + y")[0], B);
+	int zz = graph.add(&compile("z * z")[0]);
+	int c = graph.add(&compile("x > 0")[0], C);
+	int c1 = graph.add(&compile("c + 1")[0]);
+	REQUIRE(b3 >= 0);
+	REQUIRE(a >= 0);
+	REQUIRE(b >= 0);
+	REQUIRE(c1 >= 0);
+
+	graph.set(X, 1);
+	graph.set(Y, 2);
+	graph.set(Z, 3);
+	CHECK(graph.update() == 6);
+	CHECK(graph.get(A) == 2.0f);
+	CHECK(graph.get(B) == 4.0f);
+	CHECK(graph.getResult(b3).f_value == 12.0f);
+	CHECK(graph.getResult(zz).f_value == 9.0f);
+	CHECK(graph.getResult(c).b_value);
+	CHECK(graph.getResult(c1).f_value == 2.0f);
+
+	// nothing changed
+	CHECK(graph.update() == 0);
+	graph.set(X, 1);
+	CHECK(graph.update() == 0);
+
+	graph.set(Z, 4);
+	CHECK(graph.update() == 1);
+	CHECK(graph.getResult(zz).f_value == 16.0f);
+
+	// `x > 0` stays true, so `c + 1` is not evaluated
+	graph.set(X, 5);
+	CHECK(graph.update() == 4);
+	CHECK(graph.getResult(b3).f_value == 36.0f);
+	CHECK(graph.getResult(c1).f_value == 2.0f);
+
+	graph.set(X, -1);
+	graph.set(Y, 0);
+	CHECK(graph.update() == 5);
+	CHECK(graph.getResult(b3).f_value == -6.0f);
+	CHECK(graph.getResult(c1).f_value == 1.0f);
+
+	ExpressionGraph::Stats stats = graph.getStats();
+	CHECK(stats.updates == 6);
+	CHECK(stats.evaluated == 16);
+	CHECK(stats.skipped == 6 * 6 - 16);
+
+	// every result matches a full evaluation
+	ExpressionVM vm;
+	static const char* SOURCES[] = {"b * 3", "x * 2", "a + y", "z * z", "x > 0", "c + 1"};
+	for (int i = 0; i < 6; ++i)
+	{
+		ExpressionVM::ReturnValue expected = vm.evaluate(&compile(SOURCES[i])[0], graph.getSlots());
+		ExpressionVM::ReturnValue value = graph.getResult(i);
+		REQUIRE(value.type == expected.type);
+		if (value.type == Types::FLOAT) CHECK(value.f_value == expected.f_value);
+		else CHECK(value.b_value == expected.b_value);
+	}
+
+	SECTION("Errors") {
+		// cycles, slots written twice or out of range
+		CHECK(graph.add(&compile("b + 1")[0], A) == -1);
+		CHECK(graph.add(&compile("y")[0], B) == -1);
+		CHECK(graph.add(&compile("x")[0], SLOTS) == -1);
+		ExpressionGraph small(2);
+		CHECK(small.add(&compile("z")[0]) == -1);
+		CHECK(small.add(&compile("x + 1")[0], X) == -1);
+		CHECK(small.add(&compile("x + 1")[0], Y) == 0);
+		CHECK(small.add(&compile("y + 1")[0], X) == -1);
+	}
+}
+
+
+TEST_CASE("Arena", "Compile without heap allocations") {
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+
+	SECTION("Allocate") {
+		ExpressionArena arena(64);
+		std::vector<uint8*> blocks;
+		for (int i = 0; i < 100; ++i)
+		{
+			size_t align = (size_t)1 << (i % 5);
+			uint8* block = (uint8*)arena.allocate(i + 1, align);
+			REQUIRE(block);
+			CHECK(((uintptr_t)block & (align - 1)) == 0);
+			memset(block, i, i + 1);
+			blocks.push_back(block);
+		}
+		for (int i = 0; i < 100; ++i)
+		{
+			for (int j = 0; j <= i; ++j) REQUIRE(blocks[i][j] == (uint8)i);
+		}
+		int chunks = arena.getHeapAllocations();
+		size_t capacity = arena.getCapacity();
+		CHECK(chunks > 1);
+		CHECK(chunks < 10);
+
+		// chunks are merged into one, then reused
+		for (int round = 0; round < 3; ++round)
+		{
+			arena.reset();
+			for (int i = 0; i < 100; ++i) arena.allocate(i + 1, (size_t)1 << (i % 5));
+			CHECK(arena.getCapacity() == capacity);
+			CHECK(arena.getHeapAllocations() == chunks + 1);
+		}
+	}
+
+	SECTION("Same as the stages") {
+		ExpressionArena arena(256);
+		std::vector<uint8> byte_code;
+		uint32 seed = 777;
+		for (int i = 0; i < 300; ++i)
+		{
+			std::string src = randomExpression(seed, i % 2 == 0, 4);
+			if (i % 10 == 9) src += ")";
+			INFO(src);
+			uint8 expected[4096];
+			int expected_size = compileOptimized(compiler, src.c_str(), expected, sizeof(expected));
+			ExpressionCompiler::Error expected_error = compiler.getError();
+			if (expected_size > 0) compiler.peephole(expected, expected_size);
+			int size = compiler.compile(src.c_str(), arena, byte_code);
+			REQUIRE(size == expected_size);
+			if (size < 0)
+			{
+				CHECK(compiler.getError() == expected_error);
+				continue;
+			}
+			REQUIRE(byte_code.size() == (size_t)size);
+			CHECK(memcmp(&byte_code[0], expected, size) == 0);
+		}
+	}
+
+	SECTION("Malformed sources as the stages") {
+		static const char* PIECES[] = {"x", "y", "q", "2", "0", "0.5", "PI", " + ", " - ", "-",
+			" * ", " / ", " < ", " > ", " and ", " or ", "(", ")", ",", "sin", "cos", "#", " "};
+		static const int PIECES_COUNT = sizeof(PIECES) / sizeof(PIECES[0]);
+		ExpressionArena arena;
+		std::vector<uint8> byte_code;
+		uint32 seed = 4242;
+		auto next = [&seed](int n) -> int {
+			seed = seed * 1664525U + 1013904223U;
+			return (seed >> 16) % n;
+		};
+		for (int i = 0; i < 3000; ++i)
+		{
+			std::string src;
+			int count = 1 + next(16);
+			for (int j = 0; j < count; ++j) src += PIECES[next(PIECES_COUNT)];
+			INFO(src);
+			uint8 expected[4096];
+			int expected_size = compileOptimized(compiler, src.c_str(), expected, sizeof(expected));
+			ExpressionCompiler::Error expected_error = compiler.getError();
+			if (expected_size > 0) compiler.peephole(expected, expected_size);
+			int size = compiler.compile(src.c_str(), arena, byte_code);
+			REQUIRE(size == expected_size);
+			CHECK(compiler.getError() == expected_error);
+			if (size > 0) CHECK(memcmp(&byte_code[0], expected, size) == 0);
+		}
+	}
+
+	SECTION("Large sources") {
+		ExpressionVM vm;
+		float inputs[] = {0.75f, 1.5f};
+
+		// far more tokens than the stack arrays of the stages hold
+		std::string sum = "x";
+		float expected = inputs[0];
+		for (int i = 0; i < 1000; ++i)
+		{
+			sum += i % 2 ? " + x * y" : " - y / 4";
+			expected = i % 2 ? expected + inputs[0] * inputs[1] : expected - inputs[1] / 4;
+		}
+		CHECK(vm.compileAndRun(compiler, sum.c_str(), inputs).f_value == expected);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::NONE);
+
+		std::string nested = "x";
+		for (int i = 0; i < 200; ++i) nested = "-(" + nested + ")";
+		CHECK(vm.compileAndRun(compiler, nested.c_str(), inputs).f_value == inputs[0]);
+
+		std::string prefix;
+		for (int i = 0; i < 201; ++i) prefix += "- ";
+		prefix += "y";
+		CHECK(vm.compileAndRun(compiler, prefix.c_str(), inputs).f_value == -inputs[1]);
+
+		// deeper than the single pass parser recurses, the stages compile it
+		std::string parenthesized = std::string(3000, '(') + "x * y" + std::string(3000, ')');
+		ExpressionVM::ReturnValue value = vm.compileAndRun(compiler, parenthesized.c_str(), inputs);
+		CHECK(value.f_value == inputs[0] * inputs[1]);
+		parenthesized.pop_back();
+		CHECK(vm.compileAndRun(compiler, parenthesized.c_str(), inputs).type == Types::NONE);
+		CHECK(compiler.getError() == ExpressionCompiler::Error::MISSING_RIGHT_PARENTHESIS);
+	}
+
+	SECTION("No allocations") {
+		std::vector<std::string> sources;
+		uint32 seed = 31;
+		for (int i = 0; i < 50; ++i) sources.push_back(randomExpression(seed, i % 3 == 0, 4));
+		ExpressionVM vm;
+		ExpressionArena arena;
+		std::vector<uint8> byte_code;
+		std::vector<float> results(sources.size());
+		float inputs[] = {0.5f, -2};
+		// the first round grows the arenas and buffers to the largest source
+		for (int round = 0; round < 2; ++round)
+		{
+			int allocations = g_heap_allocations;
+			for (size_t i = 0; i < sources.size(); ++i)
+			{
+				results[i] = vm.compileAndRun(compiler, sources[i].c_str(), inputs).f_value;
+				compiler.compile(sources[i].c_str(), arena, byte_code);
+			}
+			// read before CHECK allocates
+			int added = g_heap_allocations - allocations;
+			if (round == 1) CHECK(added == 0);
+		}
+	}
+}
+
+
+// setProfiler() exists only in builds with EXPRESSIONS_PROFILER
+template <typename VM, typename = void>
+struct HasProfilerHooks : std::false_type
+{
+};
+
+
+template <typename VM>
+struct HasProfilerHooks<VM, decltype(std::declval<VM&>().setProfiler(nullptr), void())>
+	: std::true_type
+{
+};
+
+
+TEST_CASE("Profiler", "Opcode and program statistics") {
+	ExpressionVM vm;
+	CHECK(HasProfilerHooks<ExpressionVM>::value == ExpressionProfiler::ENABLED);
+
+	SECTION("Dump") {
+		ExpressionProfiler::Snapshot snapshot;
+		snapshot.opcodes[Instruction::ADD_FLOAT].count = 3;
+		snapshot.opcodes[Instruction::ADD_FLOAT].cycles = 30;
+		snapshot.opcodes[Instruction::CALL].count = 1;
+		snapshot.opcodes[Instruction::CALL].cycles = 50;
+		ExpressionProfiler::ProgramStats stats = {};
+		stats.name = "x \"quoted\"\n";
+		stats.evaluations = 4;
+		stats.cycles = 80;
+		stats.histogram[4] = 4;
+		snapshot.programs.push_back(stats);
+
+		std::string text;
+		snapshot.dumpText(text);
+		// sorted by cycles
+		CHECK(text.find("CALL") < text.find("ADD_FLOAT"));
+		CHECK(text.find("MUL_FLOAT") == std::string::npos);
+		std::string json;
+		snapshot.dumpJSON(json);
+		const char* opcode = "{\"name\": \"ADD_FLOAT\", \"count\": 3, \"cycles\": 30}";
+		const char* program = "{\"name\": \"x \\\"quoted\\\"\\u000a\", \"evaluations\": 4, "
+							  "\"cycles\": 80, \"histogram\": [0, 0, 0, 0, 4, 0";
+		CHECK(json.find(opcode) != std::string::npos);
+		CHECK(json.find(program) != std::string::npos);
+
+		ExpressionProfiler::Snapshot merged = snapshot;
+		merged.merge(snapshot);
+		CHECK(merged.opcodes[Instruction::ADD_FLOAT].count == 6);
+		REQUIRE(merged.programs.size() == 1);
+		CHECK(merged.programs[0].evaluations == 8);
+		CHECK(merged.programs[0].histogram[4] == 8);
+	}
+
+#ifdef EXPRESSIONS_PROFILER
+	SECTION("Evaluate") {
+		ExpressionCompiler compiler;
+		static const char* VARIABLES[] = {"x", "y"};
+		compiler.setVariables(VARIABLES, 2);
+		uint8 first[1024];
+		uint8 second[1024];
+		REQUIRE(compileSource(compiler, "x * y + sin(x)", first, sizeof(first)) > 0);
+		REQUIRE(compileSource(compiler, "x - y < 1", second, sizeof(second)) > 0);
+
+		// both programs are straight, every instruction runs once per evaluation
+		uint64 expected[Instruction::COUNT] = {};
+		for (const uint8* code : {first, second})
+		{
+			const uint8* ip = ((const ProgramHeader*)code)->instructions();
+			for (;; ip += Instruction::SIZE)
+			{
+				expected[ip[0]] += code == first ? 100 : 50;
+				if (ip[0] == Instruction::RET_FLOAT || ip[0] == Instruction::RET_BOOL) break;
+			}
+		}
+
+		ExpressionProfiler profiler;
+		profiler.setName(first, "first");
+		vm.setProfiler(&profiler);
+		for (int i = 0; i < 100; ++i)
+		{
+			float inputs[] = {i * 0.1f, 2};
+			vm.evaluate(first, inputs);
+			if (i % 2 == 0) vm.evaluate(second, inputs);
+		}
+		vm.setProfiler(nullptr);
+		float inputs[] = {1, 2};
+		vm.evaluate(first, inputs);
+
+		ExpressionProfiler::Snapshot snapshot = profiler.snapshot();
+		uint64 cycles = 0;
+		for (int i = 0; i < Instruction::COUNT; ++i)
+		{
+			INFO(Instruction::getName((uint8)i));
+			CHECK(snapshot.opcodes[i].count == expected[i]);
+			cycles += snapshot.opcodes[i].cycles;
+		}
+		CHECK(cycles > 0);
+		REQUIRE(snapshot.programs.size() == 2);
+		for (const ExpressionProfiler::ProgramStats& stats : snapshot.programs)
+		{
+			CHECK(stats.evaluations == (stats.code == first ? 100 : 50));
+			CHECK(stats.name == (stats.code == first ? "first" : ""));
+			uint64 histogram_count = 0;
+			for (uint64 count : stats.histogram) histogram_count += count;
+			CHECK(histogram_count == stats.evaluations);
+		}
+
+		profiler.reset();
+		CHECK(profiler.snapshot().programs.empty());
+		CHECK(profiler.snapshot().opcodes[Instruction::RET_FLOAT].count == 0);
+	}
+#endif
+}
+
+
+TEST_CASE("Dispatch benchmark", "[.][benchmark]") {
+	ExpressionVM vm;
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+	static const int ITERATIONS = 1 << 22;
+
+	for (const char* src : DISPATCH_SOURCES)
+	{
+		uint8 byte_code[200];
+		REQUIRE(compileSource(compiler, src, byte_code, sizeof(byte_code)) > 0);
+		ExpressionVM::DecodedProgram program;
+		REQUIRE(vm.decode(byte_code, program));
+
+		float sum = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < ITERATIONS; ++i)
+		{
+			float inputs[] = {(float)(i & 1023), (float)(i & 15)};
+			sum += vm.evaluate(byte_code, inputs).f_value;
+		}
+		auto middle = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < ITERATIONS; ++i)
+		{
+			float inputs[] = {(float)(i & 1023), (float)(i & 15)};
+			sum += vm.evaluate(program, inputs).f_value;
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+
+		double switch_ns = std::chrono::duration<double, std::nano>(middle - start).count();
+		double threaded_ns = std::chrono::duration<double, std::nano>(end - middle).count();
+		printf("%-56s switch %6.2f ns  threaded %6.2f ns  (%g)\n",
+			src,
+			switch_ns / ITERATIONS,
+			threaded_ns / ITERATIONS,
+			sum);
+	}
+}
+
+
+TEST_CASE("Tokenize benchmark", "[.][benchmark]") {
+	ExpressionCompiler compiler;
+	static const char* VARIABLES[] = {"x", "y"};
+	compiler.setVariables(VARIABLES, 2);
+	static const int ITERATIONS = 50;
+
+	uint32 seed = 7;
+	std::string src = "1";
+	while (src.size() < 200000) src += " + " + randomExpression(seed, false, 6) + " * 1.25e2";
+	std::vector<ExpressionCompiler::Token> tokens(src.size());
+
+	int count = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < ITERATIONS; ++i)
+	{
+		count = compiler.tokenize(src.c_str(), &tokens[0], (int)tokens.size());
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	REQUIRE(count > 0);
+
+	double ns = std::chrono::duration<double, std::nano>(end - start).count() / ITERATIONS;
+	printf("tokenize %d chars, %d tokens: %.2f ns/char, %.1f MB/s\n",
+		(int)src.size(),
+		count,
+		ns / src.size(),
+		src.size() / ns * 1000);
+}
+
+
+TEST_CASE("Run", "Execute bytecode") {
+	SECTION("Multiply") {
+		CHECK(floatBinaryOperator(2, 4, Instruction::MUL_FLOAT).f_value == Approx(8.0f));
+		CHECK(floatBinaryOperator(5, -4, Instruction::MUL_FLOAT).f_value == Approx(-20.0f));
+		CHECK(floatBinaryOperator(3, 0, Instruction::MUL_FLOAT).f_value == Approx(0.0f));
+	}
+
+	SECTION("Add") {
+		CHECK(floatBinaryOperator(2, 4, Instruction::ADD_FLOAT).f_value == Approx(6.0f));
+		CHECK(floatBinaryOperator(5, -4, Instruction::ADD_FLOAT).f_value == Approx(1.0f));
+		CHECK(floatBinaryOperator(3, 0, Instruction::ADD_FLOAT).f_value == Approx(3.0f));
+		CHECK(floatBinaryOperator(3, -4, Instruction::ADD_FLOAT).f_value == Approx(-1.0f));
+	}
+
+	SECTION("Subtract & divide") {
+		CHECK(floatBinaryOperator(2, 4, Instruction::SUB_FLOAT).f_value == Approx(-2.0f));
+		CHECK(floatBinaryOperator(2, 4, Instruction::DIV_FLOAT).f_value == Approx(0.5f));
 	}
 }
@@ -0,0 +1,137 @@
+// Compiles expressions to a C++ translation unit, see ExpressionCompiler::transpile()
+//   expressions_transpiler <namespace> <variables> <input> <output>
+// <variables> are the comma separated names of the input slots in order. Every line of <input>
+// is `name = expression`, empty lines and lines starting with # are skipped. Only the builtin
+// functions are known here, applications with their own functions call transpile() after
+// registering them. Build the output with optimizations which vectorize loops (-O3, /O2).
+#include "expressions.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+static const char* getErrorName(ExpressionCompiler::Error error)
+{
+	static const char* NAMES[] = {"NONE",
+		"UNKNOWN_IDENTIFIER",
+		"MISSING_LEFT_PARENTHESIS",
+		"MISSING_RIGHT_PARENTHESIS",
+		"UNEXPECTED_CHAR",
+		"OUT_OF_MEMORY",
+		"MISSING_BINARY_OPERAND",
+		"NOT_ENOUGH_PARAMETERS",
+		"INCORRECT_TYPE_ARGS",
+		"TOO_MANY_PARAMETERS"};
+	return NAMES[(int)error];
+}
+
+
+static std::string trim(const std::string& str)
+{
+	size_t begin = str.find_first_not_of(" \t\r\n");
+	if (begin == std::string::npos) return "";
+	size_t end = str.find_last_not_of(" \t\r\n");
+	return str.substr(begin, end - begin + 1);
+}
+
+
+int main(int argc, char** argv)
+{
+	if (argc != 5)
+	{
+		fprintf(stderr, "usage: %s <namespace> <variables> <input> <output>\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<std::string> variables;
+	std::string list = argv[2];
+	for (size_t begin = 0; begin <= list.size();)
+	{
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos) end = list.size();
+		std::string name = trim(list.substr(begin, end - begin));
+		if (!name.empty()) variables.push_back(name);
+		begin = end + 1;
+	}
+
+	FILE* input = fopen(argv[3], "rb");
+	if (!input)
+	{
+		fprintf(stderr, "can not open %s\n", argv[3]);
+		return 1;
+	}
+	std::vector<std::string> names;
+	std::vector<std::string> sources;
+	std::vector<int> lines;
+	char buffer[4096];
+	for (int line = 1; fgets(buffer, sizeof(buffer), input); ++line)
+	{
+		std::string text = trim(buffer);
+		if (text.empty() || text[0] == '#') continue;
+		size_t eq = text.find('=');
+		if (eq == std::string::npos)
+		{
+			fprintf(stderr, "%s:%d: expected `name = expression`\n", argv[3], line);
+			fclose(input);
+			return 1;
+		}
+		names.push_back(trim(text.substr(0, eq)));
+		sources.push_back(trim(text.substr(eq + 1)));
+		lines.push_back(line);
+	}
+	fclose(input);
+
+	std::vector<const char*> variable_ptrs;
+	for (auto& name : variables) variable_ptrs.push_back(name.c_str());
+	ExpressionCompiler compiler;
+	compiler.setVariables(variable_ptrs.empty() ? nullptr : &variable_ptrs[0],
+		(int)variables.size());
+
+	// transpile one by one first, so the error points to its line
+	std::string code;
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		const char* name = names[i].c_str();
+		const char* source = sources[i].c_str();
+		if (compiler.transpile(argv[1], &name, &source, 1, code) < 0)
+		{
+			fprintf(stderr,
+				"%s:%d: %s\n",
+				argv[3],
+				lines[i],
+				getErrorName(compiler.getError()));
+			return 1;
+		}
+	}
+
+	std::vector<const char*> name_ptrs;
+	std::vector<const char*> source_ptrs;
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		name_ptrs.push_back(names[i].c_str());
+		source_ptrs.push_back(sources[i].c_str());
+	}
+	int size = compiler.transpile(argv[1],
+		name_ptrs.empty() ? nullptr : &name_ptrs[0],
+		source_ptrs.empty() ? nullptr : &source_ptrs[0],
+		(int)names.size(),
+		code);
+	if (size < 0)
+	{
+		fprintf(stderr,
+			"%s: %s, names must be distinct\n",
+			argv[3],
+			getErrorName(compiler.getError()));
+		return 1;
+	}
+
+	FILE* output = fopen(argv[4], "wb");
+	if (!output || fwrite(code.c_str(), 1, code.size(), output) != code.size())
+	{
+		fprintf(stderr, "can not write %s\n", argv[4]);
+		if (output) fclose(output);
+		return 1;
+	}
+	fclose(output);
+	return 0;
+}